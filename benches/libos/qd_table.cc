@@ -0,0 +1,163 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// stress test and cost of opening and closing queues through `qd_table` the
+// way a server does it: one acceptor thread opens every queue and hands it to
+// worker threads, which close it. meanwhile, another thread keeps looking up
+// descriptors and checks that whatever it finds is the queue registered under
+// that descriptor. descriptors closed by the workers have to be reused by the
+// acceptor, so the highest descriptor issued stays close to the number of
+// queues open at once instead of growing with every cycle; the run fails if it
+// doesn't.
+//
+// usage: qd_table [cycles] [workers]
+
+#include <dmtr/libos/qd_table.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// the headers report failures through these, which the libOS normally provides.
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+void dmtr_fail(int error_arg, const char *expr_arg, const char *funcn_arg, const char *filen_arg, int lineno_arg) {
+    DMTR_UNUSEDARG(funcn_arg);
+    fprintf(stderr, "%s:%d: %s failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+// queues open at once, at most.
+static const int MAX_OPEN = 64;
+// the test fails if a descriptor above this is ever issued.
+static const int MAX_EXPECTED_QD = 16 * MAX_OPEN;
+
+struct fake_queue {
+    int qd;
+};
+
+// descriptors waiting for a worker to close them.
+struct handoff {
+    std::mutex lock;
+    std::deque<int> qds;
+};
+
+static void check(int ret, const char *what) {
+    if (0 != ret) {
+        fprintf(stderr, "qd_table: %s failed with %d\n", what, ret);
+        abort();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t cycles = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t num_workers = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    num_workers = std::max<size_t>(num_workers, 1);
+
+    dmtr::qd_table<fake_queue> table;
+    std::vector<handoff> handoffs(num_workers);
+    std::atomic<int> open(0);
+    std::atomic<int> high_qd(0);
+    std::atomic<bool> done(false);
+
+    // closed queues are only freed once every thread has stopped, since the
+    // poller may still hold a pointer to one.
+    std::vector<std::vector<std::unique_ptr<fake_queue>>> closed(num_workers);
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < num_workers; ++w) {
+        workers.emplace_back([&, w]() {
+            for (;;) {
+                int qd = -1;
+                {
+                    std::lock_guard<std::mutex> lock(handoffs[w].lock);
+                    if (!handoffs[w].qds.empty()) {
+                        qd = handoffs[w].qds.front();
+                        handoffs[w].qds.pop_front();
+                    }
+                }
+                if (-1 == qd) {
+                    if (done.load(std::memory_order_acquire)) {
+                        return;
+                    }
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                std::unique_ptr<fake_queue> q;
+                check(table.remove(q, qd), "remove");
+                closed[w].push_back(std::move(q));
+                open.fetch_sub(1, std::memory_order_release);
+            }
+        });
+    }
+
+    size_t lookups = 0;
+    std::thread poller([&]() {
+        std::mt19937 rng(42);
+        while (!done.load(std::memory_order_acquire)) {
+            const int high = high_qd.load(std::memory_order_acquire);
+            if (0 == high) {
+                continue;
+            }
+            const int qd = 1 + static_cast<int>(rng() % high);
+            fake_queue *q = NULL;
+            if (0 == table.find(q, qd) && q->qd != qd) {
+                fprintf(stderr, "qd_table: qd %d resolved to the queue of qd %d\n", qd, q->qd);
+                abort();
+            }
+            ++lookups;
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < cycles; ++i) {
+        while (open.load(std::memory_order_acquire) >= MAX_OPEN) {
+            std::this_thread::yield();
+        }
+
+        int qd = -1;
+        check(table.alloc(qd), "alloc");
+        std::unique_ptr<fake_queue> q(new fake_queue);
+        q->qd = qd;
+        check(table.insert(qd, q), "insert");
+        open.fetch_add(1, std::memory_order_relaxed);
+        if (qd > high_qd.load(std::memory_order_relaxed)) {
+            high_qd.store(qd, std::memory_order_release);
+        }
+
+        handoff &h = handoffs[i % num_workers];
+        std::lock_guard<std::mutex> lock(h.lock);
+        h.qds.push_back(qd);
+    }
+    while (open.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    done.store(true, std::memory_order_release);
+    for (auto &t : workers) {
+        t.join();
+    }
+    poller.join();
+
+    const int high = high_qd.load();
+    printf("qd_table cycles=%zu workers=%zu max_open=%d high_qd=%d lookups=%zu ns_per_cycle=%.0f\n",
+        cycles, num_workers, MAX_OPEN, high, lookups, elapsed.count() / cycles);
+    if (high > MAX_EXPECTED_QD) {
+        fprintf(stderr, "qd_table: closed descriptors were not reused (highest qd %d)\n", high);
+        return 1;
+    }
+    return 0;
+}
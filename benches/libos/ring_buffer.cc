@@ -0,0 +1,155 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// throughput and latency of handing scatter-gather arrays from producer
+// threads to one consumer through each memory queue backend:
+//
+// - `locked`: a `std::queue` behind a `std::recursive_mutex`, which is what
+//   `dmtr_queue()` queues use;
+// - `spsc`: `spsc_ring`, with a single producer only;
+// - `mpmc`: `mpmc_ring`.
+//
+// each producer stamps the arrays it pushes with the time, and the consumer
+// records how long each one waited. a side that finds the queue full (or
+// empty) yields, so that the run makes progress with more threads than cores.
+//
+// usage: ring_buffer [messages] [capacity]
+
+#include <dmtr/libos/queue_stats.hh>
+#include <dmtr/libos/ring_buffer.hh>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// the headers report failures through these, which the libOS normally provides.
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+void dmtr_fail(int error_arg, const char *expr_arg, const char *funcn_arg, const char *filen_arg, int lineno_arg) {
+    DMTR_UNUSEDARG(funcn_arg);
+    fprintf(stderr, "%s:%d: %s failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+static const size_t PRODUCER_COUNTS[] = {1, 2, 4, 8, 16};
+
+// bounded like the rings, so that producers can't run arbitrarily far ahead.
+class locked_queue
+{
+    private: std::queue<dmtr_sgarray_t> my_queue;
+    private: std::recursive_mutex my_lock;
+    private: const size_t my_capacity;
+
+    public: locked_queue(size_t capacity) :
+        my_capacity(capacity)
+    {}
+
+    public: bool try_push(const dmtr_sgarray_t &sga) {
+        std::lock_guard<std::recursive_mutex> lock(my_lock);
+        if (my_queue.size() >= my_capacity) {
+            return false;
+        }
+        my_queue.push(sga);
+        return true;
+    }
+
+    public: bool try_pop(dmtr_sgarray_t &sga_out) {
+        std::lock_guard<std::recursive_mutex> lock(my_lock);
+        if (my_queue.empty()) {
+            return false;
+        }
+        sga_out = my_queue.front();
+        my_queue.pop();
+        return true;
+    }
+};
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Queue>
+static void run(const char *name, Queue &queue, size_t num_producers, size_t messages) {
+    const size_t per_producer = messages / num_producers;
+    const size_t total = per_producer * num_producers;
+    std::atomic<bool> go(false);
+
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < num_producers; ++p) {
+        producers.emplace_back([&]() {
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+
+            dmtr_sgarray_t sga;
+            memset(&sga, 0, sizeof(sga));
+            sga.sga_numsegs = 1;
+            for (size_t i = 0; i < per_producer; ++i) {
+                sga.sga_buf = reinterpret_cast<void *>(static_cast<uintptr_t>(now_ns()));
+                while (!queue.try_push(sga)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    dmtr::latency_histogram h;
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (size_t i = 0; i < total; ++i) {
+        dmtr_sgarray_t sga;
+        while (!queue.try_pop(sga)) {
+            std::this_thread::yield();
+        }
+        h.record(now_ns() - reinterpret_cast<uintptr_t>(sga.sga_buf));
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (auto &t : producers) {
+        t.join();
+    }
+
+    printf("ring_buffer backend=%s producers=%zu messages=%zu msgs_per_s=%.0f p50_ns=%lu p99_ns=%lu p999_ns=%lu\n",
+        name, num_producers, total, total / elapsed.count(),
+        static_cast<unsigned long>(h.percentile(0.5)),
+        static_cast<unsigned long>(h.percentile(0.99)),
+        static_cast<unsigned long>(h.percentile(0.999)));
+}
+
+int main(int argc, char *argv[]) {
+    size_t messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t capacity = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+
+    for (auto n : PRODUCER_COUNTS) {
+        {
+            locked_queue q(capacity);
+            run("locked", q, n, messages);
+        }
+        if (1 == n) {
+            std::unique_ptr<dmtr::spsc_ring<dmtr_sgarray_t>> q;
+            if (0 != dmtr::spsc_ring<dmtr_sgarray_t>::new_object(q, capacity)) {
+                return 1;
+            }
+            run("spsc", *q, n, messages);
+        }
+        {
+            std::unique_ptr<dmtr::mpmc_ring<dmtr_sgarray_t>> q;
+            if (0 != dmtr::mpmc_ring<dmtr_sgarray_t>::new_object(q, capacity)) {
+                return 1;
+            }
+            run("mpmc", *q, n, messages);
+        }
+    }
+    return 0;
+}
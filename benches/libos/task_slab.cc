@@ -0,0 +1,147 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// cost of the task slab operations behind `new_task`, `get_task` and
+// `drop_task`, with many tokens outstanding. slots carry stand-ins of the
+// same size as `io_queue`'s `task_state` and `task`. for each count of
+// outstanding tokens:
+//
+// - `new`: issues that many tokens into a slab that has grown to size;
+// - `get`: looks all of them up, in random order;
+// - `drop`: releases all of them, in random order;
+// - `cycle`: issues, looks up and drops one token while the rest stay
+//   outstanding, the steady state of a busy queue.
+//
+// usage: task_slab [outstanding...]
+
+#include <dmtr/libos/task_slab.hh>
+
+#include <dmtr/types.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// the headers report failures through these, which the libOS normally provides.
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+void dmtr_fail(int error_arg, const char *expr_arg, const char *funcn_arg, const char *filen_arg, int lineno_arg) {
+    DMTR_UNUSEDARG(funcn_arg);
+    fprintf(stderr, "%s:%d: %s failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+struct hot_type {
+    bool valid = false;
+    dmtr_opcode_t opcode = DMTR_OPC_INVALID;
+    int error = EAGAIN;
+};
+
+struct cold_type {
+    dmtr_qresult_t qr;
+    dmtr_sgarray_t sga_arg;
+    void *queue_arg;
+};
+
+typedef dmtr::task_slab<hot_type, cold_type> slab_type;
+
+// lookups fold what they find into this, so that they can't be dropped.
+static volatile uint64_t sink = 0;
+
+static void check(int ret) {
+    if (0 != ret) {
+        fprintf(stderr, "task_slab: unexpected error %d\n", ret);
+        abort();
+    }
+}
+
+static void report(const char *op, size_t outstanding, size_t count, std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    printf("task_slab op=%s outstanding=%zu ops=%zu ns_per_op=%.1f\n", op, outstanding, count, elapsed.count() / count);
+}
+
+static void run(size_t outstanding) {
+    slab_type slab;
+    std::vector<uint32_t> ids(outstanding);
+    std::mt19937 rng(42);
+
+    // grow the slab to size first, so that `new` measures reuse.
+    for (auto &id : ids) {
+        check(slab.alloc(id));
+    }
+    for (auto id : ids) {
+        check(slab.free(id));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto &id : ids) {
+        check(slab.alloc(id));
+    }
+    report("new", outstanding, outstanding, start);
+
+    std::shuffle(ids.begin(), ids.end(), rng);
+    start = std::chrono::steady_clock::now();
+    for (auto id : ids) {
+        hot_type *hot = NULL;
+        cold_type *cold = NULL;
+        check(slab.find(hot, cold, id));
+        sink = sink + hot->error;
+    }
+    report("get", outstanding, outstanding, start);
+
+    std::shuffle(ids.begin(), ids.end(), rng);
+    start = std::chrono::steady_clock::now();
+    for (auto id : ids) {
+        check(slab.free(id));
+    }
+    report("drop", outstanding, outstanding, start);
+
+    // stale tokens have to stop resolving once their slot is released.
+    for (auto id : ids) {
+        if (slab.contains(id)) {
+            fprintf(stderr, "task_slab: released token %u still resolves\n", id);
+            abort();
+        }
+    }
+
+    for (auto &id : ids) {
+        check(slab.alloc(id));
+    }
+    const size_t cycles = std::max<size_t>(outstanding, 1000000);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < cycles; ++i) {
+        uint32_t &oldest = ids[i % outstanding];
+        check(slab.free(oldest));
+        check(slab.alloc(oldest));
+        hot_type *hot = NULL;
+        cold_type *cold = NULL;
+        check(slab.find(hot, cold, oldest));
+        sink = sink + hot->error;
+    }
+    report("cycle", outstanding, cycles, start);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<size_t> counts;
+    for (int i = 1; i < argc; ++i) {
+        size_t n = strtoul(argv[i], NULL, 10);
+        if (n > 0) {
+            counts.push_back(n);
+        }
+    }
+    if (counts.empty()) {
+        counts = {1000, 10000, 100000};
+    }
+
+    for (auto n : counts) {
+        run(n);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// cost of creating, running and destroying a user thread whose function
+// returns right away, which is what opening and closing a queue pays for its
+// thread. the same trivial coroutine also runs on boost's own stack allocators
+// for comparison:
+//
+// - `user_thread`: the whole thread, on a pooled, guarded stack;
+// - `pooled`: a bare coroutine on a pooled, guarded stack;
+// - `fixedsize`: a bare coroutine on a fresh, unguarded stack;
+// - `protected_fixedsize`: a bare coroutine on a fresh, guarded stack.
+//
+// usage: user_thread [iterations]
+
+#include <dmtr/libos/user_thread.hh>
+
+#include <boost/context/fixedsize_stack.hpp>
+#include <boost/context/protected_fixedsize_stack.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// the headers report failures through these, which the libOS normally provides.
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+void dmtr_fail(int error_arg, const char *expr_arg, const char *funcn_arg, const char *filen_arg, int lineno_arg) {
+    DMTR_UNUSEDARG(funcn_arg);
+    fprintf(stderr, "%s:%d: %s failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+typedef dmtr::user_thread<uint64_t> thread_type;
+typedef thread_type::coroutine_type coroutine_type;
+
+template <typename Fun>
+static void measure(const char *name, size_t iterations, Fun fun) {
+    // let the stack pool fill up before measuring.
+    for (size_t i = 0; i < iterations / 100; ++i) {
+        fun();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        fun();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    printf("user_thread stack=%s iterations=%zu ns_per_thread=%.0f\n", name, iterations, elapsed.count() / iterations);
+}
+
+template <typename StackAllocator>
+static void run_bare(StackAllocator salloc) {
+    coroutine_type::pull_type coroutine(salloc, [](thread_type::yield_type &) {});
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t stack_size = dmtr::stack_pool::default_pool().stack_size();
+
+    measure("user_thread", iterations, []() {
+        thread_type t([](thread_type::yield_type &, thread_type::queue_type &) {
+            return 0;
+        });
+        while (EAGAIN == t.service()) {}
+    });
+    measure("pooled", iterations, []() {
+        run_bare(dmtr::pooled_stack_allocator());
+    });
+    measure("fixedsize", iterations, [=]() {
+        run_bare(boost::context::fixedsize_stack(stack_size));
+    });
+    measure("protected_fixedsize", iterations, [=]() {
+        run_bare(boost::context::protected_fixedsize_stack(stack_size));
+    });
+    return 0;
+}
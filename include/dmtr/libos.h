@@ -6,6 +6,7 @@
 
 #include <dmtr/sys/gcc.h>
 #include <dmtr/types.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -40,6 +41,24 @@ DMTR_EXPORT int dmtr_init(int argc, char *argv[]);
  */
 DMTR_EXPORT int dmtr_queue(int *qd_out);
 
+/**
+ * @brief Allocates an in-memory Demikernel queue backed by a bounded ring.
+ *
+ * @details Same FIFO semantics as dmtr_queue(), but elements are handed over
+ * through a lock-free ring of fixed capacity instead of a locked, unbounded
+ * queue. Pushes to a full ring complete once a pop makes room.
+ *
+ * @param qd_out Queue descriptor for newly allocated memory queue if
+ * successful; otherwise invalid.
+ * @param capacity Number of elements the ring holds. Must be a power of two.
+ * @param flags DMTR_QUEUE_SPSC if the queue has at most one pushing and one
+ * popping thread; DMTR_QUEUE_MPMC otherwise.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_queue2(int *qd_out, size_t capacity, int flags);
+
 /**
  * @brief Allocates Demikernel queue associated with a socket.
  *
@@ -126,6 +145,92 @@ DMTR_EXPORT int dmtr_accept(dmtr_qtoken_t *qtok_out, int sockqd);
  */
 DMTR_EXPORT int dmtr_connect(dmtr_qtoken_t *qt_out, int qd, const struct sockaddr *saddr, socklen_t size);
 
+/**
+ * @brief Opens a file as a Demikernel queue.
+ *
+ * @details Pushes write the scatter-gather array at the queue's file offset
+ * and pops read up to the configured pop size from it; both advance the offset
+ * when issued, so operations in flight together cover consecutive ranges. I/O
+ * goes through an io_uring owned by the calling thread and completes through
+ * the usual wait and poll calls, which may mix file and network tokens. Pushes
+ * do not copy, so the array must stay valid until the push completes. With
+ * O_DIRECT, buffers from dmtr_sgaalloc() of 4 KiB and up are suitably aligned.
+ * A failed operation makes dmtr_wait() and dmtr_poll() return its error, and
+ * comes back from dmtr_cq_wait() with opcode DMTR_OPC_INVALID.
+ *
+ * @param qd_out Queue descriptor for the file if successful; otherwise
+ * invalid.
+ * @param pathname Path of the file to open.
+ * @param flags Flags as for open(2).
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_open(int *qd_out, const char *pathname, int flags);
+
+/**
+ * @brief Opens a file as a Demikernel queue, creating it with mode if needed.
+ *
+ * @details Same as dmtr_open(), with the mode that open(2) takes along with
+ * O_CREAT.
+ *
+ * @param qd_out Queue descriptor for the file if successful; otherwise
+ * invalid.
+ * @param pathname Path of the file to open.
+ * @param flags Flags as for open(2).
+ * @param mode Permissions of the file, if it is created.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_open2(int *qd_out, const char *pathname, int flags, mode_t mode);
+
+/**
+ * @brief Creates (or truncates) a file and opens it as a write-only Demikernel
+ * queue, as creat(2) does.
+ *
+ * @param qd_out Queue descriptor for the file if successful; otherwise
+ * invalid.
+ * @param pathname Path of the file to create.
+ * @param mode Permissions of the file, if it is created.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_creat(int *qd_out, const char *pathname, mode_t mode);
+
+/**
+ * @brief Opens the shared-memory queue called name, creating it if no process
+ * has it open. Processes on the same host that open the same name share the
+ * queue.
+ *
+ * @param qd_out Queue descriptor for the queue if successful; otherwise
+ * invalid.
+ * @param name Name of the queue, without slashes.
+ * @param capacity Number of pushes the queue holds, a power of two; zero for
+ * the default, or for whatever an existing queue has.
+ * @param buf_size Size of each buffer in the queue's arena; zero for the
+ * default, or for whatever an existing queue has.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_shmqueue(int *qd_out, const char *name, size_t capacity, size_t buf_size);
+
+/**
+ * @brief Allocates a scatter-gather array from the arena of shared-memory
+ * queue qd. Pushing it to qd hands it over without a copy.
+ *
+ * @param sga_out Scatter-gather array if successful; otherwise invalid.
+ * @param qd Shared-memory queue to allocate from.
+ * @param size Number of bytes to allocate.
+ *
+ * @return On successful completion zero is returned. ENOBUFS is returned if
+ * the arena has too few free buffers. On failure, an error code is returned
+ * instead.
+ */
+DMTR_EXPORT int dmtr_shmalloc(dmtr_sgarray_t *sga_out, int qd, size_t size);
+
 /**
  * @brief Closes Demikernel queue qd and associated I/O connection/file
  *
@@ -163,8 +268,9 @@ DMTR_EXPORT int dmtr_is_qd_valid(int *flag_out, int qd);
  * @param qd Queue descriptor for queue to push to.
  * @param sga Scatter-gather array with pointers to data to push.
  *
- * @return On successful completion zero is returned. On failure, an error code
- * is returned instead.
+ * @return On successful completion zero is returned. ENOBUFS is returned while
+ * the libOS is short of packet buffers; the push can be retried once earlier
+ * operations complete. On failure, an error code is returned instead.
  */
 DMTR_EXPORT int dmtr_push(dmtr_qtoken_t *qtok_out, int qd, const dmtr_sgarray_t *sga);
 
@@ -186,6 +292,42 @@ DMTR_EXPORT int dmtr_pushto(
  */
 DMTR_EXPORT int dmtr_pop(dmtr_qtoken_t *qt_out, int qd);
 
+/**
+ * @brief Asynchronously pushes scatter-gather array sgas[i] to queue qds[i],
+ * for each i up to num_ops, in a single call.
+ *
+ * @details Equivalent to num_ops calls to dmtr_push, but crosses into the
+ * libOS only once, and the resulting packets leave in as few transmit bursts
+ * as the libOS allows. If one push fails, its error code is returned and the
+ * tokens of the pushes before it are dropped. Dropping them doesn't undo
+ * those pushes: data they already queued may still be sent.
+ *
+ * @param qtoks_out Tokens for waiting for each push to complete.
+ * @param qds Queue descriptors for queues to push to.
+ * @param sgas Scatter-gather arrays with pointers to data to push.
+ * @param num_ops Number of pushes.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_pushv(dmtr_qtoken_t qtoks_out[], const int qds[], const dmtr_sgarray_t sgas[], int num_ops);
+
+/**
+ * @brief Asynchronously pops incoming data from queue qds[i], for each i up to
+ * num_ops, in a single call.
+ *
+ * @details Equivalent to num_ops calls to dmtr_pop. If one pop fails, its
+ * error code is returned and the pops before it are cancelled.
+ *
+ * @param qtoks_out Tokens for waiting for each pop to complete.
+ * @param qds Queues to wait on incoming data.
+ * @param num_ops Number of pops.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_popv(dmtr_qtoken_t qtoks_out[], const int qds[], int num_ops);
+
 /**
  * @brief Checks for completion of queue operation associated with queue token qtok.
  *
@@ -202,6 +344,22 @@ DMTR_EXPORT int dmtr_pop(dmtr_qtoken_t *qt_out, int qd);
  */
 DMTR_EXPORT int dmtr_poll(dmtr_qresult_t *qr_out, dmtr_qtoken_t qt);
 
+/**
+ * @brief Like dmtr_poll, but reports the completion as a compact event.
+ *
+ * @details A popped scatter-gather array is not copied into the event: the
+ * event refers to it (see dmtr_qevent_sga()) and it stays valid until the
+ * application releases it with dmtr_sgafree, on the same thread.
+ *
+ * @param qe_out Event describing the completed queue operation.
+ * @param qt Queue token from requested queue operation.
+ *
+ * @return On successful completion zero is returned. If the operation has not
+ * completed yet, EAGAIN is returned. On failure, an error code is returned
+ * instead.
+ */
+DMTR_EXPORT int dmtr_poll_event(dmtr_qevent_t *qe_out, dmtr_qtoken_t qt);
+
 /**
  * @brief Signals that the application is no longer waiting on the queue token qtok.
  *
@@ -0,0 +1,127 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_INPLACE_FUNCTION_HH_IS_INCLUDED
+#define DMTR_LIBOS_INPLACE_FUNCTION_HH_IS_INCLUDED
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dmtr {
+
+template <typename Signature, size_t Capacity = 4 * sizeof(void *)>
+class inplace_function;
+
+// `std::function` replacement that stores its callable inside the object and
+// never allocates. a callable that does not fit in `Capacity` bytes is
+// rejected at compile time rather than spilled to the heap.
+template <typename Result, typename... Args, size_t Capacity>
+class inplace_function<Result (Args...), Capacity>
+{
+    private: struct ops_type {
+        Result (*invoke)(void *, Args &&...);
+        void (*copy)(void *, const void *);
+        void (*move)(void *, void *);
+        void (*destroy)(void *);
+    };
+
+    private: typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type my_storage;
+    // NULL when empty.
+    private: const ops_type *my_ops;
+
+    public: inplace_function() :
+        my_ops(NULL)
+    {}
+
+    public: inplace_function(std::nullptr_t) :
+        my_ops(NULL)
+    {}
+
+    public:
+        template <typename Fun, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<Fun>::type, inplace_function>::value>::type>
+        inplace_function(Fun &&fun) :
+            my_ops(&ops_for<typename std::decay<Fun>::type>())
+        {
+            typedef typename std::decay<Fun>::type fun_type;
+            static_assert(sizeof(fun_type) <= Capacity,
+                "callable does not fit in inplace_function; capture less or raise the capacity");
+            static_assert(alignof(std::max_align_t) % alignof(fun_type) == 0,
+                "callable is over-aligned for inplace_function");
+            new (&my_storage) fun_type(std::forward<Fun>(fun));
+        }
+
+    public: inplace_function(const inplace_function &other) :
+        my_ops(other.my_ops)
+    {
+        if (NULL != my_ops) {
+            my_ops->copy(&my_storage, &other.my_storage);
+        }
+    }
+
+    public: inplace_function(inplace_function &&other) :
+        my_ops(other.my_ops)
+    {
+        if (NULL != my_ops) {
+            my_ops->move(&my_storage, &other.my_storage);
+        }
+    }
+
+    public: ~inplace_function() {
+        reset();
+    }
+
+    public: inplace_function &operator=(inplace_function other) {
+        reset();
+        my_ops = other.my_ops;
+        if (NULL != my_ops) {
+            my_ops->move(&my_storage, &other.my_storage);
+        }
+        return *this;
+    }
+
+    public: explicit operator bool() const {
+        return NULL != my_ops;
+    }
+
+    public: Result operator()(Args... args) const {
+        assert(NULL != my_ops);
+        return my_ops->invoke(const_cast<void *>(static_cast<const void *>(&my_storage)), std::forward<Args>(args)...);
+    }
+
+    public: void reset() {
+        if (NULL != my_ops) {
+            my_ops->destroy(&my_storage);
+            my_ops = NULL;
+        }
+    }
+
+    private:
+        template <typename Fun>
+        static const ops_type &ops_for() {
+            static const ops_type ops = {
+                [](void *fun, Args &&...args) -> Result {
+                    return (*static_cast<Fun *>(fun))(std::forward<Args>(args)...);
+                },
+                [](void *dest, const void *src) {
+                    new (dest) Fun(*static_cast<const Fun *>(src));
+                },
+                [](void *dest, void *src) {
+                    new (dest) Fun(std::move(*static_cast<Fun *>(src)));
+                },
+                [](void *fun) {
+                    static_cast<Fun *>(fun)->~Fun();
+                },
+            };
+            return ops;
+        }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_INPLACE_FUNCTION_HH_IS_INCLUDED */
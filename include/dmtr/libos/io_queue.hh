@@ -9,11 +9,11 @@
 #include <boost/coroutine2/coroutine.hpp>
 #include <dmtr/annot.h>
 #include <dmtr/types.h>
+#include <dmtr/libos/queue_stats.hh>
+#include <dmtr/libos/task_slab.hh>
 #include <dmtr/libos/user_thread.hh>
 #include <memory>
 #include <sys/socket.h>
-#include <boost/unordered_map.hpp>
-#include <boost/atomic.hpp>
 
 namespace dmtr {
 
@@ -25,15 +25,24 @@ class io_queue
         NETWORK_Q,
         FILE_Q,
     };
+    // fields consulted on every poll. kept apart from `task` so that the
+    // slab can pack them densely.
+    protected: struct task_state {
+        bool valid = false;
+        dmtr_opcode_t opcode = DMTR_OPC_INVALID;
+        int error = EAGAIN;
+    };
     protected: class task {
         public: typedef user_thread<dmtr_qtoken_t> thread_type;
-        private: bool valid = false;
+        private: task_state *my_state;
         private: dmtr_qresult_t my_qr;
-        private: int my_error;
         private: dmtr_sgarray_t my_sga_arg;
         private: io_queue *my_queue_arg;
 
         public: task();
+        public: void attach(task_state &state) {
+            my_state = &state;
+        }
         public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode);
         public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg);
         public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg);
@@ -47,29 +56,28 @@ class io_queue
         public: bool arg(io_queue *&arg_out) const;
 
         public: bool done() const {
-            return my_error != EAGAIN;
+            return my_state->error != EAGAIN;
         }
         public: bool is_valid() const {
-            return valid;
+            return my_state->valid;
         }
         public: void clear() {
-            valid = false;
+            my_state->valid = false;
         }
         public: dmtr_opcode_t opcode() const {
-            return my_qr.qr_opcode;
+            return my_state->opcode;
         }
     };
-#define MAX_TASKS 1024
+    protected: typedef task_slab<task_state, task> task_table_type;
 
-#ifdef MAX_TASKS
-    private: task my_tasks[MAX_TASKS];
-#else
-    private: boost::unordered_map<dmtr_qtoken_t,task> my_tasks;
-#endif
+    // the low 32 bits of a queue token are a `task_table_type` slot id. the
+    // slab locks internally, so tokens may be issued and dropped from any
+    // thread.
+    private: task_table_type my_tasks;
     protected: const category_id my_cid;
     protected: const int my_qd;
-    private: boost::atomic<uint32_t> my_qt_counter;
- 
+    protected: queue_stats my_stats;
+
     protected: io_queue(enum category_id cid, int qd);
     public: virtual ~io_queue();
 
@@ -81,6 +89,14 @@ class io_queue
         return my_cid;
     }
 
+    public: const queue_stats &stats() const {
+        return my_stats;
+    }
+
+    public: void reset_stats() {
+        my_stats.reset();
+    }
+
     // network control plane functions
     // todo: move into derived class.
     public: virtual int socket(int domain, int type, int protocol);
@@ -95,6 +111,9 @@ class io_queue
     public: virtual int open2(const char *pathname, int flags, mode_t mode);
     public: virtual int creat(const char *pathname, mode_t mode);
 
+    // memory control plane functions
+    public: virtual int ring(size_t capacity, int flags);
+
     // general control plane functions.
     public: virtual int close();
 
@@ -114,6 +133,13 @@ class io_queue
     public: bool has_task(dmtr_qtoken_t qt);
     protected: task * get_task(dmtr_qtoken_t qt);
     private: int drop_task(dmtr_qtoken_t qt);
+
+    private: dmtr_qtoken_t make_qtoken(uint32_t task_id) const {
+        return (static_cast<dmtr_qtoken_t>(my_qd) << QD_OFFSET) | task_id;
+    }
+    private: static uint32_t task_id(dmtr_qtoken_t qt) {
+        return static_cast<uint32_t>(qt);
+    }
 };
 
 } // namespace dmtr
@@ -8,17 +8,17 @@
 
 #include "io_queue.hh"
 #include "io_queue_factory.hh"
-#include <boost/atomic.hpp>
+#include "qd_table.hh"
 #include <dmtr/annot.h>
 #include <memory>
+#include <ostream>
 #include <unordered_map>
 
 namespace dmtr {
 
 class io_queue_api
 {
-    private: boost::atomic<uint32_t> my_qd_counter;
-    private: std::unique_ptr<io_queue> my_queues[256];
+    private: qd_table<io_queue> my_queues;
     private: io_queue_factory my_queue_factory;
 
     private: io_queue_api();
@@ -37,6 +37,7 @@ class io_queue_api
     public: int register_queue_ctor(enum io_queue::category_id cid, io_queue_factory::ctor_type ctor);
 
     public: int queue(int &qd_out);
+    public: int queue2(int &qd_out, size_t capacity, int flags);
 
     // ================================================
     // Generic interfaces to libOS syscalls
@@ -59,6 +60,21 @@ class io_queue_api
     public: int drop(dmtr_qtoken_t qt);
     public: int is_qd_valid(bool &flag, int qd);
 
+    // writes one `queue_stats::print()` line per open queue.
+    public: int stats(std::ostream &out) const {
+        my_queues.for_each([&out](int qd, const io_queue &q) {
+            q.stats().print(out, qd);
+        });
+        return 0;
+    }
+
+    public: int reset_stats() {
+        my_queues.for_each([](int, io_queue &q) {
+            q.reset_stats();
+        });
+        return 0;
+    }
+
     private: static void on_poll_failure(dmtr_qresult_t * const qr_out, io_queue_api *self);
 
 };
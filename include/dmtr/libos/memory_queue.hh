@@ -7,6 +7,7 @@
 #define DMTR_LIBOS_BASIC_QUEUE_HH_IS_INCLUDED
 
 #include "io_queue.hh"
+#include "ring_buffer.hh"
 
 #include <condition_variable>
 #include <dmtr/types.h>
@@ -21,6 +22,9 @@ class memory_queue : public io_queue
 {
     private: std::queue<dmtr_sgarray_t> my_ready_queue;
     private: std::recursive_mutex my_lock;
+    // when one of these is set, it replaces `my_ready_queue` and `my_lock`.
+    private: std::unique_ptr<spsc_ring<dmtr_sgarray_t>> my_spsc_ring;
+    private: std::unique_ptr<mpmc_ring<dmtr_sgarray_t>> my_mpmc_ring;
     private: std::unique_ptr<task::thread_type> my_push_thread;
     private: std::unique_ptr<task::thread_type> my_pop_thread;
     private: bool my_good_flag;
@@ -34,10 +38,107 @@ class memory_queue : public io_queue
     public: virtual int drop(dmtr_qtoken_t qt);
     public: virtual int close();
 
+    public: virtual int ring(size_t capacity, int flags) {
+        DMTR_TRUE(EPERM, !has_ring());
+        DMTR_TRUE(EPERM, my_ready_queue.empty());
+
+        switch (flags) {
+            default:
+                return EINVAL;
+            case DMTR_QUEUE_SPSC:
+                return spsc_ring<dmtr_sgarray_t>::new_object(my_spsc_ring, capacity);
+            case DMTR_QUEUE_MPMC:
+                return mpmc_ring<dmtr_sgarray_t>::new_object(my_mpmc_ring, capacity);
+        }
+    }
+
     private: bool good() const {
         return my_good_flag;
     }
 
+    private: bool has_ring() const {
+        return NULL != my_spsc_ring.get() || NULL != my_mpmc_ring.get();
+    }
+
+    // with a ring, `push()`, `pop()` and `poll()` hand over to the functions
+    // below instead of the push and pop threads, which only one thread at a
+    // time can service. an operation tries the ring when it is submitted and
+    // again each time it is polled, so that any number of threads can push and
+    // pop at once (one of each with `DMTR_QUEUE_SPSC`), with nothing but the
+    // task slab's lock and the ring's own atomics between them.
+    private: int push_to_ring(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+        const int ret = new_task(qt, DMTR_OPC_PUSH, sga);
+        my_stats.on_submit(DMTR_OPC_PUSH, &sga, ret);
+        DMTR_OK(ret);
+        task *t = NULL;
+        DMTR_OK(get_task(t, qt));
+        return service_ring_task(*t);
+    }
+
+    private: int pop_from_ring(dmtr_qtoken_t qt) {
+        const int ret = new_task(qt, DMTR_OPC_POP);
+        my_stats.on_submit(DMTR_OPC_POP, NULL, ret);
+        DMTR_OK(ret);
+        task *t = NULL;
+        DMTR_OK(get_task(t, qt));
+        return service_ring_task(*t);
+    }
+
+    private: int poll_ring(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, qt));
+        DMTR_OK(service_ring_task(*t));
+        return t->poll(qr_out);
+    }
+
+    // completes `t` if the ring has room for its element, or an element for
+    // it. a push into a full ring, or a pop from an empty one, is left to be
+    // retried by the next poll.
+    private: int service_ring_task(task &t) {
+        if (t.done()) {
+            return 0;
+        }
+
+        switch (t.opcode()) {
+            default:
+                DMTR_UNREACHABLE();
+            case DMTR_OPC_PUSH: {
+                const dmtr_sgarray_t *sga = NULL;
+                DMTR_TRUE(EINVAL, t.arg(sga));
+                if (1 == ring_push(sga, 1)) {
+                    DMTR_OK(t.complete(0, *sga));
+                    my_stats.on_complete(DMTR_OPC_PUSH, sga);
+                }
+                return 0;
+            }
+            case DMTR_OPC_POP: {
+                dmtr_sgarray_t sga = {};
+                if (1 == ring_pop(&sga, 1)) {
+                    DMTR_OK(t.complete(0, sga));
+                    my_stats.on_complete(DMTR_OPC_POP, &sga);
+                }
+                return 0;
+            }
+        }
+    }
+
+    // moves up to `count` elements into the ring; returns how many fit.
+    private: size_t ring_push(const dmtr_sgarray_t *sgas, size_t count) {
+        if (NULL != my_spsc_ring.get()) {
+            return my_spsc_ring->push(sgas, count);
+        }
+        return my_mpmc_ring->push(sgas, count);
+    }
+
+    // moves up to `count` elements out of the ring; returns how many were
+    // available.
+    private: size_t ring_pop(dmtr_sgarray_t *sgas_out, size_t count) {
+        if (NULL != my_spsc_ring.get()) {
+            return my_spsc_ring->pop(sgas_out, count);
+        }
+        return my_mpmc_ring->pop(sgas_out, count);
+    }
+
     private: void start_threads();
     private: int push_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
     private: int pop_thread(task::thread_type::yield_type &yield, task::thread_type::queue_type &tq);
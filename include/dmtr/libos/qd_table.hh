@@ -0,0 +1,230 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_QD_TABLE_HH_IS_INCLUDED
+#define DMTR_LIBOS_QD_TABLE_HH_IS_INCLUDED
+
+#include <dmtr/annot.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace dmtr {
+
+// maps queue descriptors to objects through a two-level radix table. leaves
+// are allocated on demand and never freed before the table itself, so
+// `find()` is a pair of acquire loads with no locking.
+//
+// descriptor allocation and recycling are sharded by thread: each shard owns
+// a lock and a FIFO of released descriptors (FIFO so that a descriptor is
+// reused as late as possible). a thread that finds its own shard empty takes a
+// released descriptor from another shard before a fresh one from the shared
+// counter, so that descriptors closed on other threads than the one that opened
+// them are still reused.
+//
+// objects are owned by the table between `insert()` and `remove()`. the
+// table does not protect an object from being removed while another thread
+// is using a pointer obtained from `find()`; as before, callers must not
+// close a queue that is still in use on the data plane.
+template <typename T>
+class qd_table
+{
+    private: static const unsigned int LEAF_BITS = 12;
+    private: static const unsigned int ROOT_BITS = 12;
+    private: static const size_t LEAF_SIZE = size_t(1) << LEAF_BITS;
+    private: static const size_t ROOT_SIZE = size_t(1) << ROOT_BITS;
+    private: static const unsigned int SHARD_COUNT = 16;
+    public: static const int MAX_QD = static_cast<int>((ROOT_SIZE * LEAF_SIZE) - 1);
+
+    private: typedef std::atomic<T *> leaf_type[LEAF_SIZE];
+
+    private: struct alignas(64) shard {
+        std::mutex lock;
+        std::deque<int> free_qds;
+    };
+
+    private: std::unique_ptr<std::atomic<leaf_type *>[]> my_root;
+    private: std::mutex my_grow_lock;
+    private: std::atomic<int> my_next_qd;
+    private: shard my_shards[SHARD_COUNT];
+
+    public: qd_table() :
+        my_root(new std::atomic<leaf_type *>[ROOT_SIZE]),
+        // zero is never handed out.
+        my_next_qd(1)
+    {
+        for (size_t i = 0; i < ROOT_SIZE; ++i) {
+            my_root[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    public: ~qd_table() {
+        for (size_t i = 0; i < ROOT_SIZE; ++i) {
+            leaf_type *leaf = my_root[i].load(std::memory_order_relaxed);
+            if (NULL == leaf) {
+                continue;
+            }
+
+            for (size_t j = 0; j < LEAF_SIZE; ++j) {
+                delete (*leaf)[j].load(std::memory_order_relaxed);
+            }
+            delete[] leaf;
+        }
+    }
+
+    private: qd_table(const qd_table &) = delete;
+    private: qd_table &operator=(const qd_table &) = delete;
+
+    // reserves a descriptor. a reserved descriptor does not resolve until an
+    // object is inserted under it.
+    public: int alloc(int &qd_out) {
+        qd_out = -1;
+
+        const size_t local = local_shard_index();
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            if (take_free_qd(qd_out, my_shards[(local + i) % SHARD_COUNT])) {
+                return 0;
+            }
+        }
+
+        const int qd = my_next_qd.fetch_add(1, std::memory_order_relaxed);
+        if (DMTR_UNLIKELY(qd > MAX_QD || qd < 0)) {
+            my_next_qd.store(MAX_QD + 1, std::memory_order_relaxed);
+            return ENFILE;
+        }
+
+        DMTR_OK(ensure_leaf(qd));
+        qd_out = qd;
+        return 0;
+    }
+
+    // returns a reserved descriptor that was never used to the free list.
+    public: void release(int qd) {
+        shard &s = my_shards[local_shard_index()];
+        std::lock_guard<std::mutex> lock(s.lock);
+        s.free_qds.push_back(qd);
+    }
+
+    public: int insert(int qd, std::unique_ptr<T> &obj) {
+        DMTR_NOTNULL(EINVAL, obj.get());
+
+        std::atomic<T *> *entry = NULL;
+        DMTR_OK(find_entry(entry, qd));
+
+        T *expected = NULL;
+        DMTR_TRUE(EEXIST, entry->compare_exchange_strong(expected, obj.get(), std::memory_order_release, std::memory_order_relaxed));
+        obj.release();
+        return 0;
+    }
+
+    public: int find(T *&obj_out, int qd) const {
+        obj_out = NULL;
+
+        std::atomic<T *> *entry = NULL;
+        int ret = find_entry(entry, qd);
+        if (0 != ret) {
+            return ret;
+        }
+
+        T * const obj = entry->load(std::memory_order_acquire);
+        if (DMTR_UNLIKELY(NULL == obj)) {
+            return ENOENT;
+        }
+
+        obj_out = obj;
+        return 0;
+    }
+
+    // unpublishes the object registered under `qd` and recycles `qd`.
+    public: int remove(std::unique_ptr<T> &obj_out, int qd) {
+        obj_out.reset();
+
+        std::atomic<T *> *entry = NULL;
+        DMTR_OK(find_entry(entry, qd));
+
+        T * const obj = entry->exchange(NULL, std::memory_order_acq_rel);
+        DMTR_NOTNULL(ENOENT, obj);
+        obj_out.reset(obj);
+        release(qd);
+        return 0;
+    }
+
+    // calls `fn(qd, obj)` for every object in the table. like `find()`, this
+    // takes no lock, so objects inserted or removed meanwhile may or may not
+    // be visited.
+    public: template <typename Fn>
+    void for_each(Fn fn) const {
+        const int end = std::min(my_next_qd.load(std::memory_order_relaxed), MAX_QD + 1);
+        for (int qd = 1; qd < end; ++qd) {
+            std::atomic<T *> *entry = NULL;
+            if (0 != find_entry(entry, qd)) {
+                // the leaf isn't published yet; nothing above it is either.
+                break;
+            }
+            T * const obj = entry->load(std::memory_order_acquire);
+            if (NULL != obj) {
+                fn(qd, *obj);
+            }
+        }
+    }
+
+    private: int find_entry(std::atomic<T *> *&entry_out, int qd) const {
+        entry_out = NULL;
+        if (DMTR_UNLIKELY(qd < 0 || qd > MAX_QD)) {
+            return EBADF;
+        }
+
+        leaf_type * const leaf = my_root[qd >> LEAF_BITS].load(std::memory_order_acquire);
+        if (DMTR_UNLIKELY(NULL == leaf)) {
+            return ENOENT;
+        }
+
+        entry_out = &(*leaf)[qd & (LEAF_SIZE - 1)];
+        return 0;
+    }
+
+    private: int ensure_leaf(int qd) {
+        std::atomic<leaf_type *> &slot = my_root[qd >> LEAF_BITS];
+        if (NULL != slot.load(std::memory_order_acquire)) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lock(my_grow_lock);
+        if (NULL != slot.load(std::memory_order_relaxed)) {
+            return 0;
+        }
+
+        leaf_type *leaf = new (std::nothrow) leaf_type[1];
+        DMTR_NOTNULL(ENOMEM, leaf);
+        for (size_t i = 0; i < LEAF_SIZE; ++i) {
+            (*leaf)[i].store(NULL, std::memory_order_relaxed);
+        }
+        slot.store(leaf, std::memory_order_release);
+        return 0;
+    }
+
+    private: static bool take_free_qd(int &qd_out, shard &s) {
+        std::lock_guard<std::mutex> lock(s.lock);
+        if (s.free_qds.empty()) {
+            return false;
+        }
+        qd_out = s.free_qds.front();
+        s.free_qds.pop_front();
+        return true;
+    }
+
+    private: static size_t local_shard_index() {
+        const size_t h = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return h % SHARD_COUNT;
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_QD_TABLE_HH_IS_INCLUDED */
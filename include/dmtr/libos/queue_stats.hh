@@ -0,0 +1,205 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_QUEUE_STATS_HH_IS_INCLUDED
+#define DMTR_LIBOS_QUEUE_STATS_HH_IS_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <dmtr/types.h>
+#include <ostream>
+
+namespace dmtr {
+
+// log-linear histogram of nanosecond latencies with a fixed number of buckets.
+// values below 16 are counted exactly; above that, each power of two is split
+// into 8 buckets, so a reported percentile is at most 12.5% above the truth.
+class latency_histogram
+{
+    private: static const size_t LINEAR_BUCKETS = 16;
+    private: static const unsigned int SUB_BUCKET_BITS = 3;
+    private: static const size_t NUM_BUCKETS = LINEAR_BUCKETS + (64 - 4) * (1 << SUB_BUCKET_BITS);
+
+    private: uint64_t my_buckets[NUM_BUCKETS];
+    private: uint64_t my_count;
+    private: uint64_t my_max;
+
+    public: latency_histogram() {
+        reset();
+    }
+
+    public: void reset() {
+        memset(my_buckets, 0, sizeof(my_buckets));
+        my_count = 0;
+        my_max = 0;
+    }
+
+    public: void record(uint64_t value) {
+        ++my_buckets[bucket(value)];
+        ++my_count;
+        my_max = std::max(my_max, value);
+    }
+
+    public: uint64_t count() const {
+        return my_count;
+    }
+
+    public: uint64_t max() const {
+        return my_max;
+    }
+
+    // upper bound on the `p`th percentile (0 < p <= 1) of the recorded values.
+    public: uint64_t percentile(double p) const {
+        uint64_t target = static_cast<uint64_t>(std::max(1.0, std::ceil(my_count * p)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            seen += my_buckets[i];
+            if (seen >= target) {
+                return std::min(bucket_limit(i), my_max);
+            }
+        }
+        return my_max;
+    }
+
+    private: static size_t bucket(uint64_t value) {
+        if (value < LINEAR_BUCKETS) {
+            return value;
+        }
+        unsigned int msb = 63 - __builtin_clzll(value);
+        size_t sub = (value >> (msb - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+        return LINEAR_BUCKETS + (msb - 4) * (1 << SUB_BUCKET_BITS) + sub;
+    }
+
+    // largest value that falls into bucket `i`.
+    private: static uint64_t bucket_limit(size_t i) {
+        if (i < LINEAR_BUCKETS) {
+            return i;
+        }
+        unsigned int msb = ((i - LINEAR_BUCKETS) >> SUB_BUCKET_BITS) + 4;
+        uint64_t sub = (i - LINEAR_BUCKETS) & ((1 << SUB_BUCKET_BITS) - 1);
+        unsigned int shift = msb - SUB_BUCKET_BITS;
+        uint64_t top = (1 << SUB_BUCKET_BITS) + sub + 1;
+        // the last bucket reaches the top of the range.
+        if (top << shift == 0) {
+            return UINT64_MAX;
+        }
+        return (top << shift) - 1;
+    }
+};
+
+// counters for a single queue. the counters are relaxed atomics, since
+// ring-backed memory queues submit and complete operations on whichever
+// threads push and pop. the latency histogram isn't synchronized, and is only
+// recorded by the thread that owns the libOS instance.
+class queue_stats
+{
+    public: std::atomic<uint64_t> pushes;
+    public: std::atomic<uint64_t> pops;
+    public: std::atomic<uint64_t> push_bytes;
+    public: std::atomic<uint64_t> pop_bytes;
+    // submissions that the queue rejected.
+    public: std::atomic<uint64_t> failures;
+    // operations submitted but not yet completed or dropped.
+    public: std::atomic<uint64_t> outstanding;
+    // submission-to-completion latency, in nanoseconds.
+    public: latency_histogram latency;
+
+    public: queue_stats() {
+        reset();
+    }
+
+    private: queue_stats(const queue_stats &) = delete;
+    private: queue_stats &operator=(const queue_stats &) = delete;
+
+    public: void reset() {
+        pushes.store(0, std::memory_order_relaxed);
+        pops.store(0, std::memory_order_relaxed);
+        push_bytes.store(0, std::memory_order_relaxed);
+        pop_bytes.store(0, std::memory_order_relaxed);
+        failures.store(0, std::memory_order_relaxed);
+        outstanding.store(0, std::memory_order_relaxed);
+        latency.reset();
+    }
+
+    public: void on_submit(dmtr_opcode_t opcode, const dmtr_sgarray_t *sga, int error) {
+        if (0 != error) {
+            failures.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        switch (opcode) {
+            default:
+                break;
+            case DMTR_OPC_PUSH:
+                pushes.fetch_add(1, std::memory_order_relaxed);
+                if (NULL != sga) {
+                    push_bytes.fetch_add(length(*sga), std::memory_order_relaxed);
+                }
+                break;
+            case DMTR_OPC_POP:
+                pops.fetch_add(1, std::memory_order_relaxed);
+                break;
+        }
+        outstanding.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // for completions whose submission time isn't known. `sga` is what a pop
+    // returned.
+    public: void on_complete(dmtr_opcode_t opcode, const dmtr_sgarray_t *sga) {
+        if (DMTR_OPC_POP == opcode && NULL != sga) {
+            pop_bytes.fetch_add(length(*sga), std::memory_order_relaxed);
+        }
+        retire();
+    }
+
+    public: void on_complete(const dmtr_qresult_t &qr, uint64_t latency_ns) {
+        on_complete(qr.qr_opcode, &qr.qr_value.sga);
+        latency.record(latency_ns);
+    }
+
+    public: void on_drop() {
+        retire();
+    }
+
+    // writes one `key=value` line, in the format used by `dmtr_stats()`.
+    public: void print(std::ostream &out, int qd) const {
+        out << "qd=" << qd
+            << " pushes=" << pushes.load(std::memory_order_relaxed)
+            << " pops=" << pops.load(std::memory_order_relaxed)
+            << " push_bytes=" << push_bytes.load(std::memory_order_relaxed)
+            << " pop_bytes=" << pop_bytes.load(std::memory_order_relaxed)
+            << " failures=" << failures.load(std::memory_order_relaxed)
+            << " outstanding=" << outstanding.load(std::memory_order_relaxed);
+        if (latency.count() > 0) {
+            out << " latency_count=" << latency.count()
+                << " p50_ns=" << latency.percentile(0.5)
+                << " p99_ns=" << latency.percentile(0.99)
+                << " p999_ns=" << latency.percentile(0.999)
+                << " max_ns=" << latency.max();
+        }
+        out << "\n";
+    }
+
+    public: static uint64_t length(const dmtr_sgarray_t &sga) {
+        uint64_t n = 0;
+        for (uint32_t i = 0; i < sga.sga_numsegs && i < DMTR_SGARRAY_MAXSIZE; ++i) {
+            n += sga.sga_segs[i].sgaseg_len;
+        }
+        return n;
+    }
+
+    // counts an operation out, unless a reset already forgot it.
+    private: void retire() {
+        uint64_t n = outstanding.load(std::memory_order_relaxed);
+        while (n > 0 && !outstanding.compare_exchange_weak(n, n - 1, std::memory_order_relaxed)) {}
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_QUEUE_STATS_HH_IS_INCLUDED */
@@ -4,16 +4,22 @@
 #ifndef DMTR_RAII_GUARD_HH_IS_INCLUDED
 #define DMTR_RAII_GUARD_HH_IS_INCLUDED
 
-#include <functional>
+#include "inplace_function.hh"
+
 #include <utility>
 
 namespace dmtr {
 
+// runs a callable when it goes out of scope, unless cancelled. the callable is
+// stored inline, so creating a guard never allocates; captures larger than
+// `inplace_function`'s capacity fail to compile.
 class raii_guard {
-    private: std::function<void()> my_dtor;
+    private: inplace_function<void()> my_dtor;
 
     public: ~raii_guard() {
-        my_dtor();
+        if (my_dtor) {
+            my_dtor();
+        }
     }
 
     public:
@@ -23,9 +29,16 @@ class raii_guard {
         {}
 
     private: raii_guard(const raii_guard &) = delete;
-    public: raii_guard(raii_guard &&other);
 
-    public: void cancel();
+    public: raii_guard(raii_guard &&other) :
+        my_dtor(std::move(other.my_dtor))
+    {
+        other.cancel();
+    }
+
+    public: void cancel() {
+        my_dtor.reset();
+    }
 };
 
 } //namespace dmtr
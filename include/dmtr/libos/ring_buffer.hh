@@ -0,0 +1,207 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_RING_BUFFER_HH_IS_INCLUDED
+#define DMTR_LIBOS_RING_BUFFER_HH_IS_INCLUDED
+
+#include <dmtr/annot.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace dmtr {
+
+#define DMTR_CACHE_LINE_SIZE 64
+
+// bounded single-producer/single-consumer ring. each side keeps a cached copy
+// of the other side's index so that the shared cache line is only read when
+// the ring looks full (producer) or empty (consumer).
+template <typename T>
+class spsc_ring
+{
+    private: const size_t my_mask;
+    private: std::unique_ptr<T[]> my_slots;
+
+    private: alignas(DMTR_CACHE_LINE_SIZE) std::atomic<size_t> my_head;
+    private: size_t my_cached_tail;
+    private: alignas(DMTR_CACHE_LINE_SIZE) std::atomic<size_t> my_tail;
+    private: size_t my_cached_head;
+    private: char my_padding[DMTR_CACHE_LINE_SIZE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+    private: spsc_ring(size_t capacity) :
+        my_mask(capacity - 1),
+        my_slots(new T[capacity]),
+        my_head(0),
+        my_cached_tail(0),
+        my_tail(0),
+        my_cached_head(0)
+    {}
+
+    // `capacity` must be a nonzero power of two.
+    public: static int new_object(std::unique_ptr<spsc_ring> &ring_out, size_t capacity) {
+        DMTR_TRUE(EINVAL, capacity > 0 && 0 == (capacity & (capacity - 1)));
+        ring_out.reset(new spsc_ring(capacity));
+        return 0;
+    }
+
+    private: spsc_ring(const spsc_ring &) = delete;
+    private: spsc_ring &operator=(const spsc_ring &) = delete;
+
+    public: size_t capacity() const {
+        return my_mask + 1;
+    }
+
+    // producer side. returns the number of items enqueued, which is less
+    // than `count` if the ring fills up.
+    public: size_t push(const T *items, size_t count) {
+        const size_t tail = my_tail.load(std::memory_order_relaxed);
+        size_t space = capacity() - (tail - my_cached_head);
+        if (space < count) {
+            my_cached_head = my_head.load(std::memory_order_acquire);
+            space = capacity() - (tail - my_cached_head);
+        }
+
+        const size_t n = count < space ? count : space;
+        for (size_t i = 0; i < n; ++i) {
+            my_slots[(tail + i) & my_mask] = items[i];
+        }
+        if (n > 0) {
+            my_tail.store(tail + n, std::memory_order_release);
+        }
+        return n;
+    }
+
+    public: bool try_push(const T &item) {
+        return 1 == push(&item, 1);
+    }
+
+    // consumer side. returns the number of items dequeued.
+    public: size_t pop(T *items_out, size_t count) {
+        const size_t head = my_head.load(std::memory_order_relaxed);
+        size_t ready = my_cached_tail - head;
+        if (ready < count) {
+            my_cached_tail = my_tail.load(std::memory_order_acquire);
+            ready = my_cached_tail - head;
+        }
+
+        const size_t n = count < ready ? count : ready;
+        for (size_t i = 0; i < n; ++i) {
+            items_out[i] = my_slots[(head + i) & my_mask];
+        }
+        if (n > 0) {
+            my_head.store(head + n, std::memory_order_release);
+        }
+        return n;
+    }
+
+    public: bool try_pop(T &item_out) {
+        return 1 == pop(&item_out, 1);
+    }
+};
+
+// bounded multi-producer/multi-consumer ring (Vyukov). every cell carries a
+// sequence number that tells producers and consumers whose turn it is, so
+// each operation costs one CAS on the shared index in the common case.
+template <typename T>
+class mpmc_ring
+{
+    private: struct alignas(DMTR_CACHE_LINE_SIZE) cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    private: const size_t my_mask;
+    private: std::unique_ptr<cell[]> my_cells;
+
+    private: alignas(DMTR_CACHE_LINE_SIZE) std::atomic<size_t> my_head;
+    private: alignas(DMTR_CACHE_LINE_SIZE) std::atomic<size_t> my_tail;
+    private: char my_padding[DMTR_CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+
+    private: mpmc_ring(size_t capacity) :
+        my_mask(capacity - 1),
+        my_cells(new cell[capacity]),
+        my_head(0),
+        my_tail(0)
+    {
+        for (size_t i = 0; i < capacity; ++i) {
+            my_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // `capacity` must be a power of two no smaller than two.
+    public: static int new_object(std::unique_ptr<mpmc_ring> &ring_out, size_t capacity) {
+        DMTR_TRUE(EINVAL, capacity > 1 && 0 == (capacity & (capacity - 1)));
+        ring_out.reset(new mpmc_ring(capacity));
+        return 0;
+    }
+
+    private: mpmc_ring(const mpmc_ring &) = delete;
+    private: mpmc_ring &operator=(const mpmc_ring &) = delete;
+
+    public: size_t capacity() const {
+        return my_mask + 1;
+    }
+
+    public: bool try_push(const T &item) {
+        size_t pos = my_tail.load(std::memory_order_relaxed);
+        for (;;) {
+            cell &c = my_cells[pos & my_mask];
+            const size_t seq = c.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (0 == diff) {
+                if (my_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = item;
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = my_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    public: bool try_pop(T &item_out) {
+        size_t pos = my_head.load(std::memory_order_relaxed);
+        for (;;) {
+            cell &c = my_cells[pos & my_mask];
+            const size_t seq = c.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (0 == diff) {
+                if (my_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item_out = c.value;
+                    c.sequence.store(pos + my_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = my_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    public: size_t push(const T *items, size_t count) {
+        size_t n = 0;
+        while (n < count && try_push(items[n])) {
+            ++n;
+        }
+        return n;
+    }
+
+    public: size_t pop(T *items_out, size_t count) {
+        size_t n = 0;
+        while (n < count && try_pop(items_out[n])) {
+            ++n;
+        }
+        return n;
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_RING_BUFFER_HH_IS_INCLUDED */
@@ -0,0 +1,126 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_SMALL_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_SMALL_QUEUE_HH_IS_INCLUDED
+
+#include <cassert>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dmtr {
+
+// FIFO queue with room for `InlineCapacity` elements inside the object itself,
+// so that it only allocates once more elements than that are queued at the
+// same time. it has the subset of the `std::queue` interface that user threads
+// rely on. elements are constructed when pushed and destroyed when popped, so
+// `Value` needs no default constructor.
+template <typename Value, size_t InlineCapacity = 8>
+class small_queue
+{
+    private: typedef typename std::aligned_storage<sizeof(Value), alignof(Value)>::type slot_type;
+
+    private: slot_type my_inline[InlineCapacity];
+    private: size_t my_head;
+    private: size_t my_inline_count;
+    // elements that did not fit inline, created on first use (libstdc++'s
+    // deque allocates even when empty). they are always younger than the inline
+    // ones, so anything pushed while it is non-empty goes here too.
+    private: std::unique_ptr<std::deque<Value>> my_overflow;
+
+    public: small_queue() :
+        my_head(0),
+        my_inline_count(0)
+    {}
+
+    private: small_queue(const small_queue &) = delete;
+    private: small_queue &operator=(const small_queue &) = delete;
+
+    public: small_queue(small_queue &&other) :
+        my_head(0),
+        my_inline_count(0),
+        my_overflow(std::move(other.my_overflow))
+    {
+        for (size_t i = 0; i < other.my_inline_count; ++i) {
+            Value &value = other.inline_at(i);
+            new (&my_inline[i]) Value(std::move(value));
+            value.~Value();
+        }
+        my_inline_count = other.my_inline_count;
+        other.my_head = 0;
+        other.my_inline_count = 0;
+    }
+
+    public: ~small_queue() {
+        while (my_inline_count > 0) {
+            pop_inline();
+        }
+    }
+
+    public: bool empty() const {
+        return 0 == size();
+    }
+
+    public: size_t size() const {
+        return my_inline_count + overflow_size();
+    }
+
+    public: Value &front() {
+        assert(!empty());
+        if (my_inline_count > 0) {
+            return inline_at(0);
+        }
+        return my_overflow->front();
+    }
+
+    public: const Value &front() const {
+        return const_cast<small_queue *>(this)->front();
+    }
+
+    public: void push(const Value &value) {
+        if (my_inline_count < InlineCapacity && 0 == overflow_size()) {
+            new (&my_inline[(my_head + my_inline_count) % InlineCapacity]) Value(value);
+            ++my_inline_count;
+            return;
+        }
+
+        if (NULL == my_overflow.get()) {
+            my_overflow.reset(new std::deque<Value>);
+        }
+        my_overflow->push_back(value);
+    }
+
+    public: void pop() {
+        assert(!empty());
+        if (my_inline_count > 0) {
+            pop_inline();
+        } else {
+            my_overflow->pop_front();
+        }
+    }
+
+    // returns the `i`th oldest inline element.
+    private: Value &inline_at(size_t i) {
+        return *reinterpret_cast<Value *>(&my_inline[(my_head + i) % InlineCapacity]);
+    }
+
+    private: void pop_inline() {
+        inline_at(0).~Value();
+        my_head = (my_head + 1) % InlineCapacity;
+        --my_inline_count;
+    }
+
+    private: size_t overflow_size() const {
+        return NULL == my_overflow.get() ? 0 : my_overflow->size();
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_SMALL_QUEUE_HH_IS_INCLUDED */
@@ -0,0 +1,150 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_STACK_POOL_HH_IS_INCLUDED
+#define DMTR_LIBOS_STACK_POOL_HH_IS_INCLUDED
+
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <dmtr/annot.h>
+#include <cerrno>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+namespace dmtr {
+
+// pool of fixed-size coroutine stacks. each stack is mapped once, with a
+// `PROT_NONE` guard page below it so that an overflow faults instead of
+// scribbling over a neighbour, and is kept for reuse when its coroutine
+// finishes. creating a `user_thread` then costs a free-list pop instead of an
+// `mmap()`/`munmap()` pair.
+//
+// the pool is synchronized, since queues (and their threads) may be created and
+// destroyed on different threads.
+//
+// stacks are boost's default size unless the pool is given another one. code
+// that knows its coroutines are shallow can opt into smaller stacks with a pool
+// of its own, handed to `user_thread` through a `pooled_stack_allocator`.
+class stack_pool
+{
+    public: static const size_t DEFAULT_MAX_CACHED = 1024;
+
+    private: const size_t my_page_size;
+    // usable size of each stack, not counting the guard page.
+    private: const size_t my_stack_size;
+    private: const size_t my_max_cached;
+    private: std::mutex my_lock;
+    // lowest address of each cached mapping (i.e. its guard page).
+    private: std::vector<void *> my_free_stacks;
+
+    public: stack_pool(size_t stack_size = default_stack_size(), size_t max_cached = DEFAULT_MAX_CACHED) :
+        my_page_size(sysconf(_SC_PAGESIZE)),
+        my_stack_size(round_up(stack_size, my_page_size)),
+        my_max_cached(max_cached)
+    {}
+
+    private: stack_pool(const stack_pool &) = delete;
+    private: stack_pool &operator=(const stack_pool &) = delete;
+
+    public: ~stack_pool() {
+        for (auto base : my_free_stacks) {
+            munmap(base, mapping_size());
+        }
+    }
+
+    // pool used by `user_thread` unless it is given another one.
+    public: static stack_pool &default_pool() {
+        static stack_pool pool;
+        return pool;
+    }
+
+    // what `boost::context::fixedsize_stack` would give a coroutine.
+    public: static size_t default_stack_size() {
+        return boost::context::stack_traits::default_size();
+    }
+
+    public: size_t stack_size() const {
+        return my_stack_size;
+    }
+
+    public: int allocate(boost::context::stack_context &sctx_out) {
+        void *base = NULL;
+        {
+            std::lock_guard<std::mutex> lock(my_lock);
+            if (!my_free_stacks.empty()) {
+                base = my_free_stacks.back();
+                my_free_stacks.pop_back();
+            }
+        }
+
+        if (NULL == base) {
+            base = mmap(NULL, mapping_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (MAP_FAILED == base) {
+                return ENOMEM;
+            }
+            if (0 != mprotect(base, my_page_size, PROT_NONE)) {
+                int err = errno;
+                munmap(base, mapping_size());
+                return err;
+            }
+        }
+
+        // stacks grow down, so the usable region sits above the guard page.
+        sctx_out.size = my_stack_size;
+        sctx_out.sp = static_cast<char *>(base) + mapping_size();
+        return 0;
+    }
+
+    public: void deallocate(boost::context::stack_context &sctx) {
+        void *base = static_cast<char *>(sctx.sp) - mapping_size();
+        {
+            std::lock_guard<std::mutex> lock(my_lock);
+            if (my_free_stacks.size() < my_max_cached) {
+                my_free_stacks.push_back(base);
+                return;
+            }
+        }
+        munmap(base, mapping_size());
+    }
+
+    private: size_t mapping_size() const {
+        return my_stack_size + my_page_size;
+    }
+
+    private: static size_t round_up(size_t n, size_t multiple) {
+        return (n + multiple - 1) / multiple * multiple;
+    }
+};
+
+// boost.context stack allocator that draws from a `stack_pool`. it is copied
+// into every coroutine, so it only carries a reference to the pool.
+class pooled_stack_allocator
+{
+    private: stack_pool *my_pool;
+
+    public: pooled_stack_allocator(stack_pool &pool = stack_pool::default_pool()) :
+        my_pool(&pool)
+    {}
+
+    public: boost::context::stack_context allocate() {
+        boost::context::stack_context sctx;
+        if (0 != my_pool->allocate(sctx)) {
+            throw std::bad_alloc();
+        }
+        return sctx;
+    }
+
+    public: void deallocate(boost::context::stack_context &sctx) noexcept {
+        my_pool->deallocate(sctx);
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_STACK_POOL_HH_IS_INCLUDED */
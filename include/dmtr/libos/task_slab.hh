@@ -0,0 +1,200 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_TASK_SLAB_HH_IS_INCLUDED
+#define DMTR_LIBOS_TASK_SLAB_HH_IS_INCLUDED
+
+#include <dmtr/annot.h>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace dmtr {
+
+// growable slab of task slots, addressed by 32-bit ids that carry a
+// generation counter in their low bits. the generation is bumped every time a
+// slot is released, so an id that outlives its slot (a stale or recycled queue
+// token) is rejected instead of aliasing whatever task reuses the slot.
+//
+// per-slot state is split in two: `Hot` holds the handful of fields that are
+// tested on every poll and lives in a compact array; `Cold` holds the bulky
+// payload (results, arguments) and is only touched once a slot is known to be
+// live. storage grows one chunk at a time and is never moved, so pointers
+// handed out by `find()` stay valid until the slot is released.
+//
+// the slab is synchronized, since a queue's tokens may be issued, looked up and
+// dropped from different threads. as with `qd_table`, it does not protect a
+// slot from being released while another thread uses a pointer obtained from
+// `find()`.
+template <typename Hot, typename Cold>
+class task_slab
+{
+    public: static const unsigned int GENERATION_BITS = 12;
+    public: static const uint32_t GENERATION_MASK = (UINT32_C(1) << GENERATION_BITS) - 1;
+    public: static const uint32_t MAX_SLOTS = UINT32_C(1) << (32 - GENERATION_BITS);
+
+    private: static const unsigned int CHUNK_BITS = 8;
+    private: static const uint32_t CHUNK_SIZE = UINT32_C(1) << CHUNK_BITS;
+    private: static const uint32_t CHUNK_MASK = CHUNK_SIZE - 1;
+
+    private: struct slot {
+        uint32_t generation;
+        bool live;
+        Hot hot;
+    };
+
+    private: std::vector<std::unique_ptr<slot[]>> my_hot_chunks;
+    private: std::vector<std::unique_ptr<Cold[]>> my_cold_chunks;
+    private: std::vector<uint32_t> my_free_slots;
+    private: size_t my_live_count;
+    private: mutable std::mutex my_lock;
+
+    public: task_slab() :
+        my_live_count(0)
+    {}
+
+    private: task_slab(const task_slab &) = delete;
+    private: task_slab &operator=(const task_slab &) = delete;
+
+    public: static uint32_t slot_of(uint32_t id) {
+        return id >> GENERATION_BITS;
+    }
+
+    public: static uint32_t generation_of(uint32_t id) {
+        return id & GENERATION_MASK;
+    }
+
+    public: size_t size() const {
+        std::lock_guard<std::mutex> lock(my_lock);
+        return my_live_count;
+    }
+
+    public: size_t capacity() const {
+        std::lock_guard<std::mutex> lock(my_lock);
+        return slot_count();
+    }
+
+    // reserves a slot and returns its id. the slot's `Hot` and `Cold`
+    // entries are reset to their default-constructed state.
+    public: int alloc(uint32_t &id_out) {
+        id_out = 0;
+
+        std::lock_guard<std::mutex> lock(my_lock);
+        if (my_free_slots.empty()) {
+            DMTR_OK(grow());
+        }
+
+        const uint32_t i = my_free_slots.back();
+        my_free_slots.pop_back();
+
+        slot &s = hot_slot(i);
+        s.live = true;
+        s.hot = Hot();
+        cold_slot(i) = Cold();
+        ++my_live_count;
+
+        id_out = (i << GENERATION_BITS) | s.generation;
+        return 0;
+    }
+
+    // looks up a live slot. returns `ENOENT` if the id was never issued or
+    // refers to a slot that has since been released.
+    public: int find(Hot *&hot_out, Cold *&cold_out, uint32_t id) {
+        hot_out = NULL;
+        cold_out = NULL;
+
+        std::lock_guard<std::mutex> lock(my_lock);
+        slot *s = NULL;
+        DMTR_OK(find_slot(s, id));
+
+        hot_out = &s->hot;
+        cold_out = &cold_slot(slot_of(id));
+        return 0;
+    }
+
+    public: bool contains(uint32_t id) {
+        std::lock_guard<std::mutex> lock(my_lock);
+        slot *s = NULL;
+        return 0 == find_slot(s, id);
+    }
+
+    // returns a slot to the free list. the slot's generation advances so
+    // that `id` (and every copy of it) stops resolving.
+    public: int free(uint32_t id) {
+        std::lock_guard<std::mutex> lock(my_lock);
+        slot *s = NULL;
+        DMTR_OK(find_slot(s, id));
+
+        s->live = false;
+        s->generation = next_generation(s->generation);
+        my_free_slots.push_back(slot_of(id));
+        --my_live_count;
+        return 0;
+    }
+
+    // the helpers below expect `my_lock` to be held.
+    private: int find_slot(slot *&s_out, uint32_t id) {
+        s_out = NULL;
+
+        const uint32_t i = slot_of(id);
+        if (DMTR_UNLIKELY(i >= slot_count())) {
+            return ENOENT;
+        }
+
+        slot &s = hot_slot(i);
+        if (DMTR_UNLIKELY(!s.live || s.generation != generation_of(id))) {
+            return ENOENT;
+        }
+
+        s_out = &s;
+        return 0;
+    }
+
+    private: int grow() {
+        const uint32_t base = slot_count();
+        DMTR_TRUE(ENOMEM, base + CHUNK_SIZE <= MAX_SLOTS);
+
+        std::unique_ptr<slot[]> hot(new slot[CHUNK_SIZE]);
+        std::unique_ptr<Cold[]> cold(new Cold[CHUNK_SIZE]);
+        for (uint32_t i = 0; i < CHUNK_SIZE; ++i) {
+            // generation zero is never issued, so a zeroed token can't
+            // resolve to slot zero.
+            hot[i].generation = 1;
+            hot[i].live = false;
+        }
+        my_hot_chunks.push_back(std::move(hot));
+        my_cold_chunks.push_back(std::move(cold));
+
+        // push in reverse so that low slot numbers are handed out first.
+        my_free_slots.reserve(my_free_slots.size() + CHUNK_SIZE);
+        for (uint32_t i = CHUNK_SIZE; i > 0; --i) {
+            my_free_slots.push_back(base + i - 1);
+        }
+
+        return 0;
+    }
+
+    private: size_t slot_count() const {
+        return my_hot_chunks.size() * CHUNK_SIZE;
+    }
+
+    private: slot &hot_slot(uint32_t i) {
+        return my_hot_chunks[i >> CHUNK_BITS][i & CHUNK_MASK];
+    }
+
+    private: Cold &cold_slot(uint32_t i) {
+        return my_cold_chunks[i >> CHUNK_BITS][i & CHUNK_MASK];
+    }
+
+    private: static uint32_t next_generation(uint32_t generation) {
+        generation = (generation + 1) & GENERATION_MASK;
+        return 0 == generation ? 1 : generation;
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_TASK_SLAB_HH_IS_INCLUDED */
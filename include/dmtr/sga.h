@@ -12,9 +12,54 @@ extern "C" {
 #endif
 
 DMTR_EXPORT int dmtr_sgalen(size_t *len_out, const dmtr_sgarray_t *sga);
+
+/**
+ * @brief Releases the buffers of an array.
+ *
+ * @details Arrays returned by a pop may point into the libOS's receive
+ * buffers, which `sga_buf` keeps alive; anything else must have come from
+ * dmtr_sgaalloc() with `sga_buf` set to NULL. Popped arrays may be freed
+ * from any thread, but only once.
+ *
+ * @param sga The array to release.
+ *
+ * @return On successful completion zero is returned. On failure, an error
+ * code is returned instead.
+ */
 DMTR_EXPORT int dmtr_sgafree(dmtr_sgarray_t *sga);
 DMTR_EXPORT dmtr_sgarray_t dmtr_sgaalloc(size_t len);
 
+/**
+ * @brief Registers application memory for zero-copy pushes.
+ *
+ * @details On catnip, single-segment pushes from a registered region go to the
+ * NIC as mbufs that point at the application's memory instead of as copies.
+ * Sent data must then stay untouched until the network stack is done with it,
+ * which dmtr_unregister_memory() checks. Other libOSes accept the call and
+ * copy as before.
+ *
+ * @param addr Start of the region, page-aligned.
+ * @param len Length of the region, a multiple of the page size.
+ *
+ * @return On successful completion zero is returned. EEXIST is returned if the
+ * region overlaps one already registered, and ENOTSUP if DPDK does not use
+ * virtual addresses for DMA. On failure, an error code is returned instead.
+ */
+DMTR_EXPORT int dmtr_register_memory(void *addr, size_t len);
+
+/**
+ * @brief Unregisters memory registered with dmtr_register_memory().
+ *
+ * @param addr Start of the region, as registered.
+ * @param len Length of the region, as registered.
+ *
+ * @return On successful completion zero is returned. EBUSY is returned while
+ * the NIC or the network stack still holds data sent from the region, which
+ * stops once the data is acknowledged and the NIC has reclaimed it. On failure,
+ * an error code is returned instead.
+ */
+DMTR_EXPORT int dmtr_unregister_memory(void *addr, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
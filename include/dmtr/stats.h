@@ -0,0 +1,54 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_STATS_H_IS_INCLUDED
+#define DMTR_STATS_H_IS_INCLUDED
+
+#include <dmtr/sys/gcc.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Renders the calling thread's counters as text.
+ *
+ * @details Counters are kept per thread, without synchronization, so each
+ * thread reports on the libOS instance it drives. The first line starts with
+ * `runtime` and counts the packets and bytes sent and received, transmit drops
+ * and failed buffer allocations. The second starts with `pool` and counts
+ * `dmtr_sgaalloc` buffers: allocations, frees, how many were served from the
+ * thread's cache, batch transfers to and from the shared free lists, requests
+ * too large for the pool or made while it was exhausted, and 2 MiB regions in
+ * use by all threads. It is followed by one line per queue descriptor in use,
+ * starting with `qd=`, counting pushes, pops, bytes, rejected submissions and
+ * outstanding operations. When `stats.latency` is set in the configuration,
+ * queue lines also carry submission-to-completion latency percentiles, in
+ * nanoseconds. Every value is a `key=value` pair.
+ *
+ * @param buf Buffer that receives the NUL-terminated text.
+ * @param len Size of buf.
+ * @param len_out Size of buffer needed to hold the text, including the
+ * terminating NUL.
+ *
+ * @return On successful completion zero is returned. If buf is too small,
+ * ERANGE is returned and len_out is still set. On failure, an error code is
+ * returned instead.
+ */
+DMTR_EXPORT int dmtr_stats(char *buf, size_t len, size_t *len_out);
+
+/**
+ * @brief Clears the calling thread's queue and buffer pool counters. Runtime
+ * counters are not affected.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DMTR_STATS_H_IS_INCLUDED */
@@ -12,13 +12,17 @@
 extern "C" {
 #endif
 
-#define DMTR_SGARRAY_MAXSIZE 1
+#define DMTR_SGARRAY_MAXSIZE 8
 #define DMTR_HEADER_MAGIC 0x10102010
 #define QD_OFFSET 32ul
     //#define QD_MASK 0xFFFFFFFFul << QD_OFFSET
 
 #define QT2QD(qtoken) ((qtoken) >> QD_OFFSET)
 
+// memory queue backends, selected with `dmtr_queue2()`.
+#define DMTR_QUEUE_SPSC 0x1
+#define DMTR_QUEUE_MPMC 0x2
+
 typedef uint64_t dmtr_qtoken_t;
 
 typedef struct dmtr_sgaseg {
@@ -27,6 +31,9 @@ typedef struct dmtr_sgaseg {
 } dmtr_sgaseg_t;
 
 typedef struct dmtr_sgarray {
+    // owned by the libOS: arrays returned by a pop carry a handle here that
+    // dmtr_sgafree() and pushes recognize. set it to NULL in arrays that you
+    // build yourself, and leave it alone in arrays that you are given.
     void *sga_buf;
     uint32_t sga_numsegs;
     dmtr_sgaseg_t sga_segs[DMTR_SGARRAY_MAXSIZE];
@@ -58,6 +65,32 @@ typedef struct dmtr_qresult {
     } qr_value;
 } dmtr_qresult_t;
 
+// compact completion record, filled in by `dmtr_wait_event()` and
+// `dmtr_poll_event()`. a pop refers to the popped scatter-gather array instead
+// of carrying a copy of it; the array stays valid until it is released with
+// `dmtr_sgafree()`.
+typedef struct dmtr_qevent {
+    dmtr_qtoken_t qe_qt;
+    enum dmtr_opcode qe_opcode;
+    int qe_qd;
+    union {
+        dmtr_sgarray_t *sga;
+        int qd;
+    } qe_value;
+} dmtr_qevent_t;
+
+// returns the array popped by the operation behind `qe`, or NULL if it was not
+// a pop.
+static inline dmtr_sgarray_t *dmtr_qevent_sga(const dmtr_qevent_t *qe) {
+    return DMTR_OPC_POP == qe->qe_opcode ? qe->qe_value.sga : NULL;
+}
+
+// returns the queue descriptor of the connection accepted by the operation
+// behind `qe`, or -1 if it was not an accept.
+static inline int dmtr_qevent_accepted_qd(const dmtr_qevent_t *qe) {
+    return DMTR_OPC_ACCEPT == qe->qe_opcode ? qe->qe_value.qd : -1;
+}
+
 // todo: move to <dmtr/dmtr/libos/types.hh>
 typedef struct dmtr_header {
     uint32_t h_magic;
@@ -6,6 +6,7 @@
 
 #include <dmtr/sys/gcc.h>
 #include <dmtr/types.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,6 +26,39 @@ extern "C" {
  */
 DMTR_EXPORT int dmtr_wait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtok);
 
+/**
+ * @brief Like dmtr_wait, but reports the completion as a compact event.
+ *
+ * @details A popped scatter-gather array is not copied into the event: the
+ * event refers to it (see dmtr_qevent_sga()) and it stays valid until the
+ * application releases it with dmtr_sgafree, on the same thread. Releasing it
+ * a second time fails with EINVAL.
+ *
+ * @param qe_out Event describing the completed queue operation.
+ * @param qtok Queue token from requested queue operation.
+ *
+ * @return On successful completion zero is returned. If qe_out is NULL, EINVAL
+ * is returned. On failure, an error code is returned instead.
+ */
+DMTR_EXPORT int dmtr_wait_event(dmtr_qevent_t *qe_out, dmtr_qtoken_t qtok);
+
+/**
+ * @brief Like dmtr_wait, but gives up once the relative timeout has elapsed.
+ *
+ * @details While nothing completes, the calling thread backs off according to
+ * the wait policy in the configuration (`wait.policy`: spin, pause or sleep).
+ * On timeout the queue token remains valid and can be waited on again.
+ *
+ * @param qr_out Result of completed queue operation.
+ * @param qtok Queue token from requested queue operation.
+ * @param timeout Longest time to wait.
+ *
+ * @return On successful completion zero is returned. If the operation did not
+ * complete in time, ETIMEDOUT is returned. On failure, an error code is
+ * returned instead.
+ */
+DMTR_EXPORT int dmtr_timedwait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtok, const struct timespec *timeout);
+
 /**
  * @brief Blocks until completion of at first queue operation in the set of
  * queue tokens, indicated by qtoks up to num_qtoks.
@@ -45,6 +79,64 @@ DMTR_EXPORT int dmtr_wait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qt
 
 DMTR_EXPORT int dmtr_wait_all(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtoks[], int num_qtoks);
 
+/**
+ * @brief Creates an empty completion queue.
+ *
+ * @details A completion queue is a set of queue tokens that are registered once
+ * with dmtr_cq_add and harvested in batches with dmtr_cq_wait, instead of
+ * passing the whole set to dmtr_wait_any for every completion.
+ *
+ * @param cqd_out Descriptor of the new completion queue.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_cq_create(int *cqd_out);
+
+/**
+ * @brief Registers queue token qtok with completion queue cqd.
+ *
+ * @details The token belongs to the completion queue from then on: it must not
+ * be passed to dmtr_wait, dmtr_poll or dmtr_drop.
+ *
+ * @param cqd Completion queue descriptor.
+ * @param qtok Queue token from requested queue operation.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_cq_add(int cqd, dmtr_qtoken_t qtok);
+
+/**
+ * @brief Blocks until at least one operation registered with completion queue
+ * cqd completes, and harvests up to max_qrs completed operations.
+ *
+ * @details Returns the results in qrs_out and their number in nr_out. The
+ * harvested tokens are destroyed and removed from the completion queue. Results
+ * carry their queue token in qr_qt. Waiting on an empty completion queue fails
+ * with EINVAL.
+ *
+ * @param nr_out Number of results written to qrs_out.
+ * @param qrs_out Results of completed queue operations.
+ * @param max_qrs Capacity of qrs_out.
+ * @param cqd Completion queue descriptor.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_cq_wait(int *nr_out, dmtr_qresult_t qrs_out[], int max_qrs, int cqd);
+
+/**
+ * @brief Destroys completion queue cqd, dropping the tokens still registered
+ * with it.
+ *
+ * @param cqd Completion queue descriptor.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_cq_destroy(int cqd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,126 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#![cfg_attr(feature = "strict", deny(warnings))]
+#![deny(clippy::all)]
+#![feature(try_blocks)]
+
+pub mod ring;
+pub mod runtime;
+pub mod switch;
+
+use anyhow::Error;
+use catnip::{
+    collections::bytes::Bytes,
+    libos::LibOS,
+    logging,
+};
+use demikernel::{
+    config::Config,
+    dispatch::{
+        self,
+        Dispatch,
+    },
+    file,
+    interop::dmtr_sgarray_t,
+    network::libos_network_init,
+    pool,
+    sga,
+    shm,
+    stats::{
+        self,
+        RuntimeStats,
+    },
+    wait,
+};
+use libc::{
+    c_char,
+    c_int,
+};
+use runtime::LoopRuntime;
+use std::{
+    cell::RefCell,
+    time::Duration,
+};
+use switch::{
+    LinkConfig,
+    Switch,
+};
+
+thread_local! {
+    static LIBOS: RefCell<Option<LibOS<LoopRuntime>>> = RefCell::new(None);
+}
+
+//==============================================================================
+// init
+//==============================================================================
+
+pub fn catloop_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
+    logging::initialize();
+    let r: Result<_, Error> = try {
+        // Load config file.
+        let config = Config::initialize(argc, argv)?;
+        wait::set_policy(config.wait_policy);
+        stats::set_track_latency(config.track_latency);
+        pool::configure(config.pool);
+        file::configure(config.file);
+        shm::configure(config.shm.clone());
+
+        let rt = runtime::initialize_loop(
+            config.local_link_addr,
+            config.local_ipv4_addr,
+            config.arp_table(),
+            Switch::global(),
+            LinkConfig::from_config(&config)?,
+        )?;
+        LibOS::new(rt)?
+    };
+
+    let libos = match r {
+        Ok(libos) => libos,
+        Err(e) => {
+            eprintln!("Initialization failure: {:?}", e);
+            return libc::EINVAL;
+        },
+    };
+
+    LIBOS.with(move |l| {
+        let mut tls_libos = l.borrow_mut();
+        assert!(tls_libos.is_none());
+        *tls_libos = Some(libos);
+    });
+
+    libos_network_init(dispatch::network_libos::<LoopRuntime>());
+
+    0
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Dispatch for LoopRuntime {
+    fn with_libos<T>(f: impl FnOnce(&mut LibOS<Self>) -> T) -> T {
+        LIBOS.with(|l| {
+            let mut tls_libos = l.borrow_mut();
+            f(tls_libos.as_mut().expect("Uninitialized engine"))
+        })
+    }
+
+    fn wait_for_rx(&self, timeout: Duration) {
+        LoopRuntime::wait_for_rx(self, timeout)
+    }
+
+    fn stats(&self) -> RuntimeStats {
+        LoopRuntime::stats(self)
+    }
+
+    fn into_sga(&self, buf: Bytes) -> dmtr_sgarray_t {
+        sga::bytes_into_sgarray(buf)
+    }
+
+    // Frames are handed over whole, so the segments of a vectored push are joined here.
+    fn clone_sga(&self, sga: &dmtr_sgarray_t) -> Bytes {
+        sga::gather_into_bytes(sga)
+    }
+}
@@ -0,0 +1,124 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use std::{
+    cell::UnsafeCell,
+    mem::MaybeUninit,
+    sync::atomic::{
+        AtomicUsize,
+        Ordering,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Keeps the producer and consumer positions on separate cache lines.
+#[repr(align(64))]
+struct CachePadded<T>(T);
+
+struct Slot<T> {
+    /// Position that the slot is ready for: `pos` once it can be written at `pos`, and `pos + 1`
+    /// once the value written at `pos` can be read.
+    seq: AtomicUsize,
+    value: UnsafeCell<MaybeUninit<T>>,
+}
+
+/// Bounded lock-free queue with any number of producers and a single consumer.
+///
+/// Producers claim a slot with a compare-and-swap on the tail and publish it through the slot's
+/// sequence number, so a stalled producer only holds up the consumer at its own slot.
+pub struct Ring<T> {
+    slots: Box<[Slot<T>]>,
+    mask: usize,
+    tail: CachePadded<AtomicUsize>,
+    head: CachePadded<AtomicUsize>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl<T> Ring<T> {
+    /// Creates a ring with room for `capacity` values, rounded up to a power of two.
+    pub fn new(capacity: usize) -> Self {
+        let capacity = capacity.max(2).next_power_of_two();
+        let slots = (0..capacity)
+            .map(|i| Slot {
+                seq: AtomicUsize::new(i),
+                value: UnsafeCell::new(MaybeUninit::uninit()),
+            })
+            .collect();
+        Self {
+            slots,
+            mask: capacity - 1,
+            tail: CachePadded(AtomicUsize::new(0)),
+            head: CachePadded(AtomicUsize::new(0)),
+        }
+    }
+
+    /// Appends `value`, handing it back if the ring is full.
+    pub fn push(&self, value: T) -> Result<(), T> {
+        let mut pos = self.tail.0.load(Ordering::Relaxed);
+        let slot = loop {
+            let slot = &self.slots[pos & self.mask];
+            let seq = slot.seq.load(Ordering::Acquire);
+            let diff = seq.wrapping_sub(pos) as isize;
+            if diff == 0 {
+                match self.tail.0.compare_exchange_weak(
+                    pos,
+                    pos.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(..) => break slot,
+                    Err(current) => pos = current,
+                }
+            } else if diff < 0 {
+                // The consumer hasn't freed this slot from the previous lap yet.
+                return Err(value);
+            } else {
+                pos = self.tail.0.load(Ordering::Relaxed);
+            }
+        };
+        unsafe { (*slot.value.get()).as_mut_ptr().write(value) };
+        slot.seq.store(pos.wrapping_add(1), Ordering::Release);
+        Ok(())
+    }
+
+    /// Removes the oldest value if `ready` accepts it.
+    ///
+    /// # Safety
+    ///
+    /// Only one thread may consume from the ring.
+    pub unsafe fn pop_if(&self, ready: impl FnOnce(&T) -> bool) -> Option<T> {
+        let pos = self.head.0.load(Ordering::Relaxed);
+        let slot = &self.slots[pos & self.mask];
+        if slot.seq.load(Ordering::Acquire) != pos.wrapping_add(1) {
+            return None;
+        }
+        if !ready(&*(*slot.value.get()).as_ptr()) {
+            return None;
+        }
+        let value = (*slot.value.get()).as_ptr().read();
+        self.head.0.store(pos.wrapping_add(1), Ordering::Relaxed);
+        slot.seq
+            .store(pos.wrapping_add(self.mask + 1), Ordering::Release);
+        Some(value)
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+unsafe impl<T: Send> Send for Ring<T> {}
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        // Nothing else can hold a reference by now.
+        while unsafe { self.pop_if(|_| true) }.is_some() {}
+    }
+}
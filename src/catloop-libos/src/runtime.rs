@@ -0,0 +1,353 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use crate::switch::{
+    Frame,
+    FrameData,
+    Link,
+    LinkConfig,
+    Port,
+    Switch,
+    BROADCAST_ADDR,
+};
+use anyhow::Error;
+use arrayvec::ArrayVec;
+use catnip::{
+    collections::bytes::{
+        Bytes,
+        BytesMut,
+    },
+    interop::dmtr_sgarray_t,
+    protocols::{
+        arp,
+        ethernet2::MacAddress,
+        tcp,
+        udp,
+    },
+    runtime::{
+        PacketBuf,
+        Runtime,
+        RECEIVE_BATCH_SIZE,
+    },
+    scheduler::{
+        Operation,
+        Scheduler,
+        SchedulerHandle,
+    },
+    timer::{
+        Timer,
+        TimerRc,
+        WaitFuture,
+    },
+};
+use demikernel::{
+    dispatch::Dispatch,
+    stats::RuntimeStats,
+};
+use futures::{
+    Future,
+    FutureExt,
+};
+use rand::{
+    distributions::Standard,
+    prelude::Distribution,
+    rngs::SmallRng,
+    seq::SliceRandom,
+    Rng,
+    SeedableRng,
+};
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    net::Ipv4Addr,
+    rc::Rc,
+    sync::Arc,
+    thread,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Runtime whose frames never leave the process: they go through a `Switch` to other runtimes
+/// attached to it, over links with configurable latency, bandwidth and loss.
+#[derive(Clone)]
+pub struct LoopRuntime {
+    inner: Rc<RefCell<Inner>>,
+    scheduler: Scheduler<Operation<LoopRuntime>>,
+}
+
+pub struct Inner {
+    pub timer: TimerRc,
+    pub rng: SmallRng,
+    pub link_addr: MacAddress,
+    pub ipv4_addr: Ipv4Addr,
+    pub tcp_options: tcp::Options<LoopRuntime>,
+    pub arp_options: arp::Options,
+    switch: Arc<Switch>,
+    port: Arc<Port>,
+    /// Ports looked up so far, so that the switch is only locked on first contact.
+    peers: HashMap<[u8; 6], Arc<Port>>,
+    link: Link,
+    stats: RuntimeStats,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl LoopRuntime {
+    pub fn new(
+        now: Instant,
+        link_addr: MacAddress,
+        ipv4_addr: Ipv4Addr,
+        arp: HashMap<Ipv4Addr, MacAddress>,
+        switch: Arc<Switch>,
+        link: LinkConfig,
+    ) -> Result<Self, Error> {
+        let mut arp_options = arp::Options::default();
+        arp_options.retry_count = 2;
+        arp_options.cache_ttl = Duration::from_secs(600);
+        arp_options.request_timeout = Duration::from_secs(1);
+        arp_options.initial_values = arp;
+
+        let port = switch.attach(link_addr, link.queue_len)?;
+        let inner = Inner {
+            timer: TimerRc(Rc::new(Timer::new(now))),
+            rng: SmallRng::from_seed([0; 32]),
+            link_addr,
+            ipv4_addr,
+            tcp_options: tcp::Options::default(),
+            arp_options,
+            switch,
+            port,
+            peers: HashMap::new(),
+            link: Link::new(link, now),
+            stats: RuntimeStats::default(),
+        };
+        Ok(Self {
+            inner: Rc::new(RefCell::new(inner)),
+            scheduler: Scheduler::new(),
+        })
+    }
+
+    pub fn stats(&self) -> RuntimeStats {
+        self.inner.borrow().stats
+    }
+
+    /// Sleeps for `timeout`. Frames are handed over as they are sent, so there's nothing to flush.
+    pub fn wait_for_rx(&self, timeout: Duration) {
+        thread::sleep(timeout);
+    }
+}
+
+impl Inner {
+    fn peer(&mut self, link_addr: [u8; 6]) -> Option<Arc<Port>> {
+        if let Some(port) = self.peers.get(&link_addr) {
+            return Some(port.clone());
+        }
+        let port = self.switch.lookup(link_addr)?;
+        self.peers.insert(link_addr, port.clone());
+        Some(port)
+    }
+
+    /// Queues `frame` on `port`. Returns false if the port's queue was full and the frame was
+    /// dropped.
+    fn send(&mut self, port: &Port, frame: Frame) -> bool {
+        if port.send(frame).is_err() {
+            self.stats.tx_drops += 1;
+            return false;
+        }
+        true
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for Inner {
+    fn drop(&mut self) {
+        self.switch.detach(self.port.link_addr());
+    }
+}
+
+impl Runtime for LoopRuntime {
+    type Buf = Bytes;
+    type WaitFuture = WaitFuture<TimerRc>;
+
+    // The C interface goes through the `Dispatch` hooks, with demikernel's arrays. These only
+    // serve catnip's own calls, whose arrays hold a single segment.
+    fn into_sgarray(&self, buf: Bytes) -> dmtr_sgarray_t {
+        self.into_sga(buf).narrow()
+    }
+
+    fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
+        self.alloc_sga(size).narrow()
+    }
+
+    fn free_sgarray(&self, sga: dmtr_sgarray_t) {
+        self.free_sga(&sga.into())
+    }
+
+    fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Bytes {
+        self.clone_sga(&(*sga).into())
+    }
+
+    fn transmit(&self, pkt: impl PacketBuf<Bytes>) {
+        // The frame is built once, in a buffer of its own that the receiving runtime takes over.
+        let header_size = pkt.header_size();
+        let len = header_size + pkt.body_size();
+        let mut buf = BytesMut::zeroed(len).unwrap();
+        pkt.write_header(&mut buf[..header_size]);
+        if let Some(body) = pkt.take_body() {
+            buf[header_size..].copy_from_slice(&body[..]);
+        }
+        let data = FrameData::new(buf);
+
+        // Frames are timed by the runtime's clock, not the system's, so that a test can drive the
+        // link with `advance_clock`.
+        let mut inner = self.inner.borrow_mut();
+        let now = inner.timer.0.now();
+        let deliver_at = match inner.link.send(now, len) {
+            Some(deliver_at) => deliver_at,
+            None => {
+                inner.stats.tx_drops += 1;
+                return;
+            },
+        };
+
+        let dst_addr = data.dst_addr();
+        let sent = if dst_addr == BROADCAST_ADDR {
+            let ports = inner.switch.others(inner.port.link_addr());
+            let mut sent = false;
+            for port in ports {
+                let frame = Frame {
+                    deliver_at,
+                    data: data.copy(),
+                };
+                sent |= inner.send(&port, frame);
+            }
+            sent
+        } else {
+            match inner.peer(dst_addr) {
+                Some(port) => inner.send(&port, Frame { deliver_at, data }),
+                // Nobody by that address.
+                None => {
+                    inner.stats.tx_drops += 1;
+                    false
+                },
+            }
+        };
+        if sent {
+            inner.stats.tx_packets += 1;
+            inner.stats.tx_bytes += len as u64;
+        }
+    }
+
+    fn receive(&self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        let mut inner = self.inner.borrow_mut();
+        let mut out = ArrayVec::new();
+        let now = inner.timer.0.now();
+        while !out.is_full() {
+            let frame = match unsafe { inner.port.receive(now) } {
+                Some(frame) => frame,
+                None => break,
+            };
+            let buf = frame.data.into_bytes();
+            inner.stats.rx_packets += 1;
+            inner.stats.rx_bytes += buf.len() as u64;
+            out.push(buf);
+        }
+        out
+    }
+
+    fn scheduler(&self) -> &Scheduler<Operation<Self>> {
+        &self.scheduler
+    }
+
+    fn local_link_addr(&self) -> MacAddress {
+        self.inner.borrow().link_addr.clone()
+    }
+
+    fn local_ipv4_addr(&self) -> Ipv4Addr {
+        self.inner.borrow().ipv4_addr.clone()
+    }
+
+    fn tcp_options(&self) -> tcp::Options<Self> {
+        self.inner.borrow().tcp_options.clone()
+    }
+
+    fn udp_options(&self) -> udp::Options {
+        udp::Options::default()
+    }
+
+    fn arp_options(&self) -> arp::Options {
+        self.inner.borrow().arp_options.clone()
+    }
+
+    fn advance_clock(&self, now: Instant) {
+        self.inner.borrow_mut().timer.0.advance_clock(now);
+    }
+
+    fn wait(&self, duration: Duration) -> Self::WaitFuture {
+        let inner = self.inner.borrow_mut();
+        let now = inner.timer.0.now();
+        inner
+            .timer
+            .0
+            .wait_until(inner.timer.clone(), now + duration)
+    }
+
+    fn wait_until(&self, when: Instant) -> Self::WaitFuture {
+        let inner = self.inner.borrow_mut();
+        inner.timer.0.wait_until(inner.timer.clone(), when)
+    }
+
+    fn now(&self) -> Instant {
+        self.inner.borrow().timer.0.now()
+    }
+
+    fn rng_gen<T>(&self) -> T
+    where
+        Standard: Distribution<T>,
+    {
+        let mut inner = self.inner.borrow_mut();
+        inner.rng.gen()
+    }
+
+    fn rng_shuffle<T>(&self, slice: &mut [T]) {
+        let mut inner = self.inner.borrow_mut();
+        slice.shuffle(&mut inner.rng);
+    }
+
+    fn spawn<F: Future<Output = ()> + 'static>(&self, future: F) -> SchedulerHandle {
+        self.scheduler
+            .insert(Operation::Background(future.boxed_local()))
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+pub fn initialize_loop(
+    local_link_addr: MacAddress,
+    local_ipv4_addr: Ipv4Addr,
+    arp_table: HashMap<Ipv4Addr, MacAddress>,
+    switch: Arc<Switch>,
+    link: LinkConfig,
+) -> Result<LoopRuntime, Error> {
+    LoopRuntime::new(
+        Instant::now(),
+        local_link_addr,
+        local_ipv4_addr,
+        arp_table,
+        switch,
+        link,
+    )
+}
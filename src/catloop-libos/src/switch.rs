@@ -0,0 +1,401 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use crate::ring::Ring;
+use anyhow::{
+    format_err,
+    Error,
+};
+use catnip::{
+    collections::bytes::{
+        Bytes,
+        BytesMut,
+    },
+    protocols::ethernet2::MacAddress,
+};
+use demikernel::config::Config;
+use rand::{
+    rngs::SmallRng,
+    Rng,
+    SeedableRng,
+};
+use std::{
+    collections::HashMap,
+    sync::{
+        Arc,
+        Mutex,
+        Once,
+    },
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+pub const BROADCAST_ADDR: [u8; 6] = [0xff; 6];
+
+/// Frames that a port can hold before the switch starts dropping them.
+const DEFAULT_QUEUE_LEN: usize = 4096;
+
+/// How frames sent by a runtime travel to their destination.
+#[derive(Clone, Copy, Debug)]
+pub struct LinkConfig {
+    /// One-way propagation delay.
+    pub latency: Duration,
+    /// Line rate in bits per second, if limited.
+    pub bandwidth: Option<u64>,
+    /// Probability that a frame is lost.
+    pub loss: f64,
+    /// Seed for the losses, so that a run can be repeated.
+    pub seed: u64,
+    /// Frames that the runtime's port can hold.
+    pub queue_len: usize,
+}
+
+/// The sending side of a link: decides which frames are lost and when the others arrive.
+///
+/// Times come from the caller rather than the system clock, so that a run is a function of the
+/// runtimes' clocks, the configuration and the seed alone.
+pub struct Link {
+    config: LinkConfig,
+    /// Decides which frames are lost, apart from the runtime's generator so that losses don't
+    /// depend on the stack.
+    rng: SmallRng,
+    /// When the link finishes sending the frames already handed to it.
+    busy_until: Instant,
+}
+
+/// A frame's bytes, in a buffer that nothing else refers to. `Bytes` counts its references
+/// without atomics, so it may only move to another thread while it is the sole reference.
+pub struct FrameData(Bytes);
+
+pub struct Frame {
+    /// When the frame reaches the receiver, once latency and serialization are accounted for.
+    pub deliver_at: Instant,
+    pub data: FrameData,
+}
+
+/// A runtime's attachment to the switch. Anyone may send to it; only its runtime receives.
+pub struct Port {
+    link_addr: [u8; 6],
+    rx: Ring<Frame>,
+}
+
+/// Connects runtimes in the same process by link address.
+pub struct Switch {
+    ports: Mutex<HashMap<[u8; 6], Arc<Port>>>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl LinkConfig {
+    /// Reads the `catloop` section of the configuration: `latency_us`, `bandwidth_mbps`, `loss`,
+    /// `seed` and `queue_len`. Links are instantaneous and lossless by default.
+    pub fn from_config(config: &Config) -> Result<Self, Error> {
+        let obj = &config.config_obj["catloop"];
+        let mut link = LinkConfig::default();
+        if let Some(us) = obj["latency_us"].as_i64() {
+            if us < 0 {
+                return Err(format_err!("Invalid catloop latency_us {}", us));
+            }
+            link.latency = Duration::from_micros(us as u64);
+        }
+        if let Some(mbps) = obj["bandwidth_mbps"].as_i64() {
+            if mbps <= 0 {
+                return Err(format_err!("Invalid catloop bandwidth_mbps {}", mbps));
+            }
+            link.bandwidth = Some(mbps as u64 * 1_000_000);
+        }
+        if let Some(loss) = obj["loss"].as_f64() {
+            if !(0.0..=1.0).contains(&loss) {
+                return Err(format_err!("Invalid catloop loss {}", loss));
+            }
+            link.loss = loss;
+        }
+        if let Some(seed) = obj["seed"].as_i64() {
+            link.seed = seed as u64;
+        }
+        if let Some(n) = obj["queue_len"].as_i64() {
+            if n <= 0 {
+                return Err(format_err!("Invalid catloop queue_len {}", n));
+            }
+            link.queue_len = n as usize;
+        }
+        Ok(link)
+    }
+
+    /// Time it takes to put `len` bytes on the wire.
+    pub fn serialization_delay(&self, len: usize) -> Duration {
+        match self.bandwidth {
+            Some(bps) => Duration::from_nanos((len as u64 * 8 * 1_000_000_000) / bps),
+            None => Duration::from_secs(0),
+        }
+    }
+}
+
+impl Link {
+    pub fn new(config: LinkConfig, now: Instant) -> Self {
+        Self {
+            config,
+            rng: SmallRng::seed_from_u64(config.seed),
+            busy_until: now,
+        }
+    }
+
+    /// Puts a frame of `len` bytes on the link at `now`. Returns when it arrives, or `None` if it
+    /// is lost. Frames queue up behind each other, then take `latency` to arrive; lost frames
+    /// take up the link all the same.
+    pub fn send(&mut self, now: Instant, len: usize) -> Option<Instant> {
+        let start = std::cmp::max(now, self.busy_until);
+        self.busy_until = start + self.config.serialization_delay(len);
+        if self.config.loss > 0.0 && self.rng.gen::<f64>() < self.config.loss {
+            return None;
+        }
+        Some(self.busy_until + self.config.latency)
+    }
+}
+
+impl FrameData {
+    pub fn new(buf: BytesMut) -> Self {
+        Self(buf.freeze())
+    }
+
+    /// Copies the frame into a buffer of its own, e.g. for each port that a broadcast goes to.
+    pub fn copy(&self) -> Self {
+        Self::new(BytesMut::from(&self.0[..]))
+    }
+
+    pub fn dst_addr(&self) -> [u8; 6] {
+        let mut addr = [0_u8; 6];
+        addr.copy_from_slice(&self.0[..6]);
+        addr
+    }
+
+    pub fn into_bytes(self) -> Bytes {
+        self.0
+    }
+}
+
+impl Port {
+    pub fn link_addr(&self) -> [u8; 6] {
+        self.link_addr
+    }
+
+    /// Queues `frame` for the port's runtime, handing it back if the port is full.
+    pub fn send(&self, frame: Frame) -> Result<(), Frame> {
+        self.rx.push(frame)
+    }
+
+    /// Takes the oldest frame if it has arrived by `now`.
+    ///
+    /// # Safety
+    ///
+    /// Only the runtime that attached the port may receive from it.
+    pub unsafe fn receive(&self, now: Instant) -> Option<Frame> {
+        self.rx.pop_if(|frame| frame.deliver_at <= now)
+    }
+}
+
+impl Switch {
+    pub fn new() -> Self {
+        Self {
+            ports: Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// Returns the switch that runtimes created through `dmtr_init` attach to.
+    pub fn global() -> Arc<Switch> {
+        static INIT: Once = Once::new();
+        static mut SWITCH: Option<Arc<Switch>> = None;
+        unsafe {
+            INIT.call_once(|| SWITCH = Some(Arc::new(Switch::new())));
+            SWITCH.clone().unwrap()
+        }
+    }
+
+    pub fn attach(&self, link_addr: MacAddress, queue_len: usize) -> Result<Arc<Port>, Error> {
+        let link_addr = link_addr.to_array();
+        let mut ports = self.ports.lock().unwrap();
+        if ports.contains_key(&link_addr) {
+            return Err(format_err!(
+                "Link address {:x?} is already in use",
+                link_addr
+            ));
+        }
+        let port = Arc::new(Port {
+            link_addr,
+            rx: Ring::new(queue_len),
+        });
+        ports.insert(link_addr, port.clone());
+        Ok(port)
+    }
+
+    pub fn detach(&self, link_addr: [u8; 6]) {
+        self.ports.lock().unwrap().remove(&link_addr);
+    }
+
+    pub fn lookup(&self, link_addr: [u8; 6]) -> Option<Arc<Port>> {
+        self.ports.lock().unwrap().get(&link_addr).cloned()
+    }
+
+    /// Returns every port except the one at `link_addr`.
+    pub fn others(&self, link_addr: [u8; 6]) -> Vec<Arc<Port>> {
+        self.ports
+            .lock()
+            .unwrap()
+            .values()
+            .filter(|port| port.link_addr != link_addr)
+            .cloned()
+            .collect()
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for LinkConfig {
+    fn default() -> Self {
+        Self {
+            latency: Duration::from_secs(0),
+            bandwidth: None,
+            loss: 0.0,
+            seed: 0,
+            queue_len: DEFAULT_QUEUE_LEN,
+        }
+    }
+}
+
+// `FrameData::new` takes a `BytesMut`, which is the only reference to its buffer, and nothing hands
+// out another one while the frame crosses over.
+unsafe impl Send for FrameData {}
+
+impl Default for Switch {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        Frame,
+        FrameData,
+        Link,
+        LinkConfig,
+        Switch,
+    };
+    use catnip::{
+        collections::bytes::BytesMut,
+        protocols::ethernet2::MacAddress,
+    };
+    use std::time::{
+        Duration,
+        Instant,
+    };
+
+    fn link_config(latency_us: u64, bandwidth: Option<u64>, loss: f64) -> LinkConfig {
+        LinkConfig {
+            latency: Duration::from_micros(latency_us),
+            bandwidth,
+            loss,
+            seed: 42,
+            ..LinkConfig::default()
+        }
+    }
+
+    #[test]
+    fn frames_arrive_after_latency() {
+        let start = Instant::now();
+        let mut link = Link::new(link_config(10, None, 0.0), start);
+        for i in 0..100 {
+            let now = start + Duration::from_micros(i * 3);
+            assert_eq!(link.send(now, 1500), Some(now + Duration::from_micros(10)));
+        }
+    }
+
+    #[test]
+    fn frames_queue_at_the_line_rate() {
+        // 1 Gb/s puts a 1250-byte frame on the wire in 10 us.
+        let start = Instant::now();
+        let mut link = Link::new(link_config(5, Some(1_000_000_000), 0.0), start);
+        let mut last = start;
+        for i in 1..=1000 {
+            last = link.send(start, 1250).unwrap();
+            assert_eq!(last, start + Duration::from_micros(i * 10 + 5));
+        }
+
+        // 1000 frames of 10 kbit each took 10 ms: 1 Gb/s.
+        let elapsed = last - start - Duration::from_micros(5);
+        let bps = (1000 * 1250 * 8) as f64 / elapsed.as_secs_f64();
+        assert!((bps - 1e9).abs() < 1e3, "{} b/s", bps);
+
+        // Once the link has drained, a frame only waits for itself.
+        let later = last + Duration::from_millis(1);
+        assert_eq!(
+            link.send(later, 1250),
+            Some(later + Duration::from_micros(15))
+        );
+    }
+
+    #[test]
+    fn frames_are_lost_at_the_configured_rate() {
+        let start = Instant::now();
+        for &loss in &[0.0, 0.01, 0.1, 0.5, 1.0] {
+            let mut link = Link::new(link_config(0, None, loss), start);
+            let n = 100_000;
+            let lost = (0..n).filter(|_| link.send(start, 64).is_none()).count();
+            let rate = lost as f64 / n as f64;
+            assert!(
+                (rate - loss).abs() < 0.01,
+                "loss {} measured {}",
+                loss,
+                rate
+            );
+        }
+    }
+
+    #[test]
+    fn losses_repeat_with_the_seed() {
+        let start = Instant::now();
+        let run = || {
+            let mut link = Link::new(link_config(0, None, 0.1), start);
+            (0..1000)
+                .map(|_| link.send(start, 64).is_some())
+                .collect::<Vec<_>>()
+        };
+        assert_eq!(run(), run());
+    }
+
+    #[test]
+    fn ports_hold_frames_until_they_arrive() {
+        let switch = Switch::new();
+        let addr = [0x12, 0, 0, 0, 0, 1];
+        let port = switch.attach(MacAddress::new(addr), 16).unwrap();
+        let start = Instant::now();
+        let deliver_at = start + Duration::from_micros(10);
+        let mut buf = BytesMut::zeroed(64).unwrap();
+        buf[..6].copy_from_slice(&addr);
+        let data = FrameData::new(buf);
+        assert_eq!(data.dst_addr(), addr);
+        assert!(port.send(Frame { deliver_at, data }).is_ok());
+
+        unsafe {
+            assert!(port.receive(start).is_none());
+            assert!(port.receive(deliver_at - Duration::from_nanos(1)).is_none());
+            let frame = port.receive(deliver_at).unwrap();
+            assert_eq!(frame.data.into_bytes().len(), 64);
+            assert!(port.receive(deliver_at).is_none());
+        }
+    }
+}
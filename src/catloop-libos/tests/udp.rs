@@ -0,0 +1,217 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use catloop_libos::{
+    runtime::LoopRuntime,
+    switch::{
+        LinkConfig,
+        Switch,
+    },
+};
+use catnip::{
+    collections::bytes::Bytes,
+    file_table::FileDescriptor,
+    libos::LibOS,
+    operations::OperationResult,
+    protocols::{
+        ethernet2::MacAddress,
+        ip::Port,
+        ipv4::Endpoint,
+    },
+    runtime::RuntimeBuf,
+};
+use std::{
+    collections::HashMap,
+    convert::TryFrom,
+    net::Ipv4Addr,
+    sync::{
+        Arc,
+        Barrier,
+    },
+    thread,
+    time::Duration,
+};
+
+//==============================================================================
+// Test
+//==============================================================================
+
+const BUFFER_SIZE: usize = 64;
+
+/// Both peers run in this process, one per thread, so the test needs no NIC, root or config file.
+pub struct Test {
+    is_server: bool,
+    pub libos: LibOS<LoopRuntime>,
+    sockfd: FileDescriptor,
+}
+
+impl Test {
+    const CLIENT_IPV4: Ipv4Addr = Ipv4Addr::new(198, 19, 0, 2);
+    const CLIENT_MAC: [u8; 6] = [0x12, 0x00, 0x00, 0x00, 0x00, 0x02];
+    const PORT: u16 = 12345;
+    const SERVER_IPV4: Ipv4Addr = Ipv4Addr::new(198, 19, 0, 1);
+    const SERVER_MAC: [u8; 6] = [0x12, 0x00, 0x00, 0x00, 0x00, 0x01];
+
+    pub fn new(is_server: bool, switch: Arc<Switch>, link: LinkConfig) -> Self {
+        let mut arp = HashMap::new();
+        arp.insert(Self::SERVER_IPV4, MacAddress::new(Self::SERVER_MAC));
+        arp.insert(Self::CLIENT_IPV4, MacAddress::new(Self::CLIENT_MAC));
+        let (mac, ipv4) = if is_server {
+            (Self::SERVER_MAC, Self::SERVER_IPV4)
+        } else {
+            (Self::CLIENT_MAC, Self::CLIENT_IPV4)
+        };
+        let rt =
+            catloop_libos::runtime::initialize_loop(MacAddress::new(mac), ipv4, arp, switch, link)
+                .unwrap();
+        let mut libos = LibOS::new(rt).unwrap();
+
+        let sockfd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0).unwrap();
+        let port = Port::try_from(Self::PORT).unwrap();
+        libos.bind(sockfd, Endpoint::new(ipv4, port)).unwrap();
+
+        Self {
+            is_server,
+            libos,
+            sockfd,
+        }
+    }
+
+    pub fn remote_addr(&self) -> Endpoint {
+        let port = Port::try_from(Self::PORT).unwrap();
+        if self.is_server {
+            Endpoint::new(Self::CLIENT_IPV4, port)
+        } else {
+            Endpoint::new(Self::SERVER_IPV4, port)
+        }
+    }
+
+    pub fn mkbuf(fill_char: u8) -> Bytes {
+        Bytes::from_slice(&[fill_char; BUFFER_SIZE])
+    }
+
+    pub fn bufcmp(a: Bytes, b: Bytes) -> bool {
+        a.len() == b.len() && a[..] == b[..]
+    }
+
+    /// Runs `server` and `client` on their own threads over a fresh switch. Both peers are
+    /// attached before either starts, so that nothing is sent to a missing port.
+    pub fn run(
+        link: LinkConfig,
+        server: impl FnOnce(Test) + Send + 'static,
+        client: impl FnOnce(Test) + Send + 'static,
+    ) {
+        let switch = Arc::new(Switch::new());
+        let barrier = Arc::new(Barrier::new(2));
+        let peer = |is_server: bool, f: Box<dyn FnOnce(Test) + Send>| {
+            let switch = switch.clone();
+            let barrier = barrier.clone();
+            thread::spawn(move || {
+                let test = Test::new(is_server, switch, link);
+                barrier.wait();
+                f(test);
+            })
+        };
+        let s = peer(true, Box::new(server));
+        let c = peer(false, Box::new(client));
+        c.join().expect("client failed");
+        s.join().expect("server failed");
+    }
+}
+
+//==============================================================================
+// Push Pop
+//==============================================================================
+
+#[test]
+fn udp_push_pop() {
+    let payload: u8 = 'a' as u8;
+    let nsends: usize = 1000;
+
+    Test::run(
+        LinkConfig::default(),
+        move |mut test| {
+            let expectbuf = Test::mkbuf(payload);
+
+            // The link is lossless and the port deep enough, so every send arrives.
+            for _ in 0..nsends {
+                let qtoken = test.libos.pop(test.sockfd).expect("server failed to pop()");
+                let recvbuf = match test.libos.wait2(qtoken) {
+                    (_, OperationResult::Pop(_, buf)) => buf,
+                    _ => panic!("server failed to wait()"),
+                };
+                assert!(
+                    Test::bufcmp(expectbuf.clone(), recvbuf),
+                    "server expectbuf != recevbuf"
+                );
+            }
+        },
+        move |mut test| {
+            let sendbuf = Test::mkbuf(payload);
+            let remote_addr = test.remote_addr();
+
+            for _ in 0..nsends {
+                let qtoken = test
+                    .libos
+                    .pushto2(test.sockfd, sendbuf.clone(), remote_addr)
+                    .expect("client failed to pushto2()");
+                test.libos.wait(qtoken);
+            }
+        },
+    );
+}
+
+//==============================================================================
+// Ping Pong
+//==============================================================================
+
+#[test]
+fn udp_ping_pong() {
+    let payload: u8 = 'a' as u8;
+    let npongs: usize = 1000;
+    let mut link = LinkConfig::default();
+    link.latency = Duration::from_micros(10);
+    link.bandwidth = Some(10_000_000_000);
+
+    let echo = |test: &mut Test, buf: Bytes| {
+        let remote_addr = test.remote_addr();
+        let qtoken = test
+            .libos
+            .pushto2(test.sockfd, buf, remote_addr)
+            .expect("failed to pushto2()");
+        test.libos.wait(qtoken);
+    };
+    let recv = |test: &mut Test| {
+        let qtoken = test.libos.pop(test.sockfd).expect("failed to pop()");
+        match test.libos.wait2(qtoken) {
+            (_, OperationResult::Pop(_, buf)) => buf,
+            _ => panic!("failed to wait()"),
+        }
+    };
+
+    Test::run(
+        link,
+        move |mut test| {
+            let expectbuf = Test::mkbuf(payload);
+            for _ in 0..npongs {
+                let recvbuf = recv(&mut test);
+                assert!(
+                    Test::bufcmp(expectbuf.clone(), recvbuf.clone()),
+                    "server expectbuf != recevbuf"
+                );
+                echo(&mut test, recvbuf);
+            }
+        },
+        move |mut test| {
+            let sendbuf = Test::mkbuf(payload);
+            for _ in 0..npongs {
+                echo(&mut test, sendbuf.clone());
+                let recvbuf = recv(&mut test);
+                assert!(
+                    Test::bufcmp(sendbuf.clone(), recvbuf),
+                    "client sendbuf != recevbuf"
+                );
+            }
+        },
+    );
+}
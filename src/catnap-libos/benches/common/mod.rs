@@ -0,0 +1,468 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Setup and reporting shared by the benchmarks.
+//!
+//! Like the tests, benchmarks run as a pair of peers: export `PEER=server` on one side and
+//! `PEER=client` on the other, and point `CONFIG_PATH` at a configuration with the `server` and
+//! `client` addresses. Servers echo until they are killed; clients print their results and exit.
+//!
+//! `Bench` drives the Rust `LibOS` directly. Benchmarks of the C interface use `CBench` instead,
+//! which sets the LibOS up with `catnap_init` and leaves the rest to the `dmtr_*` functions.
+
+#![allow(dead_code)]
+
+use anyhow::{
+    format_err,
+    Error,
+};
+use catnap_libos::runtime::{
+    IoBackend,
+    LinuxRuntime,
+};
+use catnip::{
+    collections::bytes::{
+        Bytes,
+        BytesMut,
+    },
+    file_table::FileDescriptor,
+    libos::LibOS,
+    operations::OperationResult,
+    protocols::{
+        ip::Port,
+        ipv4::Endpoint,
+    },
+};
+use demikernel::{
+    config::Config,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+    network,
+    stats::LatencyHistogram,
+};
+use libc::{
+    c_int,
+    sockaddr,
+    sockaddr_in,
+    socklen_t,
+};
+use std::{
+    convert::TryFrom,
+    env,
+    mem,
+    net::Ipv4Addr,
+    ptr,
+    str::FromStr,
+    time::Duration,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Protocol {
+    Udp,
+    Tcp,
+}
+
+pub struct Bench {
+    config: Config,
+    io_backend: IoBackend,
+    pub libos: LibOS<LinuxRuntime>,
+}
+
+pub struct CBench {
+    config: Config,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl Protocol {
+    /// Reads `PROTO` from the environment, defaulting to UDP.
+    pub fn from_env() -> Self {
+        match env::var("PROTO").as_deref() {
+            Err(..) | Ok("udp") => Protocol::Udp,
+            Ok("tcp") => Protocol::Tcp,
+            Ok(s) => panic!("PROTO must be udp or tcp, not {:?}", s),
+        }
+    }
+
+    fn socket_type(&self) -> libc::c_int {
+        match self {
+            Protocol::Udp => libc::SOCK_DGRAM,
+            Protocol::Tcp => libc::SOCK_STREAM,
+        }
+    }
+}
+
+impl Bench {
+    /// Sets up a LibOS from the configuration at `CONFIG_PATH`. `IO_BACKEND`, if set, overrides
+    /// `catnap.io_backend`.
+    pub fn new() -> Self {
+        let config = Config::new(env::var("CONFIG_PATH").unwrap());
+        let io_backend = match env::var("IO_BACKEND") {
+            Ok(name) => IoBackend::from_name(&name).unwrap(),
+            Err(..) => IoBackend::from_config(&config).unwrap(),
+        };
+        let rt: LinuxRuntime = catnap_libos::runtime::initialize_linux(
+            config.local_link_addr,
+            config.local_ipv4_addr,
+            &config.local_interface_name,
+            config.arp_table(),
+            io_backend,
+        )
+        .unwrap();
+        let libos = LibOS::new(rt).unwrap();
+
+        Self {
+            config,
+            io_backend,
+            libos,
+        }
+    }
+
+    pub fn io_backend(&self) -> IoBackend {
+        self.io_backend
+    }
+
+    pub fn is_server(&self) -> bool {
+        is_server()
+    }
+
+    pub fn local_addr(&self) -> Endpoint {
+        let (host, port) = local_addr(&self.config);
+        Endpoint::new(host, Port::try_from(port).unwrap())
+    }
+
+    pub fn remote_addr(&self) -> Endpoint {
+        let (host, port) = remote_addr(&self.config);
+        Endpoint::new(host, Port::try_from(port).unwrap())
+    }
+
+    /// Creates a socket bound to the local address. TCP sockets also start listening.
+    pub fn bound_socket(&mut self, proto: Protocol) -> FileDescriptor {
+        let fd = self
+            .libos
+            .socket(libc::AF_INET, proto.socket_type(), 0)
+            .unwrap();
+        let local_addr = self.local_addr();
+        self.libos.bind(fd, local_addr).unwrap();
+        if proto == Protocol::Tcp {
+            self.libos.listen(fd, 1024).unwrap();
+        }
+        fd
+    }
+
+    /// Opens a TCP connection to the server.
+    pub fn connect(&mut self) -> FileDescriptor {
+        let fd = self
+            .libos
+            .socket(libc::AF_INET, libc::SOCK_STREAM, 0)
+            .unwrap();
+        let remote_addr = self.remote_addr();
+        let qt = self.libos.connect(fd, remote_addr).unwrap();
+        match self.libos.wait2(qt) {
+            (_, OperationResult::Connect) => fd,
+            _ => panic!("failed to connect"),
+        }
+    }
+
+    /// Pops from a connection until `len` bytes have arrived. The caller's messages are the
+    /// only traffic on the connection, so anything popped belongs to the message being waited on.
+    pub fn recv_exact(&mut self, fd: FileDescriptor, mut len: usize) {
+        while len > 0 {
+            let qt = self.libos.pop(fd).unwrap();
+            match self.libos.wait2(qt) {
+                (_, OperationResult::Pop(_, buf)) => {
+                    assert!(buf.len() <= len, "peer sent more than expected");
+                    len -= buf.len();
+                },
+                _ => panic!("failed to pop"),
+            }
+        }
+    }
+
+    /// Echoes every message back to its sender, forever.
+    pub fn run_echo_server(&mut self, proto: Protocol, fd: FileDescriptor) -> ! {
+        match proto {
+            Protocol::Udp => self.run_udp_echo_server(fd),
+            Protocol::Tcp => self.run_tcp_echo_server(fd),
+        }
+    }
+
+    fn run_udp_echo_server(&mut self, fd: FileDescriptor) -> ! {
+        let remote_addr = self.remote_addr();
+        let mut qts = vec![self.libos.pop(fd).unwrap()];
+        loop {
+            let (i, _, result) = self.libos.wait_any2(&qts);
+            qts.swap_remove(i);
+            match result {
+                OperationResult::Pop(addr, buf) => {
+                    qts.push(self.libos.pop(fd).unwrap());
+                    let dest = addr.unwrap_or(remote_addr);
+                    qts.push(self.libos.pushto2(fd, buf, dest).unwrap());
+                },
+                OperationResult::Push => {},
+                _ => panic!("unexpected result"),
+            }
+        }
+    }
+
+    fn run_tcp_echo_server(&mut self, listen_fd: FileDescriptor) -> ! {
+        let mut qts = vec![self.libos.accept(listen_fd).unwrap()];
+        loop {
+            let (i, fd, result) = self.libos.wait_any2(&qts);
+            qts.swap_remove(i);
+            match result {
+                OperationResult::Accept(new_fd) => {
+                    qts.push(self.libos.accept(listen_fd).unwrap());
+                    qts.push(self.libos.pop(new_fd).unwrap());
+                },
+                // An empty pop means that the client hung up.
+                OperationResult::Pop(_, ref buf) if buf.len() == 0 => {
+                    self.libos.close(fd).unwrap();
+                },
+                OperationResult::Pop(_, buf) => {
+                    qts.push(self.libos.pop(fd).unwrap());
+                    qts.push(self.libos.push2(fd, buf).unwrap());
+                },
+                OperationResult::Push => {},
+                OperationResult::Failed(e) => {
+                    eprintln!("closing connection: {:?}", e);
+                    let _ = self.libos.close(fd);
+                },
+                _ => panic!("unexpected result"),
+            }
+        }
+    }
+
+    /// Pops and discards everything that arrives, forever.
+    pub fn run_sink(&mut self, proto: Protocol, fd: FileDescriptor) -> ! {
+        let mut qts = match proto {
+            Protocol::Udp => vec![self.libos.pop(fd).unwrap()],
+            Protocol::Tcp => vec![self.libos.accept(fd).unwrap()],
+        };
+        loop {
+            let (i, qd, result) = self.libos.wait_any2(&qts);
+            qts.swap_remove(i);
+            match result {
+                OperationResult::Accept(new_fd) => {
+                    qts.push(self.libos.accept(fd).unwrap());
+                    qts.push(self.libos.pop(new_fd).unwrap());
+                },
+                // An empty pop means that the client hung up.
+                OperationResult::Pop(_, ref buf) if proto == Protocol::Tcp && buf.len() == 0 => {
+                    self.libos.close(qd).unwrap();
+                },
+                OperationResult::Pop(..) => qts.push(self.libos.pop(qd).unwrap()),
+                OperationResult::Failed(e) => {
+                    eprintln!("closing connection: {:?}", e);
+                    let _ = self.libos.close(qd);
+                },
+                _ => panic!("unexpected result"),
+            }
+        }
+    }
+}
+
+impl CBench {
+    /// Sets up the calling thread's LibOS from the configuration at `CONFIG_PATH`.
+    pub fn new() -> Self {
+        assert_eq!(catnap_libos::catnap_init(0, ptr::null_mut()), 0);
+        let config = Config::new(env::var("CONFIG_PATH").unwrap());
+        Self { config }
+    }
+
+    pub fn local_addr(&self) -> sockaddr_in {
+        let (host, port) = local_addr(&self.config);
+        sockaddr(host, port)
+    }
+
+    pub fn remote_addr(&self) -> sockaddr_in {
+        let (host, port) = remote_addr(&self.config);
+        sockaddr(host, port)
+    }
+
+    /// Creates a UDP socket bound to the local address, `port_offset` ports above the configured
+    /// one.
+    pub fn udp_socket(&self, port_offset: u16) -> c_int {
+        let mut qd: c_int = 0;
+        assert_eq!(
+            network::dmtr_socket(&mut qd, libc::AF_INET, libc::SOCK_DGRAM, 0),
+            0
+        );
+        let mut addr = self.local_addr();
+        addr.sin_port = (u16::from_be(addr.sin_port) + port_offset).to_be();
+        let ret = network::dmtr_bind(
+            qd,
+            &addr as *const sockaddr_in as *const sockaddr,
+            mem::size_of::<sockaddr_in>() as socklen_t,
+        );
+        assert_eq!(ret, 0);
+        qd
+    }
+
+    /// Sends `sga` to `addr` from `qd`, returning the push's token.
+    pub fn pushto(&self, qd: c_int, sga: &dmtr_sgarray_t, addr: &sockaddr_in) -> dmtr_qtoken_t {
+        let mut qt: dmtr_qtoken_t = 0;
+        let ret = network::dmtr_pushto(
+            &mut qt,
+            qd,
+            sga,
+            addr as *const sockaddr_in as *const sockaddr,
+            mem::size_of::<sockaddr_in>() as socklen_t,
+        );
+        assert_eq!(ret, 0);
+        qt
+    }
+
+    pub fn pop(&self, qd: c_int) -> dmtr_qtoken_t {
+        let mut qt: dmtr_qtoken_t = 0;
+        assert_eq!(network::dmtr_pop(&mut qt, qd), 0);
+        qt
+    }
+
+    /// Opens a TCP connection to the server.
+    pub fn tcp_connect(&self) -> c_int {
+        let mut qd: c_int = 0;
+        assert_eq!(
+            network::dmtr_socket(&mut qd, libc::AF_INET, libc::SOCK_STREAM, 0),
+            0
+        );
+        let addr = self.remote_addr();
+        let mut qt: dmtr_qtoken_t = 0;
+        let ret = network::dmtr_connect(
+            &mut qt,
+            qd,
+            &addr as *const sockaddr_in as *const sockaddr,
+            mem::size_of::<sockaddr_in>() as socklen_t,
+        );
+        assert_eq!(ret, 0);
+        self.wait(qt);
+        qd
+    }
+
+    /// Waits for the operation of `qt`, which must succeed.
+    pub fn wait(&self, qt: dmtr_qtoken_t) -> dmtr_qresult_t {
+        let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+        assert_eq!(network::dmtr_wait(&mut qr, qt), 0);
+        qr
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+pub fn is_server() -> bool {
+    match env::var("PEER").as_deref() {
+        Ok("server") => true,
+        Ok("client") => false,
+        _ => panic!("either PEER=server or PEER=client must be exported"),
+    }
+}
+
+fn config_addr(config: &Config, k1: &str, k2: &str) -> Result<(Ipv4Addr, u16), Error> {
+    let addr = &config.config_obj[k1][k2];
+    let host_s = addr["host"].as_str().ok_or(format_err!("Missing host"))?;
+    let host = Ipv4Addr::from_str(host_s)?;
+    let port_i = addr["port"].as_i64().ok_or(format_err!("Missing port"))?;
+    Ok((host, port_i as u16))
+}
+
+fn local_addr(config: &Config) -> (Ipv4Addr, u16) {
+    if is_server() {
+        config_addr(config, "server", "bind").unwrap()
+    } else {
+        config_addr(config, "client", "client").unwrap()
+    }
+}
+
+fn remote_addr(config: &Config) -> (Ipv4Addr, u16) {
+    if is_server() {
+        config_addr(config, "server", "client").unwrap()
+    } else {
+        config_addr(config, "client", "connect_to").unwrap()
+    }
+}
+
+fn sockaddr(host: Ipv4Addr, port: u16) -> sockaddr_in {
+    let mut addr: sockaddr_in = unsafe { mem::zeroed() };
+    addr.sin_family = libc::AF_INET as libc::sa_family_t;
+    addr.sin_port = port.to_be();
+    addr.sin_addr.s_addr = u32::from_ne_bytes(host.octets());
+    addr
+}
+
+pub fn env_usize(name: &str, default: usize) -> usize {
+    match env::var(name) {
+        Ok(s) => s
+            .parse()
+            .unwrap_or_else(|_| panic!("{} must be a number", name)),
+        Err(..) => default,
+    }
+}
+
+pub fn env_f64(name: &str, default: f64) -> f64 {
+    match env::var(name) {
+        Ok(s) => s
+            .parse()
+            .unwrap_or_else(|_| panic!("{} must be a number", name)),
+        Err(..) => default,
+    }
+}
+
+/// Reads a comma-separated list of numbers, e.g. `MSG_SIZES=64,1024`.
+pub fn env_usize_list(name: &str, default: &[usize]) -> Vec<usize> {
+    match env::var(name) {
+        Ok(s) => s
+            .split(',')
+            .map(|n| {
+                n.trim()
+                    .parse()
+                    .unwrap_or_else(|_| panic!("{} must be a list of numbers", name))
+            })
+            .collect(),
+        Err(..) => default.to_vec(),
+    }
+}
+
+/// Makes a `len` byte message. Messages at least 8 bytes long start with `tag`.
+pub fn mkbuf(len: usize, tag: u64) -> Bytes {
+    let mut buf = BytesMut::zeroed(len).unwrap();
+    if len >= 8 {
+        buf[..8].copy_from_slice(&tag.to_le_bytes());
+    }
+    buf.freeze()
+}
+
+/// Returns the CPU time consumed by the calling thread so far.
+pub fn thread_cpu_time() -> Duration {
+    let mut ts: libc::timespec = unsafe { mem::zeroed() };
+    unsafe { libc::clock_gettime(libc::CLOCK_THREAD_CPUTIME_ID, &mut ts) };
+    Duration::new(ts.tv_sec as u64, ts.tv_nsec as u32)
+}
+
+/// Prints one line of results, as `key=value` pairs.
+pub fn report(name: &str, h: &LatencyHistogram, elapsed: Duration, ops: u64, bytes: u64) {
+    let secs = elapsed.as_secs_f64();
+    println!(
+        "{} ops={} elapsed_s={:.3} ops_per_s={:.0} gbps={:.3} p50_ns={} p99_ns={} p999_ns={} \
+         max_ns={}",
+        name,
+        ops,
+        secs,
+        ops as f64 / secs,
+        (bytes * 8) as f64 / secs / 1e9,
+        h.percentile(0.5),
+        h.percentile(0.99),
+        h.percentile(0.999),
+        h.max()
+    );
+}
@@ -0,0 +1,84 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Request throughput and latency as the number of TCP connections grows.
+//!
+//! For each count in `NUM_CONNS`, the client opens that many connections to the echo server and
+//! runs `ROUNDS` rounds. Each round sends a `MSG_SIZE` byte request on every connection at once
+//! and waits for all the replies, so every connection has one request in flight.
+
+mod common;
+
+use catnip::{
+    file_table::FileDescriptor,
+    operations::OperationResult,
+};
+use common::{
+    env_usize,
+    env_usize_list,
+    mkbuf,
+    report,
+    Bench,
+    Protocol,
+};
+use demikernel::stats::LatencyHistogram;
+use std::{
+    collections::HashMap,
+    time::Instant,
+};
+
+fn main() {
+    let num_conns = env_usize_list("NUM_CONNS", &[1, 16, 64, 256]);
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let rounds = env_usize("ROUNDS", 1000);
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(Protocol::Tcp);
+        bench.run_echo_server(Protocol::Tcp, fd);
+    }
+
+    let buf = mkbuf(msg_size, 0);
+    for n in num_conns {
+        let fds: Vec<FileDescriptor> = (0..n).map(|_| bench.connect()).collect();
+        let mut h = LatencyHistogram::new();
+        // Reply bytes still expected per connection in the current round.
+        let mut left: HashMap<FileDescriptor, usize> = HashMap::with_capacity(n);
+        let mut qts = Vec::with_capacity(2 * n);
+        let start = Instant::now();
+        for _ in 0..rounds {
+            let t0 = Instant::now();
+            for &fd in &fds {
+                left.insert(fd, msg_size);
+                qts.push(bench.libos.push2(fd, buf.clone()).unwrap());
+                qts.push(bench.libos.pop(fd).unwrap());
+            }
+            while !qts.is_empty() {
+                let (i, fd, result) = bench.libos.wait_any2(&qts);
+                qts.swap_remove(i);
+                match result {
+                    OperationResult::Push => {},
+                    OperationResult::Pop(_, reply) => {
+                        let remaining = left.get_mut(&fd).unwrap();
+                        assert!(reply.len() <= *remaining, "server sent more than expected");
+                        *remaining -= reply.len();
+                        if *remaining > 0 {
+                            qts.push(bench.libos.pop(fd).unwrap());
+                        } else {
+                            h.record(t0.elapsed().as_nanos() as u64);
+                        }
+                    },
+                    _ => panic!("unexpected result"),
+                }
+            }
+        }
+        let elapsed = start.elapsed();
+        for fd in fds {
+            bench.libos.close(fd).unwrap();
+        }
+
+        let ops = (n * rounds) as u64;
+        let label = format!("tcp_connscale num_conns={} msg_size={}", n, msg_size);
+        report(&label, &h, elapsed, ops, 2 * ops * msg_size as u64);
+    }
+}
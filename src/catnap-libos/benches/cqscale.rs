@@ -0,0 +1,98 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Cost of harvesting completions from a completion queue that also holds many idle operations.
+//!
+//! For each count in `NUM_IDLE`, the client makes sure that that many UDP sockets each have a pop
+//! outstanding that never completes, all registered with one completion queue. It then runs
+//! `ITERATIONS` round trips of `MSG_SIZE` bytes with the echo server on another socket, harvesting
+//! both the push and the pop through `dmtr_cq_wait`, and reports their latency. Every harvest
+//! still tests each registered token, so this shows what the idle operations cost it.
+
+mod common;
+
+use common::{
+    env_usize,
+    env_usize_list,
+    is_server,
+    report,
+    Bench,
+    CBench,
+    Protocol,
+};
+use demikernel::{
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+    },
+    network,
+    stats::LatencyHistogram,
+};
+use libc::c_int;
+use std::{
+    mem,
+    ptr,
+    time::Instant,
+};
+
+fn main() {
+    let num_idle = env_usize_list("NUM_IDLE", &[0, 100, 1000, 10000]);
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let iterations = env_usize("ITERATIONS", 100_000);
+
+    if is_server() {
+        let mut bench = Bench::new();
+        let fd = bench.bound_socket(Protocol::Udp);
+        bench.run_echo_server(Protocol::Udp, fd);
+    }
+
+    let bench = CBench::new();
+    let remote_addr = bench.remote_addr();
+    let qd = bench.udp_socket(0);
+    let mut cqd: c_int = 0;
+    assert_eq!(network::dmtr_cq_create(&mut cqd), 0);
+    let sga = network::dmtr_sgaalloc(msg_size);
+    unsafe { ptr::write_bytes(sga.sga_segs[0].sgaseg_buf as *mut u8, 0, msg_size) };
+
+    let mut idle = 0;
+    for n in num_idle {
+        while idle < n {
+            let idle_qd = bench.udp_socket(1 + idle as u16);
+            assert_eq!(network::dmtr_cq_add(cqd, bench.pop(idle_qd)), 0);
+            idle += 1;
+        }
+
+        let mut h = LatencyHistogram::new();
+        let mut qrs: [dmtr_qresult_t; 2] = unsafe { mem::zeroed() };
+        let start = Instant::now();
+        for _ in 0..iterations {
+            let t0 = Instant::now();
+            assert_eq!(network::dmtr_cq_add(cqd, bench.pop(qd)), 0);
+            let push_qt = bench.pushto(qd, &sga, &remote_addr);
+            assert_eq!(network::dmtr_cq_add(cqd, push_qt), 0);
+            let mut pending = 2;
+            while pending > 0 {
+                let mut nr: c_int = 0;
+                let ret = network::dmtr_cq_wait(&mut nr, qrs.as_mut_ptr(), 2, cqd);
+                assert_eq!(ret, 0);
+                for qr in &mut qrs[..nr as usize] {
+                    if let dmtr_opcode_t::DMTR_OPC_POP = qr.qr_opcode {
+                        assert_eq!(network::dmtr_sgafree(unsafe { &mut qr.qr_value.sga }), 0);
+                    }
+                }
+                pending -= nr;
+            }
+            h.record(t0.elapsed().as_nanos() as u64);
+        }
+
+        let label = format!("udp_cqscale num_idle={} msg_size={}", n, msg_size);
+        report(
+            &label,
+            &h,
+            start.elapsed(),
+            iterations as u64,
+            (2 * iterations * msg_size) as u64,
+        );
+    }
+    assert_eq!(network::dmtr_cq_destroy(cqd), 0);
+}
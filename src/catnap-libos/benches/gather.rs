@@ -0,0 +1,173 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! CPU cost of sending messages made of a header and a body that live in separate buffers.
+//!
+//! The client keeps `WINDOW` pushes in flight and sends `ITERATIONS` messages of a `HEADER_SIZE`
+//! byte header followed by a `MSG_SIZE` byte body over `PROTO` (udp or tcp), after `WARMUP`
+//! unmeasured ones; the server only drains them. `MODE` picks how the two parts go out:
+//!
+//! - `copy` joins them into a freshly allocated array first, as applications do today;
+//! - `twopush` pushes them one after the other (on UDP, that's two datagrams per message);
+//! - `gather` pushes a single two-segment array.
+//!
+//! Pushes take the path of `dmtr_push` and `dmtr_pushto`: the array goes through
+//! `Dispatch::clone_sga` and the result to `push2` or `pushto2`.
+
+mod common;
+
+use common::{
+    env_usize,
+    thread_cpu_time,
+    Bench,
+    Protocol,
+};
+use demikernel::{
+    dispatch::Dispatch,
+    interop::{
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+};
+use std::{
+    env,
+    ptr,
+    time::Instant,
+};
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Mode {
+    Copy,
+    TwoPush,
+    Gather,
+}
+
+fn main() {
+    let proto = Protocol::from_env();
+    let header_size = env_usize("HEADER_SIZE", 64);
+    let msg_size = env_usize("MSG_SIZE", 1024);
+    let iterations = env_usize("ITERATIONS", 1_000_000);
+    let warmup = env_usize("WARMUP", 10_000);
+    let window = env_usize("WINDOW", 32);
+    let mode = match env::var("MODE").as_deref() {
+        Err(..) | Ok("gather") => Mode::Gather,
+        Ok("copy") => Mode::Copy,
+        Ok("twopush") => Mode::TwoPush,
+        Ok(s) => panic!("MODE must be copy, twopush or gather, not {:?}", s),
+    };
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(proto);
+        bench.run_sink(proto, fd);
+    }
+
+    let remote_addr = bench.remote_addr();
+    let fd = match proto {
+        Protocol::Udp => bench.bound_socket(proto),
+        Protocol::Tcp => bench.connect(),
+    };
+    let header = bench.libos.rt().alloc_sga(header_size);
+    let body = bench.libos.rt().alloc_sga(msg_size);
+    unsafe {
+        ptr::write_bytes(header.sga_segs[0].sgaseg_buf as *mut u8, b'h', header_size);
+        ptr::write_bytes(body.sga_segs[0].sgaseg_buf as *mut u8, b'b', msg_size);
+    }
+    let gathered = dmtr_sgarray_t::new(&[header.sga_segs[0], body.sga_segs[0]]);
+
+    // Tokens in flight, and the joined arrays that they still use.
+    let mut qts: Vec<dmtr_qtoken_t> = Vec::with_capacity(2 * window);
+    let mut joined: Vec<Option<dmtr_sgarray_t>> = Vec::with_capacity(2 * window);
+    let mut start = (Instant::now(), thread_cpu_time(), bench.libos.rt().stats());
+    for i in 0..(warmup + iterations) {
+        if i == warmup {
+            while let Some(qt) = qts.pop() {
+                bench.libos.wait(qt);
+                free(&bench, joined.pop().unwrap());
+            }
+            start = (Instant::now(), thread_cpu_time(), bench.libos.rt().stats());
+        }
+        while qts.len() >= window {
+            let (ix, ..) = bench.libos.wait_any2(&qts);
+            qts.swap_remove(ix);
+            free(&bench, joined.swap_remove(ix));
+        }
+        let push = |bench: &mut Bench, sga: &dmtr_sgarray_t| {
+            let buf = bench.libos.rt().clone_sga(sga);
+            match proto {
+                Protocol::Udp => bench.libos.pushto2(fd, buf, remote_addr),
+                Protocol::Tcp => bench.libos.push2(fd, buf),
+            }
+            .unwrap()
+        };
+        match mode {
+            Mode::Copy => {
+                let sga = join(&bench, &header, &body);
+                qts.push(push(&mut bench, &sga));
+                joined.push(Some(sga));
+            },
+            Mode::TwoPush => {
+                qts.push(push(&mut bench, &header));
+                joined.push(None);
+                qts.push(push(&mut bench, &body));
+                joined.push(None);
+            },
+            Mode::Gather => {
+                qts.push(push(&mut bench, &gathered));
+                joined.push(None);
+            },
+        }
+    }
+    while let Some(qt) = qts.pop() {
+        bench.libos.wait(qt);
+        free(&bench, joined.pop().unwrap());
+    }
+
+    let (start_time, start_cpu, start_stats) = start;
+    let elapsed = start_time.elapsed();
+    let cpu = thread_cpu_time() - start_cpu;
+    let packets = bench.libos.rt().stats().tx_packets - start_stats.tx_packets;
+    let name = match proto {
+        Protocol::Udp => "udp_gather",
+        Protocol::Tcp => "tcp_gather",
+    };
+    println!(
+        "{} mode={:?} header_size={} msg_size={} msgs={} packets={} elapsed_s={:.3} \
+         msgs_per_s={:.0} cpu_ns_per_msg={:.0}",
+        name,
+        mode,
+        header_size,
+        msg_size,
+        iterations,
+        packets,
+        elapsed.as_secs_f64(),
+        iterations as f64 / elapsed.as_secs_f64(),
+        cpu.as_nanos() as f64 / iterations as f64,
+    );
+    bench.libos.rt().free_sga(&header);
+    bench.libos.rt().free_sga(&body);
+}
+
+/// Copies `header` and `body` into a new array, the way an application without vectored pushes
+/// would.
+fn join(bench: &Bench, header: &dmtr_sgarray_t, body: &dmtr_sgarray_t) -> dmtr_sgarray_t {
+    let parts = [&header.sga_segs[0], &body.sga_segs[0]];
+    let len = parts.iter().map(|seg| seg.sgaseg_len as usize).sum();
+    let sga = bench.libos.rt().alloc_sga(len);
+    let mut pos = 0;
+    for seg in &parts {
+        let seg_len = seg.sgaseg_len as usize;
+        unsafe {
+            let out_ptr = (sga.sga_segs[0].sgaseg_buf as *mut u8).add(pos);
+            ptr::copy_nonoverlapping(seg.sgaseg_buf as *const u8, out_ptr, seg_len);
+        }
+        pos += seg_len;
+    }
+    sga
+}
+
+fn free(bench: &Bench, sga: Option<dmtr_sgarray_t>) {
+    if let Some(sga) = sga {
+        bench.libos.rt().free_sga(&sga);
+    }
+}
@@ -0,0 +1,148 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Open-loop load generator.
+//!
+//! Sends `MSG_SIZE` byte requests at Poisson-distributed times averaging `RATE` per second for
+//! `DURATION` seconds, whether or not earlier requests have been answered. Each request carries
+//! the time at which it was meant to go out, and its latency is measured from then, so a client
+//! that falls behind shows up in the tail instead of lowering the offered load.
+
+mod common;
+
+use catnip::{
+    interop::dmtr_opcode_t,
+    runtime::Runtime,
+};
+use common::{
+    env_f64,
+    env_usize,
+    mkbuf,
+    report,
+    Bench,
+    Protocol,
+};
+use demikernel::stats::LatencyHistogram;
+use rand::{
+    rngs::SmallRng,
+    Rng,
+    SeedableRng,
+};
+use std::{
+    convert::TryInto,
+    slice,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+/// How long to wait for stragglers once the last request is out.
+const DRAIN_TIMEOUT: Duration = Duration::from_secs(1);
+
+fn main() {
+    let proto = Protocol::from_env();
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let rate = env_f64("RATE", 10_000.0);
+    let duration = Duration::from_secs_f64(env_f64("DURATION", 10.0));
+    assert!(msg_size >= 8, "requests carry an 8 byte timestamp");
+    assert!(rate > 0.0);
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(proto);
+        bench.run_echo_server(proto, fd);
+    }
+
+    let remote_addr = bench.remote_addr();
+    let fd = match proto {
+        Protocol::Udp => bench.bound_socket(proto),
+        Protocol::Tcp => bench.connect(),
+    };
+    let mut rng = SmallRng::seed_from_u64(env_usize("SEED", 0) as u64);
+    let mut h = LatencyHistogram::new();
+    let mut push_qts = Vec::new();
+    let mut pop_qt = bench.libos.pop(fd).unwrap();
+    // Reply bytes that do not make up a whole message yet.
+    let mut stream: Vec<u8> = Vec::new();
+    let mut sent: u64 = 0;
+    let mut received: u64 = 0;
+
+    let start = Instant::now();
+    let end = start + duration;
+    let mut next = start;
+    loop {
+        let now = Instant::now();
+        while next <= now && next < end {
+            let intended = (next - start).as_nanos() as u64;
+            let buf = mkbuf(msg_size, intended);
+            let qt = match proto {
+                Protocol::Udp => bench.libos.pushto2(fd, buf, remote_addr),
+                Protocol::Tcp => bench.libos.push2(fd, buf),
+            }
+            .unwrap();
+            push_qts.push(qt);
+            sent += 1;
+            // Exponentially distributed gaps make for Poisson arrivals.
+            let gap = -(1.0 - rng.gen::<f64>()).ln() / rate;
+            next += Duration::from_secs_f64(gap);
+        }
+
+        let libos = &mut bench.libos;
+        push_qts.retain(|&qt| libos.poll(qt).is_none());
+
+        if let Some(qr) = bench.libos.poll(pop_qt) {
+            let sga = match qr.qr_opcode {
+                dmtr_opcode_t::DMTR_OPC_POP => unsafe { qr.qr_value.sga },
+                _ => panic!("failed to pop"),
+            };
+            for seg in &sga.sga_segs[..sga.sga_numsegs as usize] {
+                let data = unsafe {
+                    slice::from_raw_parts(seg.sgaseg_buf as *const u8, seg.sgaseg_len as usize)
+                };
+                stream.extend_from_slice(data);
+            }
+            bench.libos.rt().free_sgarray(sga);
+
+            let done = Instant::now();
+            let mut pos = 0;
+            while stream.len() - pos >= msg_size {
+                let intended = u64::from_le_bytes(stream[pos..(pos + 8)].try_into().unwrap());
+                let latency = done - (start + Duration::from_nanos(intended));
+                h.record(latency.as_nanos() as u64);
+                received += 1;
+                pos += msg_size;
+            }
+            stream.drain(..pos);
+            pop_qt = bench.libos.pop(fd).unwrap();
+        }
+
+        if now >= end && (received == sent || now >= end + DRAIN_TIMEOUT) {
+            break;
+        }
+    }
+    bench.libos.drop_qtoken(pop_qt);
+    for qt in push_qts {
+        bench.libos.drop_qtoken(qt);
+    }
+
+    let name = match proto {
+        Protocol::Udp => "udp_loadgen",
+        Protocol::Tcp => "tcp_loadgen",
+    };
+    let label = format!(
+        "{} rate={} msg_size={} sent={} lost={}",
+        name,
+        rate,
+        msg_size,
+        sent,
+        sent - received
+    );
+    report(
+        &label,
+        &h,
+        duration,
+        received,
+        2 * received * msg_size as u64,
+    );
+}
@@ -0,0 +1,79 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Round-trip latency with one message in flight.
+//!
+//! `PROTO` (udp or tcp), `MSG_SIZE` (bytes), `ITERATIONS` and `WARMUP` control the run.
+
+mod common;
+
+use catnip::operations::OperationResult;
+use common::{
+    env_usize,
+    mkbuf,
+    report,
+    Bench,
+    Protocol,
+};
+use demikernel::stats::LatencyHistogram;
+use std::time::Instant;
+
+fn main() {
+    let proto = Protocol::from_env();
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let iterations = env_usize("ITERATIONS", 100_000);
+    let warmup = env_usize("WARMUP", 1000);
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(proto);
+        bench.run_echo_server(proto, fd);
+    }
+
+    let remote_addr = bench.remote_addr();
+    let fd = match proto {
+        Protocol::Udp => bench.bound_socket(proto),
+        Protocol::Tcp => bench.connect(),
+    };
+    let buf = mkbuf(msg_size, 0);
+    let mut h = LatencyHistogram::new();
+    let mut start = Instant::now();
+    for i in 0..(warmup + iterations) {
+        if i == warmup {
+            h = LatencyHistogram::new();
+            start = Instant::now();
+        }
+
+        let t0 = Instant::now();
+        let qt = match proto {
+            Protocol::Udp => bench.libos.pushto2(fd, buf.clone(), remote_addr),
+            Protocol::Tcp => bench.libos.push2(fd, buf.clone()),
+        }
+        .unwrap();
+        bench.libos.wait(qt);
+        match proto {
+            Protocol::Udp => {
+                let qt = bench.libos.pop(fd).unwrap();
+                match bench.libos.wait2(qt) {
+                    (_, OperationResult::Pop(_, reply)) => assert_eq!(reply.len(), msg_size),
+                    _ => panic!("failed to pop"),
+                }
+            },
+            Protocol::Tcp => bench.recv_exact(fd, msg_size),
+        }
+        h.record(t0.elapsed().as_nanos() as u64);
+    }
+
+    let name = match proto {
+        Protocol::Udp => "udp_pingpong",
+        Protocol::Tcp => "tcp_pingpong",
+    };
+    let label = format!("{} msg_size={}", name, msg_size);
+    report(
+        &label,
+        &h,
+        start.elapsed(),
+        iterations as u64,
+        (2 * iterations * msg_size) as u64,
+    );
+}
@@ -0,0 +1,114 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! UDP packet rate and CPU cost per packet of the I/O backend.
+//!
+//! The client keeps `WINDOW` datagrams of `MSG_SIZE` bytes in flight to an echo server for
+//! `DURATION` seconds, sending a new one for each reply. Both peers use the backend named by
+//! `IO_BACKEND` (socket, mmsg or packet_mmap), or `catnap.io_backend` if it is unset, so running
+//! it once per backend on a veth pair compares them. Costs are in CPU time of the client thread,
+//! per packet sent or received. When no reply has come for `LOSS_TIMEOUT`, whatever is in flight
+//! is counted as lost and the window is refilled.
+
+mod common;
+
+use catnip::{
+    interop::dmtr_opcode_t,
+    runtime::Runtime,
+};
+use common::{
+    env_f64,
+    env_usize,
+    mkbuf,
+    thread_cpu_time,
+    Bench,
+    Protocol,
+};
+use std::time::{
+    Duration,
+    Instant,
+};
+
+const LOSS_TIMEOUT: Duration = Duration::from_millis(10);
+
+fn main() {
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let window = env_usize("WINDOW", 64);
+    let duration = Duration::from_secs_f64(env_f64("DURATION", 10.0));
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(Protocol::Udp);
+        bench.run_echo_server(Protocol::Udp, fd);
+    }
+
+    let remote_addr = bench.remote_addr();
+    let fd = bench.bound_socket(Protocol::Udp);
+    let buf = mkbuf(msg_size, 0);
+    let mut push_qts = Vec::with_capacity(window);
+    let mut pop_qt = bench.libos.pop(fd).unwrap();
+    let mut in_flight = 0;
+    let mut received: u64 = 0;
+    let mut lost: u64 = 0;
+
+    let start = (Instant::now(), thread_cpu_time(), bench.libos.rt().stats());
+    let end = start.0 + duration;
+    let mut last_reply = start.0;
+    loop {
+        let now = Instant::now();
+        if now >= end {
+            break;
+        }
+        while in_flight < window {
+            let qt = bench.libos.pushto2(fd, buf.clone(), remote_addr).unwrap();
+            push_qts.push(qt);
+            in_flight += 1;
+        }
+
+        let libos = &mut bench.libos;
+        push_qts.retain(|&qt| libos.poll(qt).is_none());
+
+        if let Some(qr) = bench.libos.poll(pop_qt) {
+            let sga = match qr.qr_opcode {
+                dmtr_opcode_t::DMTR_OPC_POP => unsafe { qr.qr_value.sga },
+                _ => panic!("failed to pop"),
+            };
+            bench.libos.rt().free_sgarray(sga);
+            pop_qt = bench.libos.pop(fd).unwrap();
+            received += 1;
+            in_flight -= 1;
+            last_reply = now;
+        } else if now - last_reply >= LOSS_TIMEOUT {
+            lost += in_flight as u64;
+            in_flight = 0;
+            last_reply = now;
+        }
+    }
+
+    let (start_time, start_cpu, start_stats) = start;
+    let elapsed = start_time.elapsed();
+    let cpu = thread_cpu_time() - start_cpu;
+    let stats = bench.libos.rt().stats();
+    bench.libos.drop_qtoken(pop_qt);
+    for qt in push_qts {
+        bench.libos.drop_qtoken(qt);
+    }
+
+    let tx_packets = stats.tx_packets - start_stats.tx_packets;
+    let rx_packets = stats.rx_packets - start_stats.rx_packets;
+    let secs = elapsed.as_secs_f64();
+    println!(
+        "udp_pktrate io_backend={:?} msg_size={} window={} msgs={} lost={} tx_drops={} \
+         elapsed_s={:.3} msgs_per_s={:.0} packets_per_s={:.0} cpu_ns_per_packet={:.0}",
+        bench.io_backend(),
+        msg_size,
+        window,
+        received,
+        lost,
+        stats.tx_drops - start_stats.tx_drops,
+        secs,
+        received as f64 / secs,
+        (tx_packets + rx_packets) as f64 / secs,
+        cpu.as_nanos() as f64 / (tx_packets + rx_packets) as f64,
+    );
+}
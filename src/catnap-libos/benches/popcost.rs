@@ -0,0 +1,141 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Pop throughput and receiver CPU time per pop across message sizes.
+//!
+//! For each size in `MSG_SIZES`, the client keeps `WINDOW` messages in flight to a TCP echo server
+//! until `ITERATIONS` have come back, after `WARMUP` unmeasured ones. Every pop goes through the
+//! scatter-gather array that the C interface returns. `MODE` picks what happens to it:
+//!
+//! - `zerocopy` frees the array as it is, so its segment points into the received buffer;
+//! - `copy` first copies it into a buffer from `dmtr_sgaalloc`, which is what every pop cost before
+//!   received buffers were handed to the application as-is.
+
+mod common;
+
+use catnip::{
+    file_table::FileDescriptor,
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+    },
+    runtime::Runtime,
+};
+use common::{
+    env_usize,
+    env_usize_list,
+    mkbuf,
+    thread_cpu_time,
+    Bench,
+    Protocol,
+};
+use std::{
+    env,
+    ptr,
+    time::Instant,
+};
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Mode {
+    ZeroCopy,
+    Copy,
+}
+
+fn main() {
+    let msg_sizes = env_usize_list("MSG_SIZES", &[64, 256, 1024, 4096, 8192]);
+    let iterations = env_usize("ITERATIONS", 100_000);
+    let warmup = env_usize("WARMUP", 1000);
+    let window = env_usize("WINDOW", 32);
+    let mode = match env::var("MODE").as_deref() {
+        Err(..) | Ok("zerocopy") => Mode::ZeroCopy,
+        Ok("copy") => Mode::Copy,
+        Ok(s) => panic!("MODE must be zerocopy or copy, not {:?}", s),
+    };
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(Protocol::Tcp);
+        bench.run_echo_server(Protocol::Tcp, fd);
+    }
+
+    let fd = bench.connect();
+    for msg_size in msg_sizes {
+        run(&mut bench, fd, mode, msg_size, warmup, window);
+        let start = (Instant::now(), thread_cpu_time());
+        let pops = run(&mut bench, fd, mode, msg_size, iterations, window);
+        let elapsed = start.0.elapsed();
+        let cpu = thread_cpu_time() - start.1;
+
+        let secs = elapsed.as_secs_f64();
+        let bytes = msg_size * iterations;
+        println!(
+            "tcp_popcost mode={:?} msg_size={} window={} msgs={} pops={} elapsed_s={:.3} \
+             msgs_per_s={:.0} gbps={:.3} cpu_ns_per_pop={:.0}",
+            mode,
+            msg_size,
+            window,
+            iterations,
+            pops,
+            secs,
+            iterations as f64 / secs,
+            (bytes * 8) as f64 / secs / 1e9,
+            cpu.as_nanos() as f64 / pops as f64,
+        );
+    }
+}
+
+/// Sends `msgs` messages of `msg_size` bytes with up to `window` in flight, and pops until all of
+/// them have come back. Returns the number of pops.
+fn run(
+    bench: &mut Bench,
+    fd: FileDescriptor,
+    mode: Mode,
+    msg_size: usize,
+    msgs: usize,
+    window: usize,
+) -> usize {
+    let buf = mkbuf(msg_size, 0);
+    let total = msg_size * msgs;
+    let mut push_qts: Vec<dmtr_qtoken_t> = Vec::with_capacity(window);
+    let mut sent = 0;
+    let mut received = 0;
+    let mut pops = 0;
+    while received < total {
+        while sent < msgs && sent * msg_size - received < window * msg_size {
+            push_qts.push(bench.libos.push2(fd, buf.clone()).unwrap());
+            sent += 1;
+        }
+
+        // Pack the result the way `dmtr_wait` does for C callers.
+        let qt = bench.libos.pop(fd).unwrap();
+        let (qd, result) = bench.libos.wait2(qt);
+        let qr = dmtr_qresult_t::pack(bench.libos.rt(), result, qd, qt);
+        let sga = match qr.qr_opcode {
+            dmtr_opcode_t::DMTR_OPC_POP => unsafe { qr.qr_value.sga },
+            _ => panic!("failed to pop"),
+        };
+        let len = sga.sga_segs[0].sgaseg_len as usize;
+        if mode == Mode::Copy {
+            let copy = bench.libos.rt().alloc_sgarray(len);
+            unsafe {
+                ptr::copy_nonoverlapping(
+                    sga.sga_segs[0].sgaseg_buf as *const u8,
+                    copy.sga_segs[0].sgaseg_buf as *mut u8,
+                    len,
+                );
+            }
+            bench.libos.rt().free_sgarray(copy);
+        }
+        bench.libos.rt().free_sgarray(sga);
+        received += len;
+        pops += 1;
+
+        let libos = &mut bench.libos;
+        push_qts.retain(|&qt| libos.poll(qt).is_none());
+    }
+    for qt in push_qts {
+        bench.libos.wait(qt);
+    }
+    pops
+}
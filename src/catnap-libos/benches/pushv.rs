@@ -0,0 +1,120 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Sender CPU time per message for pushes issued one at a time and in batches.
+//!
+//! For each size in `BATCH_SIZES`, the client sends `ITERATIONS` messages of `MSG_SIZE` bytes to a
+//! TCP sink, after `WARMUP` unmeasured ones, a batch at a time: once with a `dmtr_push` per
+//! message, and once with a single `dmtr_pushv` per batch. Every batch is waited on before the
+//! next one is issued. With the `socket` backend, a batch from `dmtr_pushv` also goes out in one
+//! `sendmmsg` instead of a system call per packet.
+
+mod common;
+
+use common::{
+    env_usize,
+    env_usize_list,
+    is_server,
+    thread_cpu_time,
+    Bench,
+    CBench,
+    Protocol,
+};
+use demikernel::{
+    interop::{
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+    network,
+};
+use libc::c_int;
+use std::{
+    ptr,
+    time::Instant,
+};
+
+#[derive(Clone, Copy, Debug)]
+enum Mode {
+    Push,
+    Pushv,
+}
+
+fn main() {
+    let batch_sizes = env_usize_list("BATCH_SIZES", &[1, 8, 32]);
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let iterations = env_usize("ITERATIONS", 100_000);
+    let warmup = env_usize("WARMUP", 1000);
+
+    if is_server() {
+        let mut bench = Bench::new();
+        let fd = bench.bound_socket(Protocol::Tcp);
+        bench.run_sink(Protocol::Tcp, fd);
+    }
+
+    let bench = CBench::new();
+    let qd = bench.tcp_connect();
+    let mut sga = network::dmtr_sgaalloc(msg_size);
+    unsafe { ptr::write_bytes(sga.sga_segs[0].sgaseg_buf as *mut u8, 0, msg_size) };
+
+    for batch in batch_sizes {
+        for &mode in &[Mode::Push, Mode::Pushv] {
+            run(&bench, qd, &sga, mode, batch, warmup);
+            let start = (Instant::now(), thread_cpu_time());
+            let msgs = run(&bench, qd, &sga, mode, batch, iterations);
+            let elapsed = start.0.elapsed();
+            let cpu = thread_cpu_time() - start.1;
+
+            let secs = elapsed.as_secs_f64();
+            println!(
+                "tcp_pushv mode={:?} batch={} msg_size={} msgs={} elapsed_s={:.3} \
+                 msgs_per_s={:.0} cpu_ns_per_msg={:.0}",
+                mode,
+                batch,
+                msg_size,
+                msgs,
+                secs,
+                msgs as f64 / secs,
+                cpu.as_nanos() as f64 / msgs as f64,
+            );
+        }
+    }
+    assert_eq!(network::dmtr_sgafree(&mut sga), 0);
+}
+
+/// Pushes at least `msgs` copies of `sga` to `qd`, `batch` at a time. Returns how many it pushed.
+fn run(
+    bench: &CBench,
+    qd: c_int,
+    sga: &dmtr_sgarray_t,
+    mode: Mode,
+    batch: usize,
+    msgs: usize,
+) -> usize {
+    let qds = vec![qd; batch];
+    let sgas = vec![*sga; batch];
+    let mut qts: Vec<dmtr_qtoken_t> = vec![0; batch];
+    let mut sent = 0;
+    while sent < msgs {
+        match mode {
+            Mode::Push => {
+                for qt in qts.iter_mut() {
+                    assert_eq!(network::dmtr_push(qt, qd, sga), 0);
+                }
+            },
+            Mode::Pushv => {
+                let ret = network::dmtr_pushv(
+                    qts.as_mut_ptr(),
+                    qds.as_ptr(),
+                    sgas.as_ptr(),
+                    batch as c_int,
+                );
+                assert_eq!(ret, 0);
+            },
+        }
+        for &qt in &qts {
+            bench.wait(qt);
+        }
+        sent += batch;
+    }
+    sent
+}
@@ -0,0 +1,142 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! CPU time per completion reported as a `dmtr_qresult_t` and as a `dmtr_qevent_t`.
+//!
+//! The client keeps `WINDOW` UDP messages of `MSG_SIZE` bytes in flight to the echo server until
+//! `ITERATIONS` have come back, after `WARMUP` unmeasured ones, once waiting on every push and pop
+//! with `dmtr_wait` and once with `dmtr_wait_event`. Popped arrays are freed as they are, so the
+//! difference between the two runs is what each completion costs to report.
+
+mod common;
+
+use common::{
+    env_usize,
+    is_server,
+    thread_cpu_time,
+    Bench,
+    CBench,
+    Protocol,
+};
+use demikernel::{
+    event::dmtr_qevent_t,
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+    network,
+};
+use libc::{
+    c_int,
+    sockaddr_in,
+};
+use std::{
+    collections::VecDeque,
+    mem,
+    ptr,
+    time::Instant,
+};
+
+#[derive(Clone, Copy, Debug)]
+enum Mode {
+    Result,
+    Event,
+}
+
+fn main() {
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let iterations = env_usize("ITERATIONS", 100_000);
+    let warmup = env_usize("WARMUP", 1000);
+    let window = env_usize("WINDOW", 32);
+
+    if is_server() {
+        let mut bench = Bench::new();
+        let fd = bench.bound_socket(Protocol::Udp);
+        bench.run_echo_server(Protocol::Udp, fd);
+    }
+
+    let bench = CBench::new();
+    let remote_addr = bench.remote_addr();
+    let qd = bench.udp_socket(0);
+    let sga = network::dmtr_sgaalloc(msg_size);
+    unsafe { ptr::write_bytes(sga.sga_segs[0].sgaseg_buf as *mut u8, 0, msg_size) };
+
+    for &mode in &[Mode::Result, Mode::Event] {
+        run(&bench, qd, &sga, &remote_addr, mode, window, warmup);
+        let start = (Instant::now(), thread_cpu_time());
+        let completions = run(&bench, qd, &sga, &remote_addr, mode, window, iterations);
+        let elapsed = start.0.elapsed();
+        let cpu = thread_cpu_time() - start.1;
+
+        let secs = elapsed.as_secs_f64();
+        println!(
+            "udp_qevent mode={:?} msg_size={} window={} msgs={} completions={} elapsed_s={:.3} \
+             msgs_per_s={:.0} cpu_ns_per_completion={:.0}",
+            mode,
+            msg_size,
+            window,
+            iterations,
+            completions,
+            secs,
+            iterations as f64 / secs,
+            cpu.as_nanos() as f64 / completions as f64,
+        );
+    }
+}
+
+/// Sends `msgs` messages with up to `window` in flight and waits for every push and for the
+/// replies. Returns the number of completions waited for.
+fn run(
+    bench: &CBench,
+    qd: c_int,
+    sga: &dmtr_sgarray_t,
+    remote_addr: &sockaddr_in,
+    mode: Mode,
+    window: usize,
+    msgs: usize,
+) -> usize {
+    let mut push_qts: VecDeque<dmtr_qtoken_t> = VecDeque::with_capacity(window);
+    let mut sent = 0;
+    let mut received = 0;
+    let mut completions = 0;
+    let mut pop_qt = bench.pop(qd);
+    while received < msgs {
+        while sent < msgs && sent - received < window {
+            push_qts.push_back(bench.pushto(qd, sga, remote_addr));
+            sent += 1;
+        }
+        while let Some(qt) = push_qts.pop_front() {
+            wait(mode, qt);
+            completions += 1;
+        }
+        wait(mode, pop_qt);
+        completions += 1;
+        received += 1;
+        if received < msgs {
+            pop_qt = bench.pop(qd);
+        }
+    }
+    completions
+}
+
+/// Waits for `qt` as `mode` says and frees whatever it popped.
+fn wait(mode: Mode, qt: dmtr_qtoken_t) {
+    match mode {
+        Mode::Result => {
+            let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+            assert_eq!(network::dmtr_wait(&mut qr, qt), 0);
+            if let dmtr_opcode_t::DMTR_OPC_POP = qr.qr_opcode {
+                assert_eq!(network::dmtr_sgafree(unsafe { &mut qr.qr_value.sga }), 0);
+            }
+        },
+        Mode::Event => {
+            let mut qe: dmtr_qevent_t = unsafe { mem::zeroed() };
+            assert_eq!(network::dmtr_wait_event(&mut qe, qt), 0);
+            if qe.qe_opcode == dmtr_opcode_t::DMTR_OPC_POP as u32 {
+                assert_eq!(network::dmtr_sgafree(unsafe { qe.qe_value.sga }), 0);
+            }
+        },
+    }
+}
@@ -0,0 +1,141 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Streaming TCP throughput across message sizes.
+//!
+//! For each size in `MSG_SIZES`, the client announces how many bytes it is about to send, keeps
+//! up to `WINDOW` pushes in flight until `ITERATIONS` messages are out, and stops the clock once
+//! the server acknowledges having received all of them. Latencies are per push.
+
+mod common;
+
+use catnip::{
+    file_table::FileDescriptor,
+    operations::OperationResult,
+};
+use common::{
+    env_usize,
+    env_usize_list,
+    mkbuf,
+    report,
+    Bench,
+    Protocol,
+};
+use demikernel::stats::LatencyHistogram;
+use std::{
+    collections::HashMap,
+    convert::TryInto,
+    time::Instant,
+};
+
+/// Bytes in the header that announces a run.
+const HEADER_SIZE: usize = 8;
+
+fn main() {
+    let msg_sizes = env_usize_list("MSG_SIZES", &[64, 256, 1024, 4096, 16384]);
+    let iterations = env_usize("ITERATIONS", 100_000);
+    let window = env_usize("WINDOW", 64);
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(Protocol::Tcp);
+        run_server(&mut bench, fd);
+    }
+
+    let fd = bench.connect();
+    for msg_size in msg_sizes {
+        let total = msg_size * iterations;
+        let header = mkbuf(HEADER_SIZE, total as u64);
+        let qt = bench.libos.push2(fd, header).unwrap();
+        bench.libos.wait(qt);
+
+        let buf = mkbuf(msg_size, 0);
+        let mut h = LatencyHistogram::new();
+        let mut in_flight = HashMap::new();
+        let mut qts = Vec::with_capacity(window);
+        let mut sent = 0;
+        let start = Instant::now();
+        while sent < iterations || !qts.is_empty() {
+            while sent < iterations && qts.len() < window {
+                let qt = bench.libos.push2(fd, buf.clone()).unwrap();
+                in_flight.insert(qt, Instant::now());
+                qts.push(qt);
+                sent += 1;
+            }
+            let (i, _, result) = bench.libos.wait_any2(&qts);
+            let qt = qts.swap_remove(i);
+            match result {
+                OperationResult::Push => {
+                    let t0 = in_flight.remove(&qt).unwrap();
+                    h.record(t0.elapsed().as_nanos() as u64);
+                },
+                _ => panic!("failed to push"),
+            }
+        }
+        // The server answers with a single byte once everything has arrived.
+        bench.recv_exact(fd, 1);
+
+        let label = format!("tcp_throughput msg_size={} window={}", msg_size, window);
+        report(&label, &h, start.elapsed(), iterations as u64, total as u64);
+    }
+}
+
+/// Where a connection is in its current run.
+#[derive(Default)]
+struct Run {
+    /// Header bytes received so far.
+    header: Vec<u8>,
+    /// Bytes still expected, once the header is in.
+    left: Option<usize>,
+}
+
+/// Sinks one run at a time per connection, acknowledging each with a single byte.
+fn run_server(bench: &mut Bench, listen_fd: FileDescriptor) -> ! {
+    let mut runs: HashMap<FileDescriptor, Run> = HashMap::new();
+    let mut qts = vec![bench.libos.accept(listen_fd).unwrap()];
+    loop {
+        let (i, fd, result) = bench.libos.wait_any2(&qts);
+        qts.swap_remove(i);
+        match result {
+            OperationResult::Accept(new_fd) => {
+                runs.insert(new_fd, Run::default());
+                qts.push(bench.libos.accept(listen_fd).unwrap());
+                qts.push(bench.libos.pop(new_fd).unwrap());
+            },
+            OperationResult::Pop(_, ref buf) if buf.len() == 0 => {
+                runs.remove(&fd);
+                bench.libos.close(fd).unwrap();
+            },
+            OperationResult::Pop(_, buf) => {
+                let run = runs.get_mut(&fd).unwrap();
+                let mut data = &buf[..];
+                while !data.is_empty() {
+                    match run.left {
+                        None => {
+                            let n = (HEADER_SIZE - run.header.len()).min(data.len());
+                            run.header.extend_from_slice(&data[..n]);
+                            data = &data[n..];
+                            if run.header.len() == HEADER_SIZE {
+                                let total = u64::from_le_bytes(run.header[..].try_into().unwrap());
+                                run.left = Some(total as usize);
+                                run.header.clear();
+                            }
+                        },
+                        Some(n) => {
+                            let consumed = n.min(data.len());
+                            data = &data[consumed..];
+                            run.left = Some(n - consumed);
+                        },
+                    }
+                    if run.left == Some(0) {
+                        run.left = None;
+                        qts.push(bench.libos.push2(fd, mkbuf(1, 0)).unwrap());
+                    }
+                }
+                qts.push(bench.libos.pop(fd).unwrap());
+            },
+            OperationResult::Push => {},
+            _ => panic!("unexpected result"),
+        }
+    }
+}
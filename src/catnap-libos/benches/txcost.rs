@@ -0,0 +1,85 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! CPU cost of sending small messages, per message and per packet.
+//!
+//! The client keeps `WINDOW` pushes in flight and sends `ITERATIONS` messages of `MSG_SIZE` bytes
+//! over `PROTO` (udp or tcp), after `WARMUP` unmeasured ones; the server only drains them. Costs
+//! are in CPU time of the client thread, so time spent blocked doesn't count, and packets are the
+//! ones the runtime sent, acknowledgements and retransmissions included.
+
+mod common;
+
+use common::{
+    env_usize,
+    mkbuf,
+    thread_cpu_time,
+    Bench,
+    Protocol,
+};
+use std::time::Instant;
+
+fn main() {
+    let proto = Protocol::from_env();
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let iterations = env_usize("ITERATIONS", 1_000_000);
+    let warmup = env_usize("WARMUP", 10_000);
+    let window = env_usize("WINDOW", 32);
+
+    let mut bench = Bench::new();
+    if bench.is_server() {
+        let fd = bench.bound_socket(proto);
+        bench.run_sink(proto, fd);
+    }
+
+    let remote_addr = bench.remote_addr();
+    let fd = match proto {
+        Protocol::Udp => bench.bound_socket(proto),
+        Protocol::Tcp => bench.connect(),
+    };
+    let buf = mkbuf(msg_size, 0);
+    let mut qts = Vec::with_capacity(window);
+    let mut start = (Instant::now(), thread_cpu_time(), bench.libos.rt().stats());
+    for i in 0..(warmup + iterations) {
+        if i == warmup {
+            for qt in qts.drain(..) {
+                bench.libos.wait(qt);
+            }
+            start = (Instant::now(), thread_cpu_time(), bench.libos.rt().stats());
+        }
+        if qts.len() == window {
+            let (ix, ..) = bench.libos.wait_any2(&qts);
+            qts.swap_remove(ix);
+        }
+        let qt = match proto {
+            Protocol::Udp => bench.libos.pushto2(fd, buf.clone(), remote_addr),
+            Protocol::Tcp => bench.libos.push2(fd, buf.clone()),
+        }
+        .unwrap();
+        qts.push(qt);
+    }
+    for qt in qts.drain(..) {
+        bench.libos.wait(qt);
+    }
+
+    let (start_time, start_cpu, start_stats) = start;
+    let elapsed = start_time.elapsed();
+    let cpu = thread_cpu_time() - start_cpu;
+    let packets = bench.libos.rt().stats().tx_packets - start_stats.tx_packets;
+    let name = match proto {
+        Protocol::Udp => "udp_txcost",
+        Protocol::Tcp => "tcp_txcost",
+    };
+    println!(
+        "{} msg_size={} msgs={} packets={} elapsed_s={:.3} cpu_s={:.3} cpu_ns_per_msg={:.0} \
+         cpu_ns_per_packet={:.0}",
+        name,
+        msg_size,
+        iterations,
+        packets,
+        elapsed.as_secs_f64(),
+        cpu.as_secs_f64(),
+        cpu.as_nanos() as f64 / iterations as f64,
+        cpu.as_nanos() as f64 / packets as f64
+    );
+}
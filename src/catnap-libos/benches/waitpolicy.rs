@@ -0,0 +1,110 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Round-trip latency and CPU utilization of each wait policy.
+//!
+//! For each policy in `POLICIES` (any of spin, pause and sleep), the client sends `ITERATIONS`
+//! UDP messages of `MSG_SIZE` bytes to the echo server, one every `INTERVAL_US` microseconds, and
+//! waits for each reply with `dmtr_wait`. It idles between messages in `dmtr_timedwait` on the
+//! pending pop, so that the policy decides what the thread does while nothing arrives, as in a
+//! lightly loaded process. Latencies are of the round trips; `cpu_util` is the client thread's CPU
+//! time over elapsed time.
+
+mod common;
+
+use common::{
+    env_usize,
+    is_server,
+    report,
+    thread_cpu_time,
+    Bench,
+    CBench,
+    Protocol,
+};
+use demikernel::{
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+    },
+    network,
+    stats::LatencyHistogram,
+    wait::{
+        self,
+        WaitPolicy,
+    },
+};
+use std::{
+    env,
+    mem,
+    ptr,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+fn main() {
+    let policies = env::var("POLICIES").unwrap_or_else(|_| "spin,pause,sleep".to_string());
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let iterations = env_usize("ITERATIONS", 10_000);
+    let interval = Duration::from_micros(env_usize("INTERVAL_US", 1000) as u64);
+
+    if is_server() {
+        let mut bench = Bench::new();
+        let fd = bench.bound_socket(Protocol::Udp);
+        bench.run_echo_server(Protocol::Udp, fd);
+    }
+
+    let bench = CBench::new();
+    let remote_addr = bench.remote_addr();
+    let qd = bench.udp_socket(0);
+    let sga = network::dmtr_sgaalloc(msg_size);
+    unsafe { ptr::write_bytes(sga.sga_segs[0].sgaseg_buf as *mut u8, 0, msg_size) };
+    let timeout = libc::timespec {
+        tv_sec: interval.as_secs() as libc::time_t,
+        tv_nsec: interval.subsec_nanos() as libc::c_long,
+    };
+
+    for name in policies.split(',') {
+        wait::set_policy(WaitPolicy::parse(Some(name), None, None));
+        let mut h = LatencyHistogram::new();
+        let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+        let mut pop_qt = bench.pop(qd);
+        let start = (Instant::now(), thread_cpu_time());
+        for _ in 0..iterations {
+            // Nothing is in flight, so this only idles.
+            let ret = network::dmtr_timedwait(&mut qr, pop_qt, &timeout);
+            assert_eq!(ret, libc::ETIMEDOUT);
+
+            let t0 = Instant::now();
+            bench.wait(bench.pushto(qd, &sga, &remote_addr));
+            qr = bench.wait(pop_qt);
+            h.record(t0.elapsed().as_nanos() as u64);
+            match qr.qr_opcode {
+                dmtr_opcode_t::DMTR_OPC_POP => {
+                    assert_eq!(network::dmtr_sgafree(unsafe { &mut qr.qr_value.sga }), 0)
+                },
+                _ => panic!("failed to pop"),
+            }
+            pop_qt = bench.pop(qd);
+        }
+        let elapsed = start.0.elapsed();
+        let cpu = thread_cpu_time() - start.1;
+        assert_eq!(network::dmtr_drop(pop_qt), 0);
+
+        let label = format!(
+            "udp_waitpolicy policy={} msg_size={} interval_us={} cpu_util={:.3}",
+            name,
+            msg_size,
+            interval.as_micros(),
+            cpu.as_secs_f64() / elapsed.as_secs_f64(),
+        );
+        report(
+            &label,
+            &h,
+            elapsed,
+            iterations as u64,
+            (2 * iterations * msg_size) as u64,
+        );
+    }
+}
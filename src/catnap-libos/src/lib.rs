@@ -6,55 +6,47 @@
 #![feature(maybe_uninit_uninit_array, new_uninit)]
 #![feature(try_blocks)]
 
+pub mod mmsg;
+pub mod packet_ring;
 pub mod runtime;
 
 use anyhow::Error;
 use catnip::{
-    file_table::FileDescriptor,
-    interop::{
-        dmtr_qresult_t,
-        dmtr_qtoken_t,
-        dmtr_sgarray_t,
-    },
+    collections::bytes::Bytes,
     libos::LibOS,
     logging,
-    protocols::{
-        ip,
-        ipv4,
-    },
-    runtime::Runtime,
 };
 use demikernel::{
     config::Config,
-    network::{
-        libos_network_init,
-        NetworkLibOS,
+    dispatch::{
+        self,
+        Dispatch,
+    },
+    file,
+    interop::dmtr_sgarray_t,
+    network::libos_network_init,
+    pool,
+    sga,
+    shm,
+    stats::{
+        self,
+        RuntimeStats,
     },
+    wait,
 };
 use libc::{
     c_char,
     c_int,
-    sockaddr,
-    socklen_t,
 };
 use runtime::LinuxRuntime;
 use std::{
     cell::RefCell,
-    convert::TryFrom,
-    mem,
-    net::Ipv4Addr,
-    slice,
+    time::Duration,
 };
 
 thread_local! {
     static LIBOS: RefCell<Option<LibOS<LinuxRuntime>>> = RefCell::new(None);
 }
-fn with_libos<T>(f: impl FnOnce(&mut LibOS<LinuxRuntime>) -> T) -> T {
-    LIBOS.with(|l| {
-        let mut tls_libos = l.borrow_mut();
-        f(tls_libos.as_mut().expect("Uninitialized engine"))
-    })
-}
 
 //==============================================================================
 // init
@@ -65,12 +57,18 @@ pub fn catnap_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
     let r: Result<_, Error> = try {
         // Load config file.
         let config = Config::initialize(argc, argv)?;
+        wait::set_policy(config.wait_policy);
+        stats::set_track_latency(config.track_latency);
+        pool::configure(config.pool);
+        file::configure(config.file);
+        shm::configure(config.shm.clone());
 
         let rt = runtime::initialize_linux(
             config.local_link_addr,
             config.local_ipv4_addr,
             &config.local_interface_name,
             config.arp_table(),
+            runtime::IoBackend::from_config(&config)?,
         )
         .unwrap();
         LibOS::new(rt)?
@@ -90,291 +88,47 @@ pub fn catnap_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
         *tls_libos = Some(libos);
     });
 
-    libos_network_init(NetworkLibOS::new(
-        catnap_socket,
-        catnap_bind,
-        catnap_listen,
-        catnap_accept,
-        catnap_connect,
-        catnap_pushto,
-        catnap_drop,
-        catnap_close,
-        catnap_push,
-        catnap_wait,
-        catnap_wait_any,
-        catnap_poll,
-        catnap_pop,
-        catnap_sgaalloc,
-        catnap_sgafree,
-        catnap_getsockname,
-    ));
+    libos_network_init(dispatch::network_libos::<LinuxRuntime>());
 
     0
 }
 
 //==============================================================================
-// socket
-//==============================================================================
-
-pub fn catnap_socket(
-    qd_out: *mut c_int,
-    domain: c_int,
-    socket_type: c_int,
-    protocol: c_int,
-) -> c_int {
-    with_libos(|libos| match libos.socket(domain, socket_type, protocol) {
-        Ok(fd) => {
-            unsafe { *qd_out = fd as c_int };
-            0
-        },
-        Err(e) => {
-            eprintln!("dmtr_socket failed: {:?}", e);
-            e.errno()
-        },
-    })
-}
-
-//==============================================================================
-// bind
+// Trait Implementations
 //==============================================================================
 
-fn catnap_bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
-    if saddr.is_null() {
-        return libc::EINVAL;
-    }
-    if size as usize != mem::size_of::<libc::sockaddr_in>() {
-        return libc::EINVAL;
+// Pushes go through the kernel, which copies them anyway, so there is no memory to register.
+impl Dispatch for LinuxRuntime {
+    fn with_libos<T>(f: impl FnOnce(&mut LibOS<Self>) -> T) -> T {
+        LIBOS.with(|l| {
+            let mut tls_libos = l.borrow_mut();
+            f(tls_libos.as_mut().expect("Uninitialized engine"))
+        })
     }
-    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
-    let mut addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
-
-    with_libos(|libos| {
-        if addr.is_unspecified() {
-            addr = libos.rt().local_ipv4_addr();
-        }
-        let endpoint = ipv4::Endpoint::new(addr, port);
-        match libos.bind(qd as FileDescriptor, endpoint) {
-            Ok(..) => 0,
-            Err(e) => {
-                eprintln!("dmtr_bind failed: {:?}", e);
-                e.errno()
-            },
-        }
-    })
-}
-
-//==============================================================================
-// listen
-//==============================================================================
-
-fn catnap_listen(fd: c_int, backlog: c_int) -> c_int {
-    with_libos(
-        |libos| match libos.listen(fd as FileDescriptor, backlog as usize) {
-            Ok(..) => 0,
-            Err(e) => {
-                eprintln!("listen failed: {:?}", e);
-                e.errno()
-            },
-        },
-    )
-}
 
-//==============================================================================
-// accept
-//==============================================================================
-
-fn catnap_accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.accept(sockqd as FileDescriptor).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// connect
-//==============================================================================
-
-fn catnap_connect(
-    qtok_out: *mut dmtr_qtoken_t,
-    qd: c_int,
-    saddr: *const sockaddr,
-    size: socklen_t,
-) -> c_int {
-    if saddr.is_null() {
-        return libc::EINVAL;
-    }
-    if size as usize != mem::size_of::<libc::sockaddr_in>() {
-        return libc::EINVAL;
+    fn wait_for_rx(&self, timeout: Duration) {
+        LinuxRuntime::wait_for_rx(self, timeout)
     }
-    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
-    let addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
-    let endpoint = ipv4::Endpoint::new(addr, port);
-
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.connect(qd as FileDescriptor, endpoint).unwrap() };
-        0
-    })
-}
 
-//==============================================================================
-// close
-//==============================================================================
-
-fn catnap_close(qd: c_int) -> c_int {
-    with_libos(|libos| match libos.close(qd as FileDescriptor) {
-        Ok(..) => 0,
-        Err(e) => {
-            eprintln!("dmtr_close failed: {:?}", e);
-            e.errno()
-        },
-    })
-}
-
-//==============================================================================
-// push
-//==============================================================================
-
-fn catnap_push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
-    if sga.is_null() {
-        return libc::EINVAL;
+    fn stats(&self) -> RuntimeStats {
+        LinuxRuntime::stats(self)
     }
-    let sga = unsafe { &*sga };
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.push(qd as FileDescriptor, sga).unwrap() };
-        0
-    })
-}
 
-//==============================================================================
-// pushto
-//==============================================================================
-
-fn catnap_pushto(
-    qtok_out: *mut dmtr_qtoken_t,
-    qd: c_int,
-    sga: *const dmtr_sgarray_t,
-    saddr: *const sockaddr,
-    size: socklen_t,
-) -> c_int {
-    if sga.is_null() {
-        return libc::EINVAL;
+    fn into_sga(&self, buf: Bytes) -> dmtr_sgarray_t {
+        sga::bytes_into_sgarray(buf)
     }
-    let sga = unsafe { &*sga };
-    if saddr.is_null() {
-        return libc::EINVAL;
-    }
-    if size as usize != mem::size_of::<libc::sockaddr_in>() {
-        return libc::EINVAL;
-    }
-    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
-    let addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
-    let endpoint = ipv4::Endpoint::new(addr, port);
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.pushto(qd as FileDescriptor, sga, endpoint).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// pop
-//==============================================================================
-
-fn catnap_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.pop(qd as FileDescriptor).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// poll
-//==============================================================================
-
-fn catnap_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| match libos.poll(qt) {
-        None => libc::EAGAIN,
-        Some(r) => {
-            unsafe { *qr_out = r };
-            0
-        },
-    })
-}
-
-//==============================================================================
-// drop
-//==============================================================================
-
-fn catnap_drop(qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| {
-        libos.drop_qtoken(qt);
-        0
-    })
-}
 
-//==============================================================================
-// wait
-//==============================================================================
-
-fn catnap_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| {
-        let (qd, r) = libos.wait2(qt);
-        if !qr_out.is_null() {
-            let packed = dmtr_qresult_t::pack(libos.rt(), r, qd, qt);
-            unsafe { *qr_out = packed };
-        }
-        0
-    })
-}
-
-//==============================================================================
-// wait_any
-//==============================================================================
-
-fn catnap_wait_any(
-    qr_out: *mut dmtr_qresult_t,
-    ready_offset: *mut c_int,
-    qts: *mut dmtr_qtoken_t,
-    num_qts: c_int,
-) -> c_int {
-    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
-    with_libos(|libos| {
-        let (ix, qr) = libos.wait_any(qts);
-        unsafe {
-            *qr_out = qr;
-            *ready_offset = ix as c_int;
-        }
-        0
-    })
-}
-
-//==============================================================================
-// sgaalloc
-//==============================================================================
-
-fn catnap_sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
-    with_libos(|libos| libos.rt().alloc_sgarray(size))
-}
-
-//==============================================================================
-// sgafree
-//==============================================================================
+    // The body of a packet is a single buffer, so the segments of a vectored push are joined here.
+    fn clone_sga(&self, sga: &dmtr_sgarray_t) -> Bytes {
+        sga::gather_into_bytes(sga)
+    }
 
-fn catnap_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
-    if sga.is_null() {
-        return 0;
+    // Pushes that go out right away are batched into a single system call.
+    fn cork(&self) {
+        LinuxRuntime::cork(self)
     }
-    with_libos(|libos| {
-        libos.rt().free_sgarray(unsafe { *sga });
-        0
-    })
-}
-//==============================================================================
-// getsockname
-//==============================================================================
 
-fn catnap_getsockname(_qd: c_int, _saddr: *mut sockaddr, _size: *mut socklen_t) -> c_int {
-    unimplemented!();
+    fn uncork(&self) {
+        LinuxRuntime::uncork(self)
+    }
 }
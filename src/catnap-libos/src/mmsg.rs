@@ -0,0 +1,210 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Batched socket I/O for `AF_PACKET` sockets: a single `recvmmsg` fills up to
+//! `RECEIVE_BATCH_SIZE` frames, and transmitted frames are queued and sent with a single
+//! `sendmmsg`.
+
+use crate::runtime::MAX_HEADER_SIZE;
+use arrayvec::ArrayVec;
+use catnip::{
+    collections::bytes::{
+        Bytes,
+        BytesMut,
+    },
+    runtime::RECEIVE_BATCH_SIZE,
+};
+use socket2::SockAddr;
+use std::{
+    mem,
+    os::unix::io::RawFd,
+    ptr,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Size of each receive buffer, matching what the unbatched path reads into.
+const RX_BUFFER_SIZE: usize = 4096;
+
+type RxBuffer = Box<[u8; RX_BUFFER_SIZE]>;
+
+/// Number of frames that we queue before flushing them with `sendmmsg`.
+const TX_BATCH_SIZE: usize = 32;
+
+struct TxFrame {
+    header: [u8; MAX_HEADER_SIZE],
+    header_len: usize,
+    body: Option<Bytes>,
+    dest: SockAddr,
+}
+
+pub struct MmsgSocket {
+    fd: RawFd,
+    /// Buffers that `recvmmsg` reads into, allocated once. Frames are copied out of them into
+    /// buffers of their own size, which costs less than handing a fresh 4 KiB buffer up the stack
+    /// for every frame, however small.
+    rx_bufs: Vec<RxBuffer>,
+    tx_queue: Vec<TxFrame>,
+    /// Frames dropped because the socket stayed full across a flush.
+    tx_drops: usize,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl MmsgSocket {
+    /// The caller keeps ownership of `fd`, which must stay open (and nonblocking) for as long as
+    /// this is alive.
+    pub fn new(fd: RawFd) -> Self {
+        let rx_bufs = (0..RECEIVE_BATCH_SIZE)
+            .map(|_| Box::new([0_u8; RX_BUFFER_SIZE]))
+            .collect();
+        Self {
+            fd,
+            rx_bufs,
+            tx_queue: Vec::with_capacity(TX_BATCH_SIZE),
+            tx_drops: 0,
+        }
+    }
+
+    /// Like `new`, for a socket that only sends frames through this and receives them some other
+    /// way. `receive` must not be called on it.
+    pub fn tx_only(fd: RawFd) -> Self {
+        Self {
+            fd,
+            rx_bufs: Vec::new(),
+            tx_queue: Vec::with_capacity(TX_BATCH_SIZE),
+            tx_drops: 0,
+        }
+    }
+
+    /// Whether some queued frames have yet to be sent.
+    pub fn has_pending(&self) -> bool {
+        !self.tx_queue.is_empty()
+    }
+
+    pub fn tx_drops(&self) -> usize {
+        self.tx_drops
+    }
+
+    /// Reads up to `RECEIVE_BATCH_SIZE` frames with one syscall.
+    pub fn receive(&mut self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        let mut out = ArrayVec::new();
+        let mut iovecs: [libc::iovec; RECEIVE_BATCH_SIZE] = unsafe { mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; RECEIVE_BATCH_SIZE] = unsafe { mem::zeroed() };
+        for i in 0..RECEIVE_BATCH_SIZE {
+            iovecs[i].iov_base = self.rx_bufs[i].as_mut_ptr() as *mut libc::c_void;
+            iovecs[i].iov_len = RX_BUFFER_SIZE;
+            msgs[i].msg_hdr.msg_iov = &mut iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        let ret = unsafe {
+            libc::recvmmsg(
+                self.fd,
+                msgs.as_mut_ptr(),
+                RECEIVE_BATCH_SIZE as libc::c_uint,
+                libc::MSG_DONTWAIT,
+                ptr::null_mut(),
+            )
+        };
+        if ret <= 0 {
+            return out;
+        }
+
+        for i in 0..ret as usize {
+            let len = msgs[i].msg_len as usize;
+            out.push(BytesMut::from(&self.rx_bufs[i][..len]).freeze());
+        }
+        out
+    }
+
+    /// Queues a frame for transmission, flushing the queue once it holds a full batch. Returns
+    /// false if the frame was dropped because the queue stayed full.
+    pub fn transmit(&mut self, header: &[u8], body: Option<Bytes>, dest: SockAddr) -> bool {
+        if self.tx_queue.len() == TX_BATCH_SIZE {
+            self.flush_tx();
+            if self.tx_queue.len() == TX_BATCH_SIZE {
+                // The socket buffer is full. Drop the frame and let the upper layers recover.
+                self.tx_drops += 1;
+                return false;
+            }
+        }
+
+        let mut frame = TxFrame {
+            header: [0_u8; MAX_HEADER_SIZE],
+            header_len: header.len(),
+            body,
+            dest,
+        };
+        frame.header[..header.len()].copy_from_slice(header);
+        self.tx_queue.push(frame);
+
+        if self.tx_queue.len() == TX_BATCH_SIZE {
+            self.flush_tx();
+        }
+        true
+    }
+
+    /// Sends as much of the queue as the socket will take with one `sendmmsg`. Frames that didn't
+    /// make it stay queued for the next flush.
+    pub fn flush_tx(&mut self) {
+        if self.tx_queue.is_empty() {
+            return;
+        }
+
+        let n = self.tx_queue.len();
+        let mut iovecs: [[libc::iovec; 2]; TX_BATCH_SIZE] = unsafe { mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; TX_BATCH_SIZE] = unsafe { mem::zeroed() };
+        for (i, frame) in self.tx_queue.iter().enumerate() {
+            iovecs[i][0].iov_base = frame.header.as_ptr() as *mut libc::c_void;
+            iovecs[i][0].iov_len = frame.header_len;
+            let mut iovlen = 1;
+            if let Some(ref body) = frame.body {
+                iovecs[i][1].iov_base = body[..].as_ptr() as *mut libc::c_void;
+                iovecs[i][1].iov_len = body.len();
+                iovlen = 2;
+            }
+            let hdr = &mut msgs[i].msg_hdr;
+            hdr.msg_name = frame.dest.as_ptr() as *mut libc::c_void;
+            hdr.msg_namelen = frame.dest.len();
+            hdr.msg_iov = iovecs[i].as_mut_ptr();
+            hdr.msg_iovlen = iovlen;
+        }
+
+        let ret = unsafe {
+            libc::sendmmsg(
+                self.fd,
+                msgs.as_mut_ptr(),
+                n as libc::c_uint,
+                libc::MSG_DONTWAIT,
+            )
+        };
+        if ret > 0 {
+            self.tx_queue.drain(..ret as usize);
+        } else if ret < 0 {
+            match std::io::Error::last_os_error().raw_os_error() {
+                Some(libc::EAGAIN) | Some(libc::ENOBUFS) | Some(libc::EINTR) => (),
+                // Anything else is specific to the frame at the head of the queue, so drop it
+                // rather than let it block everything behind it.
+                _ => {
+                    self.tx_queue.remove(0);
+                    self.tx_drops += 1;
+                },
+            }
+        }
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for MmsgSocket {
+    fn drop(&mut self) {
+        self.flush_tx();
+    }
+}
@@ -0,0 +1,394 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Memory-mapped `PACKET_MMAP` (TPACKET_V3) rings for an `AF_PACKET` socket.
+//!
+//! The RX ring is a sequence of blocks that the kernel fills with frames and hands over one block
+//! at a time, so receiving is a matter of walking the current block with no syscalls. The TX ring
+//! is a sequence of fixed-size frames: frames are filled in place, marked as ready, and pushed out
+//! in bulk by a single zero-length `sendto`.
+
+use anyhow::{
+    format_err,
+    Error,
+};
+use arrayvec::ArrayVec;
+use catnip::{
+    collections::bytes::{
+        Bytes,
+        BytesMut,
+    },
+    runtime::RECEIVE_BATCH_SIZE,
+};
+use std::{
+    mem,
+    os::unix::io::RawFd,
+    ptr,
+    slice,
+    sync::atomic::{
+        AtomicU32,
+        Ordering,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+// These are not exported by the version of the libc crate that we depend on. Values come from
+// `linux/if_packet.h`.
+const SOL_PACKET: libc::c_int = 263;
+const PACKET_RX_RING: libc::c_int = 5;
+const PACKET_VERSION: libc::c_int = 10;
+const PACKET_TX_RING: libc::c_int = 13;
+const PACKET_QDISC_BYPASS: libc::c_int = 20;
+const TPACKET_V3: libc::c_int = 2;
+
+const TP_STATUS_KERNEL: u32 = 0;
+const TP_STATUS_USER: u32 = 1 << 0;
+const TP_STATUS_AVAILABLE: u32 = 0;
+const TP_STATUS_SEND_REQUEST: u32 = 1 << 0;
+const TP_STATUS_WRONG_FORMAT: u32 = 1 << 2;
+
+/// RX ring geometry: 64 blocks of 256 KiB.
+const RX_BLOCK_SIZE: u32 = 1 << 18;
+const RX_BLOCK_COUNT: u32 = 64;
+const RX_FRAME_SIZE: u32 = 1 << 11;
+
+/// How long (in milliseconds) the kernel may hold on to a partially filled RX block before handing
+/// it to us. This bounds the latency added by block batching when the link is lightly loaded.
+const RX_BLOCK_TIMEOUT_MS: u32 = 1;
+
+/// TX ring geometry: 1024 frames of 4 KiB.
+const TX_BLOCK_SIZE: u32 = 1 << 16;
+const TX_BLOCK_COUNT: u32 = 64;
+const TX_FRAME_SIZE: u32 = 1 << 12;
+
+/// Number of frames that we queue on the TX ring before asking the kernel to send them.
+const TX_BATCH_SIZE: usize = 32;
+
+/// Offset of the packet data in a TX frame: `TPACKET_ALIGN(sizeof(struct tpacket3_hdr))`.
+const TX_DATA_OFFSET: usize = (mem::size_of::<Tpacket3Hdr>() + 15) & !15;
+
+#[repr(C)]
+#[allow(dead_code)]
+struct TpacketReq3 {
+    tp_block_size: u32,
+    tp_block_nr: u32,
+    tp_frame_size: u32,
+    tp_frame_nr: u32,
+    tp_retire_blk_tov: u32,
+    tp_sizeof_priv: u32,
+    tp_feature_req_word: u32,
+}
+
+#[repr(C)]
+#[allow(dead_code)]
+struct TpacketBdTs {
+    ts_sec: u32,
+    ts_nsec: u32,
+}
+
+#[repr(C)]
+#[allow(dead_code)]
+struct TpacketHdrV1 {
+    block_status: u32,
+    num_pkts: u32,
+    offset_to_first_pkt: u32,
+    blk_len: u32,
+    seq_num: u64,
+    ts_first_pkt: TpacketBdTs,
+    ts_last_pkt: TpacketBdTs,
+}
+
+#[repr(C)]
+#[allow(dead_code)]
+struct TpacketBlockDesc {
+    version: u32,
+    offset_to_priv: u32,
+    hdr: TpacketHdrV1,
+}
+
+#[repr(C)]
+#[allow(dead_code)]
+struct Tpacket3Hdr {
+    tp_next_offset: u32,
+    tp_sec: u32,
+    tp_nsec: u32,
+    tp_snaplen: u32,
+    tp_len: u32,
+    tp_status: u32,
+    tp_mac: u16,
+    tp_net: u16,
+    hv1_rxhash: u32,
+    hv1_vlan_tci: u32,
+    hv1_vlan_tpid: u16,
+    hv1_padding: u16,
+    tp_padding: [u8; 8],
+}
+
+pub struct PacketRing {
+    fd: RawFd,
+    map: *mut u8,
+    map_len: usize,
+
+    /// Block that we are currently reading from.
+    rx_block: u32,
+    /// Packets left to read in `rx_block`, or zero if we don't own it yet.
+    rx_remaining: u32,
+    /// Offset of the next packet to read, relative to the start of `rx_block`.
+    rx_offset: usize,
+
+    /// Whether the kernel accepted a TX ring. Older kernels don't support TX rings with
+    /// TPACKET_V3, in which case we only use the RX ring.
+    tx_enabled: bool,
+    /// Next frame to be filled in.
+    tx_frame: u32,
+    /// Frames marked as ready since the last kick.
+    tx_pending: usize,
+    /// Frames that the kernel refused to send.
+    tx_rejected: usize,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl PacketRing {
+    /// Sets up the rings on `fd`, which must be an `AF_PACKET` raw socket that has not been used
+    /// for I/O yet. The caller keeps ownership of `fd`, and must keep it open for as long as the
+    /// ring is alive.
+    pub fn new(fd: RawFd) -> Result<Self, Error> {
+        setsockopt(fd, PACKET_VERSION, &TPACKET_V3)?;
+
+        let rx_req = TpacketReq3 {
+            tp_block_size: RX_BLOCK_SIZE,
+            tp_block_nr: RX_BLOCK_COUNT,
+            tp_frame_size: RX_FRAME_SIZE,
+            tp_frame_nr: (RX_BLOCK_SIZE / RX_FRAME_SIZE) * RX_BLOCK_COUNT,
+            tp_retire_blk_tov: RX_BLOCK_TIMEOUT_MS,
+            tp_sizeof_priv: 0,
+            tp_feature_req_word: 0,
+        };
+        setsockopt(fd, PACKET_RX_RING, &rx_req)?;
+
+        let tx_req = TpacketReq3 {
+            tp_block_size: TX_BLOCK_SIZE,
+            tp_block_nr: TX_BLOCK_COUNT,
+            tp_frame_size: TX_FRAME_SIZE,
+            tp_frame_nr: (TX_BLOCK_SIZE / TX_FRAME_SIZE) * TX_BLOCK_COUNT,
+            tp_retire_blk_tov: 0,
+            tp_sizeof_priv: 0,
+            tp_feature_req_word: 0,
+        };
+        let tx_enabled = match setsockopt(fd, PACKET_TX_RING, &tx_req) {
+            Ok(()) => true,
+            Err(e) => {
+                eprintln!("TX ring unavailable, falling back to sendmsg: {:?}", e);
+                false
+            },
+        };
+        if tx_enabled {
+            // Frames already carry their Ethernet header, so there's nothing for the qdisc layer
+            // to do. This is best effort.
+            let _ = setsockopt(fd, PACKET_QDISC_BYPASS, &(1 as libc::c_int));
+        }
+
+        let mut map_len = (RX_BLOCK_SIZE * RX_BLOCK_COUNT) as usize;
+        if tx_enabled {
+            map_len += (TX_BLOCK_SIZE * TX_BLOCK_COUNT) as usize;
+        }
+        let map = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                map_len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                0,
+            )
+        };
+        if map == libc::MAP_FAILED {
+            return Err(format_err!(
+                "mmap of packet ring failed: {:?}",
+                std::io::Error::last_os_error()
+            ));
+        }
+
+        Ok(Self {
+            fd,
+            map: map as *mut u8,
+            map_len,
+            rx_block: 0,
+            rx_remaining: 0,
+            rx_offset: 0,
+            tx_enabled,
+            tx_frame: 0,
+            tx_pending: 0,
+            tx_rejected: 0,
+        })
+    }
+
+    pub fn tx_rejected(&self) -> usize {
+        self.tx_rejected
+    }
+
+    /// Drains up to `RECEIVE_BATCH_SIZE` packets from the RX ring. Blocks are returned to the
+    /// kernel as soon as their last packet has been copied out.
+    pub fn receive(&mut self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        let mut out = ArrayVec::new();
+        while !out.is_full() {
+            let block = self.rx_block_ptr();
+            if self.rx_remaining == 0 {
+                let status = unsafe { status_ref(&(*block).hdr.block_status) };
+                if status.load(Ordering::Acquire) & TP_STATUS_USER == 0 {
+                    break;
+                }
+                unsafe {
+                    self.rx_remaining = (*block).hdr.num_pkts;
+                    self.rx_offset = (*block).hdr.offset_to_first_pkt as usize;
+                }
+                if self.rx_remaining == 0 {
+                    self.release_rx_block();
+                    continue;
+                }
+            }
+
+            unsafe {
+                let hdr = (block as *const u8).add(self.rx_offset) as *const Tpacket3Hdr;
+                let data = (hdr as *const u8).add((*hdr).tp_mac as usize);
+                let len = (*hdr).tp_snaplen as usize;
+                out.push(BytesMut::from(slice::from_raw_parts(data, len)).freeze());
+                self.rx_offset += (*hdr).tp_next_offset as usize;
+            }
+            self.rx_remaining -= 1;
+            if self.rx_remaining == 0 {
+                self.release_rx_block();
+            }
+        }
+        out
+    }
+
+    /// Copies a frame made of `header` followed by `body` into the TX ring. Returns false if the
+    /// frame could not be queued (no TX ring, ring full, or frame too large), in which case the
+    /// caller must send it some other way.
+    pub fn transmit(&mut self, header: &[u8], body: Option<&[u8]>) -> bool {
+        if !self.tx_enabled {
+            return false;
+        }
+        let body_len = body.map(|b| b.len()).unwrap_or(0);
+        let frame_len = header.len() + body_len;
+        if frame_len > TX_FRAME_SIZE as usize - TX_DATA_OFFSET {
+            return false;
+        }
+
+        let frame = self.tx_frame_ptr(self.tx_frame);
+        let status = unsafe { status_ref(&(*frame).tp_status) };
+        let s = status.load(Ordering::Acquire);
+        if s & TP_STATUS_WRONG_FORMAT != 0 {
+            // The kernel is done with this frame but refused to send it. Count it as dropped and
+            // take the frame back.
+            self.tx_rejected += 1;
+            status.store(TP_STATUS_AVAILABLE, Ordering::Relaxed);
+        } else if s != TP_STATUS_AVAILABLE {
+            // The kernel hasn't caught up with us yet. Nudge it and let the caller fall back.
+            self.flush_tx();
+            return false;
+        }
+
+        unsafe {
+            let data = (frame as *mut u8).add(TX_DATA_OFFSET);
+            ptr::copy_nonoverlapping(header.as_ptr(), data, header.len());
+            if let Some(body) = body {
+                ptr::copy_nonoverlapping(body.as_ptr(), data.add(header.len()), body.len());
+            }
+            (*frame).tp_len = frame_len as u32;
+        }
+        status.store(TP_STATUS_SEND_REQUEST, Ordering::Release);
+
+        self.tx_frame = (self.tx_frame + 1) % self.tx_frame_count();
+        self.tx_pending += 1;
+        if self.tx_pending >= TX_BATCH_SIZE {
+            self.flush_tx();
+        }
+        true
+    }
+
+    /// Asks the kernel to send every frame queued on the TX ring.
+    pub fn flush_tx(&mut self) {
+        if self.tx_pending == 0 {
+            return;
+        }
+        // A zero-length send on a socket with a TX ring transmits all frames marked as ready. If
+        // the kernel can't take them right now they stay queued and go out with the next kick.
+        let ret =
+            unsafe { libc::sendto(self.fd, ptr::null(), 0, libc::MSG_DONTWAIT, ptr::null(), 0) };
+        if ret >= 0 {
+            self.tx_pending = 0;
+        }
+    }
+
+    fn release_rx_block(&mut self) {
+        let block = self.rx_block_ptr();
+        let status = unsafe { status_ref(&(*block).hdr.block_status) };
+        status.store(TP_STATUS_KERNEL, Ordering::Release);
+        self.rx_block = (self.rx_block + 1) % RX_BLOCK_COUNT;
+    }
+
+    fn rx_block_ptr(&self) -> *mut TpacketBlockDesc {
+        unsafe { self.map.add((self.rx_block * RX_BLOCK_SIZE) as usize) as *mut _ }
+    }
+
+    fn tx_frame_count(&self) -> u32 {
+        (TX_BLOCK_SIZE / TX_FRAME_SIZE) * TX_BLOCK_COUNT
+    }
+
+    fn tx_frame_ptr(&self, frame: u32) -> *mut Tpacket3Hdr {
+        // The TX ring is mapped right after the RX ring. Frames never straddle blocks, and blocks
+        // are a whole number of frames, so frames can be indexed directly.
+        let offset = (RX_BLOCK_SIZE * RX_BLOCK_COUNT + frame * TX_FRAME_SIZE) as usize;
+        unsafe { self.map.add(offset) as *mut _ }
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for PacketRing {
+    fn drop(&mut self) {
+        self.flush_tx();
+        unsafe {
+            libc::munmap(self.map as *mut libc::c_void, self.map_len);
+        }
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+/// Status words are shared with the kernel, so they have to be accessed atomically.
+unsafe fn status_ref<'a>(status: *const u32) -> &'a AtomicU32 {
+    &*(status as *const AtomicU32)
+}
+
+fn setsockopt<T>(fd: RawFd, name: libc::c_int, value: &T) -> Result<(), Error> {
+    let ret = unsafe {
+        libc::setsockopt(
+            fd,
+            SOL_PACKET,
+            name,
+            value as *const T as *const libc::c_void,
+            mem::size_of::<T>() as libc::socklen_t,
+        )
+    };
+    if ret != 0 {
+        return Err(format_err!(
+            "setsockopt({}) failed: {:?}",
+            name,
+            std::io::Error::last_os_error()
+        ));
+    }
+    Ok(())
+}
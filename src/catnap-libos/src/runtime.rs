@@ -1,21 +1,29 @@
-use anyhow::Error;
+use crate::{
+    mmsg::MmsgSocket,
+    packet_ring::PacketRing,
+};
+use anyhow::{
+    format_err,
+    Error,
+};
 use arrayvec::ArrayVec;
 use catnip::{
     collections::bytes::{
         Bytes,
         BytesMut,
     },
-    interop::{
-        dmtr_sgarray_t,
-        dmtr_sgaseg_t,
-    },
+    interop::dmtr_sgarray_t,
     protocols::{
         arp,
         ethernet2::{
-            Ethernet2Header,
+            frame::ETHERNET2_HEADER_SIZE,
             MacAddress,
         },
-        tcp,
+        ipv4::datagram::IPV4_HEADER_SIZE,
+        tcp::{
+            self,
+            segment::MAX_TCP_HEADER_SIZE,
+        },
         udp,
     },
     runtime::{
@@ -34,6 +42,12 @@ use catnip::{
         WaitFuture,
     },
 };
+use demikernel::{
+    config::Config,
+    dispatch::Dispatch,
+    stats::RuntimeStats,
+    wait,
+};
 use futures::{
     Future,
     FutureExt,
@@ -58,14 +72,14 @@ use std::{
     collections::HashMap,
     convert::TryInto,
     fs,
+    io::IoSlice,
     mem::{
         self,
         MaybeUninit,
     },
     net::Ipv4Addr,
-    ptr,
+    os::unix::io::AsRawFd,
     rc::Rc,
-    slice,
     time::{
         Duration,
         Instant,
@@ -76,8 +90,24 @@ use std::{
 // Constants & Structures
 //==============================================================================
 
+/// Largest header that the network stack asks us to serialize in front of a body.
+pub(crate) const MAX_HEADER_SIZE: usize =
+    ETHERNET2_HEADER_SIZE + IPV4_HEADER_SIZE + MAX_TCP_HEADER_SIZE;
+
 // ETH_P_ALL must be converted to big-endian short but (due to a bug in Rust libc bindings) comes as an int.
 const ETH_P_ALL: libc::c_ushort = (libc::ETH_P_ALL as libc::c_ushort).to_be();
+
+/// How packets move between the raw socket and the network stack.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum IoBackend {
+    /// One `recvfrom`/`sendmsg` per packet.
+    Socket,
+    /// Batches of packets per `recvmmsg`/`sendmmsg`.
+    Mmsg,
+    /// Memory-mapped TPACKET_V3 RX/TX rings.
+    PacketMmap,
+}
+
 enum SockAddrPurpose {
     Bind,
     Send,
@@ -92,12 +122,23 @@ pub struct LinuxRuntime {
 pub struct Inner {
     pub timer: TimerRc,
     pub rng: SmallRng,
+    /// Declared ahead of `socket` so that they are torn down before the socket is closed.
+    pub ring: Option<PacketRing>,
+    pub mmsg: Option<MmsgSocket>,
+    /// With the `socket` backend, frames transmitted while corked are queued here and sent with a
+    /// single `sendmmsg` when uncorked.
+    pub tx_batch: Option<MmsgSocket>,
+    pub corked: bool,
     pub socket: Socket,
     pub ifindex: i32,
     pub link_addr: MacAddress,
     pub ipv4_addr: Ipv4Addr,
     pub tcp_options: tcp::Options<LinuxRuntime>,
     pub arp_options: arp::Options,
+    pub stats: RuntimeStats,
+    /// Link address of the last frame sent, with the socket address to send it to. Established
+    /// flows keep sending to the same neighbor, so this is built once rather than per packet.
+    pub tx_dest: Option<([u8; 6], SockAddr)>,
 }
 
 //==============================================================================
@@ -120,6 +161,75 @@ impl SockAddrPurpose {
     }
 }
 
+impl IoBackend {
+    /// Reads `catnap.io_backend` from the configuration, defaulting to `socket`.
+    pub fn from_config(config: &Config) -> Result<Self, Error> {
+        match config.config_obj["catnap"]["io_backend"].as_str() {
+            None => Ok(IoBackend::Socket),
+            Some(name) => Self::from_name(name),
+        }
+    }
+
+    /// Parses a backend name, as written in the configuration.
+    pub fn from_name(name: &str) -> Result<Self, Error> {
+        match name {
+            "socket" => Ok(IoBackend::Socket),
+            "mmsg" => Ok(IoBackend::Mmsg),
+            "packet_mmap" => Ok(IoBackend::PacketMmap),
+            s => Err(format_err!("Unknown catnap io_backend {:?}", s)),
+        }
+    }
+}
+
+impl Inner {
+    /// Sends a frame made of `header` followed by `body`, or queues it to be sent, through
+    /// whichever backend is set up. Returns false if the frame was dropped instead.
+    fn send_frame(&mut self, header: &[u8], body: Option<Bytes>) -> bool {
+        if let Some(ref mut ring) = self.ring {
+            if ring.transmit(header, body.as_ref().map(|b| &b[..])) {
+                return true;
+            }
+        }
+
+        // Frames start with the destination link address, which is all the kernel needs from the
+        // header.
+        let mut dest_addr = [0_u8; 6];
+        dest_addr.copy_from_slice(&header[..6]);
+        let dest_sockaddr = match self.tx_dest {
+            Some((addr, ref sockaddr)) if addr == dest_addr => sockaddr,
+            _ => {
+                let sockaddr = raw_sockaddr(SockAddrPurpose::Send, self.ifindex, &dest_addr);
+                &self.tx_dest.insert((dest_addr, sockaddr)).1
+            },
+        };
+
+        if let Some(ref mut mmsg) = self.mmsg {
+            return mmsg.transmit(header, body, dest_sockaddr.clone());
+        }
+        if let Some(ref mut tx_batch) = self.tx_batch {
+            // Frames still held back have to go out first.
+            if self.corked || tx_batch.has_pending() {
+                return tx_batch.transmit(header, body, dest_sockaddr.clone());
+            }
+        }
+
+        let header_slice = IoSlice::new(header);
+        let sent = match body {
+            Some(ref body) => self
+                .socket
+                .send_to_vectored(&[header_slice, IoSlice::new(&body[..])], dest_sockaddr),
+            None => self.socket.send_to_vectored(&[header_slice], dest_sockaddr),
+        };
+        if sent.is_err() {
+            // The socket buffer is full or the frame was refused. Drop it and let the upper layers
+            // recover, as the batched backends do.
+            self.stats.tx_drops += 1;
+            return false;
+        }
+        true
+    }
+}
+
 impl LinuxRuntime {
     pub fn new(
         now: Instant,
@@ -127,6 +237,7 @@ impl LinuxRuntime {
         ipv4_addr: Ipv4Addr,
         interface_name: &str,
         arp: HashMap<Ipv4Addr, MacAddress>,
+        io_backend: IoBackend,
     ) -> Self {
         let mut arp_options = arp::Options::default();
         arp_options.retry_count = 2;
@@ -147,6 +258,21 @@ impl LinuxRuntime {
             .parse()
             .unwrap();
 
+        // Rings have to be set up before the socket is bound, so that no packet is ever queued
+        // on the regular receive path.
+        let ring = match io_backend {
+            IoBackend::PacketMmap => Some(PacketRing::new(socket.as_raw_fd()).unwrap()),
+            _ => None,
+        };
+        let mmsg = match io_backend {
+            IoBackend::Mmsg => Some(MmsgSocket::new(socket.as_raw_fd())),
+            _ => None,
+        };
+        let tx_batch = match io_backend {
+            IoBackend::Socket => Some(MmsgSocket::tx_only(socket.as_raw_fd())),
+            _ => None,
+        };
+
         socket
             .bind(&raw_sockaddr(SockAddrPurpose::Bind, ifindex, &[0; 6]))
             .unwrap();
@@ -154,118 +280,88 @@ impl LinuxRuntime {
         let inner = Inner {
             timer: TimerRc(Rc::new(Timer::new(now))),
             rng: SmallRng::from_seed([0; 32]),
+            ring,
+            mmsg,
+            tx_batch,
+            corked: false,
             socket,
             ifindex,
             link_addr,
             ipv4_addr,
             tcp_options: tcp::Options::default(),
             arp_options,
+            stats: RuntimeStats::default(),
+            tx_dest: None,
         };
         Self {
             inner: Rc::new(RefCell::new(inner)),
             scheduler: Scheduler::new(),
         }
     }
-}
-
-//==============================================================================
-// Trait Implementations
-//==============================================================================
-
-impl Runtime for LinuxRuntime {
-    type Buf = Bytes;
-    type WaitFuture = WaitFuture<TimerRc>;
 
-    fn into_sgarray(&self, buf: Bytes) -> dmtr_sgarray_t {
-        let buf_copy: Box<[u8]> = (&buf[..]).into();
-        let ptr = Box::into_raw(buf_copy);
-        let sgaseg = dmtr_sgaseg_t {
-            sgaseg_buf: ptr as *mut _,
-            sgaseg_len: buf.len() as u32,
+    /// Blocks until the socket has incoming packets, for at most `timeout`. Queued transmits go
+    /// out first.
+    pub fn wait_for_rx(&self, timeout: Duration) {
+        let fd = {
+            let mut inner = self.inner.borrow_mut();
+            if let Some(ref mut ring) = inner.ring {
+                ring.flush_tx();
+            }
+            if let Some(ref mut mmsg) = inner.mmsg {
+                mmsg.flush_tx();
+            }
+            if let Some(ref mut tx_batch) = inner.tx_batch {
+                tx_batch.flush_tx();
+            }
+            inner.socket.as_raw_fd()
         };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
-        }
+        wait::poll_fd(fd, timeout);
     }
 
-    fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
-        let allocation: Box<[u8]> = unsafe { Box::new_uninit_slice(size).assume_init() };
-        let ptr = Box::into_raw(allocation);
-        let sgaseg = dmtr_sgaseg_t {
-            sgaseg_buf: ptr as *mut _,
-            sgaseg_len: size as u32,
-        };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
-        }
+    /// Holds back frames transmitted from now on until `uncork`, so that a burst of pushes goes
+    /// out in one system call. Only the `socket` backend needs this: the others batch anyway.
+    pub fn cork(&self) {
+        self.inner.borrow_mut().corked = true;
     }
 
-    fn free_sgarray(&self, sga: dmtr_sgarray_t) {
-        assert_eq!(sga.sga_numsegs, 1);
-        for i in 0..sga.sga_numsegs as usize {
-            let seg = &sga.sga_segs[i];
-            let allocation: Box<[u8]> = unsafe {
-                Box::from_raw(slice::from_raw_parts_mut(
-                    seg.sgaseg_buf as *mut _,
-                    seg.sgaseg_len as usize,
-                ))
-            };
-            drop(allocation);
+    /// Sends whatever was held back since `cork`.
+    pub fn uncork(&self) {
+        let mut inner = self.inner.borrow_mut();
+        inner.corked = false;
+        if let Some(ref mut tx_batch) = inner.tx_batch {
+            tx_batch.flush_tx();
         }
     }
 
-    fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Bytes {
-        let mut len = 0;
-        for i in 0..sga.sga_numsegs as usize {
-            len += sga.sga_segs[i].sgaseg_len;
+    pub fn stats(&self) -> RuntimeStats {
+        let inner = self.inner.borrow();
+        let mut stats = inner.stats;
+        if let Some(ref mmsg) = inner.mmsg {
+            stats.tx_drops += mmsg.tx_drops() as u64;
         }
-        let mut buf = BytesMut::zeroed(len as usize).unwrap();
-        let mut pos = 0;
-        for i in 0..sga.sga_numsegs as usize {
-            let seg = &sga.sga_segs[i];
-            let seg_slice = unsafe {
-                slice::from_raw_parts(seg.sgaseg_buf as *mut u8, seg.sgaseg_len as usize)
-            };
-            buf[pos..(pos + seg_slice.len())].copy_from_slice(seg_slice);
-            pos += seg_slice.len();
+        if let Some(ref tx_batch) = inner.tx_batch {
+            stats.tx_drops += tx_batch.tx_drops() as u64;
         }
-        buf.freeze()
+        if let Some(ref ring) = inner.ring {
+            stats.tx_drops += ring.tx_rejected() as u64;
+        }
+        stats
     }
 
-    fn transmit(&self, pkt: impl PacketBuf<Bytes>) {
-        let header_size = pkt.header_size();
-        let body_size = pkt.body_size();
-
-        let mut buf = BytesMut::zeroed(header_size + body_size).unwrap();
-
-        pkt.write_header(&mut buf[..header_size]);
-        if let Some(body) = pkt.take_body() {
-            buf[header_size..].copy_from_slice(&body[..]);
+    fn receive_batch(&self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        if let Some(ref mut ring) = self.inner.borrow_mut().ring {
+            // Push out whatever was queued since the last poll before looking for new packets.
+            ring.flush_tx();
+            return ring.receive();
+        }
+        if let Some(ref mut mmsg) = self.inner.borrow_mut().mmsg {
+            mmsg.flush_tx();
+            return mmsg.receive();
+        }
+        if let Some(ref mut tx_batch) = self.inner.borrow_mut().tx_batch {
+            tx_batch.flush_tx();
         }
 
-        let buf = buf.freeze();
-        let (header, _) = Ethernet2Header::parse(buf.clone()).unwrap();
-        let dest_addr_arr = header.dst_addr.to_array();
-        let dest_sockaddr = raw_sockaddr(
-            SockAddrPurpose::Send,
-            self.inner.borrow().ifindex,
-            &dest_addr_arr,
-        );
-
-        self.inner
-            .borrow()
-            .socket
-            .send_to(&buf, &dest_sockaddr)
-            .unwrap();
-    }
-
-    fn receive(&self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
         // 4096B buffer size chosen arbitrarily, seems fine for now.
         // This use-case is an example for MaybeUninit in the docs
         let mut out: [MaybeUninit<u8>; 4096] =
@@ -281,6 +377,60 @@ impl Runtime for LinuxRuntime {
             ArrayVec::new()
         }
     }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Runtime for LinuxRuntime {
+    type Buf = Bytes;
+    type WaitFuture = WaitFuture<TimerRc>;
+
+    // The C interface goes through the `Dispatch` hooks, with demikernel's arrays. These only
+    // serve catnip's own calls, whose arrays hold a single segment.
+    fn into_sgarray(&self, buf: Bytes) -> dmtr_sgarray_t {
+        self.into_sga(buf).narrow()
+    }
+
+    fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
+        self.alloc_sga(size).narrow()
+    }
+
+    fn free_sgarray(&self, sga: dmtr_sgarray_t) {
+        self.free_sga(&sga.into())
+    }
+
+    fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Bytes {
+        self.clone_sga(&(*sga).into())
+    }
+
+    fn transmit(&self, pkt: impl PacketBuf<Bytes>) {
+        // Headers are serialized on the stack. With a TX ring they are copied straight into a ring
+        // frame along with the body; otherwise they are handed to the kernel alongside the body,
+        // so the frame is gathered by `sendmsg`/`sendmmsg` instead of being copied into a staging
+        // buffer.
+        let header_size = pkt.header_size();
+        assert!(header_size <= MAX_HEADER_SIZE);
+        let mut header = [0_u8; MAX_HEADER_SIZE];
+        pkt.write_header(&mut header[..header_size]);
+        let body = pkt.take_body();
+
+        let len = header_size + body.as_ref().map_or(0, |b| b.len());
+        let mut inner = self.inner.borrow_mut();
+        if inner.send_frame(&header[..header_size], body) {
+            inner.stats.tx_packets += 1;
+            inner.stats.tx_bytes += len as u64;
+        }
+    }
+
+    fn receive(&self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        let batch = self.receive_batch();
+        let stats = &mut self.inner.borrow_mut().stats;
+        stats.rx_packets += batch.len() as u64;
+        stats.rx_bytes += batch.iter().map(|buf| buf.len() as u64).sum::<u64>();
+        batch
+    }
 
     fn scheduler(&self) -> &Scheduler<Operation<Self>> {
         &self.scheduler
@@ -379,6 +529,7 @@ pub fn initialize_linux(
     local_ipv4_addr: Ipv4Addr,
     interface_name: &str,
     arp_table: HashMap<Ipv4Addr, MacAddress>,
+    io_backend: IoBackend,
 ) -> Result<LinuxRuntime, Error> {
     Ok(LinuxRuntime::new(
         Instant::now(),
@@ -386,5 +537,6 @@ pub fn initialize_linux(
         local_ipv4_addr,
         interface_name,
         arp_table,
+        io_backend,
     ))
 }
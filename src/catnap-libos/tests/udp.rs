@@ -7,7 +7,10 @@ use anyhow::{
     format_err,
     Error,
 };
-use catnap_libos::runtime::LinuxRuntime;
+use catnap_libos::runtime::{
+    IoBackend,
+    LinuxRuntime,
+};
 use catnip::{
     collections::bytes::Bytes,
     file_table::FileDescriptor,
@@ -49,6 +52,7 @@ impl Test {
             config.local_ipv4_addr,
             &config.local_interface_name,
             config.arp_table(),
+            IoBackend::from_config(&config).unwrap(),
         )
         .unwrap();
         let libos = LibOS::new(rt).unwrap();
@@ -0,0 +1,163 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Shared-nothing scaling across DPDK queues.
+//!
+//! Meant for a device that hands each queue back whatever was sent on it, like the ring PMD
+//! (`--vdev=net_ring0` in `dpdk.eal_init`). `CORES` threads each claim a queue pair and build a
+//! LibOS of their own on it, then bounce `MSG_SIZE` byte UDP messages between two sockets of that
+//! LibOS for `DURATION` seconds, keeping `WINDOW` of them in flight. Runs with `CORES` set to 1, 2,
+//! 4 and 8 show how close to linearly the stack scales when cores share nothing.
+
+use catnip::{
+    file_table::FileDescriptor,
+    libos::LibOS,
+    operations::OperationResult,
+    protocols::{
+        ip::Port,
+        ipv4::Endpoint,
+    },
+    runtime::Runtime,
+};
+use catnip_libos::{
+    dpdk::{
+        initialize_dpdk_queues,
+        DPDKQueue,
+    },
+    memory::DPDKBuf,
+};
+use demikernel::config::Config;
+use dpdk_rs::load_mlx_driver;
+use std::{
+    convert::TryFrom,
+    env,
+    sync::{
+        Arc,
+        Barrier,
+    },
+    thread,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+/// Queue `i` uses UDP ports `BASE_PORT + 2 * i` and `BASE_PORT + 2 * i + 1`.
+const BASE_PORT: u16 = 20000;
+
+fn main() {
+    load_mlx_driver();
+    let config = Config::new(env::var("CONFIG_PATH").unwrap());
+    let cores = env_usize("CORES", 1);
+    let msg_size = env_usize("MSG_SIZE", 64);
+    let window = env_usize("WINDOW", 32);
+    let duration = Duration::from_secs(env_usize("DURATION", 10) as u64);
+    assert!(msg_size <= config.mss, "MSG_SIZE must fit in one segment");
+
+    let queues = initialize_dpdk_queues(
+        config.local_ipv4_addr,
+        &config.eal_init_args(),
+        config.arp_table(),
+        config.disable_arp,
+        config.use_jumbo_frames,
+        config.mtu,
+        config.mss,
+        config.tcp_checksum_offload,
+        config.udp_checksum_offload,
+        &config.mempool,
+        false,
+        u16::try_from(cores).unwrap(),
+    )
+    .unwrap();
+
+    // Cores start measuring together, once every LibOS is up.
+    let barrier = Arc::new(Barrier::new(cores));
+    let threads: Vec<_> = queues
+        .into_iter()
+        .map(|queue| {
+            let barrier = barrier.clone();
+            thread::spawn(move || run_core(queue, &barrier, msg_size, window, duration))
+        })
+        .collect();
+    let per_core: Vec<u64> = threads.into_iter().map(|t| t.join().unwrap()).collect();
+
+    let msgs: u64 = per_core.iter().sum();
+    let secs = duration.as_secs_f64();
+    println!(
+        "catnip_scaling cores={} msg_size={} window={} msgs={} msgs_per_s={:.0} \
+         msgs_per_s_per_core={:.0} slowest_core_msgs_per_s={:.0}",
+        cores,
+        msg_size,
+        window,
+        msgs,
+        msgs as f64 / secs,
+        msgs as f64 / secs / cores as f64,
+        *per_core.iter().min().unwrap() as f64 / secs,
+    );
+}
+
+/// Bounces messages between two sockets on `queue` until `duration` is up. Returns how many
+/// messages arrived.
+fn run_core(
+    queue: DPDKQueue,
+    barrier: &Barrier,
+    msg_size: usize,
+    window: usize,
+    duration: Duration,
+) -> u64 {
+    let queue_id = queue.queue_id();
+    let mut libos = LibOS::new(queue.into_runtime()).unwrap();
+    let local_ipv4_addr = libos.rt().local_ipv4_addr();
+    let mut ends: Vec<(FileDescriptor, Endpoint)> = Vec::with_capacity(2);
+    for i in 0..2 {
+        let port = Port::try_from(BASE_PORT + 2 * queue_id + i).unwrap();
+        let endpoint = Endpoint::new(local_ipv4_addr, port);
+        let fd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0).unwrap();
+        libos.bind(fd, endpoint).unwrap();
+        ends.push((fd, endpoint));
+    }
+
+    let mut mbuf = libos.rt().alloc_body_mbuf().unwrap();
+    mbuf.trim(mbuf.len() - msg_size);
+    let buf = DPDKBuf::Managed(mbuf);
+
+    barrier.wait();
+    let end = Instant::now() + duration;
+    let mut qts = vec![libos.pop(ends[0].0).unwrap(), libos.pop(ends[1].0).unwrap()];
+    for _ in 0..window {
+        qts.push(libos.pushto2(ends[0].0, buf.clone(), ends[1].1).unwrap());
+    }
+    let mut msgs = 0;
+    while Instant::now() < end {
+        let (i, qd, result) = libos.wait_any2(&qts);
+        qts.swap_remove(i);
+        match result {
+            OperationResult::Push => (),
+            OperationResult::Pop(..) => {
+                msgs += 1;
+                qts.push(libos.pop(qd).unwrap());
+                // Bounce it back to the other socket.
+                let (from, to) = if qd == ends[0].0 {
+                    (ends[0], ends[1])
+                } else {
+                    (ends[1], ends[0])
+                };
+                qts.push(libos.pushto2(from.0, buf.clone(), to.1).unwrap());
+            },
+            _ => panic!("unexpected result"),
+        }
+    }
+    for qt in qts {
+        libos.drop_qtoken(qt);
+    }
+    msgs
+}
+
+fn env_usize(name: &str, default: usize) -> usize {
+    match env::var(name) {
+        Ok(s) => s
+            .parse()
+            .unwrap_or_else(|_| panic!("{} must be a number", name)),
+        Err(..) => default,
+    }
+}
@@ -2,8 +2,12 @@ use crate::{
     memory::{
         MemoryConfig,
         MemoryManager,
+        MemoryPools,
+    },
+    runtime::{
+        ArpFanout,
+        DPDKRuntime,
     },
-    runtime::DPDKRuntime,
 };
 use anyhow::{
     bail,
@@ -11,6 +15,7 @@ use anyhow::{
     Error,
 };
 use catnip::protocols::ethernet2::MacAddress;
+use demikernel::config::MempoolConfig;
 use dpdk_rs::{
     rte_delay_us_block,
     rte_eal_init,
@@ -27,6 +32,7 @@ use dpdk_rs::{
     rte_eth_link_get_nowait,
     rte_eth_macaddr_get,
     rte_eth_promiscuous_enable,
+    rte_eth_rx_mq_mode_ETH_MQ_RX_NONE as ETH_MQ_RX_NONE,
     rte_eth_rx_mq_mode_ETH_MQ_RX_RSS as ETH_MQ_RX_RSS,
     rte_eth_rx_queue_setup,
     rte_eth_rxconf,
@@ -53,6 +59,7 @@ use std::{
     ffi::CString,
     mem::MaybeUninit,
     net::Ipv4Addr,
+    sync::Arc,
     time::Duration,
 };
 
@@ -67,6 +74,60 @@ macro_rules! expect_zero {
     }};
 }
 
+/// Descriptors in each RX and TX ring.
+const RX_RING_SIZE: u16 = 2048;
+const TX_RING_SIZE: u16 = 2048;
+
+/// Symmetric RSS key: repeating `0x6d5a` makes the Toeplitz hash invariant under swapping source
+/// and destination, so both directions of a flow are steered to the same queue (and thus the same
+/// core).
+const SYMMETRIC_RSS_KEY: [u8; 40] = [
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+];
+
+/// One RX/TX queue pair of the DPDK port together with the memory pools that back it. Queues are
+/// set up by `initialize_dpdk_queues` on whichever thread initializes DPDK and are then handed to
+/// the thread that will drive them, where `into_runtime` builds that thread's `DPDKRuntime`.
+pub struct DPDKQueue {
+    port_id: u16,
+    queue_id: u16,
+    pools: MemoryPools,
+    arp_fanout: Option<Arc<ArpFanout>>,
+    local_link_addr: MacAddress,
+    local_ipv4_addr: Ipv4Addr,
+    arp_table: HashMap<Ipv4Addr, MacAddress>,
+    disable_arp: bool,
+    mss: usize,
+    tcp_checksum_offload: bool,
+    udp_checksum_offload: bool,
+    rx_interrupts: bool,
+}
+
+impl DPDKQueue {
+    pub fn queue_id(&self) -> u16 {
+        self.queue_id
+    }
+
+    pub fn into_runtime(self) -> DPDKRuntime {
+        DPDKRuntime::new(
+            self.local_link_addr,
+            self.local_ipv4_addr,
+            self.port_id,
+            self.queue_id,
+            MemoryManager::from_pools(self.pools),
+            self.arp_fanout,
+            self.arp_table,
+            self.disable_arp,
+            self.mss,
+            self.tcp_checksum_offload,
+            self.udp_checksum_offload,
+            self.rx_interrupts,
+        )
+    }
+}
+
 pub fn initialize_dpdk(
     local_ipv4_addr: Ipv4Addr,
     eal_init_args: &[CString],
@@ -77,10 +138,53 @@ pub fn initialize_dpdk(
     mss: usize,
     tcp_checksum_offload: bool,
     udp_checksum_offload: bool,
+    mempool: &MempoolConfig,
+    rx_interrupts: bool,
 ) -> Result<DPDKRuntime, Error> {
+    let mut queues = initialize_dpdk_queues(
+        local_ipv4_addr,
+        eal_init_args,
+        arp_table,
+        disable_arp,
+        use_jumbo_frames,
+        mtu,
+        mss,
+        tcp_checksum_offload,
+        udp_checksum_offload,
+        mempool,
+        rx_interrupts,
+        1,
+    )?;
+    Ok(queues.remove(0).into_runtime())
+}
+
+/// Initializes DPDK and configures the first available port with `num_queues` RX/TX queue pairs,
+/// with incoming traffic spread across them by symmetric RSS. Each queue gets its own memory
+/// pools, sized by `mempool`. With `rx_interrupts`, the port raises an interrupt when packets
+/// arrive on an idle queue, which lets waiting threads block instead of polling. Returns one
+/// `DPDKQueue` per queue pair, ordered by queue id.
+pub fn initialize_dpdk_queues(
+    local_ipv4_addr: Ipv4Addr,
+    eal_init_args: &[CString],
+    arp_table: HashMap<Ipv4Addr, MacAddress>,
+    disable_arp: bool,
+    use_jumbo_frames: bool,
+    mtu: u16,
+    mss: usize,
+    tcp_checksum_offload: bool,
+    udp_checksum_offload: bool,
+    mempool: &MempoolConfig,
+    rx_interrupts: bool,
+    num_queues: u16,
+) -> Result<Vec<DPDKQueue>, Error> {
+    if num_queues == 0 {
+        bail!("At least one queue is required");
+    }
     std::env::set_var("MLX5_SHUT_UP_BF", "1");
-    std::env::set_var("MLX5_SINGLE_THREADED", "1");
-    std::env::set_var("MLX4_SINGLE_THREADED", "1");
+    if num_queues == 1 {
+        std::env::set_var("MLX5_SINGLE_THREADED", "1");
+        std::env::set_var("MLX4_SINGLE_THREADED", "1");
+    }
     let eal_init_refs = eal_init_args
         .iter()
         .map(|s| s.as_ptr() as *mut u8)
@@ -102,24 +206,30 @@ pub fn initialize_dpdk(
         memory_config.max_body_size =
             (RTE_ETHER_MAX_JUMBO_FRAME_LEN + RTE_PKTMBUF_HEADROOM) as usize;
     }
-    let memory_manager = MemoryManager::new(memory_config)?;
+    memory_config.configure(
+        mempool,
+        num_queues as usize,
+        mss,
+        RX_RING_SIZE as usize,
+        TX_RING_SIZE as usize,
+    );
+    let mut pools = Vec::with_capacity(num_queues as usize);
+    for queue_id in 0..num_queues {
+        pools.push(MemoryPools::new(memory_config, queue_id)?);
+    }
 
     let owner = RTE_ETH_DEV_NO_OWNER as u64;
     let port_id = unsafe { rte_eth_find_next_owned_by(0, owner) as u16 };
     initialize_dpdk_port(
         port_id,
-        &memory_manager,
+        &pools,
         use_jumbo_frames,
         mtu,
         tcp_checksum_offload,
         udp_checksum_offload,
+        rx_interrupts,
     )?;
 
-    // TODO: Where is this function?
-    // if unsafe { rte_lcore_count() } > 1 {
-    //     eprintln!("WARNING: Too many lcores enabled. Only 1 used.");
-    // }
-
     let local_link_addr = unsafe {
         let mut m: MaybeUninit<rte_ether_addr> = MaybeUninit::zeroed();
         // TODO: Why does bindgen say this function doesn't return an int?
@@ -130,33 +240,44 @@ pub fn initialize_dpdk(
         Err(format_err!("Invalid mac address"))?;
     }
 
-    Ok(DPDKRuntime::new(
-        local_link_addr,
-        local_ipv4_addr,
-        port_id,
-        memory_manager,
-        arp_table,
-        disable_arp,
-        mss,
-        tcp_checksum_offload,
-        udp_checksum_offload,
-    ))
+    let arp_fanout = match num_queues {
+        1 => None,
+        n => Some(Arc::new(ArpFanout::new(n as usize))),
+    };
+    let queues = pools
+        .into_iter()
+        .enumerate()
+        .map(|(queue_id, pools)| DPDKQueue {
+            port_id,
+            queue_id: queue_id as u16,
+            pools,
+            arp_fanout: arp_fanout.clone(),
+            local_link_addr,
+            local_ipv4_addr,
+            arp_table: arp_table.clone(),
+            disable_arp,
+            mss,
+            tcp_checksum_offload,
+            udp_checksum_offload,
+            rx_interrupts,
+        })
+        .collect();
+    Ok(queues)
 }
 
 fn initialize_dpdk_port(
     port_id: u16,
-    memory_manager: &MemoryManager,
+    pools: &[MemoryPools],
     use_jumbo_frames: bool,
     mtu: u16,
     tcp_checksum_offload: bool,
     udp_checksum_offload: bool,
+    rx_interrupts: bool,
 ) -> Result<(), Error> {
-    let rx_rings = 1;
-    let tx_rings = 1;
-    let rx_ring_size = 2048;
-    let tx_ring_size = 2048;
-    let nb_rxd = rx_ring_size;
-    let nb_txd = tx_ring_size;
+    let rx_rings = pools.len() as u16;
+    let tx_rings = pools.len() as u16;
+    let nb_rxd = RX_RING_SIZE;
+    let nb_txd = TX_RING_SIZE;
 
     let rx_pthresh = 8;
     let rx_hthresh = 8;
@@ -197,8 +318,17 @@ fn initialize_dpdk_port(
     if use_jumbo_frames {
         port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_JUMBO_FRAME as u64;
     }
-    port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
-    port_conf.rx_adv_conf.rss_conf.rss_hf = ETH_RSS_IP as u64 | dev_info.flow_type_rss_offloads;
+    // DPDK copies the key during `rte_eth_dev_configure`, so it only has to outlive that call.
+    let mut rss_key = SYMMETRIC_RSS_KEY;
+    // Devices without RSS, like the ring PMD, hand each queue whatever was sent to it.
+    if dev_info.flow_type_rss_offloads == 0 {
+        port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+    } else {
+        port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+        port_conf.rx_adv_conf.rss_conf.rss_hf = ETH_RSS_IP as u64 | dev_info.flow_type_rss_offloads;
+        port_conf.rx_adv_conf.rss_conf.rss_key = rss_key.as_mut_ptr();
+        port_conf.rx_adv_conf.rss_conf.rss_key_len = rss_key.len() as u8;
+    }
 
     port_conf.txmode.mq_mode = ETH_MQ_TX_NONE;
     if tcp_checksum_offload {
@@ -208,6 +338,9 @@ fn initialize_dpdk_port(
         port_conf.txmode.offloads |= DEV_TX_OFFLOAD_UDP_CKSUM as u64;
     }
     port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS as u64;
+    if rx_interrupts {
+        port_conf.intr_conf.set_rxq(1);
+    }
 
     let mut rx_conf: rte_eth_rxconf = unsafe { MaybeUninit::zeroed().assume_init() };
     rx_conf.rx_thresh.pthresh = rx_pthresh;
@@ -240,7 +373,7 @@ fn initialize_dpdk_port(
                 nb_rxd,
                 socket_id,
                 &rx_conf as *const _,
-                memory_manager.body_pool(),
+                pools[i as usize].body_pool(),
             ))?;
         }
         for i in 0..tx_rings {
@@ -3,60 +3,67 @@
 
 #![cfg_attr(feature = "strict", deny(warnings))]
 #![deny(clippy::all)]
-#![feature(maybe_uninit_uninit_array, new_uninit)]
+#![feature(maybe_uninit_uninit_array, new_uninit, once_cell)]
 #![feature(try_blocks)]
 
 pub mod dpdk;
 pub mod memory;
 pub mod runtime;
 
-use crate::runtime::DPDKRuntime;
+use crate::{
+    dpdk::DPDKQueue,
+    memory::DPDKBuf,
+    runtime::DPDKRuntime,
+};
 use anyhow::Error;
 use catnip::{
-    file_table::FileDescriptor,
-    interop::{
-        dmtr_qresult_t,
-        dmtr_qtoken_t,
-        dmtr_sgarray_t,
-    },
     libos::LibOS,
     logging,
-    protocols::{
-        ip,
-        ipv4,
-    },
-    runtime::Runtime,
 };
 use demikernel::{
     config::Config,
-    network::{
-        libos_network_init,
-        NetworkLibOS,
+    dispatch::{
+        self,
+        Dispatch,
+    },
+    file,
+    interop::{
+        dmtr_sgarray_t,
+        DMTR_SGARRAY_MAXSIZE,
+    },
+    network::libos_network_init,
+    pool,
+    shm,
+    stats::{
+        self,
+        RuntimeStats,
+    },
+    wait::{
+        self,
+        WaitPolicy,
     },
 };
 use libc::{
     c_char,
     c_int,
-    sockaddr,
-    socklen_t,
+    c_void,
 };
 use std::{
     cell::RefCell,
     convert::TryFrom,
-    mem,
-    net::Ipv4Addr,
-    slice,
+    lazy::SyncLazy,
+    sync::Mutex,
+    time::Duration,
 };
 
+/// Queue pairs that have been configured on the NIC but not yet claimed by a thread. The first call
+/// to `dmtr_init` initializes DPDK and fills this in; every call (including the first) then takes
+/// the lowest-numbered unclaimed queue and builds a `LibOS` for it on the calling thread.
+static DPDK_QUEUES: SyncLazy<Mutex<Option<Vec<DPDKQueue>>>> = SyncLazy::new(|| Mutex::new(None));
+
 thread_local! {
     static LIBOS: RefCell<Option<LibOS<DPDKRuntime>>> = RefCell::new(None);
 }
-fn with_libos<T>(f: impl FnOnce(&mut LibOS<DPDKRuntime>) -> T) -> T {
-    LIBOS.with(|l| {
-        let mut tls_libos = l.borrow_mut();
-        f(tls_libos.as_mut().expect("Uninitialized engine"))
-    })
-}
 
 //==============================================================================
 // init
@@ -72,18 +79,13 @@ pub fn catnip_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
     let r: Result<_, Error> = try {
         // Load config file.
         let config = Config::initialize(argc, argv)?;
+        wait::set_policy(config.wait_policy);
+        stats::set_track_latency(config.track_latency);
+        pool::configure(config.pool);
+        file::configure(config.file);
+        shm::configure(config.shm.clone());
 
-        let rt = self::dpdk::initialize_dpdk(
-            config.local_ipv4_addr,
-            &config.eal_init_args(),
-            config.arp_table(),
-            config.disable_arp,
-            config.use_jumbo_frames,
-            config.mtu,
-            config.mss,
-            config.tcp_checksum_offload,
-            config.udp_checksum_offload,
-        )?;
+        let rt = claim_dpdk_queue(&config)?.into_runtime();
         LibOS::new(rt)?
     };
 
@@ -101,292 +103,100 @@ pub fn catnip_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
         *tls_libos = Some(libos);
     });
 
-    libos_network_init(NetworkLibOS::new(
-        catnip_socket,
-        catnip_bind,
-        catnip_listen,
-        catnip_accept,
-        catnip_connect,
-        catnip_pushto,
-        catnip_drop,
-        catnip_close,
-        catnip_push,
-        catnip_wait,
-        catnip_wait_any,
-        catnip_poll,
-        catnip_pop,
-        catnip_sgaalloc,
-        catnip_sgafree,
-        catnip_getsockname,
-    ));
+    libos_network_init(dispatch::network_libos::<DPDKRuntime>());
 
     0
 }
 
-//==============================================================================
-// socket
-//==============================================================================
-
-pub fn catnip_socket(
-    qd_out: *mut c_int,
-    domain: c_int,
-    socket_type: c_int,
-    protocol: c_int,
-) -> c_int {
-    with_libos(|libos| match libos.socket(domain, socket_type, protocol) {
-        Ok(fd) => {
-            unsafe { *qd_out = fd as c_int };
-            0
-        },
-        Err(e) => {
-            eprintln!("dmtr_socket failed: {:?}", e);
-            e.errno()
-        },
-    })
-}
-
-//==============================================================================
-// bind
-//==============================================================================
-
-fn catnip_bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
-    if saddr.is_null() {
-        return libc::EINVAL;
+fn claim_dpdk_queue(config: &Config) -> Result<DPDKQueue, Error> {
+    let mut queues = DPDK_QUEUES.lock().unwrap();
+    if queues.is_none() {
+        let num_queues = u16::try_from(config.num_cores)?;
+        let mut q = self::dpdk::initialize_dpdk_queues(
+            config.local_ipv4_addr,
+            &config.eal_init_args(),
+            config.arp_table(),
+            config.disable_arp,
+            config.use_jumbo_frames,
+            config.mtu,
+            config.mss,
+            config.tcp_checksum_offload,
+            config.udp_checksum_offload,
+            &config.mempool,
+            // Only threads that sleep while they wait have any use for the interrupts.
+            matches!(config.wait_policy, WaitPolicy::Sleep { .. }),
+            num_queues,
+        )?;
+        // Hand queues out in ascending order.
+        q.reverse();
+        *queues = Some(q);
     }
-    if size as usize != mem::size_of::<libc::sockaddr_in>() {
-        return libc::EINVAL;
+    match queues.as_mut().unwrap().pop() {
+        Some(q) => Ok(q),
+        None => Err(anyhow::format_err!(
+            "All {} DPDK queues are already claimed",
+            config.num_cores
+        )),
     }
-    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
-    let mut addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
-
-    with_libos(|libos| {
-        if addr.is_unspecified() {
-            addr = libos.rt().local_ipv4_addr();
-        }
-        let endpoint = ipv4::Endpoint::new(addr, port);
-        match libos.bind(qd as FileDescriptor, endpoint) {
-            Ok(..) => 0,
-            Err(e) => {
-                eprintln!("dmtr_bind failed: {:?}", e);
-                e.errno()
-            },
-        }
-    })
 }
 
 //==============================================================================
-// listen
+// Trait Implementations
 //==============================================================================
 
-fn catnip_listen(fd: c_int, backlog: c_int) -> c_int {
-    with_libos(
-        |libos| match libos.listen(fd as FileDescriptor, backlog as usize) {
-            Ok(..) => 0,
-            Err(e) => {
-                eprintln!("listen failed: {:?}", e);
-                e.errno()
-            },
-        },
-    )
-}
-
-//==============================================================================
-// accept
-//==============================================================================
-
-fn catnip_accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.accept(sockqd as FileDescriptor).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// connect
-//==============================================================================
-
-fn catnip_connect(
-    qtok_out: *mut dmtr_qtoken_t,
-    qd: c_int,
-    saddr: *const sockaddr,
-    size: socklen_t,
-) -> c_int {
-    if saddr.is_null() {
-        return libc::EINVAL;
-    }
-    if size as usize != mem::size_of::<libc::sockaddr_in>() {
-        return libc::EINVAL;
+// Pushes send straight from registered memory, and from the mbuf pool otherwise, so they are
+// refused while the pool is short rather than starving receive.
+impl Dispatch for DPDKRuntime {
+    fn with_libos<T>(f: impl FnOnce(&mut LibOS<Self>) -> T) -> T {
+        LIBOS.with(|l| {
+            let mut tls_libos = l.borrow_mut();
+            f(tls_libos.as_mut().expect("Uninitialized engine"))
+        })
     }
-    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
-    let addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
-    let endpoint = ipv4::Endpoint::new(addr, port);
 
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.connect(qd as FileDescriptor, endpoint).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// close
-//==============================================================================
-
-fn catnip_close(qd: c_int) -> c_int {
-    with_libos(|libos| match libos.close(qd as FileDescriptor) {
-        Ok(..) => 0,
-        Err(e) => {
-            eprintln!("dmtr_close failed: {:?}", e);
-            e.errno()
-        },
-    })
-}
-
-//==============================================================================
-// push
-//==============================================================================
-
-fn catnip_push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
-    if sga.is_null() {
-        return libc::EINVAL;
+    fn wait_for_rx(&self, timeout: Duration) {
+        DPDKRuntime::wait_for_rx(self, timeout)
     }
-    let sga = unsafe { &*sga };
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.push(qd as FileDescriptor, sga).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// pushto
-//==============================================================================
 
-fn catnip_pushto(
-    qtok_out: *mut dmtr_qtoken_t,
-    qd: c_int,
-    sga: *const dmtr_sgarray_t,
-    saddr: *const sockaddr,
-    size: socklen_t,
-) -> c_int {
-    if sga.is_null() {
-        return libc::EINVAL;
-    }
-    let sga = unsafe { &*sga };
-    if saddr.is_null() {
-        return libc::EINVAL;
+    fn stats(&self) -> RuntimeStats {
+        DPDKRuntime::stats(self)
     }
-    if size as usize != mem::size_of::<libc::sockaddr_in>() {
-        return libc::EINVAL;
-    }
-    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
-    let addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
-    let endpoint = ipv4::Endpoint::new(addr, port);
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.pushto(qd as FileDescriptor, sga, endpoint).unwrap() };
-        0
-    })
-}
 
-//==============================================================================
-// pop
-//==============================================================================
-
-fn catnip_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
-    with_libos(|libos| {
-        unsafe { *qtok_out = libos.pop(qd as FileDescriptor).unwrap() };
-        0
-    })
-}
-
-//==============================================================================
-// poll
-//==============================================================================
+    fn low_on_buffers(&self) -> bool {
+        DPDKRuntime::low_on_buffers(self)
+    }
 
-fn catnip_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| match libos.poll(qt) {
-        None => libc::EAGAIN,
-        Some(r) => {
-            unsafe { *qr_out = r };
-            0
-        },
-    })
-}
+    // A chained receive comes back as a segment per `mbuf`, as long as the array has room.
+    fn into_sga(&self, buf: DPDKBuf) -> dmtr_sgarray_t {
+        self.memory_manager()
+            .into_sgarray(buf, DMTR_SGARRAY_MAXSIZE)
+    }
 
-//==============================================================================
-// drop
-//==============================================================================
+    // The segments of a vectored push are gathered into one body `mbuf`, since the stack needs
+    // bodies to be contiguous.
+    fn clone_sga(&self, sga: &dmtr_sgarray_t) -> DPDKBuf {
+        self.memory_manager().clone_sgarray(sga)
+    }
 
-fn catnip_drop(qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| {
-        libos.drop_qtoken(qt);
-        0
-    })
-}
+    fn alloc_sga(&self, size: usize) -> dmtr_sgarray_t {
+        self.memory_manager().alloc_sgarray(size)
+    }
 
-//==============================================================================
-// wait
-//==============================================================================
+    fn free_sga(&self, sga: &dmtr_sgarray_t) {
+        self.memory_manager().free_sgarray(*sga)
+    }
 
-fn catnip_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| {
-        let (qd, r) = libos.wait2(qt);
-        if !qr_out.is_null() {
-            let packed = dmtr_qresult_t::pack(libos.rt(), r, qd, qt);
-            unsafe { *qr_out = packed };
+    fn register_memory(&self, addr: *mut c_void, len: libc::size_t) -> c_int {
+        match DPDKRuntime::register_memory(self, addr, len) {
+            Ok(..) => 0,
+            Err(e) => e,
         }
-        0
-    })
-}
-
-//==============================================================================
-// wait_any
-//==============================================================================
+    }
 
-fn catnip_wait_any(
-    qr_out: *mut dmtr_qresult_t,
-    ready_offset: *mut c_int,
-    qts: *mut dmtr_qtoken_t,
-    num_qts: c_int,
-) -> c_int {
-    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
-    with_libos(|libos| {
-        let (ix, qr) = libos.wait_any(qts);
-        unsafe {
-            *qr_out = qr;
-            *ready_offset = ix as c_int;
+    fn unregister_memory(&self, addr: *mut c_void, len: libc::size_t) -> c_int {
+        match DPDKRuntime::unregister_memory(self, addr, len) {
+            Ok(..) => 0,
+            Err(e) => e,
         }
-        0
-    })
-}
-
-//==============================================================================
-// sgaalloc
-//==============================================================================
-
-fn catnip_sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
-    with_libos(|libos| libos.rt().alloc_sgarray(size))
-}
-
-//==============================================================================
-// sgafree
-//==============================================================================
-
-fn catnip_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
-    if sga.is_null() {
-        return 0;
     }
-    with_libos(|libos| {
-        libos.rt().free_sgarray(unsafe { *sga });
-        0
-    })
-}
-
-//==============================================================================
-// getsockname
-//==============================================================================
-
-fn catnip_getsockname(_qd: c_int, _saddr: *mut sockaddr, _size: *mut socklen_t) -> c_int {
-    unimplemented!();
 }
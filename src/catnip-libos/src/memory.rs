@@ -1,13 +1,10 @@
+use crate::runtime::RECEIVE_WINDOW_SIZE;
 use anyhow::Error;
 use catnip::{
     collections::bytes::{
         Bytes,
         BytesMut,
     },
-    interop::{
-        dmtr_sgarray_t,
-        dmtr_sgaseg_t,
-    },
     protocols::{
         ethernet2::frame::ETHERNET2_HEADER_SIZE,
         ipv4::datagram::IPV4_HEADER_SIZE,
@@ -15,16 +12,39 @@ use catnip::{
     },
     runtime::RuntimeBuf,
 };
+use demikernel::{
+    config::MempoolConfig,
+    interop::{
+        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
+    },
+    pool,
+    sga,
+};
 use dpdk_rs::{
+    rte_dev_dma_map,
+    rte_dev_dma_unmap,
+    rte_device,
+    rte_eal_iova_mode,
     rte_errno,
+    rte_eth_dev_info_get,
+    rte_extmem_register,
+    rte_extmem_unregister,
+    rte_iova_mode_RTE_IOVA_VA,
     rte_mbuf,
+    rte_mbuf_ext_refcnt_read,
+    rte_mbuf_ext_refcnt_set,
+    rte_mbuf_ext_refcnt_update,
+    rte_mbuf_ext_shared_info,
     rte_mempool,
+    rte_mempool_avail_count,
     rte_mempool_calc_obj_size,
     rte_mempool_mem_iter,
     rte_mempool_memhdr,
     rte_mempool_objsz,
     rte_pktmbuf_adj,
     rte_pktmbuf_alloc,
+    rte_pktmbuf_attach_extbuf,
     rte_pktmbuf_clone,
     rte_pktmbuf_free,
     rte_pktmbuf_pool_create,
@@ -33,20 +53,46 @@ use dpdk_rs::{
     rte_strerror,
 };
 use libc::{
+    c_int,
     c_uint,
     c_void,
 };
 use std::{
+    cell::{
+        Cell,
+        RefCell,
+    },
+    cmp,
+    collections::HashMap,
     ffi::CString,
-    mem,
+    fmt,
+    lazy::SyncLazy,
+    mem::{
+        self,
+        MaybeUninit,
+    },
     ops::Deref,
     ptr,
     rc::Rc,
     slice,
+    sync::Mutex,
 };
 
 const _RTE_PKTMBUF_HEADROOM: usize = 128;
 
+/// Largest per-core cache `rte_mempool` supports (`RTE_MEMPOOL_CACHE_MAX_SIZE`).
+const MEMPOOL_CACHE_MAX_SIZE: usize = 512;
+
+/// Pushes are refused once a pool is down to this fraction of its buffers. The rest is left for
+/// what the stack can't put off: acknowledgements, retransmissions and refilling the RX ring.
+const POOL_RESERVE_FRACTION: usize = 16;
+
+/// Application memory registered with DPDK, by address, with its length and the number of threads
+/// that registered it. DPDK's view of external memory is process-wide, while every thread has a
+/// `MemoryManager` of its own.
+static EXTMEM: SyncLazy<Mutex<HashMap<usize, (usize, usize)>>> =
+    SyncLazy::new(|| Mutex::new(HashMap::new()));
+
 #[derive(Clone, Copy, Debug)]
 pub struct MemoryConfig {
     /// What is the cutoff point for copying application buffers into reserved body space within a
@@ -83,30 +129,119 @@ impl Default for MemoryConfig {
     }
 }
 
+impl MemoryConfig {
+    /// Applies the `dpdk.mempool` section of the configuration to the pools of one of `num_queues`
+    /// queues. Pool sizes it leaves out are derived from the expected number of connections, if it
+    /// gives one, and otherwise keep their defaults.
+    pub fn configure(
+        &mut self,
+        mempool: &MempoolConfig,
+        num_queues: usize,
+        mss: usize,
+        rx_ring_size: usize,
+        tx_ring_size: usize,
+    ) {
+        if let Some(cache_size) = mempool.cache_size {
+            self.cache_size = cache_size;
+        }
+        if let Some(connections) = mempool.connections {
+            // RSS spreads connections evenly across queues, give or take.
+            let connections = (connections + num_queues - 1) / num_queues;
+            // Each connection can have a window's worth of segments waiting in either direction:
+            // received ones until the application frees them, and pushed ones until they are
+            // acknowledged.
+            let window = connections * ((RECEIVE_WINDOW_SIZE + mss - 1) / mss);
+            // A per-core cache holds up to one and a half times its size.
+            let cached = self.cache_size * 3 / 2;
+            // Every RX descriptor holds a body `mbuf`, and so does every copied segment on its way
+            // to the NIC.
+            self.body_pool_size = pool_size(rx_ring_size + tx_ring_size + 2 * window + cached);
+            // Pushed segments are cloned to be held for retransmission, and again to be sent.
+            self.indirect_pool_size = pool_size(tx_ring_size + window + cached);
+            // Headers only live until the NIC has sent them.
+            self.header_pool_size = pool_size(tx_ring_size + connections + cached);
+        }
+        self.header_pool_size = mempool.header_pool_size.unwrap_or(self.header_pool_size);
+        self.indirect_pool_size = mempool
+            .indirect_pool_size
+            .unwrap_or(self.indirect_pool_size);
+        self.body_pool_size = mempool.body_pool_size.unwrap_or(self.body_pool_size);
+
+        // `rte_mempool` rejects caches that could hold more than the pool.
+        let smallest = cmp::min(
+            self.header_pool_size,
+            cmp::min(self.indirect_pool_size, self.body_pool_size),
+        );
+        self.cache_size = cmp::min(
+            self.cache_size,
+            cmp::min(MEMPOOL_CACHE_MAX_SIZE, smallest * 2 / 3),
+        );
+    }
+}
+
+/// Rounds `n` up to one less than a power of two, the size `rte_mempool` stores most compactly.
+fn pool_size(n: usize) -> usize {
+    (n + 1).next_power_of_two() - 1
+}
+
 #[derive(Clone, Debug)]
 pub struct MemoryManager {
     inner: Rc<Inner>,
 }
 
-impl MemoryManager {
-    pub fn new(config: MemoryConfig) -> Result<Self, Error> {
+/// The DPDK memory pools behind a `MemoryManager`, before they are bound to the thread that will
+/// use them. Pools have to exist before the port is started, so in multi-queue mode they are
+/// created up front on the thread that initializes DPDK and then moved to their owning threads.
+#[derive(Debug)]
+pub struct MemoryPools {
+    inner: Inner,
+}
+
+// The pools are only ever used by one thread at a time: `MemoryPools` is consumed when it is turned
+// into a (non-`Send`) `MemoryManager`.
+unsafe impl Send for MemoryPools {}
+
+impl MemoryPools {
+    /// Creates a set of pools. `pool_id` disambiguates the (process-wide) pool names, so each
+    /// queue of a port needs its own.
+    pub fn new(config: MemoryConfig, pool_id: u16) -> Result<Self, Error> {
         Ok(Self {
-            inner: Rc::new(Inner::new(config)?),
+            inner: Inner::new(config, pool_id)?,
         })
     }
 
-    fn clone_mbuf(&self, mbuf: &Mbuf) -> Mbuf {
-        Mbuf {
-            ptr: self.inner.clone_mbuf(mbuf.ptr),
-            mm: self.clone(),
+    pub fn body_pool(&self) -> *mut rte_mempool {
+        self.inner.body_pool
+    }
+}
+
+impl MemoryManager {
+    pub fn new(config: MemoryConfig) -> Result<Self, Error> {
+        Ok(Self::from_pools(MemoryPools::new(config, 0)?))
+    }
+
+    pub fn from_pools(pools: MemoryPools) -> Self {
+        Self {
+            inner: Rc::new(pools.inner),
         }
     }
 
+    fn clone_mbuf(&self, mbuf: &Mbuf) -> Option<Mbuf> {
+        Some(Mbuf {
+            ptr: self.inner.clone_mbuf(mbuf.ptr)?,
+            mm: self.clone(),
+        })
+    }
+
     /// Given a pointer and length into a body `mbuf`, return a fresh indirect `mbuf` that points to
-    /// the same memory region, incrementing the refcount of the body `mbuf`.
-    pub fn clone_body(&self, ptr: *mut c_void, len: usize) -> Result<Mbuf, Error> {
+    /// the same memory region, incrementing the refcount of the body `mbuf`. Returns `None` if the
+    /// indirect pool is empty.
+    pub fn clone_body(&self, ptr: *mut c_void, len: usize) -> Result<Option<Mbuf>, Error> {
         let mbuf_ptr = self.recover_body_mbuf(ptr)?;
-        let body_clone = self.inner.clone_mbuf(mbuf_ptr);
+        let body_clone = match self.inner.clone_mbuf(mbuf_ptr) {
+            Some(body_clone) => body_clone,
+            None => return Ok(None),
+        };
 
         // Wrap the mbuf first so we free it on early exit.
         let mut mbuf = Mbuf {
@@ -139,7 +274,7 @@ impl MemoryManager {
         mbuf.adjust(adjust);
         mbuf.trim(trim);
 
-        Ok(mbuf)
+        Ok(Some(mbuf))
     }
 
     fn recover_body_mbuf(&self, ptr: *mut c_void) -> Result<*mut rte_mbuf, Error> {
@@ -169,136 +304,417 @@ impl MemoryManager {
         ptr_int >= self.inner.body_region_addr && ptr_int < body_end
     }
 
-    pub fn into_sgarray(&self, buf: DPDKBuf) -> dmtr_sgarray_t {
-        let sgaseg = match buf {
-            DPDKBuf::External(bytes) => {
-                // We have to do a copy here since `Bytes` uses an `Arc<[u8]>` internally and has
-                // some additional bookkeeping for an offset and length, but we want to be able to
-                // hand off a raw pointer up the application that they can free later.
-                let buf_copy: Box<[u8]> = (&bytes[..]).into();
-                let ptr = Box::into_raw(buf_copy);
-                dmtr_sgaseg_t {
-                    sgaseg_buf: ptr as *mut _,
-                    sgaseg_len: bytes.len() as u32,
+    /// Hands a received buffer to the application, as at most `max_segs` segments.
+    pub fn into_sgarray(&self, buf: DPDKBuf, max_segs: usize) -> dmtr_sgarray_t {
+        match buf {
+            // The application gets a pointer straight into the `Bytes`, which stays alive behind a
+            // handle in `sga_buf` until the array is freed.
+            DPDKBuf::External(bytes) => sga::bytes_into_sgarray(bytes),
+            DPDKBuf::Managed(mut mbuf) => {
+                // A chain with more `mbuf`s than that is copied out into a single segment instead.
+                if unsafe { (*mbuf.ptr()).nb_segs } as usize > max_segs {
+                    return dmtr_sgarray_t::new(&[linearize_chain(mbuf)]);
                 }
+                let mut sga = dmtr_sgarray_t::new(&[]);
+                // Otherwise a chained receive turns into one segment per `mbuf`. We unlink the
+                // chain as we go so that each segment can later be released on its own by
+                // `free_sgarray`.
+                let mut numsegs = 0;
+                let mut seg_ptr = mbuf.into_raw();
+                while !seg_ptr.is_null() {
+                    unsafe {
+                        let next_ptr = (*seg_ptr).next;
+                        (*seg_ptr).next = ptr::null_mut();
+                        (*seg_ptr).nb_segs = 1;
+                        (*seg_ptr).pkt_len = (*seg_ptr).data_len as u32;
+                        let buf_ptr = (*seg_ptr).buf_addr as *mut u8;
+                        sga.sga_segs[numsegs] = dmtr_sgaseg_t {
+                            sgaseg_buf: buf_ptr.offset((*seg_ptr).data_off as isize) as *mut _,
+                            sgaseg_len: (*seg_ptr).data_len as u32,
+                        };
+                        seg_ptr = next_ptr;
+                    }
+                    numsegs += 1;
+                }
+                sga.sga_numsegs = numsegs as u32;
+                sga
             },
-            DPDKBuf::Managed(mbuf) => {
-                let sgaseg = dmtr_sgaseg_t {
-                    sgaseg_buf: mbuf.data_ptr() as *mut _,
-                    sgaseg_len: mbuf.len() as u32,
-                };
-                mem::forget(mbuf);
-                sgaseg
-            },
-        };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
         }
     }
 
-    pub fn alloc_header_mbuf(&self) -> Mbuf {
-        let mbuf_ptr = unsafe { rte_pktmbuf_alloc(self.inner.header_pool) };
-        assert!(!mbuf_ptr.is_null());
-        unsafe {
-            let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
-            (*mbuf_ptr).data_len = num_bytes as u16;
-            (*mbuf_ptr).pkt_len = num_bytes as u32;
-        }
-        Mbuf {
-            ptr: mbuf_ptr,
-            mm: self.clone(),
-        }
+    /// Allocates a header `mbuf` spanning its whole data room, or returns `None` if the header pool
+    /// is empty.
+    pub fn alloc_header_mbuf(&self) -> Option<Mbuf> {
+        self.alloc_whole_mbuf(self.inner.header_pool)
     }
 
-    pub fn alloc_body_mbuf(&self) -> Mbuf {
-        let mbuf_ptr = unsafe { rte_pktmbuf_alloc(self.inner.body_pool) };
-        assert!(!mbuf_ptr.is_null());
+    /// Allocates a body `mbuf` spanning its whole data room, or returns `None` if the body pool is
+    /// empty.
+    pub fn alloc_body_mbuf(&self) -> Option<Mbuf> {
+        self.alloc_whole_mbuf(self.inner.body_pool)
+    }
+
+    fn alloc_whole_mbuf(&self, pool: *mut rte_mempool) -> Option<Mbuf> {
+        let mbuf_ptr = self.inner.alloc_mbuf(pool)?;
         unsafe {
             let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
             (*mbuf_ptr).data_len = num_bytes as u16;
             (*mbuf_ptr).pkt_len = num_bytes as u32;
         }
-        Mbuf {
+        Some(Mbuf {
             ptr: mbuf_ptr,
             mm: self.clone(),
-        }
+        })
     }
 
     pub fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
-        assert!(size <= self.inner.config.max_body_size);
-
-        let sgaseg = if self.inner.config.inline_body_size < size
-            && size <= self.inner.config.max_body_size
+        let config = &self.inner.config;
+        // Buffers the application holds could otherwise take the reserve that refills the RX ring.
+        if config.inline_body_size < size && size <= config.max_body_size && !self.low_on_buffers()
         {
-            let mbuf_ptr = unsafe { rte_pktmbuf_alloc(self.inner.body_pool) };
-            assert!(!mbuf_ptr.is_null());
-            unsafe {
-                let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
-                // We don't strictly have to set these fields, since we don't directly hand off body
-                // `mbuf`s to `rte_eth_tx_burst`, but it's nice to have the original allocation size around.
-                assert!(size as u16 <= num_bytes);
-                (*mbuf_ptr).data_len = size as u16;
-                (*mbuf_ptr).pkt_len = size as u32;
-                let buf_ptr = (*mbuf_ptr).buf_addr as *mut u8;
-                let data_ptr = buf_ptr.offset((*mbuf_ptr).data_off as isize);
-                dmtr_sgaseg_t {
-                    sgaseg_buf: data_ptr as *mut _,
-                    sgaseg_len: size as u32,
-                }
-            }
-        } else {
-            let allocation: Box<[u8]> = unsafe { Box::new_uninit_slice(size).assume_init() };
-            let ptr = Box::into_raw(allocation);
-            dmtr_sgaseg_t {
-                sgaseg_buf: ptr as *mut _,
-                sgaseg_len: size as u32,
+            if let Some(mbuf_ptr) = self.inner.alloc_mbuf(self.inner.body_pool) {
+                let sgaseg = unsafe {
+                    let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
+                    // We don't strictly have to set these fields, since we don't directly hand off
+                    // body `mbuf`s to `rte_eth_tx_burst`, but it's nice to have the original
+                    // allocation size around.
+                    assert!(size as u16 <= num_bytes);
+                    (*mbuf_ptr).data_len = size as u16;
+                    (*mbuf_ptr).pkt_len = size as u32;
+                    let buf_ptr = (*mbuf_ptr).buf_addr as *mut u8;
+                    let data_ptr = buf_ptr.offset((*mbuf_ptr).data_off as isize);
+                    dmtr_sgaseg_t {
+                        sgaseg_buf: data_ptr as *mut _,
+                        sgaseg_len: size as u32,
+                    }
+                };
+                return dmtr_sgarray_t::new(&[sgaseg]);
             }
-        };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
         }
+        // Small buffers get copied into a header `mbuf` on transmit anyway. Larger ones end up here
+        // when the pools are down to their reserve, and get copied into body `mbuf`s as they are
+        // sent.
+        let sgaseg = dmtr_sgaseg_t {
+            sgaseg_buf: pool::alloc(size) as *mut _,
+            sgaseg_len: size as u32,
+        };
+        dmtr_sgarray_t::new(&[sgaseg])
     }
 
     pub fn free_sgarray(&self, sga: dmtr_sgarray_t) {
-        assert_eq!(sga.sga_numsegs, 1);
-        let sgaseg = sga.sga_segs[0];
-        let (ptr, len) = (sgaseg.sgaseg_buf, sgaseg.sgaseg_len as usize);
-
-        if self.is_body_ptr(ptr) {
-            let mbuf_ptr = self.recover_body_mbuf(ptr).expect("Invalid sga pointer");
-            unsafe { rte_pktmbuf_free(mbuf_ptr) };
-        } else {
-            let allocation: Box<[u8]> =
-                unsafe { Box::from_raw(slice::from_raw_parts_mut(ptr as *mut _, len)) };
-            drop(allocation);
+        if sga::free_bytes_sgarray(&sga) {
+            return;
+        }
+        for sgaseg in sga.segments() {
+            let (ptr, len) = (sgaseg.sgaseg_buf, sgaseg.sgaseg_len as usize);
+
+            if self.is_body_ptr(ptr) {
+                let mbuf_ptr = self.recover_body_mbuf(ptr).expect("Invalid sga pointer");
+                unsafe { rte_pktmbuf_free(mbuf_ptr) };
+            } else {
+                unsafe { pool::free(ptr as *mut u8, len) };
+            }
         }
     }
 
     pub fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> DPDKBuf {
-        assert_eq!(sga.sga_numsegs, 1);
+        assert!(sga.sga_numsegs >= 1);
+        if let Some(bytes) = sga::clone_bytes_sgarray(sga) {
+            return DPDKBuf::External(bytes);
+        }
+        if sga.sga_numsegs > 1 {
+            return self.gather_sgarray(sga);
+        }
         let sgaseg = sga.sga_segs[0];
         let (ptr, len) = (sgaseg.sgaseg_buf, sgaseg.sgaseg_len as usize);
 
-        if self.is_body_ptr(ptr) {
-            let mbuf = self.clone_body(ptr, len).expect("Invalid sga pointer");
-            DPDKBuf::Managed(mbuf)
+        let mbuf = if self.is_body_ptr(ptr) {
+            self.clone_body(ptr, len).expect("Invalid sga pointer")
         } else {
-            let mut buf = BytesMut::zeroed(len).unwrap();
-            let seg_slice = unsafe { slice::from_raw_parts(ptr as *const u8, len) };
-            buf.copy_from_slice(seg_slice);
-            DPDKBuf::External(buf.freeze())
+            self.attach_registered(ptr, len)
+        };
+        match mbuf {
+            Some(mbuf) => DPDKBuf::Managed(mbuf),
+            // Memory we can't attach an `mbuf` to, or no indirect `mbuf`s left to attach.
+            None => {
+                let seg_slice = unsafe { slice::from_raw_parts(ptr as *const u8, len) };
+                DPDKBuf::External(copy_bytes(seg_slice))
+            },
         }
     }
 
+    /// Gathers a multi-segment scatter-gather array into a single buffer. The network stack needs
+    /// packet bodies to be contiguous, so this is where the segments of a vectored push get
+    /// joined; doing it here saves the application a copy and lands the data directly in a body
+    /// `mbuf` whenever it fits in one.
+    fn gather_sgarray(&self, sga: &dmtr_sgarray_t) -> DPDKBuf {
+        let segs = sga.segments();
+        let len = sga.len();
+
+        let mut pos = 0;
+        if len <= self.inner.config.max_body_size {
+            if let Some(mut mbuf) = self.alloc_body_mbuf() {
+                if len <= mbuf.len() {
+                    let out_slice = unsafe { mbuf.slice_mut() };
+                    for seg in segs {
+                        let seg_slice = unsafe {
+                            slice::from_raw_parts(
+                                seg.sgaseg_buf as *const u8,
+                                seg.sgaseg_len as usize,
+                            )
+                        };
+                        out_slice[pos..(pos + seg_slice.len())].copy_from_slice(seg_slice);
+                        pos += seg_slice.len();
+                    }
+                    mbuf.trim(mbuf.len() - len);
+                    return DPDKBuf::Managed(mbuf);
+                }
+            }
+        }
+
+        let mut buf = BytesMut::zeroed(len).unwrap();
+        for seg in segs {
+            let seg_slice = unsafe {
+                slice::from_raw_parts(seg.sgaseg_buf as *const u8, seg.sgaseg_len as usize)
+            };
+            buf[pos..(pos + seg_slice.len())].copy_from_slice(seg_slice);
+            pos += seg_slice.len();
+        }
+        DPDKBuf::External(buf.freeze())
+    }
+
     pub fn body_pool(&self) -> *mut rte_mempool {
         self.inner.body_pool
     }
+
+    /// Number of `mbuf`s left in the body pool.
+    pub fn body_pool_avail(&self) -> usize {
+        unsafe { rte_mempool_avail_count(self.inner.body_pool) as usize }
+    }
+
+    /// Whether any pool is down to its reserve, in which case pushes are refused with `ENOBUFS`
+    /// until the stack has sent or freed enough to get above it.
+    pub fn low_on_buffers(&self) -> bool {
+        let config = &self.inner.config;
+        let low = |pool: *mut rte_mempool, size: usize| {
+            (unsafe { rte_mempool_avail_count(pool) } as usize) < size / POOL_RESERVE_FRACTION
+        };
+        low(self.inner.header_pool, config.header_pool_size)
+            || low(self.inner.indirect_pool, config.indirect_pool_size)
+            || low(self.inner.body_pool, config.body_pool_size)
+    }
+
+    /// Number of times an allocation found its pool empty.
+    pub fn alloc_failures(&self) -> u64 {
+        self.inner.alloc_failures.get()
+    }
+
+    /// Registers `len` bytes of application memory at `addr` with DPDK and with the device behind
+    /// `port_id`. Pushes of buffers within the region then go out as mbufs attached to it instead
+    /// of as copies, so sent data must stay untouched until `unregister_memory` succeeds.
+    pub fn register_memory(
+        &self,
+        port_id: u16,
+        addr: *mut c_void,
+        len: usize,
+    ) -> Result<(), c_int> {
+        if addr.is_null() || len == 0 || addr as usize % page_size() != 0 || len % page_size() != 0
+        {
+            return Err(libc::EINVAL);
+        }
+        // An mbuf carries the address the device reads its data from. For memory that DPDK didn't
+        // allocate, we only know that address when it is the virtual one.
+        if unsafe { rte_eal_iova_mode() } != rte_iova_mode_RTE_IOVA_VA {
+            return Err(libc::ENOTSUP);
+        }
+        let (start, end) = (addr as usize, addr as usize + len);
+        let mut regions = self.inner.ext_regions.borrow_mut();
+        if regions
+            .iter()
+            .any(|r| start < r.addr + r.len && r.addr < end)
+        {
+            return Err(libc::EEXIST);
+        }
+        extmem_map(port_id, addr, len)?;
+        let mut shinfo: Box<rte_mbuf_ext_shared_info> = Box::new(unsafe { mem::zeroed() });
+        shinfo.free_cb = Some(ext_free_cb);
+        unsafe { rte_mbuf_ext_refcnt_set(&mut *shinfo, 1) };
+        regions.push(ExtRegion {
+            addr: start,
+            len,
+            shinfo,
+        });
+        Ok(())
+    }
+
+    /// Undoes `register_memory`. Fails with `EBUSY` while mbufs attached to the region are still
+    /// waiting for the NIC or held for retransmission.
+    pub fn unregister_memory(
+        &self,
+        port_id: u16,
+        addr: *mut c_void,
+        len: usize,
+    ) -> Result<(), c_int> {
+        let mut regions = self.inner.ext_regions.borrow_mut();
+        let ix = regions
+            .iter()
+            .position(|r| r.addr == addr as usize && r.len == len)
+            .ok_or(libc::ENOENT)?;
+        if regions[ix].in_flight() > 0 {
+            return Err(libc::EBUSY);
+        }
+        extmem_unmap(port_id, addr, len)?;
+        regions.swap_remove(ix);
+        Ok(())
+    }
+
+    /// Wraps `len` bytes at `ptr` in an mbuf attached to the registered region they lie in, if
+    /// there is one.
+    fn attach_registered(&self, ptr: *mut c_void, len: usize) -> Option<Mbuf> {
+        if len == 0 || len > u16::MAX as usize {
+            return None;
+        }
+        let mut regions = self.inner.ext_regions.borrow_mut();
+        let start = ptr as usize;
+        let region = regions
+            .iter_mut()
+            .find(|r| start >= r.addr && start + len <= r.addr + r.len)?;
+        // The reference count is 16 bits wide. Past that, we copy.
+        if region.in_flight() + 1 >= u16::MAX as usize {
+            return None;
+        }
+        let mbuf_ptr = self.inner.alloc_mbuf(self.inner.indirect_pool)?;
+        unsafe {
+            rte_mbuf_ext_refcnt_update(&mut *region.shinfo, 1);
+            // `register_memory` made sure that IOVAs are virtual addresses.
+            rte_pktmbuf_attach_extbuf(mbuf_ptr, ptr, start as u64, len as u16, &mut *region.shinfo);
+            (*mbuf_ptr).data_len = len as u16;
+            (*mbuf_ptr).pkt_len = len as u32;
+        }
+        Some(Mbuf {
+            ptr: mbuf_ptr,
+            mm: self.clone(),
+        })
+    }
+}
+
+/// Application memory registered through `MemoryManager::register_memory`.
+struct ExtRegion {
+    addr: usize,
+    len: usize,
+    /// Shared by every mbuf attached to the region. Its reference count is one for the
+    /// registration plus one per attached mbuf, so DPDK keeps count of what is in flight for us.
+    shinfo: Box<rte_mbuf_ext_shared_info>,
+}
+
+impl ExtRegion {
+    fn in_flight(&self) -> usize {
+        unsafe { rte_mbuf_ext_refcnt_read(&*self.shinfo) as usize - 1 }
+    }
+}
+
+impl fmt::Debug for ExtRegion {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("ExtRegion")
+            .field("addr", &self.addr)
+            .field("len", &self.len)
+            .field("in_flight", &self.in_flight())
+            .finish()
+    }
+}
+
+/// Called once the last mbuf attached to a region is freed, which never happens while it is
+/// registered: the registration holds a reference of its own.
+unsafe extern "C" fn ext_free_cb(_addr: *mut c_void, _opaque: *mut c_void) {}
+
+fn page_size() -> usize {
+    unsafe { libc::sysconf(libc::_SC_PAGESIZE) as usize }
+}
+
+fn port_device(port_id: u16) -> *mut rte_device {
+    unsafe {
+        let mut dev_info = MaybeUninit::zeroed();
+        rte_eth_dev_info_get(port_id, dev_info.as_mut_ptr());
+        dev_info.assume_init().device
+    }
+}
+
+/// Registers memory with DPDK and maps it for the port's device, unless another thread already
+/// did.
+fn extmem_map(port_id: u16, addr: *mut c_void, len: usize) -> Result<(), c_int> {
+    let mut extmem = EXTMEM.lock().unwrap();
+    if let Some((registered_len, count)) = extmem.get_mut(&(addr as usize)) {
+        if *registered_len != len {
+            return Err(libc::EEXIST);
+        }
+        *count += 1;
+        return Ok(());
+    }
+    unsafe {
+        if rte_extmem_register(addr, len as _, ptr::null_mut(), 0, page_size() as _) != 0 {
+            return Err(rte_errno());
+        }
+        // Devices that don't need memory mapped for them, such as virtual ones, say so with
+        // `ENOTSUP`.
+        if rte_dev_dma_map(port_device(port_id), addr, addr as u64, len as _) != 0
+            && rte_errno() != libc::ENOTSUP
+        {
+            let e = rte_errno();
+            rte_extmem_unregister(addr, len as _);
+            return Err(e);
+        }
+    }
+    extmem.insert(addr as usize, (len, 1));
+    Ok(())
+}
+
+fn extmem_unmap(port_id: u16, addr: *mut c_void, len: usize) -> Result<(), c_int> {
+    let mut extmem = EXTMEM.lock().unwrap();
+    let count = match extmem.get_mut(&(addr as usize)) {
+        Some((_, count)) => count,
+        None => return Err(libc::ENOENT),
+    };
+    *count -= 1;
+    if *count > 0 {
+        return Ok(());
+    }
+    extmem.remove(&(addr as usize));
+    unsafe {
+        rte_dev_dma_unmap(port_device(port_id), addr, addr as u64, len as _);
+        if rte_extmem_unregister(addr, len as _) != 0 {
+            return Err(rte_errno());
+        }
+    }
+    Ok(())
+}
+
+/// Copies `data` into a buffer of its own.
+fn copy_bytes(data: &[u8]) -> Bytes {
+    let mut buf = BytesMut::zeroed(data.len()).unwrap();
+    buf.copy_from_slice(data);
+    buf.freeze()
+}
+
+/// Copies the data of an `mbuf` chain into a pool buffer, and frees the chain.
+fn linearize_chain(mut mbuf: Mbuf) -> dmtr_sgaseg_t {
+    let len = unsafe { (*mbuf.ptr()).pkt_len } as usize;
+    let out_ptr = pool::alloc(len);
+    let mut pos = 0;
+    let mut seg_ptr = mbuf.ptr();
+    while !seg_ptr.is_null() {
+        unsafe {
+            let seg_len = (*seg_ptr).data_len as usize;
+            let buf_ptr = ((*seg_ptr).buf_addr as *mut u8).offset((*seg_ptr).data_off as isize);
+            ptr::copy_nonoverlapping(buf_ptr, out_ptr.add(pos), seg_len);
+            pos += seg_len;
+            seg_ptr = (*seg_ptr).next;
+        }
+    }
+    assert_eq!(pos, len);
+    dmtr_sgaseg_t {
+        sgaseg_buf: out_ptr as *mut _,
+        sgaseg_len: len as u32,
+    }
 }
 
 #[derive(Debug)]
@@ -330,10 +746,16 @@ struct Inner {
     //
     body_region_addr: usize,
     body_region_len: usize,
+
+    // Application memory that pushes can send from without a copy.
+    ext_regions: RefCell<Vec<ExtRegion>>,
+
+    // Allocations that found their pool empty.
+    alloc_failures: Cell<u64>,
 }
 
 impl Inner {
-    fn new(config: MemoryConfig) -> Result<Self, Error> {
+    fn new(config: MemoryConfig, pool_id: u16) -> Result<Self, Error> {
         let header_size = ETHERNET2_HEADER_SIZE + IPV4_HEADER_SIZE + MAX_TCP_HEADER_SIZE;
         let header_mbuf_size = header_size + config.inline_body_size;
         let priv_size = 0;
@@ -342,7 +764,7 @@ impl Inner {
             "Private data isn't supported (it adds another region between `rte_mbuf` and data)"
         );
         let header_pool = unsafe {
-            let name = CString::new("header_pool")?;
+            let name = CString::new(format!("header_pool_{}", pool_id))?;
             rte_pktmbuf_pool_create(
                 name.as_ptr(),
                 config.header_pool_size as u32,
@@ -358,7 +780,7 @@ impl Inner {
         }
 
         let indirect_pool = unsafe {
-            let name = CString::new("indirect_pool")?;
+            let name = CString::new(format!("indirect_pool_{}", pool_id))?;
             rte_pktmbuf_pool_create(
                 name.as_ptr(),
                 config.indirect_pool_size as u32,
@@ -375,7 +797,7 @@ impl Inner {
         }
 
         let body_pool = unsafe {
-            let name = CString::new("body_pool")?;
+            let name = CString::new(format!("body_pool_{}", pool_id))?;
             rte_pktmbuf_pool_create(
                 name.as_ptr(),
                 config.body_pool_size as u32,
@@ -445,6 +867,10 @@ impl Inner {
 
             body_region_addr: base_addr,
             body_region_len: total_len,
+
+            ext_regions: RefCell::new(Vec::new()),
+
+            alloc_failures: Cell::new(0),
         })
     }
 
@@ -452,16 +878,23 @@ impl Inner {
         64 + 128 + self.config.max_body_size
     }
 
-    fn alloc_indirect_empty(&self) -> *mut rte_mbuf {
-        let ptr = unsafe { rte_pktmbuf_alloc(self.indirect_pool) };
-        assert!(!ptr.is_null());
-        ptr
+    /// Takes an `mbuf` from `pool`, or returns `None` if it is empty.
+    fn alloc_mbuf(&self, pool: *mut rte_mempool) -> Option<*mut rte_mbuf> {
+        let ptr = unsafe { rte_pktmbuf_alloc(pool) };
+        self.check_alloc(ptr)
     }
 
-    fn clone_mbuf(&self, ptr: *mut rte_mbuf) -> *mut rte_mbuf {
+    fn clone_mbuf(&self, ptr: *mut rte_mbuf) -> Option<*mut rte_mbuf> {
         let ptr = unsafe { rte_pktmbuf_clone(ptr, self.indirect_pool) };
-        assert!(!ptr.is_null());
-        ptr
+        self.check_alloc(ptr)
+    }
+
+    fn check_alloc(&self, ptr: *mut rte_mbuf) -> Option<*mut rte_mbuf> {
+        if ptr.is_null() {
+            self.alloc_failures.set(self.alloc_failures.get() + 1);
+            return None;
+        }
+        Some(ptr)
     }
 }
 
@@ -492,7 +925,11 @@ impl Mbuf {
         let n = self.len();
         if ix == n {
             let empty = Self {
-                ptr: self.mm.inner.alloc_indirect_empty(),
+                ptr: self
+                    .mm
+                    .inner
+                    .alloc_mbuf(self.mm.inner.indirect_pool)
+                    .expect("Indirect pool exhausted"),
                 mm: self.mm.clone(),
             };
             return (self, empty);
@@ -528,11 +965,16 @@ impl Mbuf {
     pub fn ptr(&mut self) -> *mut rte_mbuf {
         self.ptr
     }
+
+    /// Clones the `mbuf`, or returns `None` if the indirect pool is empty.
+    pub fn try_clone(&self) -> Option<Self> {
+        self.mm.clone_mbuf(self)
+    }
 }
 
 impl Clone for Mbuf {
     fn clone(&self) -> Self {
-        self.mm.clone_mbuf(self)
+        self.try_clone().expect("Indirect pool exhausted")
     }
 }
 
@@ -556,12 +998,26 @@ impl Drop for Mbuf {
     }
 }
 
-#[derive(Clone, Debug)]
+#[derive(Debug)]
 pub enum DPDKBuf {
     External(Bytes),
     Managed(Mbuf),
 }
 
+impl Clone for DPDKBuf {
+    fn clone(&self) -> Self {
+        match self {
+            DPDKBuf::External(ref buf) => DPDKBuf::External(buf.clone()),
+            // The network stack clones segments it may have to retransmit. Without an indirect
+            // `mbuf` to share the data through, a copy does just as well.
+            DPDKBuf::Managed(ref mbuf) => match mbuf.try_clone() {
+                Some(mbuf) => DPDKBuf::Managed(mbuf),
+                None => DPDKBuf::External(copy_bytes(&mbuf[..])),
+            },
+        }
+    }
+}
+
 impl Deref for DPDKBuf {
     type Target = [u8];
 
@@ -600,11 +1056,27 @@ impl RuntimeBuf for DPDKBuf {
 #[cfg(test)]
 mod tests {
     use super::{
+        DPDKBuf,
         Mbuf,
+        MemoryConfig,
         MemoryManager,
+        MemoryPools,
+    };
+    use demikernel::{
+        config::MempoolConfig,
+        interop::dmtr_sgarray_t,
     };
     use dpdk_rs::*;
-    use std::ffi::CString;
+    use std::{
+        ffi::CString,
+        mem,
+        ptr,
+    };
+
+    /// `EXT_ATTACHED_MBUF` from `rte_mbuf_core.h`, which the bindings don't export: set in mbufs
+    /// whose data lives in an external buffer, such as registered application memory, instead of
+    /// in the mbuf itself.
+    const EXT_ATTACHED_MBUF: u64 = 1 << 61;
 
     #[test]
     #[ignore]
@@ -672,11 +1144,181 @@ mod tests {
         let data_ptr = unsafe { prefix.data_ptr().offset(10) as *mut libc::c_void };
         let data_len = 17;
 
-        let cloned_mbuf = mm.clone_body(data_ptr, data_len).unwrap();
+        let cloned_mbuf = mm.clone_body(data_ptr, data_len).unwrap().unwrap();
         assert_eq!(cloned_mbuf[0], 32);
         assert_eq!(cloned_mbuf.len(), 17);
         assert_eq!(unsafe { (*cloned_mbuf.ptr).ol_flags }, 1 << 62);
         drop(cloned_mbuf);
         drop(prefix);
     }
+
+    /// Starts DPDK with a null device, which takes packets without DMA, so tests run without a NIC.
+    fn init_null_eal() {
+        let eal_init_args: Vec<CString> = vec![
+            CString::new("-c").unwrap(),
+            CString::new("0x1").unwrap(),
+            CString::new("--no-pci").unwrap(),
+            CString::new("--vdev=net_null0").unwrap(),
+            CString::new("--iova-mode=va").unwrap(),
+        ];
+        let eal_init_refs = eal_init_args
+            .iter()
+            .map(|s| s.as_ptr() as *mut u8)
+            .collect::<Vec<_>>();
+        unsafe {
+            rte_eal_init(eal_init_refs.len() as i32, eal_init_refs.as_ptr() as *mut _);
+        }
+    }
+
+    #[test]
+    #[ignore]
+    fn test_registered_memory() {
+        init_null_eal();
+        let mm = MemoryManager::new(Default::default()).unwrap();
+        let port_id = 0;
+
+        // Step 1: Register a buffer the application allocated itself.
+        let len = 2 << 20;
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(addr, libc::MAP_FAILED);
+        assert_eq!(mm.register_memory(port_id, addr, len), Ok(()));
+        assert_eq!(mm.register_memory(port_id, addr, 4096), Err(libc::EEXIST));
+
+        // Step 2: A push from it turns into an mbuf attached to the application's memory.
+        let data_ptr = unsafe { (addr as *mut u8).add(100) };
+        let mut sga: dmtr_sgarray_t = unsafe { mem::zeroed() };
+        sga.sga_numsegs = 1;
+        sga.sga_segs[0].sgaseg_buf = data_ptr as *mut _;
+        sga.sga_segs[0].sgaseg_len = 3000;
+        let mbuf = match mm.clone_sgarray(&sga) {
+            DPDKBuf::Managed(mbuf) => mbuf,
+            DPDKBuf::External(..) => panic!("Registered memory was copied"),
+        };
+        assert_eq!(mbuf.data_ptr(), data_ptr);
+        assert_eq!(mbuf.len(), 3000);
+        assert_ne!(unsafe { (*mbuf.ptr).ol_flags } & EXT_ATTACHED_MBUF, 0);
+
+        // Step 3: Segments split off for transmission share it too, and hold it registered.
+        let (prefix, suffix) = mbuf.split(1000);
+        assert_eq!(suffix.data_ptr(), unsafe { data_ptr.add(1000) });
+        assert_eq!(mm.unregister_memory(port_id, addr, len), Err(libc::EBUSY));
+        drop(prefix);
+        assert_eq!(mm.unregister_memory(port_id, addr, len), Err(libc::EBUSY));
+        drop(suffix);
+        assert_eq!(mm.unregister_memory(port_id, addr, len), Ok(()));
+        assert_eq!(mm.unregister_memory(port_id, addr, len), Err(libc::ENOENT));
+
+        // Step 4: Once unregistered, the memory is copied again.
+        assert!(matches!(mm.clone_sgarray(&sga), DPDKBuf::External(..)));
+        unsafe { libc::munmap(addr, len) };
+    }
+
+    #[test]
+    fn test_configure() {
+        // 512 connections per queue, each with 45 full segments waiting in either direction.
+        let mut config = MemoryConfig::default();
+        let mempool = MempoolConfig {
+            connections: Some(1024),
+            body_pool_size: Some(4095),
+            ..Default::default()
+        };
+        config.configure(&mempool, 2, 1460, 2048, 2048);
+        assert_eq!(config.header_pool_size, 4095);
+        assert_eq!(config.indirect_pool_size, 32767);
+        assert_eq!(config.body_pool_size, 4095);
+        assert_eq!(config.cache_size, 250);
+
+        // Caches are cut down to what the smallest pool can back.
+        let mempool = MempoolConfig {
+            header_pool_size: Some(127),
+            cache_size: Some(1000),
+            ..Default::default()
+        };
+        config.configure(&mempool, 2, 1460, 2048, 2048);
+        assert_eq!(config.header_pool_size, 127);
+        assert_eq!(config.cache_size, 84);
+    }
+
+    #[test]
+    #[ignore]
+    fn test_pool_exhaustion() {
+        init_null_eal();
+        // Without caches, every allocation is visible in the pools' counts.
+        let config = MemoryConfig {
+            header_pool_size: 63,
+            indirect_pool_size: 63,
+            body_pool_size: 63,
+            cache_size: 0,
+            ..Default::default()
+        };
+        let mm = MemoryManager::from_pools(MemoryPools::new(config, 1).unwrap());
+
+        // Step 1: Take body mbufs until the pool is down to its reserve. Application buffers then
+        // come from the buffer pool, and pushes from them are copied.
+        let mut bodies = vec![];
+        while !mm.low_on_buffers() {
+            bodies.push(mm.alloc_body_mbuf().unwrap());
+        }
+        let avail = mm.body_pool_avail();
+        assert!(avail > 0);
+        let sga = mm.alloc_sgarray(4096);
+        assert!(!mm.is_body_ptr(sga.sga_segs[0].sgaseg_buf));
+        assert_eq!(mm.body_pool_avail(), avail);
+        assert!(matches!(mm.clone_sgarray(&sga), DPDKBuf::External(..)));
+        mm.free_sgarray(sga);
+
+        // Step 2: Drain the rest of the body pool. Allocations fail instead of aborting.
+        while let Some(mbuf) = mm.alloc_body_mbuf() {
+            bodies.push(mbuf);
+        }
+        assert_eq!(bodies.len(), 63);
+        assert_eq!(mm.alloc_failures(), 1);
+        assert_eq!(mm.body_pool_avail(), 0);
+
+        // Step 3: Drain the indirect pool with clones held for retransmission. Once it is empty,
+        // clones turn into copies.
+        let body = DPDKBuf::Managed(bodies.pop().unwrap());
+        let mut clones = vec![];
+        loop {
+            match body.clone() {
+                DPDKBuf::Managed(mbuf) => clones.push(mbuf),
+                DPDKBuf::External(bytes) => {
+                    assert_eq!(&bytes[..], &body[..]);
+                    break;
+                },
+            }
+        }
+        assert_eq!(clones.len(), 63);
+        assert_eq!(mm.alloc_failures(), 2);
+
+        // Step 4: Drain the header pool, as a stalled NIC would.
+        let mut headers = vec![];
+        while let Some(mbuf) = mm.alloc_header_mbuf() {
+            headers.push(mbuf);
+        }
+        assert_eq!(headers.len(), 63);
+        assert_eq!(mm.alloc_failures(), 3);
+
+        // Step 5: Once everything is back, pushes are accepted and go out without copies again.
+        drop(headers);
+        drop(clones);
+        drop(body);
+        drop(bodies);
+        assert_eq!(mm.body_pool_avail(), 63);
+        assert!(!mm.low_on_buffers());
+        let sga = mm.alloc_sgarray(4096);
+        assert!(mm.is_body_ptr(sga.sga_segs[0].sgaseg_buf));
+        assert!(matches!(mm.clone_sgarray(&sga), DPDKBuf::Managed(..)));
+        mm.free_sgarray(sga);
+        assert_eq!(mm.alloc_failures(), 3);
+    }
 }
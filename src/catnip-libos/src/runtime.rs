@@ -6,6 +6,7 @@ use crate::memory::{
 use arrayvec::ArrayVec;
 use catnip::{
     self,
+    collections::bytes::BytesMut,
     interop::dmtr_sgarray_t,
     protocols::{
         arp,
@@ -32,13 +33,26 @@ use catnip::{
         WaitFuture,
     },
 };
+use demikernel::stats::RuntimeStats;
 use dpdk_rs::{
+    rte_epoll_event,
+    rte_epoll_wait,
+    rte_eth_dev_rx_intr_ctl_q,
+    rte_eth_dev_rx_intr_disable,
+    rte_eth_dev_rx_intr_enable,
     rte_eth_rx_burst,
     rte_eth_tx_burst,
     rte_mbuf,
     rte_pktmbuf_chain,
+    rte_pktmbuf_free,
+    RTE_EPOLL_PER_THREAD,
+    RTE_INTR_EVENT_ADD,
 };
 use futures::FutureExt;
+use libc::{
+    c_int,
+    c_void,
+};
 use rand::{
     distributions::{
         Distribution,
@@ -51,20 +65,122 @@ use rand::{
 };
 use std::{
     cell::RefCell,
-    collections::HashMap,
+    cmp,
+    collections::{
+        HashMap,
+        VecDeque,
+    },
     future::Future,
     mem,
     net::Ipv4Addr,
+    ptr,
     rc::Rc,
+    sync::{
+        atomic::{
+            AtomicBool,
+            Ordering,
+        },
+        Arc,
+        Mutex,
+    },
+    thread,
     time::{
         Duration,
         Instant,
     },
 };
 
+/// How many packets we stage before handing them to the NIC in a single burst.
+const TX_BATCH_SIZE: usize = 32;
+
+/// Receive window the runtime advertises, which also bounds how much data a connection can have
+/// waiting in either direction.
+pub const RECEIVE_WINDOW_SIZE: usize = 0xffff;
+
+/// How many times we retry a burst that the TX ring only partially accepted before leaving the
+/// remainder staged for the next flush.
+const TX_RETRY_COUNT: usize = 4;
+
+/// How many forwarded ARP frames a queue holds at most. More are dropped, as on a full RX ring.
+const ARP_INBOX_SIZE: usize = 64;
+
+const ETHERTYPE_ARP: [u8; 2] = [0x08, 0x06];
+
 #[derive(Clone)]
 pub struct TimerRc(Rc<Timer<TimerRc>>);
 
+/// ARP frames on their way from queue 0 to the other queues of a port. RSS only spreads IP traffic,
+/// so the NIC delivers all ARP frames to queue 0, but each queue's network stack has an ARP cache
+/// of its own. Queue 0 copies every ARP frame it receives into the other queues' inboxes, so that
+/// the replies to their requests reach them.
+pub struct ArpFanout {
+    inboxes: Vec<Mutex<VecDeque<Vec<u8>>>>,
+    /// Whether each inbox may hold frames, so that polls don't take its lock for nothing.
+    pending: Vec<AtomicBool>,
+}
+
+/// Transmit path counters.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct TxStats {
+    /// Number of `rte_eth_tx_burst` calls that sent at least one packet.
+    pub bursts: u64,
+    /// Number of packets handed to the NIC.
+    pub packets: u64,
+    /// Number of bytes in those packets.
+    pub bytes: u64,
+    /// Largest number of packets sent in a single burst.
+    pub max_burst: u64,
+    /// Number of bursts that the TX ring could not fully accept.
+    pub ring_full: u64,
+    /// Number of packets dropped because the ring stayed full while the staging buffer was full.
+    pub drops: u64,
+}
+
+impl ArpFanout {
+    pub fn new(num_queues: usize) -> Self {
+        Self {
+            inboxes: (0..num_queues)
+                .map(|_| Mutex::new(VecDeque::new()))
+                .collect(),
+            pending: (0..num_queues).map(|_| AtomicBool::new(false)).collect(),
+        }
+    }
+
+    fn forward(&self, from_queue: u16, frame: &[u8]) {
+        for (queue_id, inbox) in self.inboxes.iter().enumerate() {
+            if queue_id == from_queue as usize {
+                continue;
+            }
+            let mut inbox = inbox.lock().unwrap();
+            if inbox.len() < ARP_INBOX_SIZE {
+                inbox.push_back(frame.to_vec());
+                self.pending[queue_id].store(true, Ordering::Release);
+            }
+        }
+    }
+
+    /// Moves frames forwarded to `queue_id` into `out`, as far as it has room.
+    fn receive(&self, queue_id: u16, out: &mut ArrayVec<DPDKBuf, RECEIVE_BATCH_SIZE>) {
+        let pending = &self.pending[queue_id as usize];
+        if !pending.swap(false, Ordering::Acquire) {
+            return;
+        }
+        let mut inbox = self.inboxes[queue_id as usize].lock().unwrap();
+        while !out.is_full() {
+            let frame = match inbox.pop_front() {
+                Some(frame) => frame,
+                None => break,
+            };
+            let mut buf = BytesMut::zeroed(frame.len()).unwrap();
+            buf.copy_from_slice(&frame);
+            out.push(DPDKBuf::External(buf.freeze()));
+        }
+        if !inbox.is_empty() {
+            pending.store(true, Ordering::Release);
+        }
+    }
+}
+
 impl TimerPtr for TimerRc {
     fn timer(&self) -> &Timer<Self> {
         &*self.0
@@ -82,13 +198,37 @@ impl DPDKRuntime {
         link_addr: MacAddress,
         ipv4_addr: Ipv4Addr,
         dpdk_port_id: u16,
+        dpdk_queue_id: u16,
         memory_manager: MemoryManager,
+        arp_fanout: Option<Arc<ArpFanout>>,
         arp_table: HashMap<Ipv4Addr, MacAddress>,
         disable_arp: bool,
         mss: usize,
         tcp_checksum_offload: bool,
         udp_checksum_offload: bool,
+        rx_interrupts: bool,
     ) -> Self {
+        // The interrupt is registered with the epoll instance of the calling thread, which is the
+        // one that will drive the queue.
+        let rx_interrupts = rx_interrupts && {
+            let ret = unsafe {
+                rte_eth_dev_rx_intr_ctl_q(
+                    dpdk_port_id,
+                    dpdk_queue_id,
+                    RTE_EPOLL_PER_THREAD,
+                    RTE_INTR_EVENT_ADD as c_int,
+                    ptr::null_mut(),
+                )
+            };
+            if ret != 0 {
+                eprintln!(
+                    "RX interrupts unavailable on queue {} ({}), waits will sleep instead",
+                    dpdk_queue_id, ret
+                );
+            }
+            ret == 0
+        };
+
         let mut rng = rand::thread_rng();
         let rng = SmallRng::from_rng(&mut rng).expect("Failed to initialize RNG");
         let now = Instant::now();
@@ -104,7 +244,7 @@ impl DPDKRuntime {
         let mut tcp_options = tcp::Options::default();
         tcp_options.advertised_mss = mss;
         tcp_options.window_scale = 5;
-        tcp_options.receive_window_size = 0xffff;
+        tcp_options.receive_window_size = RECEIVE_WINDOW_SIZE as _;
         tcp_options.tx_checksum_offload = tcp_checksum_offload;
         tcp_options.rx_checksum_offload = tcp_checksum_offload;
 
@@ -120,7 +260,16 @@ impl DPDKRuntime {
             udp_options,
 
             dpdk_port_id,
+            dpdk_queue_id,
+            rx_interrupts,
             memory_manager,
+            arp_fanout,
+
+            tx_queue: ArrayVec::new(),
+            tx_stats: TxStats::default(),
+            rx_packets: 0,
+            rx_bytes: 0,
+            rx_deferred: 0,
         };
         Self {
             inner: Rc::new(RefCell::new(inner)),
@@ -128,7 +277,7 @@ impl DPDKRuntime {
         }
     }
 
-    pub fn alloc_body_mbuf(&self) -> Mbuf {
+    pub fn alloc_body_mbuf(&self) -> Option<Mbuf> {
         self.inner.borrow().memory_manager.alloc_body_mbuf()
     }
 
@@ -136,9 +285,81 @@ impl DPDKRuntime {
         self.inner.borrow().dpdk_port_id
     }
 
+    pub fn queue_id(&self) -> u16 {
+        self.inner.borrow().dpdk_queue_id
+    }
+
     pub fn memory_manager(&self) -> MemoryManager {
         self.inner.borrow().memory_manager.clone()
     }
+
+    /// Whether pushes should be turned away until buffers come back. See
+    /// `MemoryManager::low_on_buffers`.
+    pub fn low_on_buffers(&self) -> bool {
+        self.inner.borrow().memory_manager.low_on_buffers()
+    }
+
+    /// Lets pushes send from `len` bytes of application memory at `addr` without copying. See
+    /// `MemoryManager::register_memory`.
+    pub fn register_memory(&self, addr: *mut c_void, len: usize) -> Result<(), c_int> {
+        let inner = self.inner.borrow();
+        inner
+            .memory_manager
+            .register_memory(inner.dpdk_port_id, addr, len)
+    }
+
+    pub fn unregister_memory(&self, addr: *mut c_void, len: usize) -> Result<(), c_int> {
+        let inner = self.inner.borrow();
+        inner
+            .memory_manager
+            .unregister_memory(inner.dpdk_port_id, addr, len)
+    }
+
+    /// Hands all staged packets to the NIC. Staged packets are otherwise flushed once the staging
+    /// buffer fills up and at the start of every `receive`, which the LibOS calls on each poll.
+    pub fn flush_tx(&self) {
+        self.inner.borrow_mut().flush_tx();
+    }
+
+    pub fn tx_stats(&self) -> TxStats {
+        self.inner.borrow().tx_stats
+    }
+
+    pub fn stats(&self) -> RuntimeStats {
+        let inner = self.inner.borrow();
+        RuntimeStats {
+            tx_packets: inner.tx_stats.packets,
+            tx_bytes: inner.tx_stats.bytes,
+            tx_drops: inner.tx_stats.drops,
+            rx_packets: inner.rx_packets,
+            rx_bytes: inner.rx_bytes,
+            alloc_failures: inner.memory_manager.alloc_failures(),
+            rx_deferred: inner.rx_deferred,
+        }
+    }
+
+    /// Blocks until packets arrive, for at most `timeout`, after handing staged packets to the
+    /// NIC. Without RX interrupts there is nothing to block on, so it sleeps for `timeout`.
+    pub fn wait_for_rx(&self, timeout: Duration) {
+        self.flush_tx();
+        let (port_id, queue_id, rx_interrupts) = {
+            let inner = self.inner.borrow();
+            (inner.dpdk_port_id, inner.dpdk_queue_id, inner.rx_interrupts)
+        };
+        if !rx_interrupts {
+            thread::sleep(timeout);
+            return;
+        }
+        // Packets that arrived between the last poll and arming the interrupt don't raise it, so
+        // they wait for the timeout, which the wait policy keeps short.
+        let timeout_ms = cmp::max(1, (timeout.as_micros() + 999) / 1000) as c_int;
+        unsafe {
+            let mut event: rte_epoll_event = mem::zeroed();
+            rte_eth_dev_rx_intr_enable(port_id, queue_id);
+            rte_epoll_wait(RTE_EPOLL_PER_THREAD, &mut event, 1, timeout_ms);
+            rte_eth_dev_rx_intr_disable(port_id, queue_id);
+        }
+    }
 }
 
 struct Inner {
@@ -152,26 +373,115 @@ struct Inner {
     udp_options: udp::Options,
 
     dpdk_port_id: u16,
+    dpdk_queue_id: u16,
+    /// Whether the queue's RX interrupt is registered with this thread's epoll instance.
+    rx_interrupts: bool,
+    /// Shared by the queues of a port when there is more than one.
+    arp_fanout: Option<Arc<ArpFanout>>,
+
+    tx_queue: ArrayVec<*mut rte_mbuf, TX_BATCH_SIZE>,
+    tx_stats: TxStats,
+    rx_packets: u64,
+    rx_bytes: u64,
+    rx_deferred: u64,
+}
+
+impl Inner {
+    fn stage_tx(&mut self, pkt: *mut rte_mbuf) {
+        if self.tx_queue.is_full() {
+            self.flush_tx();
+        }
+        if self.tx_queue.is_full() {
+            // The NIC isn't draining its ring. Drop instead of spinning here; the network stack
+            // recovers lost segments through retransmission.
+            unsafe { rte_pktmbuf_free(pkt) };
+            self.tx_stats.drops += 1;
+            return;
+        }
+        self.tx_queue.push(pkt);
+        if self.tx_queue.is_full() {
+            self.flush_tx();
+        }
+    }
+
+    fn flush_tx(&mut self) {
+        let mut retries = TX_RETRY_COUNT;
+        while !self.tx_queue.is_empty() {
+            let nb_pkts = self.tx_queue.len();
+            // Sent mbufs belong to the NIC, so their lengths are read beforehand.
+            let mut pkt_lens = [0_u32; TX_BATCH_SIZE];
+            for (len, &pkt) in pkt_lens.iter_mut().zip(self.tx_queue.iter()) {
+                *len = unsafe { (*pkt).pkt_len };
+            }
+            let nb_tx = unsafe {
+                rte_eth_tx_burst(
+                    self.dpdk_port_id,
+                    self.dpdk_queue_id,
+                    self.tx_queue.as_mut_ptr(),
+                    nb_pkts as u16,
+                )
+            } as usize;
+            assert!(nb_tx <= nb_pkts);
+
+            if nb_tx > 0 {
+                self.tx_stats.bursts += 1;
+                self.tx_stats.packets += nb_tx as u64;
+                self.tx_stats.bytes += pkt_lens[..nb_tx].iter().map(|&len| len as u64).sum::<u64>();
+                self.tx_stats.max_burst = std::cmp::max(self.tx_stats.max_burst, nb_tx as u64);
+                self.tx_queue.drain(..nb_tx);
+            }
+            if nb_tx < nb_pkts {
+                self.tx_stats.ring_full += 1;
+                if retries == 0 {
+                    break;
+                }
+                retries -= 1;
+            }
+        }
+    }
+}
+
+impl Drop for Inner {
+    fn drop(&mut self) {
+        self.flush_tx();
+        for pkt in self.tx_queue.drain(..) {
+            unsafe { rte_pktmbuf_free(pkt) };
+        }
+    }
 }
 
 impl Runtime for DPDKRuntime {
     type Buf = DPDKBuf;
     type WaitFuture = WaitFuture<TimerRc>;
 
+    // The C interface goes through the `Dispatch` hooks, with demikernel's arrays. These only
+    // serve catnip's own calls, whose arrays hold a single segment, so chained receives are copied
+    // out here.
     fn into_sgarray(&self, buf: Self::Buf) -> dmtr_sgarray_t {
-        self.inner.borrow().memory_manager.into_sgarray(buf)
+        self.inner
+            .borrow()
+            .memory_manager
+            .into_sgarray(buf, 1)
+            .narrow()
     }
 
     fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
-        self.inner.borrow().memory_manager.alloc_sgarray(size)
+        self.inner
+            .borrow()
+            .memory_manager
+            .alloc_sgarray(size)
+            .narrow()
     }
 
     fn free_sgarray(&self, sga: dmtr_sgarray_t) {
-        self.inner.borrow().memory_manager.free_sgarray(sga)
+        self.inner.borrow().memory_manager.free_sgarray(sga.into())
     }
 
     fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Self::Buf {
-        self.inner.borrow().memory_manager.clone_sgarray(sga)
+        self.inner
+            .borrow()
+            .memory_manager
+            .clone_sgarray(&(*sga).into())
     }
 
     fn transmit(&self, buf: impl PacketBuf<DPDKBuf>) {
@@ -186,9 +496,17 @@ impl Runtime for DPDKRuntime {
         //   2) Not managed => alloc body
         // Chain body buffer.
 
-        // First, allocate a header mbuf and write the header into it.
-        let inner = self.inner.borrow_mut();
-        let mut header_mbuf = inner.memory_manager.alloc_header_mbuf();
+        // First, allocate a header mbuf and write the header into it. Without one, the packet is
+        // dropped like any other that can't be sent; the network stack recovers lost segments
+        // through retransmission.
+        let mut inner = self.inner.borrow_mut();
+        let mut header_mbuf = match inner.memory_manager.alloc_header_mbuf() {
+            Some(mbuf) => mbuf,
+            None => {
+                inner.tx_stats.drops += 1;
+                return;
+            },
+        };
         let header_size = buf.header_size();
         assert!(header_size <= header_mbuf.len());
         buf.write_header(unsafe { &mut header_mbuf.slice_mut()[..header_size] });
@@ -206,12 +524,17 @@ impl Runtime for DPDKRuntime {
 
                 let body_mbuf = match body {
                     DPDKBuf::Managed(mbuf) => mbuf,
-                    DPDKBuf::External(bytes) => {
-                        let mut mbuf = inner.memory_manager.alloc_body_mbuf();
-                        assert!(mbuf.len() >= bytes.len());
-                        unsafe { mbuf.slice_mut()[..bytes.len()].copy_from_slice(&bytes[..]) };
-                        mbuf.trim(mbuf.len() - bytes.len());
-                        mbuf
+                    DPDKBuf::External(bytes) => match inner.memory_manager.alloc_body_mbuf() {
+                        Some(mut mbuf) if mbuf.len() >= bytes.len() => {
+                            unsafe { mbuf.slice_mut()[..bytes.len()].copy_from_slice(&bytes[..]) };
+                            mbuf.trim(mbuf.len() - bytes.len());
+                            mbuf
+                        },
+                        // Out of body mbufs, or a datagram too large for one.
+                        _ => {
+                            inner.tx_stats.drops += 1;
+                            return;
+                        },
                     },
                 };
                 unsafe {
@@ -220,10 +543,7 @@ impl Runtime for DPDKRuntime {
                         0
                     );
                 }
-                let mut header_mbuf_ptr = header_mbuf.into_raw();
-                let num_sent =
-                    unsafe { rte_eth_tx_burst(inner.dpdk_port_id, 0, &mut header_mbuf_ptr, 1) };
-                assert_eq!(num_sent, 1);
+                inner.stage_tx(header_mbuf.into_raw());
             }
             // Otherwise, write in the inline space.
             else {
@@ -245,10 +565,7 @@ impl Runtime for DPDKRuntime {
                 let frame_size = std::cmp::max(header_size + body.len(), MIN_PAYLOAD_SIZE);
                 header_mbuf.trim(header_mbuf.len() - frame_size);
 
-                let mut header_mbuf_ptr = header_mbuf.into_raw();
-                let num_sent =
-                    unsafe { rte_eth_tx_burst(inner.dpdk_port_id, 0, &mut header_mbuf_ptr, 1) };
-                assert_eq!(num_sent, 1);
+                inner.stage_tx(header_mbuf.into_raw());
             }
         }
         // No body on our packet, just send the headers.
@@ -263,33 +580,56 @@ impl Runtime for DPDKRuntime {
             }
             let frame_size = std::cmp::max(header_size, MIN_PAYLOAD_SIZE);
             header_mbuf.trim(header_mbuf.len() - frame_size);
-            let mut header_mbuf_ptr = header_mbuf.into_raw();
-            let num_sent =
-                unsafe { rte_eth_tx_burst(inner.dpdk_port_id, 0, &mut header_mbuf_ptr, 1) };
-            assert_eq!(num_sent, 1);
+            inner.stage_tx(header_mbuf.into_raw());
         }
     }
 
     fn receive(&self) -> ArrayVec<DPDKBuf, RECEIVE_BATCH_SIZE> {
-        let inner = self.inner.borrow_mut();
+        let mut inner = self.inner.borrow_mut();
         let mut out = ArrayVec::new();
 
+        // The LibOS receives once per poll, which makes this the end of the previous poll's
+        // transmit work.
+        inner.flush_tx();
+
+        let arp_fanout = inner.arp_fanout.clone();
+        if let Some(ref arp_fanout) = arp_fanout {
+            arp_fanout.receive(inner.dpdk_queue_id, &mut out);
+        }
+
+        // The driver replaces every packet it hands over with a fresh body mbuf. When the pool
+        // can't cover a whole burst, we leave packets on the ring instead of starving it of
+        // buffers: the NIC drops what doesn't fit and senders back off until the application
+        // frees some.
+        if inner.memory_manager.body_pool_avail() < RECEIVE_BATCH_SIZE {
+            inner.rx_deferred += 1;
+            return out;
+        }
+
         let mut packets: [*mut rte_mbuf; RECEIVE_BATCH_SIZE] = unsafe { mem::zeroed() };
         let nb_rx = unsafe {
             rte_eth_rx_burst(
                 inner.dpdk_port_id,
-                0,
+                inner.dpdk_queue_id,
                 packets.as_mut_ptr(),
-                RECEIVE_BATCH_SIZE as u16,
+                out.remaining_capacity() as u16,
             )
         };
-        assert!(nb_rx as usize <= RECEIVE_BATCH_SIZE);
+        assert!(nb_rx as usize <= out.remaining_capacity());
 
         for &packet in &packets[..nb_rx as usize] {
+            inner.rx_packets += 1;
+            inner.rx_bytes += unsafe { (*packet).pkt_len } as u64;
             let mbuf = Mbuf {
                 ptr: packet,
                 mm: inner.memory_manager.clone(),
             };
+            match arp_fanout {
+                Some(ref arp_fanout) if inner.dpdk_queue_id == 0 && is_arp(&mbuf) => {
+                    arp_fanout.forward(0, &mbuf)
+                },
+                _ => (),
+            }
             out.push(DPDKBuf::Managed(mbuf));
         }
         out
@@ -359,3 +699,7 @@ impl Runtime for DPDKRuntime {
         &self.scheduler
     }
 }
+
+fn is_arp(frame: &[u8]) -> bool {
+    frame.len() >= 14 && frame[12..14] == ETHERTYPE_ARP
+}
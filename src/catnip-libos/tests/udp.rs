@@ -57,6 +57,8 @@ impl Test {
             config.mss,
             config.tcp_checksum_offload,
             config.udp_checksum_offload,
+            &config.mempool,
+            false,
         )
         .unwrap();
         let libos = LibOS::new(rt).unwrap();
@@ -107,7 +109,7 @@ impl Test {
 
     pub fn mkbuf(&self, fill_char: u8) -> DPDKBuf {
         assert!(self.config.buffer_size <= self.config.mss);
-        let mut pktbuf = self.libos.rt().alloc_body_mbuf();
+        let mut pktbuf = self.libos.rt().alloc_body_mbuf().unwrap();
         let pktbuf_slice = unsafe { pktbuf.slice_mut() };
         for j in 0..self.config.buffer_size {
             pktbuf_slice[j] = fill_char;
@@ -0,0 +1,142 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#![cfg_attr(feature = "strict", deny(warnings))]
+#![deny(clippy::all)]
+#![feature(maybe_uninit_uninit_array, new_uninit)]
+#![feature(try_blocks)]
+
+pub mod runtime;
+pub mod umem;
+pub mod xsk;
+
+use anyhow::Error;
+use catnip::{
+    libos::LibOS,
+    logging,
+};
+use demikernel::{
+    config::Config,
+    dispatch::{
+        self,
+        Dispatch,
+    },
+    file,
+    interop::dmtr_sgarray_t,
+    network::libos_network_init,
+    pool,
+    shm,
+    stats::{
+        self,
+        RuntimeStats,
+    },
+    wait,
+};
+use libc::{
+    c_char,
+    c_int,
+};
+use runtime::XdpRuntime;
+use std::{
+    cell::RefCell,
+    time::Duration,
+};
+use umem::XdpBuf;
+
+thread_local! {
+    static LIBOS: RefCell<Option<LibOS<XdpRuntime>>> = RefCell::new(None);
+}
+
+//==============================================================================
+// init
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
+    catpowder_init(argc, argv)
+}
+
+/// NIC queue to attach to, from `catpowder.queue_id` (queue 0 by default).
+pub fn queue_id(config: &Config) -> u32 {
+    config.config_obj["catpowder"]["queue_id"]
+        .as_i64()
+        .unwrap_or(0) as u32
+}
+
+pub fn catpowder_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
+    logging::initialize();
+    let r: Result<_, Error> = try {
+        // Load config file.
+        let config = Config::initialize(argc, argv)?;
+        wait::set_policy(config.wait_policy);
+        stats::set_track_latency(config.track_latency);
+        pool::configure(config.pool);
+        file::configure(config.file);
+        shm::configure(config.shm.clone());
+
+        let rt = runtime::initialize_xdp(
+            config.local_link_addr,
+            config.local_ipv4_addr,
+            &config.local_interface_name,
+            queue_id(&config),
+            config.arp_table(),
+        )?;
+        LibOS::new(rt)?
+    };
+
+    let libos = match r {
+        Ok(libos) => libos,
+        Err(e) => {
+            eprintln!("Initialization failure: {:?}", e);
+            return libc::EINVAL;
+        },
+    };
+
+    LIBOS.with(move |l| {
+        let mut tls_libos = l.borrow_mut();
+        assert!(tls_libos.is_none());
+        *tls_libos = Some(libos);
+    });
+
+    libos_network_init(dispatch::network_libos::<XdpRuntime>());
+
+    0
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+// Buffers outside the UMEM are copied into it on push, so there is no memory to register.
+impl Dispatch for XdpRuntime {
+    fn with_libos<T>(f: impl FnOnce(&mut LibOS<Self>) -> T) -> T {
+        LIBOS.with(|l| {
+            let mut tls_libos = l.borrow_mut();
+            f(tls_libos.as_mut().expect("Uninitialized engine"))
+        })
+    }
+
+    fn wait_for_rx(&self, timeout: Duration) {
+        XdpRuntime::wait_for_rx(self, timeout)
+    }
+
+    fn stats(&self) -> RuntimeStats {
+        XdpRuntime::stats(self)
+    }
+
+    fn into_sga(&self, buf: XdpBuf) -> dmtr_sgarray_t {
+        XdpRuntime::into_sga(self, buf)
+    }
+
+    fn clone_sga(&self, sga: &dmtr_sgarray_t) -> XdpBuf {
+        XdpRuntime::clone_sga(self, sga)
+    }
+
+    fn alloc_sga(&self, size: usize) -> dmtr_sgarray_t {
+        XdpRuntime::alloc_sga(self, size)
+    }
+
+    fn free_sga(&self, sga: &dmtr_sgarray_t) {
+        XdpRuntime::free_sga(self, sga)
+    }
+}
@@ -0,0 +1,511 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use crate::{
+    umem::{
+        Umem,
+        UmemBuf,
+        XdpBuf,
+        FRAME_HEADROOM,
+        FRAME_SIZE,
+    },
+    xsk::{
+        XdpDesc,
+        XdpSocket,
+        COMPLETION_RING_SIZE,
+    },
+};
+use anyhow::Error;
+use arrayvec::ArrayVec;
+use catnip::{
+    interop,
+    protocols::{
+        arp,
+        ethernet2::{
+            frame::ETHERNET2_HEADER_SIZE,
+            MacAddress,
+        },
+        ipv4::datagram::IPV4_HEADER_SIZE,
+        tcp::{
+            self,
+            segment::MAX_TCP_HEADER_SIZE,
+        },
+        udp,
+    },
+    runtime::{
+        PacketBuf,
+        Runtime,
+        RECEIVE_BATCH_SIZE,
+    },
+    scheduler::{
+        Operation,
+        Scheduler,
+        SchedulerHandle,
+    },
+    timer::{
+        Timer,
+        TimerRc,
+        WaitFuture,
+    },
+};
+use demikernel::{
+    interop::{
+        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
+    },
+    pool,
+    sga,
+    stats::RuntimeStats,
+    wait,
+};
+use futures::{
+    Future,
+    FutureExt,
+};
+use rand::{
+    distributions::Standard,
+    prelude::Distribution,
+    rngs::SmallRng,
+    seq::SliceRandom,
+    Rng,
+    SeedableRng,
+};
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    fs,
+    net::Ipv4Addr,
+    ptr,
+    rc::Rc,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Largest header that the network stack asks us to serialize in front of a body.
+const MAX_HEADER_SIZE: usize = ETHERNET2_HEADER_SIZE + IPV4_HEADER_SIZE + MAX_TCP_HEADER_SIZE;
+
+/// Number of frames that we put on the TX ring before asking the kernel to send them.
+const TX_BATCH_SIZE: u32 = 32;
+
+/// Largest number of frames that we hand to the fill ring at once.
+const FILL_BATCH_SIZE: u32 = 64;
+
+#[derive(Clone)]
+pub struct XdpRuntime {
+    inner: Rc<RefCell<Inner>>,
+    scheduler: Scheduler<Operation<XdpRuntime>>,
+}
+
+pub struct Inner {
+    pub timer: TimerRc,
+    pub rng: SmallRng,
+    /// Declared ahead of `umem` so that the socket lets go of the UMEM before it is unmapped.
+    pub socket: XdpSocket,
+    pub umem: Rc<Umem>,
+    pub link_addr: MacAddress,
+    pub ipv4_addr: Ipv4Addr,
+    pub tcp_options: tcp::Options<XdpRuntime>,
+    pub arp_options: arp::Options,
+    /// Frames put on the TX ring since the last kick.
+    tx_pending: u32,
+    stats: RuntimeStats,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl XdpRuntime {
+    pub fn new(
+        now: Instant,
+        link_addr: MacAddress,
+        ipv4_addr: Ipv4Addr,
+        interface_name: &str,
+        queue_id: u32,
+        arp: HashMap<Ipv4Addr, MacAddress>,
+    ) -> Result<Self, Error> {
+        let mut arp_options = arp::Options::default();
+        arp_options.retry_count = 2;
+        arp_options.cache_ttl = Duration::from_secs(600);
+        arp_options.request_timeout = Duration::from_secs(1);
+        arp_options.initial_values = arp;
+
+        let path: String = format!("/sys/class/net/{}/ifindex", interface_name);
+        let ifindex: u32 = fs::read_to_string(path)
+            .expect("Could not read ifindex")
+            .trim()
+            .parse()
+            .unwrap();
+
+        let umem = Umem::new()?;
+        let socket = XdpSocket::new(umem.clone(), ifindex, queue_id)?;
+
+        let mut inner = Inner {
+            timer: TimerRc(Rc::new(Timer::new(now))),
+            rng: SmallRng::from_seed([0; 32]),
+            socket,
+            umem,
+            link_addr,
+            ipv4_addr,
+            tcp_options: tcp::Options::default(),
+            arp_options,
+            tx_pending: 0,
+            stats: RuntimeStats::default(),
+        };
+        inner.refill();
+        Ok(Self {
+            inner: Rc::new(RefCell::new(inner)),
+            scheduler: Scheduler::new(),
+        })
+    }
+
+    pub fn stats(&self) -> RuntimeStats {
+        self.inner.borrow().stats
+    }
+
+    /// Blocks until the RX ring has packets, for at most `timeout`. Queued transmits go out first,
+    /// and we don't block while some are still waiting for another kick.
+    pub fn wait_for_rx(&self, timeout: Duration) {
+        let fd = {
+            let mut inner = self.inner.borrow_mut();
+            inner.flush_tx();
+            if inner.socket.tx.outstanding() > 0 {
+                return;
+            }
+            inner.socket.fd()
+        };
+        wait::poll_fd(fd, timeout);
+    }
+}
+
+impl Inner {
+    /// Hands free frames to the kernel for incoming packets.
+    fn refill(&mut self) {
+        let n = self
+            .socket
+            .fill
+            .free(FILL_BATCH_SIZE.min(self.umem.num_free() as u32));
+        for i in 0..n {
+            let frame = self.umem.alloc_frame().unwrap();
+            self.socket.fill.write(i, Umem::frame_addr(frame));
+        }
+        if n > 0 {
+            self.socket.fill.submit(n);
+            if self.socket.fill.needs_wakeup() {
+                self.socket.kick_fill();
+            }
+        }
+    }
+
+    /// Releases frames that the kernel is done sending.
+    fn reap_completions(&mut self) {
+        let n = self.socket.completion.available(COMPLETION_RING_SIZE);
+        for i in 0..n {
+            // The kernel only completes a descriptor once its packet is out, so that is when it
+            // counts as sent.
+            let (frame, _) = Umem::split_addr(self.socket.completion.read(i));
+            self.stats.tx_packets += 1;
+            self.stats.tx_bytes += self.umem.tx_len(frame) as u64;
+            self.umem.set_tx_len(frame, 0);
+            self.umem.put(frame);
+        }
+        self.socket.completion.release(n);
+    }
+
+    /// Kicks the TX ring once if it has frames that the kernel hasn't taken yet. A kick only
+    /// sends part of a full ring, so this is called at least once per poll until it drains.
+    fn flush_tx(&mut self) {
+        if self.tx_pending > 0 || self.socket.tx.outstanding() > 0 {
+            self.socket.kick_tx();
+            self.tx_pending = 0;
+        }
+    }
+
+    /// Puts `len` bytes at `offset` within `frame` on the TX ring. The ring takes over one of the
+    /// caller's references to the frame, which is released on completion.
+    fn stage_tx(&mut self, frame: u32, offset: usize, len: usize) {
+        if self.socket.tx.free(1) == 0 {
+            self.flush_tx();
+            self.reap_completions();
+            if self.socket.tx.free(1) == 0 {
+                self.stats.tx_drops += 1;
+                self.umem.put(frame);
+                return;
+            }
+        }
+
+        self.umem.set_tx_len(frame, len as u32);
+        let desc = XdpDesc {
+            addr: Umem::frame_addr(frame) + offset as u64,
+            len: len as u32,
+            options: 0,
+        };
+        self.socket.tx.write(0, desc);
+        self.socket.tx.submit(1);
+        self.tx_pending += 1;
+        if self.tx_pending >= TX_BATCH_SIZE {
+            self.flush_tx();
+        }
+    }
+}
+
+impl XdpRuntime {
+    pub fn into_sga(&self, buf: XdpBuf) -> dmtr_sgarray_t {
+        match buf {
+            // Received frames are handed to the application in place.
+            XdpBuf::Umem(buf) => {
+                let sgaseg = dmtr_sgaseg_t {
+                    sgaseg_len: buf.len() as u32,
+                    sgaseg_buf: buf.into_raw() as *mut _,
+                };
+                dmtr_sgarray_t::new(&[sgaseg])
+            },
+            XdpBuf::External(buf) => sga::bytes_into_sgarray(buf),
+        }
+    }
+
+    pub fn alloc_sga(&self, size: usize) -> dmtr_sgarray_t {
+        let mut inner = self.inner.borrow_mut();
+        if size <= FRAME_SIZE - FRAME_HEADROOM {
+            if let Some(frame) = inner.umem.alloc_frame() {
+                let sgaseg = dmtr_sgaseg_t {
+                    sgaseg_buf: unsafe { inner.umem.frame_ptr(frame).add(FRAME_HEADROOM) }
+                        as *mut _,
+                    sgaseg_len: size as u32,
+                };
+                return dmtr_sgarray_t::new(&[sgaseg]);
+            }
+            inner.stats.alloc_failures += 1;
+        }
+
+        // Too large for a frame, or out of frames: fall back to the buffer pool.
+        pool::alloc_sgarray(size)
+    }
+
+    pub fn free_sga(&self, sga: &dmtr_sgarray_t) {
+        if sga::free_bytes_sgarray(sga) {
+            return;
+        }
+        let inner = self.inner.borrow();
+        for seg in sga.segments() {
+            match inner.umem.split_ptr(seg.sgaseg_buf as *const u8) {
+                Some((frame, _)) => inner.umem.put(frame),
+                None => unsafe { pool::free(seg.sgaseg_buf as *mut u8, seg.sgaseg_len as usize) },
+            }
+        }
+    }
+
+    /// Shares buffers that already live in the UMEM, and copies anything else.
+    pub fn clone_sga(&self, sga: &dmtr_sgarray_t) -> XdpBuf {
+        if let Some(buf) = sga::clone_bytes_sgarray(sga) {
+            return XdpBuf::External(buf);
+        }
+        let inner = self.inner.borrow();
+        if sga.sga_numsegs == 1 {
+            let seg = &sga.sga_segs[0];
+            if let Some((frame, offset)) = inner.umem.split_ptr(seg.sgaseg_buf as *const u8) {
+                // The application's buffer already lives in the UMEM: share it.
+                inner.umem.get(frame);
+                let buf = UmemBuf::new(inner.umem.clone(), frame, offset, seg.sgaseg_len as usize);
+                return XdpBuf::Umem(buf);
+            }
+        }
+        XdpBuf::External(sga::gather_into_bytes(sga))
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Runtime for XdpRuntime {
+    type Buf = XdpBuf;
+    type WaitFuture = WaitFuture<TimerRc>;
+
+    // The C interface goes through the `Dispatch` hooks below, with demikernel's arrays. These
+    // only serve catnip's own calls, whose arrays hold a single segment.
+    fn into_sgarray(&self, buf: XdpBuf) -> interop::dmtr_sgarray_t {
+        self.into_sga(buf).narrow()
+    }
+
+    fn alloc_sgarray(&self, size: usize) -> interop::dmtr_sgarray_t {
+        self.alloc_sga(size).narrow()
+    }
+
+    fn free_sgarray(&self, sga: interop::dmtr_sgarray_t) {
+        self.free_sga(&sga.into())
+    }
+
+    fn clone_sgarray(&self, sga: &interop::dmtr_sgarray_t) -> XdpBuf {
+        self.clone_sga(&(*sga).into())
+    }
+
+    fn transmit(&self, pkt: impl PacketBuf<XdpBuf>) {
+        let mut inner = self.inner.borrow_mut();
+        inner.reap_completions();
+
+        // Taking the body consumes the packet, so the header is serialized on the stack first.
+        let header_size = pkt.header_size();
+        assert!(header_size <= MAX_HEADER_SIZE);
+        let mut header = [0_u8; MAX_HEADER_SIZE];
+        pkt.write_header(&mut header[..header_size]);
+        let header = &header[..header_size];
+        let body = pkt.take_body();
+        let body_len = body.as_ref().map(|b| b.len()).unwrap_or(0);
+        if header_size + body_len > FRAME_SIZE {
+            inner.stats.tx_drops += 1;
+            return;
+        }
+
+        // If the body is an application buffer that starts right after a frame's headroom, put the
+        // header in the headroom and send the frame in place. The headroom is never part of a
+        // buffer, so the only thing to watch out for is the frame already being on the TX ring
+        // with another header.
+        if let Some(XdpBuf::Umem(ref buf)) = body {
+            let frame = buf.frame();
+            if buf.offset() == FRAME_HEADROOM && !inner.umem.in_tx(frame) {
+                let offset = FRAME_HEADROOM - header_size;
+                unsafe {
+                    let dst = inner.umem.frame_ptr(frame).add(offset);
+                    ptr::copy_nonoverlapping(header.as_ptr(), dst, header_size);
+                }
+                inner.umem.get(frame);
+                inner.stage_tx(frame, offset, header_size + body_len);
+                return;
+            }
+        }
+
+        // Otherwise, copy the header and body into a fresh frame.
+        let frame = match inner.umem.alloc_frame() {
+            Some(frame) => frame,
+            None => {
+                inner.stats.alloc_failures += 1;
+                inner.stats.tx_drops += 1;
+                return;
+            },
+        };
+        unsafe {
+            let dst = inner.umem.frame_ptr(frame);
+            ptr::copy_nonoverlapping(header.as_ptr(), dst, header_size);
+            if let Some(ref body) = body {
+                ptr::copy_nonoverlapping(body.as_ptr(), dst.add(header_size), body_len);
+            }
+        }
+        inner.stage_tx(frame, 0, header_size + body_len);
+    }
+
+    fn receive(&self) -> ArrayVec<XdpBuf, RECEIVE_BATCH_SIZE> {
+        let mut inner = self.inner.borrow_mut();
+        let mut out = ArrayVec::new();
+
+        // The LibOS receives once per poll, which makes this the end of the previous poll's
+        // transmit work.
+        inner.flush_tx();
+        inner.reap_completions();
+        inner.refill();
+
+        let n = inner.socket.rx.available(RECEIVE_BATCH_SIZE as u32);
+        for i in 0..n {
+            let desc = inner.socket.rx.read(i);
+            let (frame, offset) = Umem::split_addr(desc.addr);
+            // The reference taken when the frame went on the fill ring passes to the buffer.
+            let buf = UmemBuf::new(inner.umem.clone(), frame, offset, desc.len as usize);
+            out.push(XdpBuf::Umem(buf));
+            inner.stats.rx_packets += 1;
+            inner.stats.rx_bytes += desc.len as u64;
+        }
+        inner.socket.rx.release(n);
+        out
+    }
+
+    fn scheduler(&self) -> &Scheduler<Operation<Self>> {
+        &self.scheduler
+    }
+
+    fn local_link_addr(&self) -> MacAddress {
+        self.inner.borrow().link_addr.clone()
+    }
+
+    fn local_ipv4_addr(&self) -> Ipv4Addr {
+        self.inner.borrow().ipv4_addr.clone()
+    }
+
+    fn tcp_options(&self) -> tcp::Options<Self> {
+        self.inner.borrow().tcp_options.clone()
+    }
+
+    fn udp_options(&self) -> udp::Options {
+        udp::Options::default()
+    }
+
+    fn arp_options(&self) -> arp::Options {
+        self.inner.borrow().arp_options.clone()
+    }
+
+    fn advance_clock(&self, now: Instant) {
+        self.inner.borrow_mut().timer.0.advance_clock(now);
+    }
+
+    fn wait(&self, duration: Duration) -> Self::WaitFuture {
+        let inner = self.inner.borrow_mut();
+        let now = inner.timer.0.now();
+        inner
+            .timer
+            .0
+            .wait_until(inner.timer.clone(), now + duration)
+    }
+
+    fn wait_until(&self, when: Instant) -> Self::WaitFuture {
+        let inner = self.inner.borrow_mut();
+        inner.timer.0.wait_until(inner.timer.clone(), when)
+    }
+
+    fn now(&self) -> Instant {
+        self.inner.borrow().timer.0.now()
+    }
+
+    fn rng_gen<T>(&self) -> T
+    where
+        Standard: Distribution<T>,
+    {
+        let mut inner = self.inner.borrow_mut();
+        inner.rng.gen()
+    }
+
+    fn rng_shuffle<T>(&self, slice: &mut [T]) {
+        let mut inner = self.inner.borrow_mut();
+        slice.shuffle(&mut inner.rng);
+    }
+
+    fn spawn<F: Future<Output = ()> + 'static>(&self, future: F) -> SchedulerHandle {
+        self.scheduler
+            .insert(Operation::Background(future.boxed_local()))
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+pub fn initialize_xdp(
+    local_link_addr: MacAddress,
+    local_ipv4_addr: Ipv4Addr,
+    interface_name: &str,
+    queue_id: u32,
+    arp_table: HashMap<Ipv4Addr, MacAddress>,
+) -> Result<XdpRuntime, Error> {
+    XdpRuntime::new(
+        Instant::now(),
+        local_link_addr,
+        local_ipv4_addr,
+        interface_name,
+        queue_id,
+        arp_table,
+    )
+}
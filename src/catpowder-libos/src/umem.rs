@@ -0,0 +1,304 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! The UMEM: a region of memory, registered with an AF_XDP socket, that holds every frame that the
+//! NIC reads from or writes to. The region is split into fixed-size frames which are reference
+//! counted, so that received frames can be handed to the application and application buffers can
+//! be handed to the NIC without copying.
+
+use anyhow::{
+    format_err,
+    Error,
+};
+use catnip::{
+    collections::bytes::Bytes,
+    runtime::RuntimeBuf,
+};
+use std::{
+    cell::{
+        Cell,
+        RefCell,
+    },
+    fmt,
+    ops::Deref,
+    ptr,
+    rc::Rc,
+    slice,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Size of a UMEM frame. Frames are page-sized so that the kernel can map them in aligned mode.
+pub const FRAME_SIZE: usize = 4096;
+
+/// Number of frames in the UMEM.
+pub const FRAME_COUNT: usize = 8192;
+
+/// Bytes reserved at the front of frames handed out by `alloc_sgarray`, so that headers can be
+/// written in front of the application's data instead of copying the data after them.
+pub const FRAME_HEADROOM: usize = 256;
+
+pub struct Umem {
+    base: *mut u8,
+    len: usize,
+    /// Reference count of each frame. A frame is free when its count is zero.
+    refcnt: Vec<Cell<u16>>,
+    /// Length of the packet that a frame holds while it is on the TX ring, so that nobody else
+    /// writes headers into it and the packet is counted once the kernel has sent it. Zero
+    /// otherwise.
+    tx_len: Vec<Cell<u32>>,
+    free: RefCell<Vec<u32>>,
+}
+
+/// A reference to a range of bytes within a UMEM frame. The frame is returned to the UMEM when the
+/// last reference to it is dropped.
+pub struct UmemBuf {
+    umem: Rc<Umem>,
+    frame: u32,
+    offset: u32,
+    len: u32,
+}
+
+#[derive(Clone, Debug)]
+pub enum XdpBuf {
+    External(Bytes),
+    Umem(UmemBuf),
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl Umem {
+    pub fn new() -> Result<Rc<Self>, Error> {
+        let len = FRAME_SIZE * FRAME_COUNT;
+        let base = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE,
+                -1,
+                0,
+            )
+        };
+        if base == libc::MAP_FAILED {
+            return Err(format_err!(
+                "mmap of UMEM failed: {:?}",
+                std::io::Error::last_os_error()
+            ));
+        }
+
+        // Hand out low frames first.
+        let free = (0..FRAME_COUNT as u32).rev().collect();
+        Ok(Rc::new(Self {
+            base: base as *mut u8,
+            len,
+            refcnt: (0..FRAME_COUNT).map(|_| Cell::new(0)).collect(),
+            tx_len: (0..FRAME_COUNT).map(|_| Cell::new(0)).collect(),
+            free: RefCell::new(free),
+        }))
+    }
+
+    pub fn base(&self) -> *mut u8 {
+        self.base
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn num_free(&self) -> usize {
+        self.free.borrow().len()
+    }
+
+    /// Takes a free frame, with a reference count of one.
+    pub fn alloc_frame(&self) -> Option<u32> {
+        let frame = self.free.borrow_mut().pop()?;
+        debug_assert_eq!(self.refcnt[frame as usize].get(), 0);
+        self.refcnt[frame as usize].set(1);
+        Some(frame)
+    }
+
+    pub fn get(&self, frame: u32) {
+        let refcnt = &self.refcnt[frame as usize];
+        assert!(refcnt.get() > 0);
+        refcnt.set(refcnt.get() + 1);
+    }
+
+    pub fn put(&self, frame: u32) {
+        let refcnt = &self.refcnt[frame as usize];
+        assert!(refcnt.get() > 0);
+        refcnt.set(refcnt.get() - 1);
+        if refcnt.get() == 0 {
+            self.free.borrow_mut().push(frame);
+        }
+    }
+
+    pub fn in_tx(&self, frame: u32) -> bool {
+        self.tx_len[frame as usize].get() != 0
+    }
+
+    pub fn tx_len(&self, frame: u32) -> u32 {
+        self.tx_len[frame as usize].get()
+    }
+
+    /// Marks a frame as being on the TX ring with a packet of `len` bytes, or as off it with 0.
+    pub fn set_tx_len(&self, frame: u32, len: u32) {
+        self.tx_len[frame as usize].set(len);
+    }
+
+    /// Address of a frame, as the kernel sees it (relative to the start of the UMEM).
+    pub fn frame_addr(frame: u32) -> u64 {
+        frame as u64 * FRAME_SIZE as u64
+    }
+
+    /// Splits a UMEM address into a frame and an offset within it.
+    pub fn split_addr(addr: u64) -> (u32, usize) {
+        (
+            (addr / FRAME_SIZE as u64) as u32,
+            (addr % FRAME_SIZE as u64) as usize,
+        )
+    }
+
+    pub fn frame_ptr(&self, frame: u32) -> *mut u8 {
+        assert!((frame as usize) < FRAME_COUNT);
+        unsafe { self.base.add(frame as usize * FRAME_SIZE) }
+    }
+
+    /// Maps a pointer into the UMEM back to a frame and an offset within it.
+    pub fn split_ptr(&self, ptr: *const u8) -> Option<(u32, usize)> {
+        let ptr = ptr as usize;
+        let base = self.base as usize;
+        if ptr < base || ptr >= base + self.len {
+            return None;
+        }
+        Some(Self::split_addr((ptr - base) as u64))
+    }
+}
+
+impl UmemBuf {
+    /// Wraps `len` bytes at `offset` within `frame`, taking over one of the caller's references to
+    /// the frame.
+    pub fn new(umem: Rc<Umem>, frame: u32, offset: usize, len: usize) -> Self {
+        assert!(offset + len <= FRAME_SIZE);
+        Self {
+            umem,
+            frame,
+            offset: offset as u32,
+            len: len as u32,
+        }
+    }
+
+    pub fn frame(&self) -> u32 {
+        self.frame
+    }
+
+    pub fn offset(&self) -> usize {
+        self.offset as usize
+    }
+
+    pub fn data_ptr(&self) -> *mut u8 {
+        unsafe { self.umem.frame_ptr(self.frame).add(self.offset as usize) }
+    }
+
+    /// Gives up this buffer's reference to its frame without releasing it, for when ownership is
+    /// passed on through a raw pointer (e.g. a scatter-gather array).
+    pub fn into_raw(self) -> *mut u8 {
+        let ptr = self.data_ptr();
+        std::mem::forget(self);
+        ptr
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for Umem {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.base as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+impl Clone for UmemBuf {
+    fn clone(&self) -> Self {
+        self.umem.get(self.frame);
+        Self {
+            umem: self.umem.clone(),
+            frame: self.frame,
+            offset: self.offset,
+            len: self.len,
+        }
+    }
+}
+
+impl Drop for UmemBuf {
+    fn drop(&mut self) {
+        self.umem.put(self.frame);
+    }
+}
+
+impl Deref for UmemBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.data_ptr(), self.len as usize) }
+    }
+}
+
+impl fmt::Debug for UmemBuf {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("UmemBuf")
+            .field("frame", &self.frame)
+            .field("offset", &self.offset)
+            .field("len", &self.len)
+            .finish()
+    }
+}
+
+impl Deref for XdpBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            XdpBuf::External(ref buf) => buf.deref(),
+            XdpBuf::Umem(ref buf) => buf.deref(),
+        }
+    }
+}
+
+impl RuntimeBuf for XdpBuf {
+    fn empty() -> Self {
+        XdpBuf::External(Bytes::empty())
+    }
+
+    fn from_slice(bytes: &[u8]) -> Self {
+        XdpBuf::External(Bytes::from_slice(bytes))
+    }
+
+    fn adjust(&mut self, num_bytes: usize) {
+        match self {
+            XdpBuf::External(ref mut buf) => buf.adjust(num_bytes),
+            XdpBuf::Umem(ref mut buf) => {
+                assert!(num_bytes <= buf.len as usize);
+                buf.offset += num_bytes as u32;
+                buf.len -= num_bytes as u32;
+            },
+        }
+    }
+
+    fn trim(&mut self, num_bytes: usize) {
+        match self {
+            XdpBuf::External(ref mut buf) => buf.trim(num_bytes),
+            XdpBuf::Umem(ref mut buf) => {
+                assert!(num_bytes <= buf.len as usize);
+                buf.len -= num_bytes as u32;
+            },
+        }
+    }
+}
@@ -0,0 +1,608 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! AF_XDP sockets, driven through raw syscalls.
+//!
+//! Setting up a socket takes four shared rings (RX, TX, and the UMEM's fill and completion rings),
+//! an XSKMAP that maps NIC queues to sockets, and an XDP program that redirects every frame
+//! arriving on our queue into that map. The program is tiny, so we assemble it here instead of
+//! depending on libbpf.
+
+use crate::umem::Umem;
+use anyhow::{
+    format_err,
+    Error,
+};
+use std::{
+    mem,
+    ptr,
+    rc::Rc,
+    sync::atomic::{
+        AtomicU32,
+        Ordering,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+// These are not exported by the version of the libc crate that we depend on. Values come from
+// `linux/if_xdp.h` and `linux/bpf.h`.
+const AF_XDP: libc::c_int = 44;
+const SOL_XDP: libc::c_int = 283;
+
+const XDP_MMAP_OFFSETS: libc::c_int = 1;
+const XDP_RX_RING: libc::c_int = 2;
+const XDP_TX_RING: libc::c_int = 3;
+const XDP_UMEM_REG: libc::c_int = 4;
+const XDP_UMEM_FILL_RING: libc::c_int = 5;
+const XDP_UMEM_COMPLETION_RING: libc::c_int = 6;
+
+const XDP_PGOFF_RX_RING: libc::off_t = 0;
+const XDP_PGOFF_TX_RING: libc::off_t = 0x80000000;
+const XDP_UMEM_PGOFF_FILL_RING: libc::off_t = 0x100000000;
+const XDP_UMEM_PGOFF_COMPLETION_RING: libc::off_t = 0x180000000;
+
+const XDP_COPY: u16 = 1 << 1;
+const XDP_USE_NEED_WAKEUP: u16 = 1 << 3;
+const XDP_RING_NEED_WAKEUP: u32 = 1 << 0;
+
+const BPF_MAP_CREATE: libc::c_long = 0;
+const BPF_MAP_UPDATE_ELEM: libc::c_long = 2;
+const BPF_PROG_LOAD: libc::c_long = 5;
+const BPF_LINK_CREATE: libc::c_long = 28;
+
+const BPF_MAP_TYPE_XSKMAP: u32 = 17;
+const BPF_PROG_TYPE_XDP: u32 = 6;
+const BPF_XDP: u32 = 37;
+const XDP_FLAGS_SKB_MODE: u32 = 1 << 1;
+const XDP_PASS: i32 = 2;
+const BPF_FUNC_REDIRECT_MAP: i32 = 51;
+const BPF_PSEUDO_MAP_FD: u8 = 1;
+
+/// Number of NIC queues that the XSKMAP can cover.
+const XSKMAP_SIZE: u32 = 64;
+
+pub const RX_RING_SIZE: u32 = 2048;
+pub const TX_RING_SIZE: u32 = 2048;
+pub const FILL_RING_SIZE: u32 = 4096;
+pub const COMPLETION_RING_SIZE: u32 = 2048;
+
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct XdpDesc {
+    pub addr: u64,
+    pub len: u32,
+    pub options: u32,
+}
+
+#[repr(C)]
+struct XdpUmemReg {
+    addr: u64,
+    len: u64,
+    chunk_size: u32,
+    headroom: u32,
+    flags: u32,
+    tx_metadata_len: u32,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct XdpRingOffset {
+    producer: u64,
+    consumer: u64,
+    desc: u64,
+    flags: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct XdpMmapOffsets {
+    rx: XdpRingOffset,
+    tx: XdpRingOffset,
+    fr: XdpRingOffset,
+    cr: XdpRingOffset,
+}
+
+#[repr(C)]
+struct SockaddrXdp {
+    sxdp_family: u16,
+    sxdp_flags: u16,
+    sxdp_ifindex: u32,
+    sxdp_queue_id: u32,
+    sxdp_shared_umem_fd: u32,
+}
+
+#[repr(C)]
+struct BpfMapCreateAttr {
+    map_type: u32,
+    key_size: u32,
+    value_size: u32,
+    max_entries: u32,
+    map_flags: u32,
+}
+
+#[repr(C)]
+struct BpfMapUpdateAttr {
+    map_fd: u32,
+    pad: u32,
+    key: u64,
+    value: u64,
+    flags: u64,
+}
+
+#[repr(C)]
+struct BpfProgLoadAttr {
+    prog_type: u32,
+    insn_cnt: u32,
+    insns: u64,
+    license: u64,
+    log_level: u32,
+    log_size: u32,
+    log_buf: u64,
+    kern_version: u32,
+    prog_flags: u32,
+    prog_name: [u8; 16],
+    prog_ifindex: u32,
+    expected_attach_type: u32,
+}
+
+#[repr(C)]
+struct BpfLinkCreateAttr {
+    prog_fd: u32,
+    target_ifindex: u32,
+    attach_type: u32,
+    flags: u32,
+}
+
+#[repr(C)]
+struct BpfInsn {
+    code: u8,
+    regs: u8,
+    off: i16,
+    imm: i32,
+}
+
+/// One of the four rings shared with the kernel. `T` is `XdpDesc` for the RX and TX rings and a
+/// UMEM address (`u64`) for the fill and completion rings.
+pub struct Ring<T> {
+    map: *mut libc::c_void,
+    map_len: usize,
+    producer: *const AtomicU32,
+    consumer: *const AtomicU32,
+    flags: *const AtomicU32,
+    entries: *mut T,
+    size: u32,
+    /// Our view of the producer and consumer indices. We own one of them and refresh the other
+    /// from shared memory only when we run out of entries.
+    cached_prod: u32,
+    cached_cons: u32,
+}
+
+pub struct XdpSocket {
+    fd: libc::c_int,
+    map_fd: libc::c_int,
+    prog_fd: libc::c_int,
+    link_fd: libc::c_int,
+    pub rx: Ring<XdpDesc>,
+    pub tx: Ring<XdpDesc>,
+    pub fill: Ring<u64>,
+    pub completion: Ring<u64>,
+    /// Dropped after the socket is closed, since the kernel keeps using the UMEM until then.
+    _umem: Rc<Umem>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl<T: Copy> Ring<T> {
+    fn new(
+        fd: libc::c_int,
+        off: &XdpRingOffset,
+        size: u32,
+        pgoff: libc::off_t,
+    ) -> Result<Self, Error> {
+        let map_len = off.desc as usize + size as usize * mem::size_of::<T>();
+        let map = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                map_len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                pgoff,
+            )
+        };
+        if map == libc::MAP_FAILED {
+            return Err(format_err!(
+                "mmap of XDP ring failed: {:?}",
+                std::io::Error::last_os_error()
+            ));
+        }
+        let at = |offset: u64| unsafe { (map as *mut u8).add(offset as usize) };
+        let mut ring = Self {
+            map,
+            map_len,
+            producer: at(off.producer) as *const AtomicU32,
+            consumer: at(off.consumer) as *const AtomicU32,
+            flags: at(off.flags) as *const AtomicU32,
+            entries: at(off.desc) as *mut T,
+            size,
+            cached_prod: 0,
+            cached_cons: 0,
+        };
+        ring.cached_prod = ring.producer().load(Ordering::Relaxed);
+        ring.cached_cons = ring.consumer().load(Ordering::Relaxed);
+        Ok(ring)
+    }
+
+    fn producer(&self) -> &AtomicU32 {
+        unsafe { &*self.producer }
+    }
+
+    fn consumer(&self) -> &AtomicU32 {
+        unsafe { &*self.consumer }
+    }
+
+    /// Whether the kernel asked to be woken up before it will look at this ring again.
+    pub fn needs_wakeup(&self) -> bool {
+        unsafe { (*self.flags).load(Ordering::Relaxed) & XDP_RING_NEED_WAKEUP != 0 }
+    }
+
+    /// Producer side: number of entries (up to `n`) that can be written.
+    pub fn free(&mut self, n: u32) -> u32 {
+        let mut free = self.size - self.cached_prod.wrapping_sub(self.cached_cons);
+        if free < n {
+            self.cached_cons = self.consumer().load(Ordering::Acquire);
+            free = self.size - self.cached_prod.wrapping_sub(self.cached_cons);
+        }
+        free.min(n)
+    }
+
+    /// Producer side: writes the `i`-th entry past the ones already submitted.
+    pub fn write(&mut self, i: u32, entry: T) {
+        let ix = self.cached_prod.wrapping_add(i) & (self.size - 1);
+        unsafe { ptr::write_volatile(self.entries.add(ix as usize), entry) };
+    }
+
+    /// Producer side: hands the next `n` written entries to the kernel.
+    pub fn submit(&mut self, n: u32) {
+        self.cached_prod = self.cached_prod.wrapping_add(n);
+        self.producer().store(self.cached_prod, Ordering::Release);
+    }
+
+    /// Consumer side: number of entries (up to `n`) ready to be read.
+    pub fn available(&mut self, n: u32) -> u32 {
+        let mut avail = self.cached_prod.wrapping_sub(self.cached_cons);
+        if avail < n {
+            self.cached_prod = self.producer().load(Ordering::Acquire);
+            avail = self.cached_prod.wrapping_sub(self.cached_cons);
+        }
+        avail.min(n)
+    }
+
+    /// Consumer side: reads the `i`-th entry past the ones already released.
+    pub fn read(&self, i: u32) -> T {
+        let ix = self.cached_cons.wrapping_add(i) & (self.size - 1);
+        unsafe { ptr::read_volatile(self.entries.add(ix as usize)) }
+    }
+
+    /// Consumer side: hands the next `n` read entries back to the kernel.
+    pub fn release(&mut self, n: u32) {
+        self.cached_cons = self.cached_cons.wrapping_add(n);
+        self.consumer().store(self.cached_cons, Ordering::Release);
+    }
+
+    /// Producer side: entries submitted that the kernel hasn't consumed yet.
+    pub fn outstanding(&self) -> u32 {
+        self.cached_prod
+            .wrapping_sub(self.consumer().load(Ordering::Acquire))
+    }
+}
+
+impl XdpSocket {
+    /// Creates an AF_XDP socket on `queue_id` of `ifindex`, backed by `umem`, and redirects the
+    /// queue's traffic to it. The socket runs in copy mode with a generic (SKB) XDP program, which
+    /// works on any driver.
+    pub fn new(umem: Rc<Umem>, ifindex: u32, queue_id: u32) -> Result<Self, Error> {
+        let fd = unsafe { libc::socket(AF_XDP, libc::SOCK_RAW | libc::SOCK_CLOEXEC, 0) };
+        if fd < 0 {
+            return Err(format_err!(
+                "AF_XDP socket failed: {:?}",
+                std::io::Error::last_os_error()
+            ));
+        }
+        // From here on, dropping `sock` cleans up whatever has been set up so far.
+        let mut sock = PartialSocket {
+            fd,
+            map_fd: -1,
+            prog_fd: -1,
+            link_fd: -1,
+        };
+
+        let reg = XdpUmemReg {
+            addr: umem.base() as u64,
+            len: umem.len() as u64,
+            chunk_size: crate::umem::FRAME_SIZE as u32,
+            headroom: 0,
+            flags: 0,
+            tx_metadata_len: 0,
+        };
+        setsockopt(fd, XDP_UMEM_REG, &reg)?;
+        setsockopt(fd, XDP_UMEM_FILL_RING, &FILL_RING_SIZE)?;
+        setsockopt(fd, XDP_UMEM_COMPLETION_RING, &COMPLETION_RING_SIZE)?;
+        setsockopt(fd, XDP_RX_RING, &RX_RING_SIZE)?;
+        setsockopt(fd, XDP_TX_RING, &TX_RING_SIZE)?;
+
+        let mut off = XdpMmapOffsets::default();
+        let mut optlen = mem::size_of::<XdpMmapOffsets>() as libc::socklen_t;
+        let ret = unsafe {
+            libc::getsockopt(
+                fd,
+                SOL_XDP,
+                XDP_MMAP_OFFSETS,
+                &mut off as *mut _ as *mut libc::c_void,
+                &mut optlen,
+            )
+        };
+        if ret != 0 || optlen as usize != mem::size_of::<XdpMmapOffsets>() {
+            return Err(format_err!(
+                "XDP_MMAP_OFFSETS failed (ret={}, optlen={}): {:?}",
+                ret,
+                optlen,
+                std::io::Error::last_os_error()
+            ));
+        }
+
+        let rx = Ring::new(fd, &off.rx, RX_RING_SIZE, XDP_PGOFF_RX_RING)?;
+        let tx = Ring::new(fd, &off.tx, TX_RING_SIZE, XDP_PGOFF_TX_RING)?;
+        let fill = Ring::new(fd, &off.fr, FILL_RING_SIZE, XDP_UMEM_PGOFF_FILL_RING)?;
+        let completion = Ring::new(
+            fd,
+            &off.cr,
+            COMPLETION_RING_SIZE,
+            XDP_UMEM_PGOFF_COMPLETION_RING,
+        )?;
+
+        let sxdp = SockaddrXdp {
+            sxdp_family: AF_XDP as u16,
+            sxdp_flags: XDP_COPY | XDP_USE_NEED_WAKEUP,
+            sxdp_ifindex: ifindex,
+            sxdp_queue_id: queue_id,
+            sxdp_shared_umem_fd: 0,
+        };
+        let ret = unsafe {
+            libc::bind(
+                fd,
+                &sxdp as *const _ as *const libc::sockaddr,
+                mem::size_of::<SockaddrXdp>() as libc::socklen_t,
+            )
+        };
+        if ret != 0 {
+            return Err(format_err!(
+                "bind of AF_XDP socket failed: {:?}",
+                std::io::Error::last_os_error()
+            ));
+        }
+
+        sock.map_fd = create_xskmap()?;
+        update_xskmap(sock.map_fd, queue_id, fd)?;
+        sock.prog_fd = load_redirect_program(sock.map_fd)?;
+        sock.link_fd = attach_xdp(sock.prog_fd, ifindex)?;
+
+        let socket = Self {
+            fd: sock.fd,
+            map_fd: sock.map_fd,
+            prog_fd: sock.prog_fd,
+            link_fd: sock.link_fd,
+            rx,
+            tx,
+            fill,
+            completion,
+            _umem: umem,
+        };
+        mem::forget(sock);
+        Ok(socket)
+    }
+
+    pub fn fd(&self) -> libc::c_int {
+        self.fd
+    }
+
+    /// Tells the kernel to process the TX ring. In copy mode this is what actually sends frames,
+    /// and each call sends at most a small batch; whatever is left goes out with the next kick.
+    pub fn kick_tx(&self) {
+        unsafe {
+            libc::sendto(self.fd, ptr::null(), 0, libc::MSG_DONTWAIT, ptr::null(), 0);
+        }
+    }
+
+    /// Tells the kernel that the fill ring has been replenished.
+    pub fn kick_fill(&self) {
+        unsafe {
+            libc::recvfrom(
+                self.fd,
+                ptr::null_mut(),
+                0,
+                libc::MSG_DONTWAIT,
+                ptr::null_mut(),
+                ptr::null_mut(),
+            );
+        }
+    }
+}
+
+/// Descriptors owned by a socket that is still being set up.
+struct PartialSocket {
+    fd: libc::c_int,
+    map_fd: libc::c_int,
+    prog_fd: libc::c_int,
+    link_fd: libc::c_int,
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.map, self.map_len);
+        }
+    }
+}
+
+impl Drop for PartialSocket {
+    fn drop(&mut self) {
+        close_fds(&[self.link_fd, self.prog_fd, self.map_fd, self.fd]);
+    }
+}
+
+impl Drop for XdpSocket {
+    fn drop(&mut self) {
+        // Closing the link detaches the program. The rings are unmapped afterwards, when the
+        // fields are dropped.
+        close_fds(&[self.link_fd, self.prog_fd, self.map_fd, self.fd]);
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+fn close_fds(fds: &[libc::c_int]) {
+    for &fd in fds {
+        if fd >= 0 {
+            unsafe { libc::close(fd) };
+        }
+    }
+}
+
+fn setsockopt<T>(fd: libc::c_int, name: libc::c_int, value: &T) -> Result<(), Error> {
+    let ret = unsafe {
+        libc::setsockopt(
+            fd,
+            SOL_XDP,
+            name,
+            value as *const T as *const libc::c_void,
+            mem::size_of::<T>() as libc::socklen_t,
+        )
+    };
+    if ret != 0 {
+        return Err(format_err!(
+            "setsockopt({}) failed: {:?}",
+            name,
+            std::io::Error::last_os_error()
+        ));
+    }
+    Ok(())
+}
+
+fn bpf<T>(cmd: libc::c_long, attr: &T) -> Result<libc::c_int, Error> {
+    let ret = unsafe {
+        libc::syscall(
+            libc::SYS_bpf,
+            cmd,
+            attr as *const T,
+            mem::size_of::<T>() as libc::c_uint,
+        )
+    };
+    if ret < 0 {
+        return Err(format_err!(
+            "bpf({}) failed: {:?}",
+            cmd,
+            std::io::Error::last_os_error()
+        ));
+    }
+    Ok(ret as libc::c_int)
+}
+
+fn create_xskmap() -> Result<libc::c_int, Error> {
+    let attr = BpfMapCreateAttr {
+        map_type: BPF_MAP_TYPE_XSKMAP,
+        key_size: 4,
+        value_size: 4,
+        max_entries: XSKMAP_SIZE,
+        map_flags: 0,
+    };
+    bpf(BPF_MAP_CREATE, &attr)
+}
+
+fn update_xskmap(map_fd: libc::c_int, queue_id: u32, xsk_fd: libc::c_int) -> Result<(), Error> {
+    if queue_id >= XSKMAP_SIZE {
+        return Err(format_err!("Queue {} is out of range", queue_id));
+    }
+    let value = xsk_fd as u32;
+    let attr = BpfMapUpdateAttr {
+        map_fd: map_fd as u32,
+        pad: 0,
+        key: &queue_id as *const u32 as u64,
+        value: &value as *const u32 as u64,
+        flags: 0,
+    };
+    bpf(BPF_MAP_UPDATE_ELEM, &attr)?;
+    Ok(())
+}
+
+/// Loads the equivalent of:
+///
+/// ```c
+/// int prog(struct xdp_md *ctx) {
+///     return bpf_redirect_map(&xskmap, ctx->rx_queue_index, XDP_PASS);
+/// }
+/// ```
+///
+/// Frames that arrive on a queue without a socket fall through to the kernel stack.
+fn load_redirect_program(map_fd: libc::c_int) -> Result<libc::c_int, Error> {
+    let insn = |code: u8, dst: u8, src: u8, off: i16, imm: i32| BpfInsn {
+        code,
+        regs: (src << 4) | dst,
+        off,
+        imm,
+    };
+    let insns = [
+        // r2 = ((struct xdp_md *)r1)->rx_queue_index
+        insn(0x61, 2, 1, 16, 0),
+        // r1 = map_fd (a 64-bit immediate spanning two instructions)
+        insn(0x18, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        insn(0x00, 0, 0, 0, 0),
+        // r3 = XDP_PASS
+        insn(0xb7, 3, 0, 0, XDP_PASS),
+        // r0 = bpf_redirect_map(r1, r2, r3)
+        insn(0x85, 0, 0, 0, BPF_FUNC_REDIRECT_MAP),
+        // return r0
+        insn(0x95, 0, 0, 0, 0),
+    ];
+    let license = b"Dual MIT/GPL\0";
+    let mut prog_name = [0_u8; 16];
+    prog_name[..11].copy_from_slice(b"dmtr_xsk_rx");
+    let attr = BpfProgLoadAttr {
+        prog_type: BPF_PROG_TYPE_XDP,
+        insn_cnt: insns.len() as u32,
+        insns: insns.as_ptr() as u64,
+        license: license.as_ptr() as u64,
+        log_level: 0,
+        log_size: 0,
+        log_buf: 0,
+        kern_version: 0,
+        prog_flags: 0,
+        prog_name,
+        prog_ifindex: 0,
+        expected_attach_type: BPF_XDP,
+    };
+    bpf(BPF_PROG_LOAD, &attr)
+}
+
+/// Attaches `prog_fd` to `ifindex` in generic (SKB) mode. The program stays attached for as long
+/// as the returned link is open.
+fn attach_xdp(prog_fd: libc::c_int, ifindex: u32) -> Result<libc::c_int, Error> {
+    let attr = BpfLinkCreateAttr {
+        prog_fd: prog_fd as u32,
+        target_ifindex: ifindex,
+        attach_type: BPF_XDP,
+        flags: XDP_FLAGS_SKB_MODE,
+    };
+    bpf(BPF_LINK_CREATE, &attr)
+}
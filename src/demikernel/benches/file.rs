@@ -0,0 +1,149 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Sequential append throughput of a file queue, against blocking `write(2)`.
+//!
+//! Writes `TOTAL_MB` megabytes to `FILE` in `SIZE`-byte blocks, once through a file queue with
+//! up to `DEPTH` pushes in flight and once with back-to-back `write` calls. `DIRECT=1` opens the
+//! file with `O_DIRECT` for both; `SYNC=1` adds an `fsync` at the end of each run, so that the
+//! page cache doesn't hide the device. Prints one line of `key=value` results per method.
+
+use demikernel::{
+    file,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+    },
+    pool,
+};
+use std::{
+    collections::VecDeque,
+    env,
+    ffi::CString,
+    fs,
+    mem,
+    time::Instant,
+};
+
+fn env_usize(name: &str, default: usize) -> usize {
+    env::var(name).map_or(default, |s| s.parse().expect("invalid number"))
+}
+
+fn report(method: &str, size: usize, depth: usize, bytes: usize, secs: f64) {
+    println!(
+        "file_bench method={} size={} depth={} bytes={} mbps={:.1} us_per_block={:.2}",
+        method,
+        size,
+        depth,
+        bytes,
+        bytes as f64 / secs / 1e6,
+        secs * 1e6 / (bytes / size) as f64
+    );
+}
+
+fn open_flags(direct: bool) -> libc::c_int {
+    let flags = libc::O_WRONLY | libc::O_CREAT | libc::O_TRUNC;
+    if direct {
+        flags | libc::O_DIRECT
+    } else {
+        flags
+    }
+}
+
+fn run_queue(path: &CString, size: usize, blocks: usize, depth: usize, direct: bool, sync: bool) {
+    let mut qd = 0;
+    assert_eq!(
+        file::open(&mut qd, path.as_ptr(), open_flags(direct), 0o644),
+        0
+    );
+    // Each push in flight needs a buffer of its own.
+    let sgas: Vec<_> = (0..depth)
+        .map(|i| {
+            let sga = pool::alloc_sgarray(size);
+            unsafe { (sga.sga_segs[0].sgaseg_buf as *mut u8).write_bytes(i as u8, size) };
+            sga
+        })
+        .collect();
+    let mut in_flight: VecDeque<(dmtr_qtoken_t, usize)> = VecDeque::with_capacity(depth);
+    let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+
+    let start = Instant::now();
+    for i in 0..blocks {
+        let buf = if in_flight.len() == depth {
+            let (qt, buf) = in_flight.pop_front().unwrap();
+            assert_eq!(file::wait(&mut qr, qt, None), 0, "push failed");
+            buf
+        } else {
+            i
+        };
+        let mut qt = 0;
+        assert_eq!(file::push(&mut qt, qd, &sgas[buf]), 0);
+        in_flight.push_back((qt, buf));
+    }
+    for (qt, _) in in_flight {
+        assert_eq!(file::wait(&mut qr, qt, None), 0, "push failed");
+    }
+    if sync {
+        // The queue owns the descriptor, so sync through a second one.
+        let fd = unsafe { libc::open(path.as_ptr(), libc::O_WRONLY) };
+        unsafe { libc::fsync(fd) };
+        unsafe { libc::close(fd) };
+    }
+    report(
+        "io_uring",
+        size,
+        depth,
+        size * blocks,
+        start.elapsed().as_secs_f64(),
+    );
+
+    assert_eq!(file::close(qd), 0);
+    sgas.iter().for_each(pool::free_sgarray);
+}
+
+fn run_write(path: &CString, size: usize, blocks: usize, direct: bool, sync: bool) {
+    let fd = unsafe { libc::open(path.as_ptr(), open_flags(direct), 0o644) };
+    assert!(fd >= 0, "failed to open file");
+    // A pool buffer, so that it is aligned for `O_DIRECT` just like the queue's.
+    let buf = pool::alloc(size);
+    unsafe { buf.write_bytes(1, size) };
+
+    let start = Instant::now();
+    for _ in 0..blocks {
+        let n = unsafe { libc::write(fd, buf as *const _, size) };
+        assert_eq!(n, size as isize, "write failed");
+    }
+    if sync {
+        unsafe { libc::fsync(fd) };
+    }
+    report(
+        "write",
+        size,
+        1,
+        size * blocks,
+        start.elapsed().as_secs_f64(),
+    );
+
+    unsafe { libc::close(fd) };
+    unsafe { pool::free(buf, size) };
+}
+
+fn main() {
+    let path = env::var("FILE").unwrap_or_else(|_| "dmtr-file-bench.dat".to_string());
+    let size = env_usize("SIZE", 4096);
+    let total = env_usize("TOTAL_MB", 256) << 20;
+    let depth = env_usize("DEPTH", 32).max(1);
+    let direct = env_usize("DIRECT", 0) != 0;
+    let sync = env_usize("SYNC", 0) != 0;
+    assert!(
+        size > 0 && size <= pool::MAX_SIZE,
+        "SIZE must be at most {}",
+        pool::MAX_SIZE
+    );
+    let blocks = total / size;
+
+    let cpath = CString::new(path.clone()).unwrap();
+    run_queue(&cpath, size, blocks, depth, direct, sync);
+    run_write(&cpath, size, blocks, direct, sync);
+    let _ = fs::remove_file(&path);
+}
@@ -0,0 +1,91 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Buffer pool allocation throughput, against `malloc`.
+//!
+//! For each size in `SIZES`, allocates and frees `ITERATIONS` buffers, `BATCH` at a time: every
+//! buffer of a batch is allocated, written to once, then every one is freed. A batch of 1 is the
+//! best case for either allocator; larger batches look more like buffers held across a round of
+//! pushes. Prints one line of `key=value` results per allocator and size.
+
+use demikernel::pool;
+use std::{
+    env,
+    time::Instant,
+};
+
+fn env_usize(name: &str, default: usize) -> usize {
+    env::var(name).map_or(default, |s| s.parse().expect("invalid number"))
+}
+
+fn run(
+    name: &str,
+    size: usize,
+    batch: usize,
+    iterations: usize,
+    alloc: impl Fn(usize) -> *mut u8,
+    free: impl Fn(*mut u8, usize),
+) {
+    let mut bufs = Vec::with_capacity(batch);
+    let start = Instant::now();
+    for _ in 0..(iterations / batch) {
+        for _ in 0..batch {
+            let buf = alloc(size);
+            unsafe { buf.write_volatile(1) };
+            bufs.push(buf);
+        }
+        for buf in bufs.drain(..) {
+            free(buf, size);
+        }
+    }
+    let secs = start.elapsed().as_secs_f64();
+    let ops = iterations / batch * batch;
+    println!(
+        "pool_bench allocator={} size={} batch={} ops={} ns_per_op={:.1} mops={:.2}",
+        name,
+        size,
+        batch,
+        ops,
+        secs * 1e9 / ops as f64,
+        ops as f64 / secs / 1e6
+    );
+}
+
+fn main() {
+    let sizes: Vec<usize> = env::var("SIZES")
+        .unwrap_or_else(|_| "64,1500,9000,65536".to_string())
+        .split(',')
+        .map(|s| s.trim().parse().expect("invalid size"))
+        .collect();
+    let batch = env_usize("BATCH", 32).max(1);
+    let iterations = env_usize("ITERATIONS", 10_000_000);
+
+    for &size in &sizes {
+        // Warm the pool up, so that it doesn't pay for carving regions in the measured run.
+        let warm: Vec<*mut u8> = (0..batch).map(|_| pool::alloc(size)).collect();
+        for buf in warm {
+            unsafe { pool::free(buf, size) };
+        }
+        run(
+            "pool",
+            size,
+            batch,
+            iterations,
+            pool::alloc,
+            |p, n| unsafe { pool::free(p, n) },
+        );
+        run(
+            "malloc",
+            size,
+            batch,
+            iterations,
+            |n| unsafe { libc::malloc(n) as *mut u8 },
+            |p, _| unsafe { libc::free(p as *mut _) },
+        );
+    }
+    let s = pool::stats();
+    println!(
+        "pool_stats allocs={} cache_hits={} refills={} flushes={} regions={}",
+        s.allocs, s.cache_hits, s.refills, s.flushes, s.regions
+    );
+}
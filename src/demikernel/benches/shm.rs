@@ -0,0 +1,242 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Latency and throughput of a shared-memory queue between two processes, against a Unix domain
+//! socket pair.
+//!
+//! Forks a child that echoes `ROUNDS` messages of `SIZE` bytes back to the parent, then takes
+//! `COUNT` more messages one way. The parent pushes buffers from the queue's arena, so its side
+//! of every transfer is zero-copy; the echo is a copy. `SLEEP=1` makes both processes sleep
+//! rather than spin once `SPIN_POLLS` polls have found nothing, which matters when they share a
+//! core. Prints one line of `key=value` results per method.
+
+use demikernel::{
+    interop::{
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
+    shm,
+    wait::{
+        self,
+        WaitPolicy,
+    },
+};
+use libc::c_int;
+use std::{
+    env,
+    ffi::CString,
+    mem,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+/// One queue each way. Names carry the parent's pid, so that runs don't trip over each other's
+/// leftovers.
+struct Queues {
+    ping: c_int,
+    pong: c_int,
+}
+
+fn env_usize(name: &str, default: usize) -> usize {
+    env::var(name).map_or(default, |s| s.parse().expect("invalid number"))
+}
+
+fn report(method: &str, size: usize, rtts: &mut Vec<Duration>, count: usize, secs: f64) {
+    rtts.sort();
+    let pct = |p: usize| rtts[(rtts.len() - 1) * p / 100].as_secs_f64() * 1e6;
+    println!(
+        "shm_bench method={} size={} rtt_p50_us={:.2} rtt_p99_us={:.2} msgs_per_sec={:.0} \
+         mbps={:.1}",
+        method,
+        size,
+        pct(50),
+        pct(99),
+        count as f64 / secs,
+        (count * size) as f64 / secs / 1e6
+    );
+}
+
+fn open_queues(tag: &str) -> Queues {
+    let open = |dir: &str| {
+        let name = CString::new(format!("bench-{}-{}", dir, tag)).unwrap();
+        let mut qd = 0;
+        assert_eq!(shm::open(&mut qd, name.as_ptr(), 1024, 0), 0);
+        qd
+    };
+    Queues {
+        ping: open("ping"),
+        pong: open("pong"),
+    }
+}
+
+fn push(qd: c_int, sga: &dmtr_sgarray_t) {
+    let mut qt = 0;
+    assert_eq!(shm::push(&mut qt, qd, sga), 0);
+    let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+    assert_eq!(shm::wait(&mut qr, qt, None), 0);
+}
+
+fn pop(qd: c_int) -> dmtr_sgarray_t {
+    let mut qt = 0;
+    assert_eq!(shm::pop(&mut qt, qd), 0);
+    let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+    assert_eq!(shm::wait(&mut qr, qt, None), 0);
+    unsafe { qr.qr_value.sga }
+}
+
+/// Pushes `size` bytes from the arena, retrying while the peer holds every buffer.
+fn push_new(qd: c_int, size: usize, byte: u8) {
+    let mut sga: dmtr_sgarray_t = unsafe { mem::zeroed() };
+    while shm::alloc(&mut sga, qd, size) == libc::ENOBUFS {}
+    unsafe { (sga.sga_segs[0].sgaseg_buf as *mut u8).write(byte) };
+    push(qd, &sga);
+}
+
+fn child_shm(tag: &str, rounds: usize, count: usize) {
+    let q = open_queues(tag);
+    for _ in 0..rounds {
+        let sga = pop(q.ping);
+        push(q.pong, &sga);
+        assert!(shm::free_sgarray(&sga));
+    }
+    for _ in 0..count {
+        let sga = pop(q.ping);
+        assert!(shm::free_sgarray(&sga));
+    }
+    push_new(q.pong, 1, 0);
+    assert_eq!(shm::close(q.ping), 0);
+    assert_eq!(shm::close(q.pong), 0);
+}
+
+fn parent_shm(tag: &str, size: usize, rounds: usize, count: usize) {
+    let q = open_queues(tag);
+    let mut rtts = Vec::with_capacity(rounds);
+    for i in 0..rounds {
+        let start = Instant::now();
+        push_new(q.ping, size, i as u8);
+        let sga = pop(q.pong);
+        rtts.push(start.elapsed());
+        assert_eq!(
+            unsafe { *(sga.sga_segs[0].sgaseg_buf as *const u8) },
+            i as u8
+        );
+        assert!(shm::free_sgarray(&sga));
+    }
+    let start = Instant::now();
+    for i in 0..count {
+        push_new(q.ping, size, i as u8);
+    }
+    let sga = pop(q.pong);
+    let secs = start.elapsed().as_secs_f64();
+    assert!(shm::free_sgarray(&sga));
+    report("shm", size, &mut rtts, count, secs);
+    assert_eq!(shm::close(q.ping), 0);
+    assert_eq!(shm::close(q.pong), 0);
+}
+
+fn child_socket(fd: c_int, size: usize, rounds: usize, count: usize) {
+    let mut buf = vec![0_u8; size];
+    for _ in 0..rounds {
+        let n = unsafe { libc::recv(fd, buf.as_mut_ptr() as *mut _, size, 0) };
+        assert_eq!(
+            unsafe { libc::send(fd, buf.as_ptr() as *const _, n as usize, 0) },
+            n
+        );
+    }
+    for _ in 0..count {
+        assert_eq!(
+            unsafe { libc::recv(fd, buf.as_mut_ptr() as *mut _, size, 0) },
+            size as isize
+        );
+    }
+    assert_eq!(unsafe { libc::send(fd, buf.as_ptr() as *const _, 1, 0) }, 1);
+}
+
+fn parent_socket(fd: c_int, size: usize, rounds: usize, count: usize) {
+    let mut buf = vec![0_u8; size];
+    let mut rtts = Vec::with_capacity(rounds);
+    for i in 0..rounds {
+        let start = Instant::now();
+        buf[0] = i as u8;
+        assert_eq!(
+            unsafe { libc::send(fd, buf.as_ptr() as *const _, size, 0) },
+            size as isize
+        );
+        assert_eq!(
+            unsafe { libc::recv(fd, buf.as_mut_ptr() as *mut _, size, 0) },
+            size as isize
+        );
+        rtts.push(start.elapsed());
+        assert_eq!(buf[0], i as u8);
+    }
+    let start = Instant::now();
+    for _ in 0..count {
+        assert_eq!(
+            unsafe { libc::send(fd, buf.as_ptr() as *const _, size, 0) },
+            size as isize
+        );
+    }
+    assert_eq!(
+        unsafe { libc::recv(fd, buf.as_mut_ptr() as *mut _, size, 0) },
+        1
+    );
+    report(
+        "unix_socket",
+        size,
+        &mut rtts,
+        count,
+        start.elapsed().as_secs_f64(),
+    );
+}
+
+/// Runs `child` in a forked process and `parent` here, and waits for the child.
+fn fork(child: impl FnOnce(), parent: impl FnOnce()) {
+    let pid = unsafe { libc::fork() };
+    assert!(pid >= 0, "fork failed");
+    if pid == 0 {
+        child();
+        unsafe { libc::_exit(0) };
+    }
+    parent();
+    let mut status = 0;
+    unsafe { libc::waitpid(pid, &mut status, 0) };
+    assert!(
+        libc::WIFEXITED(status) && libc::WEXITSTATUS(status) == 0,
+        "child failed"
+    );
+}
+
+fn main() {
+    let size = env_usize("SIZE", 64);
+    let rounds = env_usize("ROUNDS", 100_000).max(1);
+    let count = env_usize("COUNT", 1_000_000);
+    if env_usize("SLEEP", 0) != 0 {
+        wait::set_policy(WaitPolicy::Sleep {
+            spin_polls: env_usize("SPIN_POLLS", wait::DEFAULT_SPIN_POLLS as usize) as u32,
+            max_sleep: wait::DEFAULT_MAX_SLEEP,
+        });
+    }
+    assert!(
+        size > 0 && size <= shm::DEFAULT_BUF_SIZE,
+        "SIZE must be at most {}",
+        shm::DEFAULT_BUF_SIZE
+    );
+
+    let tag = std::process::id().to_string();
+    fork(
+        || child_shm(&tag, rounds, count),
+        || parent_shm(&tag, size, rounds, count),
+    );
+
+    let mut fds = [0; 2];
+    let ret = unsafe { libc::socketpair(libc::AF_UNIX, libc::SOCK_SEQPACKET, 0, fds.as_mut_ptr()) };
+    assert_eq!(ret, 0, "socketpair failed");
+    fork(
+        || child_socket(fds[1], size, rounds, count),
+        || parent_socket(fds[0], size, rounds, count),
+    );
+    unsafe { libc::close(fds[0]) };
+    unsafe { libc::close(fds[1]) };
+}
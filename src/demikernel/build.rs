@@ -0,0 +1,43 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Takes the layout constants of the C interface from `include/dmtr/types.h`, so that the Rust side
+//! can check at build time that its definitions still agree with the header.
+
+use std::{
+    env,
+    fs,
+    path::Path,
+};
+
+const TYPES_H: &str = "../../include/dmtr/types.h";
+
+fn main() {
+    println!("cargo:rerun-if-changed={}", TYPES_H);
+    let header = fs::read_to_string(TYPES_H).expect("Cannot read dmtr/types.h");
+    let maxsize: usize = define(&header, "DMTR_SGARRAY_MAXSIZE")
+        .parse()
+        .expect("DMTR_SGARRAY_MAXSIZE is not a number");
+
+    let out_path = Path::new(&env::var("OUT_DIR").unwrap()).join("types_h.rs");
+    fs::write(
+        out_path,
+        format!("pub const DMTR_SGARRAY_MAXSIZE: usize = {};\n", maxsize),
+    )
+    .unwrap();
+}
+
+/// Returns the value of `#define name value` in `header`.
+fn define<'a>(header: &'a str, name: &str) -> &'a str {
+    header
+        .lines()
+        .filter_map(|line| {
+            let mut words = line.split_whitespace();
+            match (words.next(), words.next(), words.next()) {
+                (Some("#define"), Some(n), Some(value)) if n == name => Some(value),
+                _ => None,
+            }
+        })
+        .next()
+        .unwrap_or_else(|| panic!("{} is not defined in dmtr/types.h", name))
+}
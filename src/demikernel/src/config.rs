@@ -1,6 +1,12 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 
+use crate::{
+    file::FileConfig,
+    pool::PoolConfig,
+    shm::ShmConfig,
+    wait::WaitPolicy,
+};
 use anyhow::{
     format_err,
     Error,
@@ -51,6 +57,55 @@ pub struct Config {
     pub local_ipv4_addr: Ipv4Addr,
     pub local_link_addr: MacAddress,
     pub local_interface_name: String,
+    pub num_cores: usize,
+    pub wait_policy: WaitPolicy,
+    pub track_latency: bool,
+    pub pool: PoolConfig,
+    pub file: FileConfig,
+    pub shm: ShmConfig,
+    pub mempool: MempoolConfig,
+}
+
+/// Sizes of the DPDK memory pools behind each catnip queue. Pool sizes left unset are derived from
+/// `connections`, when given, and otherwise keep catnip's defaults.
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct MempoolConfig {
+    /// Connections the application expects to have open at once, across all queues.
+    pub connections: Option<usize>,
+    pub header_pool_size: Option<usize>,
+    pub indirect_pool_size: Option<usize>,
+    pub body_pool_size: Option<usize>,
+    /// Buffers each pool keeps in its per-core cache.
+    pub cache_size: Option<usize>,
+}
+
+impl MempoolConfig {
+    /// Parses the `dpdk.mempool` section of the configuration.
+    pub fn parse(
+        connections: Option<i64>,
+        header_pool_size: Option<i64>,
+        indirect_pool_size: Option<i64>,
+        body_pool_size: Option<i64>,
+        cache_size: Option<i64>,
+    ) -> Self {
+        let positive = |n: Option<i64>, name: &str| match n {
+            Some(n) if n > 0 => Some(n as usize),
+            Some(..) => panic!("Invalid mempool {}", name),
+            None => None,
+        };
+        let cache_size = match cache_size {
+            Some(n) if n >= 0 => Some(n as usize),
+            Some(..) => panic!("Invalid mempool cache_size"),
+            None => None,
+        };
+        Self {
+            connections: positive(connections, "connections"),
+            header_pool_size: positive(header_pool_size, "header_pool_size"),
+            indirect_pool_size: positive(indirect_pool_size, "indirect_pool_size"),
+            body_pool_size: positive(body_pool_size, "body_pool_size"),
+            cache_size,
+        }
+    }
 }
 
 impl Config {
@@ -140,6 +195,52 @@ impl Config {
         let udp_checksum_offload = env::var("UDP_CHECKSUM_OFFLOAD").is_ok();
         let tcp_checksum_offload = env::var("TCP_CHECKSUM_OFFLOAD").is_ok();
 
+        // Number of cores (and thus NIC queue pairs) the application will drive.
+        let num_cores: usize = match config_obj["dpdk"]["num_cores"].as_i64() {
+            Some(n) if n > 0 => n as usize,
+            Some(..) => panic!("Invalid num_cores"),
+            None => 1,
+        };
+
+        // What threads do while they wait for completions.
+        let wait_policy = WaitPolicy::parse(
+            config_obj["wait"]["policy"].as_str(),
+            config_obj["wait"]["spin_polls"].as_i64(),
+            config_obj["wait"]["max_sleep_us"].as_i64(),
+        );
+
+        // Whether to time every operation from submission to completion, for `dmtr_stats`.
+        let track_latency = config_obj["stats"]["latency"].as_bool().unwrap_or(false);
+
+        // Where the buffers handed out by `dmtr_sgaalloc` come from.
+        let pool = PoolConfig::parse(
+            config_obj["pool"]["hugepages"].as_bool(),
+            config_obj["pool"]["populate"].as_bool(),
+            config_obj["pool"]["numa_node"].as_i64(),
+            config_obj["pool"]["reserve_mb"].as_i64(),
+            config_obj["pool"]["cache_size"].as_i64(),
+        );
+
+        // How `dmtr_open` queues drive their io_uring.
+        let file = FileConfig::parse(
+            config_obj["file"]["ring_entries"].as_i64(),
+            config_obj["file"]["pop_size"].as_i64(),
+            config_obj["file"]["fixed_buffers"].as_bool(),
+        );
+
+        // Where `dmtr_shmqueue` regions live.
+        let shm = ShmConfig::parse(config_obj["shm"]["dir"].as_str());
+
+        // How many buffers catnip's DPDK memory pools hold.
+        let mempool_obj = &config_obj["dpdk"]["mempool"];
+        let mempool = MempoolConfig::parse(
+            mempool_obj["connections"].as_i64(),
+            mempool_obj["header_pool_size"].as_i64(),
+            mempool_obj["indirect_pool_size"].as_i64(),
+            mempool_obj["body_pool_size"].as_i64(),
+            mempool_obj["cache_size"].as_i64(),
+        );
+
         let buffer_size: usize = 64;
 
         Self {
@@ -151,6 +252,13 @@ impl Config {
             local_interface_name: local_interface_name.to_string(),
             mss,
             mtu,
+            num_cores,
+            wait_policy,
+            track_latency,
+            pool,
+            file,
+            shm,
+            mempool,
             udp_checksum_offload,
             tcp_checksum_offload,
             config_obj: config_obj.clone(),
@@ -0,0 +1,268 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Completion queues: sets of queue tokens that are registered once and harvested in batches, so
+//! that an application with many outstanding operations doesn't have to hand its whole token array
+//! to `dmtr_wait_any` for every single completion.
+
+use crate::{
+    dispatch::Dispatch,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+};
+use catnip::{
+    file_table::FileDescriptor,
+    libos::LibOS,
+    runtime::Runtime,
+};
+use libc::c_int;
+use std::{
+    cell::Cell,
+    cmp,
+    future,
+    slice,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+#[derive(Default)]
+pub struct CompletionQueue {
+    qts: Vec<dmtr_qtoken_t>,
+    /// Scratch space for the offsets of the tokens that completed in a harvest.
+    ready: Vec<c_int>,
+}
+
+#[derive(Default)]
+pub struct CompletionQueueTable {
+    cqs: Vec<Option<CompletionQueue>>,
+    free: Vec<usize>,
+}
+
+thread_local! {
+    /// Token of a background operation that never completes, for `run_background_work`.
+    static IDLE_QT: Cell<Option<dmtr_qtoken_t>> = Cell::new(None);
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl CompletionQueue {
+    pub fn new() -> Self {
+        Self {
+            qts: Vec::new(),
+            ready: Vec::new(),
+        }
+    }
+
+    pub fn add(&mut self, qt: dmtr_qtoken_t) {
+        self.qts.push(qt);
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.qts.is_empty()
+    }
+
+    pub fn tokens(&self) -> &[dmtr_qtoken_t] {
+        &self.qts
+    }
+
+    /// Returns a scratch buffer with room for the offsets of `max` completed tokens.
+    pub fn ready_buf(&mut self, max: usize) -> &mut [c_int] {
+        self.ready.resize(max, 0);
+        &mut self.ready
+    }
+
+    /// Forgets the first `nr` tokens recorded in the scratch buffer. Offsets must be ascending.
+    pub fn remove_ready(&mut self, nr: usize) {
+        // Removing from the back first keeps the remaining offsets valid across `swap_remove`.
+        for &ix in self.ready[..nr].iter().rev() {
+            self.qts.swap_remove(ix as usize);
+        }
+    }
+
+    pub fn into_tokens(self) -> Vec<dmtr_qtoken_t> {
+        self.qts
+    }
+}
+
+impl CompletionQueueTable {
+    pub fn new() -> Self {
+        Self {
+            cqs: Vec::new(),
+            free: Vec::new(),
+        }
+    }
+
+    pub fn alloc(&mut self) -> c_int {
+        match self.free.pop() {
+            Some(ix) => {
+                self.cqs[ix] = Some(CompletionQueue::new());
+                ix as c_int
+            },
+            None => {
+                self.cqs.push(Some(CompletionQueue::new()));
+                (self.cqs.len() - 1) as c_int
+            },
+        }
+    }
+
+    pub fn get_mut(&mut self, cqd: c_int) -> Option<&mut CompletionQueue> {
+        if cqd < 0 {
+            return None;
+        }
+        self.cqs.get_mut(cqd as usize)?.as_mut()
+    }
+
+    pub fn free(&mut self, cqd: c_int) -> Option<CompletionQueue> {
+        if cqd < 0 {
+            return None;
+        }
+        let cq = self.cqs.get_mut(cqd as usize)?.take()?;
+        self.free.push(cqd as usize);
+        Some(cq)
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+/// Runs the background work and returns the result of `qt`, if its operation has completed.
+pub fn poll<RT: Dispatch>(libos: &mut LibOS<RT>, qt: dmtr_qtoken_t) -> Option<dmtr_qresult_t> {
+    run_background_work(libos);
+    take_result(libos, qt)
+}
+
+/// Harvests up to `qrs_out.len()` completed operations among `qts` without blocking, recording the
+/// offset of each completed token in `ready_out`. Returns the number of completions harvested.
+///
+/// The background work runs once per harvest, after which each token costs a bit test unless its
+/// operation has completed.
+pub fn poll_many<RT: Dispatch>(
+    libos: &mut LibOS<RT>,
+    qts: &[dmtr_qtoken_t],
+    qrs_out: &mut [dmtr_qresult_t],
+    ready_out: &mut [c_int],
+) -> usize {
+    let max = cmp::min(qrs_out.len(), ready_out.len());
+    let mut nr = 0;
+    run_background_work(libos);
+    for (ix, &qt) in qts.iter().enumerate() {
+        if nr == max {
+            break;
+        }
+        if let Some(qr) = take_result(libos, qt) {
+            qrs_out[nr] = qr;
+            ready_out[nr] = ix as c_int;
+            nr += 1;
+        }
+    }
+    nr
+}
+
+/// Runs the stack's background work, such as receiving packets and firing timers. `LibOS` only runs
+/// it on its way to polling a token, so each thread polls a token of its own, whose operation never
+/// completes.
+pub fn run_background_work<RT: Runtime>(libos: &mut LibOS<RT>) {
+    let qt = IDLE_QT.with(|idle| match idle.get() {
+        Some(qt) => qt,
+        None => {
+            let qt = libos.rt().spawn(future::pending()).into_raw();
+            idle.set(Some(qt));
+            qt
+        },
+    });
+    libos.poll(qt);
+}
+
+/// Issues a push of `sgas[i]` to `qds[i]` for each of the `num_ops` operations, writing their
+/// tokens to `qtoks_out`, for the libOSes' `dmtr_pushv`. If a push can't be issued, the tokens of
+/// the earlier ones are dropped and its error is returned. Dropping a token doesn't take back data
+/// that was already queued, so some of those pushes may still be sent.
+pub fn pushv<RT: Dispatch>(
+    libos: &mut LibOS<RT>,
+    qtoks_out: *mut dmtr_qtoken_t,
+    qds: *const c_int,
+    sgas: *const dmtr_sgarray_t,
+    num_ops: c_int,
+) -> c_int {
+    if qtoks_out.is_null() || qds.is_null() || sgas.is_null() || num_ops < 0 {
+        return libc::EINVAL;
+    }
+    let qtoks_out = unsafe { slice::from_raw_parts_mut(qtoks_out, num_ops as usize) };
+    let qds = unsafe { slice::from_raw_parts(qds, num_ops as usize) };
+    let sgas = unsafe { slice::from_raw_parts(sgas, num_ops as usize) };
+    for (i, &qd) in qds.iter().enumerate() {
+        let buf = libos.rt().clone_sga(&sgas[i]);
+        match libos.push2(qd as FileDescriptor, buf) {
+            Ok(qt) => qtoks_out[i] = qt,
+            Err(e) => {
+                eprintln!("dmtr_pushv failed: {:?}", e);
+                for &qt in &qtoks_out[..i] {
+                    libos.drop_qtoken(qt);
+                }
+                return e.errno();
+            },
+        }
+    }
+    0
+}
+
+/// Issues a pop on each of the `num_ops` queues in `qds`, writing their tokens to `qtoks_out`, for
+/// the libOSes' `dmtr_popv`. If a pop can't be issued, the earlier ones are cancelled by dropping
+/// their tokens and its error is returned.
+pub fn popv<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qtoks_out: *mut dmtr_qtoken_t,
+    qds: *const c_int,
+    num_ops: c_int,
+) -> c_int {
+    if qtoks_out.is_null() || qds.is_null() || num_ops < 0 {
+        return libc::EINVAL;
+    }
+    let qtoks_out = unsafe { slice::from_raw_parts_mut(qtoks_out, num_ops as usize) };
+    let qds = unsafe { slice::from_raw_parts(qds, num_ops as usize) };
+    for (i, &qd) in qds.iter().enumerate() {
+        match libos.pop(qd as FileDescriptor) {
+            Ok(qt) => qtoks_out[i] = qt,
+            Err(e) => {
+                eprintln!("dmtr_popv failed: {:?}", e);
+                for &qt in &qtoks_out[..i] {
+                    libos.drop_qtoken(qt);
+                }
+                return e.errno();
+            },
+        }
+    }
+    0
+}
+
+/// Takes the result of `qt` if its operation has completed, without running the background work.
+/// Results are packed here rather than by `LibOS::poll`, which would go through catnip's
+/// single-segment arrays.
+fn take_result<RT: Dispatch>(libos: &mut LibOS<RT>, qt: dmtr_qtoken_t) -> Option<dmtr_qresult_t> {
+    if !has_completed(libos.rt(), qt) {
+        return None;
+    }
+    // The operation is done, so this returns right away.
+    let (qd, result) = libos.wait2(qt);
+    Some(dmtr_qresult_t::pack(libos.rt(), result, qd, qt))
+}
+
+fn has_completed<RT: Runtime>(rt: &RT, qt: dmtr_qtoken_t) -> bool {
+    match rt.scheduler().from_raw_handle(qt) {
+        Some(handle) => {
+            let completed = handle.has_completed();
+            // Hand the token back so that dropping the handle doesn't cancel the operation.
+            handle.into_raw();
+            completed
+        },
+        None => false,
+    }
+}
@@ -0,0 +1,545 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! The network calls of the C interface, for libOSes that run catnip's stack on a runtime of their
+//! own. A libOS keeps a `LibOS` per thread and implements `Dispatch` to reach it; `network_libos`
+//! then has everything that `libos_network_init` needs, and the libOS only has to bring its
+//! `init`.
+
+use crate::{
+    cq,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+    network::NetworkLibOS,
+    pool,
+    sga,
+    stats::RuntimeStats,
+    wait,
+};
+use catnip::{
+    file_table::FileDescriptor,
+    libos::LibOS,
+    protocols::{
+        ip,
+        ipv4,
+    },
+    runtime::Runtime,
+};
+use libc::{
+    c_int,
+    c_void,
+    sockaddr,
+    socklen_t,
+};
+use std::{
+    convert::TryFrom,
+    mem,
+    net::Ipv4Addr,
+    slice,
+    time::Duration,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// What the shared calls need from a libOS.
+pub trait Dispatch: Runtime + Sized {
+    /// Runs `f` on the calling thread's `LibOS`, which must have been initialized.
+    fn with_libos<T>(f: impl FnOnce(&mut LibOS<Self>) -> T) -> T;
+
+    /// Blocks until packets may have arrived, for at most `timeout`.
+    fn wait_for_rx(&self, timeout: Duration);
+
+    fn stats(&self) -> RuntimeStats;
+
+    /// Wraps a popped buffer in an array for the application, without copying it. A buffer made of
+    /// several pieces, such as a chained receive, may take a segment each. These hooks stand in
+    /// for `Runtime::into_sgarray` and friends, whose arrays are catnip's and hold one segment.
+    fn into_sga(&self, buf: Self::Buf) -> dmtr_sgarray_t;
+
+    /// Returns a buffer with the contents of an array that the application pushes.
+    fn clone_sga(&self, sga: &dmtr_sgarray_t) -> Self::Buf;
+
+    fn alloc_sga(&self, size: usize) -> dmtr_sgarray_t {
+        pool::alloc_sgarray(size)
+    }
+
+    /// Releases an array from `into_sga` or `alloc_sga`.
+    fn free_sga(&self, sga: &dmtr_sgarray_t) {
+        if !sga::free_bytes_sgarray(sga) {
+            pool::free_sgarray(sga);
+        }
+    }
+
+    /// Called before a batch of pushes, so that the runtime can hold back what they send until
+    /// `uncork` and send it all at once.
+    fn cork(&self) {}
+
+    fn uncork(&self) {}
+
+    /// Whether the runtime is short of the buffers that pushes send from. Pushes fail with
+    /// `ENOBUFS` until it isn't, instead of taking the last ones from receive.
+    fn low_on_buffers(&self) -> bool {
+        false
+    }
+
+    /// Registers memory that pushes will come from. Runtimes that copy every push anyway have
+    /// nothing to do.
+    fn register_memory(&self, _addr: *mut c_void, _len: libc::size_t) -> c_int {
+        0
+    }
+
+    fn unregister_memory(&self, _addr: *mut c_void, _len: libc::size_t) -> c_int {
+        0
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Returns the calls of the libOS whose runtime is `RT`.
+pub fn network_libos<RT: Dispatch>() -> NetworkLibOS {
+    NetworkLibOS::new(
+        socket::<RT>,
+        bind::<RT>,
+        listen::<RT>,
+        accept::<RT>,
+        connect::<RT>,
+        pushto::<RT>,
+        drop::<RT>,
+        close::<RT>,
+        push::<RT>,
+        wait::<RT>,
+        timedwait::<RT>,
+        wait_any::<RT>,
+        poll::<RT>,
+        poll_many::<RT>,
+        pop::<RT>,
+        pushv::<RT>,
+        popv::<RT>,
+        sgaalloc::<RT>,
+        sgafree::<RT>,
+        getsockname::<RT>,
+        runtime_stats::<RT>,
+        register_memory::<RT>,
+        unregister_memory::<RT>,
+        progress::<RT>,
+        wait_for_rx::<RT>,
+    )
+}
+
+/// Reads an IPv4 socket address. Returns `None` unless `saddr` points to a `sockaddr_in`.
+fn parse_sockaddr(saddr: *const sockaddr, size: socklen_t) -> Option<(Ipv4Addr, ip::Port)> {
+    if saddr.is_null() {
+        return None;
+    }
+    if size as usize != mem::size_of::<libc::sockaddr_in>() {
+        return None;
+    }
+    let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
+    let addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
+    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
+    Some((addr, port))
+}
+
+//==============================================================================
+// socket
+//==============================================================================
+
+fn socket<RT: Dispatch>(
+    qd_out: *mut c_int,
+    domain: c_int,
+    socket_type: c_int,
+    protocol: c_int,
+) -> c_int {
+    RT::with_libos(|libos| match libos.socket(domain, socket_type, protocol) {
+        Ok(fd) => {
+            unsafe { *qd_out = fd as c_int };
+            0
+        },
+        Err(e) => {
+            eprintln!("dmtr_socket failed: {:?}", e);
+            e.errno()
+        },
+    })
+}
+
+//==============================================================================
+// bind
+//==============================================================================
+
+fn bind<RT: Dispatch>(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
+    let (mut addr, port) = match parse_sockaddr(saddr, size) {
+        Some(r) => r,
+        None => return libc::EINVAL,
+    };
+    RT::with_libos(|libos| {
+        if addr.is_unspecified() {
+            addr = libos.rt().local_ipv4_addr();
+        }
+        let endpoint = ipv4::Endpoint::new(addr, port);
+        match libos.bind(qd as FileDescriptor, endpoint) {
+            Ok(..) => 0,
+            Err(e) => {
+                eprintln!("dmtr_bind failed: {:?}", e);
+                e.errno()
+            },
+        }
+    })
+}
+
+//==============================================================================
+// listen
+//==============================================================================
+
+fn listen<RT: Dispatch>(fd: c_int, backlog: c_int) -> c_int {
+    RT::with_libos(
+        |libos| match libos.listen(fd as FileDescriptor, backlog as usize) {
+            Ok(..) => 0,
+            Err(e) => {
+                eprintln!("listen failed: {:?}", e);
+                e.errno()
+            },
+        },
+    )
+}
+
+//==============================================================================
+// accept
+//==============================================================================
+
+fn accept<RT: Dispatch>(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
+    RT::with_libos(|libos| {
+        unsafe { *qtok_out = libos.accept(sockqd as FileDescriptor).unwrap() };
+        0
+    })
+}
+
+//==============================================================================
+// connect
+//==============================================================================
+
+fn connect<RT: Dispatch>(
+    qtok_out: *mut dmtr_qtoken_t,
+    qd: c_int,
+    saddr: *const sockaddr,
+    size: socklen_t,
+) -> c_int {
+    let endpoint = match parse_sockaddr(saddr, size) {
+        Some((addr, port)) => ipv4::Endpoint::new(addr, port),
+        None => return libc::EINVAL,
+    };
+    RT::with_libos(|libos| {
+        unsafe { *qtok_out = libos.connect(qd as FileDescriptor, endpoint).unwrap() };
+        0
+    })
+}
+
+//==============================================================================
+// close
+//==============================================================================
+
+fn close<RT: Dispatch>(qd: c_int) -> c_int {
+    RT::with_libos(|libos| match libos.close(qd as FileDescriptor) {
+        Ok(..) => 0,
+        Err(e) => {
+            eprintln!("dmtr_close failed: {:?}", e);
+            e.errno()
+        },
+    })
+}
+
+//==============================================================================
+// push
+//==============================================================================
+
+fn push<RT: Dispatch>(
+    qtok_out: *mut dmtr_qtoken_t,
+    qd: c_int,
+    sga: *const dmtr_sgarray_t,
+) -> c_int {
+    if sga.is_null() {
+        return libc::EINVAL;
+    }
+    let sga = unsafe { &*sga };
+    RT::with_libos(|libos| {
+        if libos.rt().low_on_buffers() {
+            return libc::ENOBUFS;
+        }
+        let buf = libos.rt().clone_sga(sga);
+        match libos.push2(qd as FileDescriptor, buf) {
+            Ok(qt) => {
+                unsafe { *qtok_out = qt };
+                0
+            },
+            Err(e) => e.errno(),
+        }
+    })
+}
+
+//==============================================================================
+// pushto
+//==============================================================================
+
+fn pushto<RT: Dispatch>(
+    qtok_out: *mut dmtr_qtoken_t,
+    qd: c_int,
+    sga: *const dmtr_sgarray_t,
+    saddr: *const sockaddr,
+    size: socklen_t,
+) -> c_int {
+    if sga.is_null() {
+        return libc::EINVAL;
+    }
+    let sga = unsafe { &*sga };
+    let endpoint = match parse_sockaddr(saddr, size) {
+        Some((addr, port)) => ipv4::Endpoint::new(addr, port),
+        None => return libc::EINVAL,
+    };
+    RT::with_libos(|libos| {
+        if libos.rt().low_on_buffers() {
+            return libc::ENOBUFS;
+        }
+        let buf = libos.rt().clone_sga(sga);
+        match libos.pushto2(qd as FileDescriptor, buf, endpoint) {
+            Ok(qt) => {
+                unsafe { *qtok_out = qt };
+                0
+            },
+            Err(e) => e.errno(),
+        }
+    })
+}
+
+//==============================================================================
+// pop
+//==============================================================================
+
+fn pop<RT: Dispatch>(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+    RT::with_libos(|libos| {
+        unsafe { *qtok_out = libos.pop(qd as FileDescriptor).unwrap() };
+        0
+    })
+}
+
+//==============================================================================
+// pushv
+//==============================================================================
+
+fn pushv<RT: Dispatch>(
+    qtoks_out: *mut dmtr_qtoken_t,
+    qds: *const c_int,
+    sgas: *const dmtr_sgarray_t,
+    num_ops: c_int,
+) -> c_int {
+    RT::with_libos(|libos| {
+        if libos.rt().low_on_buffers() {
+            return libc::ENOBUFS;
+        }
+        libos.rt().cork();
+        let ret = cq::pushv(libos, qtoks_out, qds, sgas, num_ops);
+        libos.rt().uncork();
+        ret
+    })
+}
+
+//==============================================================================
+// popv
+//==============================================================================
+
+fn popv<RT: Dispatch>(qtoks_out: *mut dmtr_qtoken_t, qds: *const c_int, num_ops: c_int) -> c_int {
+    RT::with_libos(|libos| cq::popv(libos, qtoks_out, qds, num_ops))
+}
+
+//==============================================================================
+// poll
+//==============================================================================
+
+fn poll<RT: Dispatch>(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    RT::with_libos(|libos| match cq::poll(libos, qt) {
+        None => libc::EAGAIN,
+        Some(r) => {
+            unsafe { *qr_out = r };
+            0
+        },
+    })
+}
+
+//==============================================================================
+// poll_many
+//==============================================================================
+
+fn poll_many<RT: Dispatch>(
+    nr_out: *mut c_int,
+    qrs_out: *mut dmtr_qresult_t,
+    ready_out: *mut c_int,
+    max_qrs: c_int,
+    qts: *const dmtr_qtoken_t,
+    num_qts: c_int,
+) -> c_int {
+    let qrs_out = unsafe { slice::from_raw_parts_mut(qrs_out, max_qrs as usize) };
+    let ready_out = unsafe { slice::from_raw_parts_mut(ready_out, max_qrs as usize) };
+    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
+    RT::with_libos(|libos| {
+        let nr = cq::poll_many(libos, qts, qrs_out, ready_out);
+        unsafe { *nr_out = nr as c_int };
+        0
+    })
+}
+
+//==============================================================================
+// drop
+//==============================================================================
+
+fn drop<RT: Dispatch>(qt: dmtr_qtoken_t) -> c_int {
+    RT::with_libos(|libos| {
+        libos.drop_qtoken(qt);
+        0
+    })
+}
+
+//==============================================================================
+// wait
+//==============================================================================
+
+fn wait<RT: Dispatch>(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    RT::with_libos(|libos| {
+        let qr =
+            wait::wait_until(libos, None, RT::wait_for_rx, |libos| cq::poll(libos, qt)).unwrap();
+        if !qr_out.is_null() {
+            unsafe { *qr_out = qr };
+        }
+        0
+    })
+}
+
+//==============================================================================
+// timedwait
+//==============================================================================
+
+fn timedwait<RT: Dispatch>(
+    qr_out: *mut dmtr_qresult_t,
+    qt: dmtr_qtoken_t,
+    timeout: *const libc::timespec,
+) -> c_int {
+    if timeout.is_null() {
+        return libc::EINVAL;
+    }
+    let timeout = unsafe { *timeout };
+    if timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= 1_000_000_000 {
+        return libc::EINVAL;
+    }
+    let timeout = Duration::new(timeout.tv_sec as u64, timeout.tv_nsec as u32);
+    RT::with_libos(|libos| {
+        match wait::wait_until(libos, Some(timeout), RT::wait_for_rx, |libos| {
+            cq::poll(libos, qt)
+        }) {
+            Some(qr) => {
+                if !qr_out.is_null() {
+                    unsafe { *qr_out = qr };
+                }
+                0
+            },
+            None => libc::ETIMEDOUT,
+        }
+    })
+}
+
+//==============================================================================
+// wait_any
+//==============================================================================
+
+fn wait_any<RT: Dispatch>(
+    qr_out: *mut dmtr_qresult_t,
+    ready_offset: *mut c_int,
+    qts: *mut dmtr_qtoken_t,
+    num_qts: c_int,
+) -> c_int {
+    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
+    let qr_out = unsafe { slice::from_raw_parts_mut(qr_out, 1) };
+    let ready_offset = unsafe { slice::from_raw_parts_mut(ready_offset, 1) };
+    RT::with_libos(|libos| {
+        wait::wait_until(libos, None, RT::wait_for_rx, |libos| {
+            match cq::poll_many(libos, qts, qr_out, ready_offset) {
+                0 => None,
+                _ => Some(()),
+            }
+        });
+        0
+    })
+}
+
+//==============================================================================
+// sgaalloc
+//==============================================================================
+
+fn sgaalloc<RT: Dispatch>(size: libc::size_t) -> dmtr_sgarray_t {
+    RT::with_libos(|libos| libos.rt().alloc_sga(size))
+}
+
+//==============================================================================
+// sgafree
+//==============================================================================
+
+fn sgafree<RT: Dispatch>(sga: *mut dmtr_sgarray_t) -> c_int {
+    if sga.is_null() {
+        return 0;
+    }
+    RT::with_libos(|libos| {
+        libos.rt().free_sga(unsafe { &*sga });
+        0
+    })
+}
+
+//==============================================================================
+// getsockname
+//==============================================================================
+
+fn getsockname<RT: Dispatch>(_qd: c_int, _saddr: *mut sockaddr, _size: *mut socklen_t) -> c_int {
+    unimplemented!();
+}
+
+//==============================================================================
+// runtime_stats
+//==============================================================================
+
+fn runtime_stats<RT: Dispatch>() -> RuntimeStats {
+    RT::with_libos(|libos| libos.rt().stats())
+}
+
+//==============================================================================
+// register_memory
+//==============================================================================
+
+fn register_memory<RT: Dispatch>(addr: *mut c_void, len: libc::size_t) -> c_int {
+    RT::with_libos(|libos| libos.rt().register_memory(addr, len))
+}
+
+//==============================================================================
+// unregister_memory
+//==============================================================================
+
+fn unregister_memory<RT: Dispatch>(addr: *mut c_void, len: libc::size_t) -> c_int {
+    RT::with_libos(|libos| libos.rt().unregister_memory(addr, len))
+}
+
+//==============================================================================
+// progress
+//==============================================================================
+
+fn progress<RT: Dispatch>() {
+    RT::with_libos(cq::run_background_work)
+}
+
+//==============================================================================
+// wait_for_rx
+//==============================================================================
+
+fn wait_for_rx<RT: Dispatch>(timeout: Duration) {
+    RT::with_libos(|libos| libos.rt().wait_for_rx(timeout))
+}
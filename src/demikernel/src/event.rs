@@ -0,0 +1,277 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Compact completion records.
+//!
+//! A `dmtr_qresult_t` carries a whole scatter-gather array (and an address) by value, which makes
+//! every completion cost a copy of well over a hundred bytes. A `dmtr_qevent_t` is three words:
+//! completions are written straight into a slot of a thread-local table, and the event refers to
+//! the popped array in it by pointer. The application returns the slot with `dmtr_sgafree`, along
+//! with the buffers.
+
+use crate::interop::{
+    dmtr_opcode_t,
+    dmtr_qresult_t,
+    dmtr_qtoken_t,
+    dmtr_sgarray_t,
+};
+use libc::c_int;
+use std::{
+    alloc::{
+        self,
+        Layout,
+    },
+    cell::RefCell,
+    collections::HashSet,
+    mem,
+    ptr,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Number of slots per chunk of the slot table. Chunks are never moved or freed while the thread
+/// lives, so that pointers handed out in events stay valid.
+const SLOTS_PER_CHUNK: usize = 256;
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub union dmtr_qevent_value_t {
+    /// Popped array, for `DMTR_OPC_POP`.
+    pub sga: *mut dmtr_sgarray_t,
+    /// New queue descriptor, for `DMTR_OPC_ACCEPT`.
+    pub qd: c_int,
+}
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct dmtr_qevent_t {
+    pub qe_qt: dmtr_qtoken_t,
+    pub qe_opcode: u32,
+    pub qe_qd: c_int,
+    pub qe_value: dmtr_qevent_value_t,
+}
+
+#[repr(C)]
+struct Slot {
+    qr: dmtr_qresult_t,
+    /// Position of the slot in the table, so that it goes back on the free list without a search.
+    index: u32,
+    /// Whether an event refers to the array in the slot.
+    live: bool,
+}
+
+/// Slots live in chunks aligned to their size rounded up to a power of two, so the chunk that a
+/// pointer falls into is found by masking it.
+struct SlotTable {
+    chunks: Vec<*mut Slot>,
+    bases: HashSet<usize>,
+    free: Vec<u32>,
+    layout: Layout,
+    /// Offset of the popped array in a slot.
+    sga_offset: usize,
+}
+
+thread_local! {
+    static SLOTS: RefCell<SlotTable> = RefCell::new(SlotTable::new());
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl SlotTable {
+    fn new() -> Self {
+        let size = (SLOTS_PER_CHUNK * mem::size_of::<Slot>()).next_power_of_two();
+        let slot: Slot = unsafe { mem::zeroed() };
+        let sga = unsafe { &slot.qr.qr_value.sga } as *const dmtr_sgarray_t;
+        Self {
+            chunks: Vec::new(),
+            bases: HashSet::new(),
+            free: Vec::new(),
+            layout: Layout::from_size_align(size, size).unwrap(),
+            sga_offset: sga as usize - &slot as *const Slot as usize,
+        }
+    }
+
+    fn alloc(&mut self) -> *mut Slot {
+        if self.free.is_empty() {
+            let chunk = unsafe { alloc::alloc_zeroed(self.layout) } as *mut Slot;
+            if chunk.is_null() {
+                alloc::handle_alloc_error(self.layout);
+            }
+            let first = self.chunks.len() * SLOTS_PER_CHUNK;
+            for i in 0..SLOTS_PER_CHUNK {
+                unsafe { (*chunk.add(i)).index = (first + i) as u32 };
+            }
+            self.chunks.push(chunk);
+            self.bases.insert(chunk as usize);
+            // Hand out the low slots of the chunk first.
+            self.free
+                .extend((first..first + SLOTS_PER_CHUNK).rev().map(|i| i as u32));
+        }
+        let index = self.free.pop().unwrap() as usize;
+        unsafe { self.chunks[index / SLOTS_PER_CHUNK].add(index % SLOTS_PER_CHUNK) }
+    }
+
+    fn release(&mut self, slot: *mut Slot) {
+        unsafe {
+            (*slot).live = false;
+            self.free.push((*slot).index);
+        }
+    }
+
+    /// Returns the slot whose popped array is at `sga`, if there is one.
+    fn find(&self, sga: *const dmtr_sgarray_t) -> Option<*mut Slot> {
+        let addr = sga as usize;
+        let base = addr & !(self.layout.align() - 1);
+        if !self.bases.contains(&base) {
+            return None;
+        }
+        let offset = addr - base;
+        let size = mem::size_of::<Slot>();
+        if offset % size != self.sga_offset || offset / size >= SLOTS_PER_CHUNK {
+            return None;
+        }
+        Some((base + offset - self.sga_offset) as *mut Slot)
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for SlotTable {
+    fn drop(&mut self) {
+        for &chunk in &self.chunks {
+            unsafe { alloc::dealloc(chunk as *mut u8, self.layout) };
+        }
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+/// Fills in `qe_out` with the completion that `complete` writes, which goes straight into a slot
+/// so that a popped array is never copied. `complete` returns zero if it wrote a completion, and
+/// an error code otherwise, which is returned.
+pub fn complete_into(
+    qe_out: &mut dmtr_qevent_t,
+    complete: impl FnOnce(&mut dmtr_qresult_t) -> c_int,
+) -> c_int {
+    let slot = SLOTS.with(|s| s.borrow_mut().alloc());
+    let qr = unsafe { &mut (*slot).qr };
+    let ret = complete(qr);
+    if ret == 0 {
+        let qe_value = match qr.qr_opcode {
+            dmtr_opcode_t::DMTR_OPC_POP => {
+                unsafe { (*slot).live = true };
+                dmtr_qevent_value_t {
+                    sga: unsafe { &mut qr.qr_value.sga },
+                }
+            },
+            dmtr_opcode_t::DMTR_OPC_ACCEPT => dmtr_qevent_value_t {
+                qd: unsafe { qr.qr_value.ares.qd },
+            },
+            _ => dmtr_qevent_value_t {
+                sga: ptr::null_mut(),
+            },
+        };
+        *qe_out = dmtr_qevent_t {
+            qe_qt: qr.qr_qt,
+            qe_opcode: qr.qr_opcode as u32,
+            qe_qd: qr.qr_qd,
+            qe_value,
+        };
+        if let dmtr_opcode_t::DMTR_OPC_POP = qr.qr_opcode {
+            return 0;
+        }
+    }
+    SLOTS.with(|s| s.borrow_mut().release(slot));
+    ret
+}
+
+/// Whether `sga` is the array of a slot that was already returned, which must not be freed again.
+pub fn is_released_slot(sga: *const dmtr_sgarray_t) -> bool {
+    SLOTS.with(|s| match s.borrow().find(sga) {
+        Some(slot) => !unsafe { (*slot).live },
+        None => false,
+    })
+}
+
+/// Returns `sga` to the slot table if it was handed out in an event. The caller frees its buffers
+/// first.
+pub fn release_slot(sga: *mut dmtr_sgarray_t) {
+    SLOTS.with(|s| {
+        let mut slots = s.borrow_mut();
+        if let Some(slot) = slots.find(sga) {
+            if unsafe { (*slot).live } {
+                slots.release(slot);
+            }
+        }
+    })
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        complete_into,
+        is_released_slot,
+        release_slot,
+    };
+    use crate::interop::{
+        dmtr_opcode_t,
+        dmtr_sgarray_t,
+    };
+    use std::mem;
+
+    #[test]
+    fn slots_go_back_once() {
+        let mut qe = unsafe { mem::zeroed() };
+        let mut sgas = Vec::new();
+        // More than a chunk's worth, so that slots of a second chunk are found too.
+        for qt in 0..300 {
+            let ret = complete_into(&mut qe, |qr| {
+                qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_POP;
+                qr.qr_qt = qt;
+                0
+            });
+            assert_eq!(ret, 0);
+            assert_eq!(qe.qe_qt, qt);
+            sgas.push(unsafe { qe.qe_value.sga });
+        }
+        for &sga in &sgas {
+            assert!(!is_released_slot(sga));
+            release_slot(sga);
+            assert!(is_released_slot(sga));
+            // Releasing it again doesn't put it on the free list twice.
+            release_slot(sga);
+        }
+        let mut reused = Vec::new();
+        for _ in 0..300 {
+            let ret = complete_into(&mut qe, |qr| {
+                qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_POP;
+                0
+            });
+            assert_eq!(ret, 0);
+            reused.push(unsafe { qe.qe_value.sga });
+        }
+        reused.sort();
+        reused.dedup();
+        assert_eq!(reused.len(), 300);
+
+        // Arrays that don't live in a slot are left alone.
+        let mut own: dmtr_sgarray_t = unsafe { mem::zeroed() };
+        assert!(!is_released_slot(&own));
+        release_slot(&mut own);
+
+        // A failed completion doesn't hold on to a slot.
+        assert_eq!(complete_into(&mut qe, |_| libc::EAGAIN), libc::EAGAIN);
+    }
+}
@@ -0,0 +1,760 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! File queues: `dmtr_open` hands out queue descriptors for files whose pushes and pops go through
+//! an `io_uring` owned by the calling thread, so that file I/O completes through the same wait
+//! calls as network I/O instead of blocking the thread.
+//!
+//! A push writes its scatter-gather array at the queue's offset, and a pop reads up to `pop_size`
+//! bytes from it into a pool buffer. Both advance the offset when they are issued, so that
+//! operations in flight together cover consecutive ranges. Pushes don't copy: the array must
+//! stay valid until the push completes. Operations are queued in the ring as they are issued and
+//! submitted together on the next poll or wait.
+//!
+//! Pool buffers of 4 KiB and up are aligned to their size, so they can be used with `O_DIRECT`.
+//! Pool regions are optionally registered with the ring as fixed buffers, which spares the kernel
+//! from pinning pages on every single-segment operation.
+
+use crate::{
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
+    },
+    network,
+    pool,
+    uring::{
+        self,
+        Ring,
+    },
+    wait::{
+        self,
+        Backoff,
+    },
+};
+use libc::{
+    c_char,
+    c_int,
+    c_uint,
+    iovec,
+    mode_t,
+};
+use std::{
+    cell::{
+        Cell,
+        RefCell,
+    },
+    io,
+    mem,
+    os::unix::io::RawFd,
+    ptr,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// File queue descriptors start here, well clear of those handed out by the libOS.
+pub const FILE_QD_BASE: c_int = 1 << 24;
+
+/// Set in every file queue token. The rest holds the operation's slot and generation.
+const FILE_QT_TAG: dmtr_qtoken_t = 1 << 63;
+
+pub const DEFAULT_RING_ENTRIES: u32 = 256;
+pub const DEFAULT_POP_SIZE: usize = 4096;
+
+/// Fixed buffer slots, one per pool region: enough for the first 8 GiB of the pool.
+const FIXED_BUFFERS: usize = 4096;
+
+/// User data of cancellation requests, which no operation slot has.
+const CANCEL_USER_DATA: u64 = u64::MAX;
+
+/// How long a thread that exits waits for its file operations in flight to complete.
+const DRAIN_TIMEOUT: Duration = Duration::from_secs(1);
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct FileConfig {
+    /// Submission ring size of each thread's `io_uring`.
+    pub ring_entries: u32,
+    /// Bytes that a pop reads, at most. Must be a multiple of the block size with `O_DIRECT`.
+    pub pop_size: usize,
+    /// Register pool regions with the ring as fixed buffers.
+    pub fixed_buffers: bool,
+}
+
+struct FileQueue {
+    fd: RawFd,
+    /// Where the next push or pop starts.
+    offset: u64,
+    /// Pop that the offset was last advanced by, if nothing was issued since. A short read moves
+    /// the offset back to where the data ended.
+    last_pop: Option<dmtr_qtoken_t>,
+}
+
+struct Op {
+    qt: dmtr_qtoken_t,
+    qd: c_int,
+    opcode: dmtr_opcode_t,
+    offset: u64,
+    /// Result of the system call, once the kernel has completed it.
+    res: Option<i32>,
+    /// Dropped before completing: the slot goes back as soon as the kernel is done with it.
+    dropped: bool,
+    /// For a pop, the buffer read into.
+    sga: dmtr_sgarray_t,
+    /// Segments handed to the kernel. The vector is kept with the slot, so it doesn't move.
+    iovs: Vec<iovec>,
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum Fixed {
+    Unregistered,
+    Registered,
+    Failed,
+}
+
+#[derive(Default)]
+struct Files {
+    /// Created on first open.
+    ring: Option<Ring>,
+    queues: Vec<Option<FileQueue>>,
+    free_queues: Vec<usize>,
+    ops: Vec<Op>,
+    free_ops: Vec<usize>,
+    /// Registration state of each fixed buffer slot. Empty when fixed buffers are off.
+    fixed: Vec<Fixed>,
+    /// Scratch space for reaped completions.
+    reaped: Vec<(u64, i32)>,
+}
+
+thread_local! {
+    static CONFIG: Cell<FileConfig> = Cell::new(FileConfig::default());
+    static FILES: RefCell<Files> = RefCell::new(Files::default());
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl FileConfig {
+    /// Parses the `file` section of the configuration.
+    pub fn parse(
+        ring_entries: Option<i64>,
+        pop_size: Option<i64>,
+        fixed_buffers: Option<bool>,
+    ) -> Self {
+        let ring_entries = match ring_entries {
+            Some(n) if n > 0 && n <= 32768 => n as u32,
+            Some(..) => panic!("Invalid file ring_entries"),
+            None => DEFAULT_RING_ENTRIES,
+        };
+        let pop_size = match pop_size {
+            Some(n) if n > 0 && n as usize <= pool::MAX_SIZE => n as usize,
+            Some(..) => panic!("Invalid file pop_size"),
+            None => DEFAULT_POP_SIZE,
+        };
+        Self {
+            ring_entries,
+            pop_size,
+            fixed_buffers: fixed_buffers.unwrap_or(true),
+        }
+    }
+}
+
+impl Op {
+    fn is_live(&self) -> bool {
+        !matches!(self.opcode, dmtr_opcode_t::DMTR_OPC_INVALID)
+    }
+}
+
+impl Files {
+    fn ring(&mut self) -> Result<&mut Ring, c_int> {
+        if self.ring.is_none() {
+            let config = CONFIG.with(|c| c.get());
+            let mut ring = Ring::new(config.ring_entries).map_err(|e| errno(&e))?;
+            if config.fixed_buffers {
+                match ring.register_sparse_buffers(FIXED_BUFFERS as u32) {
+                    Ok(()) => self.fixed = vec![Fixed::Unregistered; FIXED_BUFFERS],
+                    Err(e) => eprintln!("File queues can't use fixed buffers: {}", e),
+                }
+            }
+            self.ring = Some(ring);
+        }
+        Ok(self.ring.as_mut().unwrap())
+    }
+
+    fn queue(&mut self, qd: c_int) -> Option<&mut FileQueue> {
+        if !is_file_qd(qd) {
+            return None;
+        }
+        self.queues
+            .get_mut((qd - FILE_QD_BASE) as usize)
+            .and_then(|q| q.as_mut())
+    }
+
+    fn alloc_queue(&mut self, queue: FileQueue) -> c_int {
+        let ix = match self.free_queues.pop() {
+            Some(ix) => {
+                self.queues[ix] = Some(queue);
+                ix
+            },
+            None => {
+                self.queues.push(Some(queue));
+                self.queues.len() - 1
+            },
+        };
+        FILE_QD_BASE + ix as c_int
+    }
+
+    fn alloc_op(&mut self, qd: c_int, opcode: dmtr_opcode_t, offset: u64) -> usize {
+        let ix = match self.free_ops.pop() {
+            Some(ix) => ix,
+            None => {
+                self.ops.push(Op {
+                    qt: FILE_QT_TAG | self.ops.len() as u64,
+                    qd: 0,
+                    opcode: dmtr_opcode_t::DMTR_OPC_INVALID,
+                    offset: 0,
+                    res: None,
+                    dropped: false,
+                    sga: unsafe { mem::zeroed() },
+                    iovs: Vec::new(),
+                });
+                self.ops.len() - 1
+            },
+        };
+        let op = &mut self.ops[ix];
+        op.qd = qd;
+        op.opcode = opcode;
+        op.offset = offset;
+        op.res = None;
+        op.dropped = false;
+        op.iovs.clear();
+        ix
+    }
+
+    /// Returns the slot of a live operation, or `None` for a stale or foreign token.
+    fn op_index(&self, qt: dmtr_qtoken_t) -> Option<usize> {
+        let ix = (qt & 0xffff_ffff) as usize;
+        match self.ops.get(ix) {
+            Some(op) if op.qt == qt && op.is_live() => Some(ix),
+            _ => None,
+        }
+    }
+
+    /// Puts a slot back, with a new generation so that its old token goes stale.
+    fn free_op(&mut self, ix: usize) {
+        let op = &mut self.ops[ix];
+        if let dmtr_opcode_t::DMTR_OPC_POP = op.opcode {
+            if op.sga.sga_numsegs > 0 {
+                pool::free_sgarray(&op.sga);
+            }
+        }
+        op.sga = unsafe { mem::zeroed() };
+        op.opcode = dmtr_opcode_t::DMTR_OPC_INVALID;
+        let generation = ((op.qt >> 32) as u32 & 0x7fff_ffff).wrapping_add(1) & 0x7fff_ffff;
+        op.qt = FILE_QT_TAG | (generation as u64) << 32 | ix as u64;
+        self.free_ops.push(ix);
+    }
+
+    /// Returns the fixed buffer that `len` bytes at `ptr` lie in, registering it on first use.
+    fn fixed_index(&mut self, ptr: *const u8, len: usize) -> Option<u16> {
+        if self.fixed.is_empty() {
+            return None;
+        }
+        let (ix, base, size) = pool::region_of(ptr)?;
+        if ix >= self.fixed.len() || ptr as usize + len > base as usize + size {
+            return None;
+        }
+        if self.fixed[ix] == Fixed::Unregistered {
+            let ring = self.ring.as_mut().unwrap();
+            self.fixed[ix] = match ring.update_buffer(ix as u32, base, size) {
+                Ok(()) => Fixed::Registered,
+                Err(..) => Fixed::Failed,
+            };
+        }
+        match self.fixed[ix] {
+            Fixed::Registered => Some(ix as u16),
+            _ => None,
+        }
+    }
+
+    /// Queues the read or write of operation `ix` in the ring.
+    fn prep(&mut self, ix: usize, fd: RawFd, write: bool) -> Result<(), c_int> {
+        let (offset, user_data) = (self.ops[ix].offset, ix as u64);
+        let single = match self.ops[ix].iovs[..] {
+            [iov] => Some(iov),
+            _ => None,
+        };
+        let fixed = single.and_then(|iov| self.fixed_index(iov.iov_base as *const u8, iov.iov_len));
+        let ring = self.ring.as_mut().unwrap();
+        let ret = match (single, fixed) {
+            (Some(iov), Some(buf_index)) => {
+                let opcode = if write {
+                    uring::IORING_OP_WRITE_FIXED
+                } else {
+                    uring::IORING_OP_READ_FIXED
+                };
+                let buf = iov.iov_base as *const u8;
+                ring.prep_rw_fixed(
+                    opcode,
+                    fd,
+                    buf,
+                    iov.iov_len as u32,
+                    offset,
+                    buf_index,
+                    user_data,
+                )
+            },
+            _ => {
+                let opcode = if write {
+                    uring::IORING_OP_WRITEV
+                } else {
+                    uring::IORING_OP_READV
+                };
+                ring.prep_rw(opcode, fd, &self.ops[ix].iovs, offset, user_data)
+            },
+        };
+        ret.map_err(|e| errno(&e))
+    }
+
+    /// Submits queued operations and records the results of those that completed.
+    fn progress(&mut self) {
+        let ring = match self.ring.as_mut() {
+            Some(ring) => ring,
+            None => return,
+        };
+        // A full completion ring refuses submissions; reaping below makes room.
+        let _ = ring.submit();
+        let mut reaped = mem::take(&mut self.reaped);
+        ring.reap(|user_data, res| reaped.push((user_data, res)));
+        for &(ix, res) in &reaped {
+            if ix != CANCEL_USER_DATA {
+                self.complete(ix as usize, res);
+            }
+        }
+        reaped.clear();
+        self.reaped = reaped;
+    }
+
+    fn complete(&mut self, ix: usize, res: i32) {
+        let op = &mut self.ops[ix];
+        op.res = Some(res);
+        let (qt, qd, offset) = (op.qt, op.qd, op.offset);
+        if let dmtr_opcode_t::DMTR_OPC_POP = op.opcode {
+            let asked = op.sga.sga_segs[0].sgaseg_len as i64;
+            if (res as i64) < asked {
+                if let Some(q) = self.queue(qd) {
+                    if q.last_pop == Some(qt) {
+                        q.offset = offset + res.max(0) as u64;
+                        q.last_pop = None;
+                    }
+                }
+            }
+        }
+        if self.ops[ix].dropped {
+            self.free_op(ix);
+        }
+    }
+
+    /// Hands the result of completed operation `ix` over and frees its slot. Returns zero, or the
+    /// error the operation failed with.
+    fn take_result(&mut self, ix: usize, qr_out: *mut dmtr_qresult_t) -> c_int {
+        let op = &mut self.ops[ix];
+        let res = op.res.unwrap();
+        let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+        qr.qr_qd = op.qd;
+        qr.qr_qt = op.qt;
+        let ret = if res < 0 {
+            qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_INVALID;
+            -res
+        } else {
+            qr.qr_opcode = op.opcode;
+            if let dmtr_opcode_t::DMTR_OPC_POP = op.opcode {
+                qr.qr_value.sga = shrink(&op.sga, res as usize);
+                // The buffer now belongs to the application.
+                op.sga.sga_numsegs = 0;
+            }
+            0
+        };
+        self.free_op(ix);
+        if !qr_out.is_null() {
+            unsafe { *qr_out = qr };
+        } else if let dmtr_opcode_t::DMTR_OPC_POP = qr.qr_opcode {
+            pool::free_sgarray(unsafe { &qr.qr_value.sga });
+        }
+        ret
+    }
+
+    /// Submits queued operations and blocks until the ring has completions, for at most
+    /// `timeout`.
+    fn block(&mut self, timeout: Duration) {
+        if let Some(ring) = self.ring.as_mut() {
+            let _ = ring.submit();
+            wait::poll_fd(ring.fd(), timeout);
+        }
+    }
+
+    /// Cancels the operations in flight and waits for the kernel to be done with them, for at
+    /// most `timeout`. Returns false if some are still in flight.
+    fn drain(&mut self, timeout: Duration) -> bool {
+        let in_flight = |files: &Files| files.ops.iter().any(|op| op.is_live() && op.res.is_none());
+        let ring = match self.ring.as_mut() {
+            Some(ring) => ring,
+            None => return true,
+        };
+        for (ix, op) in self.ops.iter().enumerate() {
+            if op.is_live() && op.res.is_none() {
+                // The kernel can't cancel what it is already executing, such as reads of regular
+                // files, but those complete by themselves.
+                let _ = ring.prep_cancel(ix as u64, CANCEL_USER_DATA);
+            }
+        }
+        let deadline = Instant::now() + timeout;
+        loop {
+            self.progress();
+            if !in_flight(self) {
+                return true;
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                return false;
+            }
+            self.block(deadline - now);
+        }
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for FileConfig {
+    fn default() -> Self {
+        Self {
+            ring_entries: DEFAULT_RING_ENTRIES,
+            pop_size: DEFAULT_POP_SIZE,
+            fixed_buffers: true,
+        }
+    }
+}
+
+impl Drop for Files {
+    fn drop(&mut self) {
+        // Closing the ring doesn't wait for the operations in flight, and the kernel may still
+        // write into their buffers, so those go back only once it has completed them.
+        let drained = self.drain(DRAIN_TIMEOUT);
+        if !drained {
+            eprintln!("File operations still in flight at thread exit, leaking their buffers");
+        }
+        for q in self.queues.iter().flatten() {
+            unsafe { libc::close(q.fd) };
+        }
+        self.ring = None;
+        for ix in 0..self.ops.len() {
+            if self.ops[ix].is_live() && (drained || self.ops[ix].res.is_some()) {
+                self.free_op(ix);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+fn with_files<T>(f: impl FnOnce(&mut Files) -> T) -> T {
+    FILES.with(|files| f(&mut files.borrow_mut()))
+}
+
+fn errno(e: &io::Error) -> c_int {
+    e.raw_os_error().unwrap_or(libc::EIO)
+}
+
+/// Trims a popped array to the `len` bytes that were read. Buffers that don't come from a size
+/// class must be freed with the length they were allocated with, so those are copied instead.
+fn shrink(sga: &dmtr_sgarray_t, len: usize) -> dmtr_sgarray_t {
+    let seg = sga.sga_segs[0];
+    let mut out = *sga;
+    if len == seg.sgaseg_len as usize || pool::region_of(seg.sgaseg_buf as *const u8).is_some() {
+        out.sga_segs[0].sgaseg_len = len as u32;
+        return out;
+    }
+    let buf = pool::alloc(len);
+    unsafe {
+        ptr::copy_nonoverlapping(seg.sgaseg_buf as *const u8, buf, len);
+        pool::free(seg.sgaseg_buf as *mut u8, seg.sgaseg_len as usize);
+    }
+    out.sga_segs[0] = dmtr_sgaseg_t {
+        sgaseg_buf: buf as *mut _,
+        sgaseg_len: len as u32,
+    };
+    out
+}
+
+/// Sets up file queues for the calling thread.
+pub fn configure(config: FileConfig) {
+    CONFIG.with(|c| c.set(config));
+}
+
+pub fn is_file_qd(qd: c_int) -> bool {
+    (FILE_QD_BASE..FILE_QD_BASE + (1 << 24)).contains(&qd)
+}
+
+pub fn is_file_qt(qt: dmtr_qtoken_t) -> bool {
+    qt & FILE_QT_TAG != 0
+}
+
+/// Opens `pathname` as in open(2) and returns a queue descriptor for it.
+pub fn open(qd_out: *mut c_int, pathname: *const c_char, flags: c_int, mode: mode_t) -> c_int {
+    if qd_out.is_null() || pathname.is_null() {
+        return libc::EINVAL;
+    }
+    with_files(|files| {
+        if let Err(e) = files.ring() {
+            return e;
+        }
+        let fd = unsafe { libc::open(pathname, flags | libc::O_CLOEXEC, mode as c_uint) };
+        if fd < 0 {
+            return errno(&io::Error::last_os_error());
+        }
+        // Appending starts at the end, anything else at the beginning.
+        let offset = if flags & libc::O_APPEND != 0 {
+            unsafe { libc::lseek(fd, 0, libc::SEEK_END) }.max(0) as u64
+        } else {
+            0
+        };
+        let queue = FileQueue {
+            fd,
+            offset,
+            last_pop: None,
+        };
+        unsafe { *qd_out = files.alloc_queue(queue) };
+        0
+    })
+}
+
+/// Closes a file queue. Operations in flight still complete.
+pub fn close(qd: c_int) -> c_int {
+    with_files(|files| {
+        let fd = match files.queue(qd) {
+            Some(q) => q.fd,
+            None => return libc::EBADF,
+        };
+        let ix = (qd - FILE_QD_BASE) as usize;
+        files.queues[ix] = None;
+        files.free_queues.push(ix);
+        if unsafe { libc::close(fd) } != 0 {
+            return errno(&io::Error::last_os_error());
+        }
+        0
+    })
+}
+
+/// Issues a write of `sga` at the queue's offset.
+pub fn push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
+    if qtok_out.is_null() || sga.is_null() {
+        return libc::EINVAL;
+    }
+    let sga = unsafe { &*sga };
+    let numsegs = sga.sga_numsegs as usize;
+    if numsegs == 0 || numsegs > sga.sga_segs.len() {
+        return libc::EINVAL;
+    }
+    let segs = &sga.sga_segs[..numsegs];
+    let len: u64 = segs.iter().map(|seg| seg.sgaseg_len as u64).sum();
+    with_files(|files| {
+        let (fd, offset) = match files.queue(qd) {
+            Some(q) => (q.fd, q.offset),
+            None => return libc::EBADF,
+        };
+        let ix = files.alloc_op(qd, dmtr_opcode_t::DMTR_OPC_PUSH, offset);
+        files.ops[ix].iovs.extend(segs.iter().map(|seg| iovec {
+            iov_base: seg.sgaseg_buf,
+            iov_len: seg.sgaseg_len as usize,
+        }));
+        if let Err(e) = files.prep(ix, fd, true) {
+            files.free_op(ix);
+            return e;
+        }
+        let q = files.queue(qd).unwrap();
+        q.offset += len;
+        q.last_pop = None;
+        unsafe { *qtok_out = files.ops[ix].qt };
+        0
+    })
+}
+
+/// Issues a read of up to `pop_size` bytes at the queue's offset, into a pool buffer that the
+/// application frees with `dmtr_sgafree`. A read at the end of the file pops zero bytes.
+pub fn pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+    if qtok_out.is_null() {
+        return libc::EINVAL;
+    }
+    let pop_size = CONFIG.with(|c| c.get().pop_size);
+    with_files(|files| {
+        let (fd, offset) = match files.queue(qd) {
+            Some(q) => (q.fd, q.offset),
+            None => return libc::EBADF,
+        };
+        let ix = files.alloc_op(qd, dmtr_opcode_t::DMTR_OPC_POP, offset);
+        let op = &mut files.ops[ix];
+        op.sga = pool::alloc_sgarray(pop_size);
+        op.iovs.push(iovec {
+            iov_base: op.sga.sga_segs[0].sgaseg_buf,
+            iov_len: pop_size,
+        });
+        if let Err(e) = files.prep(ix, fd, false) {
+            files.free_op(ix);
+            return e;
+        }
+        let qt = files.ops[ix].qt;
+        let q = files.queue(qd).unwrap();
+        q.offset += pop_size as u64;
+        q.last_pop = Some(qt);
+        unsafe { *qtok_out = qt };
+        0
+    })
+}
+
+/// Submits queued operations and reaps completions, without blocking.
+pub fn progress() {
+    with_files(|files| files.progress())
+}
+
+/// Returns zero and the result of a completed operation, `EAGAIN` if it is still in flight, or
+/// the error it failed with. Results of failed operations carry `DMTR_OPC_INVALID`.
+pub fn poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    with_files(|files| {
+        files.progress();
+        let ix = match files.op_index(qt) {
+            Some(ix) => ix,
+            None => return libc::EINVAL,
+        };
+        if files.ops[ix].res.is_none() {
+            return libc::EAGAIN;
+        }
+        files.take_result(ix, qr_out)
+    })
+}
+
+/// Like `poll`, but waits for the operation to complete, for at most `timeout`, according to the
+/// thread's wait policy. The thread's network stack keeps running meanwhile.
+pub fn wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t, timeout: Option<Duration>) -> c_int {
+    let mut backoff = Backoff::new(timeout);
+    loop {
+        let ret = poll(qr_out, qt);
+        if ret != libc::EAGAIN {
+            return ret;
+        }
+        network::progress();
+        if !backoff.idle(block) {
+            return libc::ETIMEDOUT;
+        }
+    }
+}
+
+/// Blocks until the calling thread's ring has completions, for at most `timeout`.
+pub fn block(timeout: Duration) {
+    with_files(|files| files.block(timeout))
+}
+
+/// Forgets an operation. One still in flight keeps its slot until the kernel is done with it.
+pub fn drop(qt: dmtr_qtoken_t) -> c_int {
+    with_files(|files| {
+        let ix = match files.op_index(qt) {
+            Some(ix) => ix,
+            None => return libc::EINVAL,
+        };
+        if files.ops[ix].res.is_some() {
+            files.free_op(ix);
+        } else {
+            files.ops[ix].dropped = true;
+        }
+        0
+    })
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        close,
+        open,
+        pop,
+        push,
+        wait,
+    };
+    use crate::{
+        interop::{
+            dmtr_opcode_t,
+            dmtr_qresult_t,
+        },
+        pool,
+    };
+    use std::{
+        env,
+        ffi::CString,
+        fs,
+        mem,
+    };
+
+    #[test]
+    fn push_pop() {
+        let path = env::temp_dir().join(format!("dmtr-file-{}", std::process::id()));
+        let cpath = CString::new(path.to_str().unwrap()).unwrap();
+        let mut qd = 0;
+        let flags = libc::O_RDWR | libc::O_CREAT | libc::O_TRUNC;
+        assert_eq!(open(&mut qd, cpath.as_ptr(), flags, 0o600), 0);
+
+        // Pushes in flight together land one after the other.
+        let sgas: Vec<_> = (0..4_u8)
+            .map(|i| {
+                let sga = pool::alloc_sgarray(3000);
+                unsafe { (sga.sga_segs[0].sgaseg_buf as *mut u8).write_bytes(i, 3000) };
+                sga
+            })
+            .collect();
+        let qts: Vec<_> = sgas
+            .iter()
+            .map(|sga| {
+                let mut qt = 0;
+                assert_eq!(push(&mut qt, qd, sga), 0);
+                qt
+            })
+            .collect();
+        for qt in qts {
+            let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+            assert_eq!(wait(&mut qr, qt, None), 0);
+            assert!(matches!(qr.qr_opcode, dmtr_opcode_t::DMTR_OPC_PUSH));
+        }
+        sgas.iter().for_each(pool::free_sgarray);
+        assert_eq!(close(qd), 0);
+        assert_eq!(fs::metadata(&path).unwrap().len(), 12000);
+
+        // Reads come back in 4 KiB pops, the last one short, then empty at the end of the file.
+        assert_eq!(open(&mut qd, cpath.as_ptr(), libc::O_RDONLY, 0), 0);
+        let mut lens = Vec::new();
+        for _ in 0..4 {
+            let mut qt = 0;
+            assert_eq!(pop(&mut qt, qd), 0);
+            let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+            assert_eq!(wait(&mut qr, qt, None), 0);
+            let sga = unsafe { qr.qr_value.sga };
+            lens.push(sga.sga_segs[0].sgaseg_len);
+            pool::free_sgarray(&sga);
+        }
+        assert_eq!(lens, vec![4096, 4096, 3808, 0]);
+        assert_eq!(close(qd), 0);
+        fs::remove_file(&path).unwrap();
+    }
+}
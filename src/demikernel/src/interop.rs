@@ -0,0 +1,277 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! The structures of the C interface, as laid out by `include/dmtr/types.h`.
+//!
+//! catnip has definitions of its own, but they are fixed at a single segment per array. These hold
+//! as many segments as the header says, and are what every call of the C interface takes and
+//! returns. catnip's are only used to talk to catnip itself, through the conversions below, which
+//! are lossless as long as an array has at most one segment.
+
+#![allow(non_camel_case_types)]
+
+use crate::dispatch::Dispatch;
+use catnip::{
+    file_table::FileDescriptor,
+    interop,
+    operations::OperationResult,
+};
+use libc::{
+    c_int,
+    sockaddr_in,
+};
+use std::{
+    cmp,
+    mem::{
+        self,
+        size_of,
+    },
+};
+
+pub use catnip::interop::{
+    dmtr_accept_result_t,
+    dmtr_opcode_t,
+    dmtr_qtoken_t,
+    dmtr_sgaseg_t,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+// Constants of `include/dmtr/types.h`, taken from the header by `build.rs`.
+include!(concat!(env!("OUT_DIR"), "/types_h.rs"));
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct dmtr_sgarray_t {
+    pub sga_buf: *mut libc::c_void,
+    pub sga_numsegs: u32,
+    pub sga_segs: [dmtr_sgaseg_t; DMTR_SGARRAY_MAXSIZE],
+    pub sga_addr: sockaddr_in,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub union dmtr_qr_value_t {
+    pub sga: dmtr_sgarray_t,
+    pub ares: dmtr_accept_result_t,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct dmtr_qresult_t {
+    pub qr_opcode: dmtr_opcode_t,
+    pub qr_qd: c_int,
+    pub qr_qt: dmtr_qtoken_t,
+    pub qr_value: dmtr_qr_value_t,
+}
+
+/// Fails the build unless `$cond` holds.
+macro_rules! const_assert {
+    ($cond:expr) => {
+        const _: [(); 0 - !$cond as usize] = [];
+    };
+}
+
+/// `sizeof(dmtr_sgarray_t)` in C: `sga_buf` and `sga_numsegs` take two words, so does each
+/// segment, and `sga_addr` comes last.
+const C_SGARRAY_SIZE: usize =
+    (2 + 2 * DMTR_SGARRAY_MAXSIZE) * size_of::<usize>() + size_of::<sockaddr_in>();
+
+/// `sizeof(dmtr_qresult_t)` in C: opcode, queue descriptor and token, then the array.
+const C_QRESULT_SIZE: usize = 16 + C_SGARRAY_SIZE;
+
+// Applications index arrays of these structures, so they must match the C header exactly. A
+// mismatch breaks the build rather than the stride.
+const_assert!(size_of::<dmtr_sgarray_t>() == C_SGARRAY_SIZE);
+const_assert!(size_of::<dmtr_qresult_t>() == C_QRESULT_SIZE);
+const_assert!(DMTR_SGARRAY_MAXSIZE >= 1);
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl dmtr_sgarray_t {
+    /// Returns an array with `segs` as its segments, which must fit.
+    pub fn new(segs: &[dmtr_sgaseg_t]) -> Self {
+        let mut sga: Self = unsafe { mem::zeroed() };
+        assert!(segs.len() <= DMTR_SGARRAY_MAXSIZE);
+        sga.sga_segs[..segs.len()].copy_from_slice(segs);
+        sga.sga_numsegs = segs.len() as u32;
+        sga
+    }
+
+    /// Returns the segments in use. A count larger than the array, which only an application can
+    /// leave behind, is cut down to it.
+    pub fn segments(&self) -> &[dmtr_sgaseg_t] {
+        &self.sga_segs[..cmp::min(self.sga_numsegs as usize, DMTR_SGARRAY_MAXSIZE)]
+    }
+
+    /// Total length of the segments in use.
+    pub fn len(&self) -> usize {
+        self.segments()
+            .iter()
+            .map(|seg| seg.sgaseg_len as usize)
+            .sum()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Returns catnip's version of an array that has at most one segment. Panics otherwise, so it
+    /// is only for arrays that are known to, such as those of `alloc_sga`.
+    pub fn narrow(&self) -> interop::dmtr_sgarray_t {
+        assert!(
+            self.sga_numsegs <= 1,
+            "catnip arrays hold a single segment, not {}",
+            self.sga_numsegs
+        );
+        let mut sga: interop::dmtr_sgarray_t = unsafe { mem::zeroed() };
+        sga.sga_buf = self.sga_buf;
+        sga.sga_numsegs = self.sga_numsegs;
+        sga.sga_segs[..self.segments().len()].copy_from_slice(self.segments());
+        sga.sga_addr = self.sga_addr;
+        sga
+    }
+}
+
+impl dmtr_qresult_t {
+    /// Turns the result of an operation into what the application gets back. Popped buffers go
+    /// through `Dispatch::into_sga`, so that a chained receive can come back as a segment per
+    /// buffer. Failed operations carry `DMTR_OPC_INVALID`, as the C header has no other opcode for
+    /// them.
+    pub fn pack<RT: Dispatch>(
+        rt: &RT,
+        result: OperationResult<RT>,
+        qd: FileDescriptor,
+        qt: dmtr_qtoken_t,
+    ) -> Self {
+        let mut qr = Self {
+            qr_opcode: dmtr_opcode_t::DMTR_OPC_INVALID,
+            qr_qd: qd as c_int,
+            qr_qt: qt,
+            qr_value: unsafe { mem::zeroed() },
+        };
+        match result {
+            OperationResult::Connect => qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_CONNECT,
+            OperationResult::Accept(new_qd) => {
+                qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_ACCEPT;
+                qr.qr_value.ares = dmtr_accept_result_t {
+                    qd: new_qd as c_int,
+                    addr: unsafe { mem::zeroed() },
+                };
+            },
+            OperationResult::Push => qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_PUSH,
+            OperationResult::Pop(addr, buf) => {
+                let mut sga = rt.into_sga(buf);
+                if let Some(endpoint) = addr {
+                    sga.sga_addr = sockaddr_in {
+                        sin_family: libc::AF_INET as libc::sa_family_t,
+                        sin_port: u16::from(endpoint.port()).to_be(),
+                        sin_addr: libc::in_addr {
+                            s_addr: u32::from_le_bytes(endpoint.address().octets()),
+                        },
+                        sin_zero: [0; 8],
+                    };
+                }
+                qr.qr_opcode = dmtr_opcode_t::DMTR_OPC_POP;
+                qr.qr_value.sga = sga;
+            },
+            OperationResult::Failed(e) => {
+                eprintln!("operation {} on qd {} failed: {:?}", qt, qd, e);
+            },
+        }
+        qr
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl From<interop::dmtr_sgarray_t> for dmtr_sgarray_t {
+    fn from(sga: interop::dmtr_sgarray_t) -> Self {
+        let numsegs = cmp::min(sga.sga_numsegs as usize, sga.sga_segs.len());
+        let mut wide = Self::new(&sga.sga_segs[..numsegs]);
+        wide.sga_buf = sga.sga_buf;
+        wide.sga_addr = sga.sga_addr;
+        wide
+    }
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
+        DMTR_SGARRAY_MAXSIZE,
+    };
+    use std::{
+        mem::{
+            size_of,
+            MaybeUninit,
+        },
+        ptr,
+    };
+
+    /// Offsets of the fields that C code reads, as laid out by `include/dmtr/types.h` on LP64.
+    #[test]
+    fn layout_matches_header() {
+        let sga = MaybeUninit::<dmtr_sgarray_t>::uninit();
+        let base = sga.as_ptr() as usize;
+        unsafe {
+            let p = sga.as_ptr();
+            assert_eq!(ptr::addr_of!((*p).sga_numsegs) as usize - base, 8);
+            assert_eq!(ptr::addr_of!((*p).sga_segs) as usize - base, 16);
+            assert_eq!(
+                ptr::addr_of!((*p).sga_addr) as usize - base,
+                16 + 16 * DMTR_SGARRAY_MAXSIZE
+            );
+        }
+
+        let qr = MaybeUninit::<dmtr_qresult_t>::uninit();
+        let base = qr.as_ptr() as usize;
+        unsafe {
+            let p = qr.as_ptr();
+            assert_eq!(ptr::addr_of!((*p).qr_qt) as usize - base, 8);
+            assert_eq!(ptr::addr_of!((*p).qr_value) as usize - base, 16);
+        }
+        assert_eq!(
+            size_of::<dmtr_qresult_t>(),
+            16 + size_of::<dmtr_sgarray_t>()
+        );
+    }
+
+    /// Single-segment arrays go to catnip and back unchanged.
+    #[test]
+    fn narrow_and_widen() {
+        let mut bytes = [0u8; 8];
+        let seg = dmtr_sgaseg_t {
+            sgaseg_buf: bytes.as_mut_ptr() as *mut _,
+            sgaseg_len: bytes.len() as u32,
+        };
+        let mut sga = dmtr_sgarray_t::new(&[seg]);
+        sga.sga_addr.sin_port = 80u16.to_be();
+        let back = dmtr_sgarray_t::from(sga.narrow());
+        assert_eq!(back.sga_numsegs, 1);
+        assert_eq!(back.segments()[0].sgaseg_buf, seg.sgaseg_buf);
+        assert_eq!(back.len(), bytes.len());
+        assert_eq!(back.sga_addr.sin_port, 80u16.to_be());
+    }
+
+    /// A count that an application got wrong never reads past the array.
+    #[test]
+    fn segments_are_bounded() {
+        let mut sga = dmtr_sgarray_t::new(&[]);
+        assert!(sga.is_empty());
+        sga.sga_numsegs = DMTR_SGARRAY_MAXSIZE as u32 + 5;
+        assert_eq!(sga.segments().len(), DMTR_SGARRAY_MAXSIZE);
+    }
+}
@@ -3,6 +3,18 @@
 
 #![cfg_attr(feature = "strict", deny(warnings))]
 #![deny(clippy::all)]
+#![feature(new_uninit)]
 
 pub mod config;
+pub mod cq;
+pub mod dispatch;
+pub mod event;
+pub mod file;
+pub mod interop;
 pub mod network;
+pub mod pool;
+pub mod sga;
+pub mod shm;
+pub mod stats;
+pub mod uring;
+pub mod wait;
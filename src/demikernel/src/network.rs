@@ -3,19 +3,42 @@
 
 #![allow(non_camel_case_types, unused)]
 
-use catnip::interop::{
-    dmtr_qresult_t,
-    dmtr_qtoken_t,
-    dmtr_sgarray_t,
+use crate::{
+    cq::CompletionQueueTable,
+    event::{
+        self,
+        dmtr_qevent_t,
+    },
+    file,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+    shm,
+    stats::{
+        self,
+        RuntimeStats,
+    },
+    wait::Backoff,
 };
 use libc::{
+    c_char,
     c_int,
+    c_void,
+    mode_t,
     sockaddr,
     socklen_t,
 };
-use std::cell::{
-    RefCell,
-    RefMut,
+use std::{
+    cell::{
+        RefCell,
+        RefMut,
+    },
+    mem,
+    ptr,
+    thread,
+    time::Duration,
 };
 
 type socket_fn = fn(*mut c_int, c_int, c_int, c_int) -> c_int;
@@ -31,17 +54,29 @@ type drop_fn = fn(dmtr_qtoken_t) -> c_int;
 type close_fn = fn(c_int) -> c_int;
 
 type wait_fn = fn(*mut dmtr_qresult_t, dmtr_qtoken_t) -> c_int;
+type timedwait_fn = fn(*mut dmtr_qresult_t, dmtr_qtoken_t, *const libc::timespec) -> c_int;
 type push_fn = fn(*mut dmtr_qtoken_t, c_int, *const dmtr_sgarray_t) -> c_int;
 
 type pop_fn = fn(*mut dmtr_qtoken_t, c_int) -> c_int;
 
+type pushv_fn = fn(*mut dmtr_qtoken_t, *const c_int, *const dmtr_sgarray_t, c_int) -> c_int;
+type popv_fn = fn(*mut dmtr_qtoken_t, *const c_int, c_int) -> c_int;
+
 type wait_any_fn = fn(*mut dmtr_qresult_t, *mut c_int, *mut dmtr_qtoken_t, c_int) -> c_int;
 
 type poll_fn = fn(*mut dmtr_qresult_t, dmtr_qtoken_t) -> c_int;
 
+type poll_many_fn =
+    fn(*mut c_int, *mut dmtr_qresult_t, *mut c_int, c_int, *const dmtr_qtoken_t, c_int) -> c_int;
+
 type sgaalloc_fn = fn(libc::size_t) -> dmtr_sgarray_t;
 type sgafree_fn = fn(*mut dmtr_sgarray_t) -> c_int;
 type getsockname_fn = fn(c_int, *mut sockaddr, *mut socklen_t) -> c_int;
+type runtime_stats_fn = fn() -> RuntimeStats;
+type register_memory_fn = fn(*mut c_void, libc::size_t) -> c_int;
+type unregister_memory_fn = fn(*mut c_void, libc::size_t) -> c_int;
+type progress_fn = fn();
+type wait_for_rx_fn = fn(Duration);
 
 //==============================================================================
 
@@ -56,12 +91,23 @@ pub struct NetworkLibOS {
     close: close_fn,
     push: push_fn,
     wait: wait_fn,
+    timedwait: timedwait_fn,
     wait_any: wait_any_fn,
     poll: poll_fn,
+    poll_many: poll_many_fn,
     pop: pop_fn,
+    pushv: pushv_fn,
+    popv: popv_fn,
     sgaalloc: sgaalloc_fn,
     sgafree: sgafree_fn,
     getsockname: getsockname_fn,
+    runtime_stats: runtime_stats_fn,
+    register_memory: register_memory_fn,
+    unregister_memory: unregister_memory_fn,
+    /// Runs the stack's background work, such as receiving and retransmitting, without a token.
+    progress: progress_fn,
+    /// Blocks until packets may have arrived, for at most the given duration.
+    wait_for_rx: wait_for_rx_fn,
 }
 
 impl NetworkLibOS {
@@ -76,12 +122,21 @@ impl NetworkLibOS {
         close: close_fn,
         push: push_fn,
         wait: wait_fn,
+        timedwait: timedwait_fn,
         wait_any: wait_any_fn,
         poll: poll_fn,
+        poll_many: poll_many_fn,
         pop: pop_fn,
+        pushv: pushv_fn,
+        popv: popv_fn,
         sgaalloc: sgaalloc_fn,
         sgafree: sgafree_fn,
         getsockname: getsockname_fn,
+        runtime_stats: runtime_stats_fn,
+        register_memory: register_memory_fn,
+        unregister_memory: unregister_memory_fn,
+        progress: progress_fn,
+        wait_for_rx: wait_for_rx_fn,
     ) -> Self {
         Self {
             socket,
@@ -94,12 +149,21 @@ impl NetworkLibOS {
             close,
             push,
             wait,
+            timedwait,
             wait_any,
             poll,
+            poll_many,
             pop,
+            pushv,
+            popv,
             sgaalloc,
             sgafree,
             getsockname,
+            runtime_stats,
+            register_memory,
+            unregister_memory,
+            progress,
+            wait_for_rx,
         }
     }
 }
@@ -108,8 +172,21 @@ impl NetworkLibOS {
 //
 //==============================================================================
 
+/// Scratch space for `poll_mixed`, kept across calls so that polling doesn't allocate.
+#[derive(Default)]
+struct MixedPoll {
+    net_ix: Vec<usize>,
+    net_qts: Vec<dmtr_qtoken_t>,
+    qrs: Vec<dmtr_qresult_t>,
+    ready: Vec<c_int>,
+    done: Vec<(c_int, dmtr_qresult_t, c_int)>,
+}
+
 thread_local! {
     static NETWORK_LIBOS: RefCell<Option<NetworkLibOS>> = RefCell::new(None);
+    static COMPLETION_QUEUES: RefCell<CompletionQueueTable> =
+        RefCell::new(CompletionQueueTable::new());
+    static MIXED_POLL: RefCell<MixedPoll> = RefCell::new(MixedPoll::default());
 }
 
 fn with_libos<T>(f: impl FnOnce(&mut NetworkLibOS) -> T) -> T {
@@ -119,6 +196,131 @@ fn with_libos<T>(f: impl FnOnce(&mut NetworkLibOS) -> T) -> T {
     })
 }
 
+fn with_cq_table<T>(f: impl FnOnce(&mut CompletionQueueTable) -> T) -> T {
+    COMPLETION_QUEUES.with(|t: &RefCell<CompletionQueueTable>| f(&mut t.borrow_mut()))
+}
+
+/// Returns the token written by a successful submission.
+fn issued_token(qtok_out: *const dmtr_qtoken_t, ret: c_int) -> dmtr_qtoken_t {
+    if ret == 0 && !qtok_out.is_null() {
+        unsafe { *qtok_out }
+    } else {
+        0
+    }
+}
+
+fn completed_result<'a>(qr: *const dmtr_qresult_t) -> Option<&'a dmtr_qresult_t> {
+    unsafe { qr.as_ref() }
+}
+
+/// Validates a wait timeout.
+fn timeout_duration(timeout: *const libc::timespec) -> Result<Duration, c_int> {
+    if timeout.is_null() {
+        return Err(libc::EINVAL);
+    }
+    let timeout = unsafe { *timeout };
+    if timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= 1_000_000_000 {
+        return Err(libc::EINVAL);
+    }
+    Ok(Duration::new(timeout.tv_sec as u64, timeout.tv_nsec as u32))
+}
+
+/// Whether `qt` belongs to a file or shared-memory queue, which this crate keeps itself.
+fn is_local_qt(qt: dmtr_qtoken_t) -> bool {
+    file::is_file_qt(qt) || shm::is_shm_qt(qt)
+}
+
+fn poll_local(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    if file::is_file_qt(qt) {
+        file::poll(qr_out, qt)
+    } else {
+        shm::poll(qr_out, qt)
+    }
+}
+
+/// Polls a set of tokens that includes file or shared-memory queue tokens, once, and calls `f`
+/// with the offset, result and error of at most `max` completed operations, by ascending offset.
+fn poll_mixed<T>(
+    qts: &[dmtr_qtoken_t],
+    max: usize,
+    f: impl FnOnce(&[(c_int, dmtr_qresult_t, c_int)]) -> T,
+) -> Result<T, c_int> {
+    MIXED_POLL.with(|p| {
+        let mut p = p.borrow_mut();
+        let p = &mut *p;
+        p.done.clear();
+        p.net_ix.clear();
+        p.net_qts.clear();
+        for (i, &qt) in qts.iter().enumerate() {
+            if !is_local_qt(qt) {
+                p.net_ix.push(i);
+                p.net_qts.push(qt);
+            }
+        }
+        // The libOS goes first: if it fails, no local result has been taken yet.
+        if !p.net_qts.is_empty() {
+            let mut nr: c_int = 0;
+            p.qrs.resize(max, unsafe { mem::zeroed() });
+            p.ready.resize(max, 0);
+            let ret = with_libos(|libos| {
+                (libos.poll_many)(
+                    &mut nr,
+                    p.qrs.as_mut_ptr(),
+                    p.ready.as_mut_ptr(),
+                    max as c_int,
+                    p.net_qts.as_ptr(),
+                    p.net_qts.len() as c_int,
+                )
+            });
+            if ret != 0 {
+                return Err(ret);
+            }
+            for i in 0..nr as usize {
+                let offset = p.net_ix[p.ready[i] as usize] as c_int;
+                p.done.push((offset, p.qrs[i], 0));
+            }
+        }
+        file::progress();
+        for (i, &qt) in qts.iter().enumerate() {
+            if p.done.len() == max {
+                break;
+            }
+            if is_local_qt(qt) {
+                let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+                let ret = poll_local(&mut qr, qt);
+                if ret != libc::EAGAIN {
+                    p.done.push((i as c_int, qr, ret));
+                }
+            }
+        }
+        p.done.sort_by_key(|&(i, ..)| i);
+        Ok(f(&p.done))
+    })
+}
+
+/// Blocks until one of `qts` may have completed, for at most `timeout`. Sets with network tokens
+/// wake up on incoming packets, and sets with file tokens on file completions. Shared-memory
+/// tokens have a wake word each, which a set can't block on, so sets of those alone just sleep.
+fn sleep_mixed(qts: &[dmtr_qtoken_t], timeout: Duration) {
+    if qts.iter().any(|&qt| !is_local_qt(qt)) {
+        with_libos(|libos| (libos.wait_for_rx)(timeout))
+    } else if qts.iter().any(|&qt| file::is_file_qt(qt)) {
+        file::block(timeout)
+    } else {
+        thread::sleep(timeout)
+    }
+}
+
+/// Runs the network stack's background work, if the calling thread has a libOS, so that waits on
+/// file or shared-memory queues don't hold it up.
+pub fn progress() {
+    NETWORK_LIBOS.with(|l| {
+        if let Some(libos) = l.borrow_mut().as_mut() {
+            (libos.progress)();
+        }
+    })
+}
+
 pub fn libos_network_init(libos: NetworkLibOS) {
     NETWORK_LIBOS.with(move |l: &RefCell<Option<NetworkLibOS>>| {
         let mut tls_libos: RefMut<Option<NetworkLibOS>> = l.borrow_mut();
@@ -182,12 +384,78 @@ pub extern "C" fn dmtr_connect(
     with_libos(|libos| (libos.connect)(qtok_out, qd, saddr, size))
 }
 
+//==============================================================================
+// open
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_open(qd_out: *mut c_int, pathname: *const c_char, flags: c_int) -> c_int {
+    file::open(qd_out, pathname, flags, 0)
+}
+
+//==============================================================================
+// open2
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_open2(
+    qd_out: *mut c_int,
+    pathname: *const c_char,
+    flags: c_int,
+    mode: mode_t,
+) -> c_int {
+    file::open(qd_out, pathname, flags, mode)
+}
+
+//==============================================================================
+// creat
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_creat(qd_out: *mut c_int, pathname: *const c_char, mode: mode_t) -> c_int {
+    let flags = libc::O_CREAT | libc::O_WRONLY | libc::O_TRUNC;
+    file::open(qd_out, pathname, flags, mode)
+}
+
+//==============================================================================
+// shmqueue
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_shmqueue(
+    qd_out: *mut c_int,
+    name: *const c_char,
+    capacity: libc::size_t,
+    buf_size: libc::size_t,
+) -> c_int {
+    shm::open(qd_out, name, capacity, buf_size)
+}
+
+//==============================================================================
+// shmalloc
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_shmalloc(
+    sga_out: *mut dmtr_sgarray_t,
+    qd: c_int,
+    size: libc::size_t,
+) -> c_int {
+    shm::alloc(sga_out, qd, size)
+}
+
 //==============================================================================
 // close
 //==============================================================================
 
 #[no_mangle]
 pub extern "C" fn dmtr_close(qd: c_int) -> c_int {
+    if file::is_file_qd(qd) {
+        return file::close(qd);
+    }
+    if shm::is_shm_qd(qd) {
+        return shm::close(qd);
+    }
     with_libos(|libos| (libos.close)(qd))
 }
 
@@ -203,7 +471,9 @@ pub extern "C" fn dmtr_pushto(
     saddr: *const sockaddr,
     size: socklen_t,
 ) -> c_int {
-    with_libos(|libos| (libos.pushto)(qtok_out, qd, sga, saddr, size))
+    let ret = with_libos(|libos| (libos.pushto)(qtok_out, qd, sga, saddr, size));
+    stats::record_push(qd, sga, issued_token(qtok_out, ret), ret);
+    ret
 }
 
 //==============================================================================
@@ -216,7 +486,15 @@ pub extern "C" fn dmtr_push(
     qd: c_int,
     sga: *const dmtr_sgarray_t,
 ) -> c_int {
-    with_libos(|libos| (libos.push)(qtok_out, qd, sga))
+    let ret = if file::is_file_qd(qd) {
+        file::push(qtok_out, qd, sga)
+    } else if shm::is_shm_qd(qd) {
+        shm::push(qtok_out, qd, sga)
+    } else {
+        with_libos(|libos| (libos.push)(qtok_out, qd, sga))
+    };
+    stats::record_push(qd, sga, issued_token(qtok_out, ret), ret);
+    ret
 }
 
 //==============================================================================
@@ -225,7 +503,96 @@ pub extern "C" fn dmtr_push(
 
 #[no_mangle]
 pub extern "C" fn dmtr_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
-    with_libos(|libos| (libos.pop)(qtok_out, qd))
+    let ret = if file::is_file_qd(qd) {
+        file::pop(qtok_out, qd)
+    } else if shm::is_shm_qd(qd) {
+        shm::pop(qtok_out, qd)
+    } else {
+        with_libos(|libos| (libos.pop)(qtok_out, qd))
+    };
+    stats::record_pop(qd, issued_token(qtok_out, ret), ret);
+    ret
+}
+
+//==============================================================================
+// pushv
+//==============================================================================
+
+fn any_local_qd(qds: *const c_int, num_ops: c_int) -> bool {
+    !qds.is_null()
+        && (0..num_ops.max(0) as usize).any(|i| {
+            let qd = unsafe { *qds.add(i) };
+            file::is_file_qd(qd) || shm::is_shm_qd(qd)
+        })
+}
+
+/// Issues a batch one operation at a time, for batches that involve file or shared-memory queues.
+/// On failure, the operations already issued are dropped.
+fn each_op(
+    qtoks_out: *mut dmtr_qtoken_t,
+    num_ops: c_int,
+    mut issue: impl FnMut(usize, *mut dmtr_qtoken_t) -> c_int,
+) -> c_int {
+    if qtoks_out.is_null() || num_ops < 0 {
+        return libc::EINVAL;
+    }
+    for i in 0..num_ops as usize {
+        let ret = issue(i, unsafe { qtoks_out.add(i) });
+        if ret != 0 {
+            for j in 0..i {
+                dmtr_drop(unsafe { *qtoks_out.add(j) });
+            }
+            return ret;
+        }
+    }
+    0
+}
+
+#[no_mangle]
+pub extern "C" fn dmtr_pushv(
+    qtoks_out: *mut dmtr_qtoken_t,
+    qds: *const c_int,
+    sgas: *const dmtr_sgarray_t,
+    num_ops: c_int,
+) -> c_int {
+    if any_local_qd(qds, num_ops) {
+        return each_op(qtoks_out, num_ops, |i, qtok_out| unsafe {
+            dmtr_push(qtok_out, *qds.add(i), sgas.add(i))
+        });
+    }
+    let ret = with_libos(|libos| (libos.pushv)(qtoks_out, qds, sgas, num_ops));
+    if !qds.is_null() && !sgas.is_null() {
+        for i in 0..num_ops.max(0) as usize {
+            let qt = issued_token(qtoks_out.wrapping_add(i), ret);
+            stats::record_push(unsafe { *qds.add(i) }, unsafe { sgas.add(i) }, qt, ret);
+        }
+    }
+    ret
+}
+
+//==============================================================================
+// popv
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_popv(
+    qtoks_out: *mut dmtr_qtoken_t,
+    qds: *const c_int,
+    num_ops: c_int,
+) -> c_int {
+    if any_local_qd(qds, num_ops) {
+        return each_op(qtoks_out, num_ops, |i, qtok_out| unsafe {
+            dmtr_pop(qtok_out, *qds.add(i))
+        });
+    }
+    let ret = with_libos(|libos| (libos.popv)(qtoks_out, qds, num_ops));
+    if !qds.is_null() {
+        for i in 0..num_ops.max(0) as usize {
+            let qt = issued_token(qtoks_out.wrapping_add(i), ret);
+            stats::record_pop(unsafe { *qds.add(i) }, qt, ret);
+        }
+    }
+    ret
 }
 
 //==============================================================================
@@ -234,7 +601,15 @@ pub extern "C" fn dmtr_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
 
 #[no_mangle]
 pub extern "C" fn dmtr_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| (libos.poll)(qr_out, qt))
+    let ret = if is_local_qt(qt) {
+        poll_local(qr_out, qt)
+    } else {
+        with_libos(|libos| (libos.poll)(qr_out, qt))
+    };
+    if ret == 0 {
+        stats::record_completion(qt, completed_result(qr_out));
+    }
+    ret
 }
 
 //==============================================================================
@@ -243,6 +618,13 @@ pub extern "C" fn dmtr_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c
 
 #[no_mangle]
 pub extern "C" fn dmtr_drop(qt: dmtr_qtoken_t) -> c_int {
+    stats::record_drop(qt);
+    if file::is_file_qt(qt) {
+        return file::drop(qt);
+    }
+    if shm::is_shm_qt(qt) {
+        return shm::drop(qt);
+    }
     with_libos(|libos| (libos.drop)(qt))
 }
 
@@ -252,7 +634,93 @@ pub extern "C" fn dmtr_drop(qt: dmtr_qtoken_t) -> c_int {
 
 #[no_mangle]
 pub extern "C" fn dmtr_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| (libos.wait)(qr_out, qt))
+    let ret = if file::is_file_qt(qt) {
+        file::wait(qr_out, qt, None)
+    } else if shm::is_shm_qt(qt) {
+        shm::wait(qr_out, qt, None)
+    } else {
+        with_libos(|libos| (libos.wait)(qr_out, qt))
+    };
+    if ret == 0 {
+        stats::record_completion(qt, completed_result(qr_out));
+    }
+    ret
+}
+
+//==============================================================================
+// timedwait
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_timedwait(
+    qr_out: *mut dmtr_qresult_t,
+    qt: dmtr_qtoken_t,
+    timeout: *const libc::timespec,
+) -> c_int {
+    let ret = if file::is_file_qt(qt) {
+        match timeout_duration(timeout) {
+            Ok(timeout) => file::wait(qr_out, qt, Some(timeout)),
+            Err(e) => e,
+        }
+    } else if shm::is_shm_qt(qt) {
+        match timeout_duration(timeout) {
+            Ok(timeout) => shm::wait(qr_out, qt, Some(timeout)),
+            Err(e) => e,
+        }
+    } else {
+        with_libos(|libos| (libos.timedwait)(qr_out, qt, timeout))
+    };
+    if ret == 0 {
+        stats::record_completion(qt, completed_result(qr_out));
+    }
+    ret
+}
+
+//==============================================================================
+// wait_event
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_wait_event(qe_out: *mut dmtr_qevent_t, qt: dmtr_qtoken_t) -> c_int {
+    // Without an event to return it in, a popped array would be lost.
+    if qe_out.is_null() {
+        return libc::EINVAL;
+    }
+    event::complete_into(unsafe { &mut *qe_out }, |qr| {
+        let ret = if file::is_file_qt(qt) {
+            file::wait(qr, qt, None)
+        } else if shm::is_shm_qt(qt) {
+            shm::wait(qr, qt, None)
+        } else {
+            with_libos(|libos| (libos.wait)(qr, qt))
+        };
+        if ret == 0 {
+            stats::record_completion(qt, Some(&*qr));
+        }
+        ret
+    })
+}
+
+//==============================================================================
+// poll_event
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_poll_event(qe_out: *mut dmtr_qevent_t, qt: dmtr_qtoken_t) -> c_int {
+    if qe_out.is_null() {
+        return libc::EINVAL;
+    }
+    event::complete_into(unsafe { &mut *qe_out }, |qr| {
+        let ret = if is_local_qt(qt) {
+            poll_local(qr, qt)
+        } else {
+            with_libos(|libos| (libos.poll)(qr, qt))
+        };
+        if ret == 0 {
+            stats::record_completion(qt, Some(&*qr));
+        }
+        ret
+    })
 }
 
 //==============================================================================
@@ -266,7 +734,162 @@ pub extern "C" fn dmtr_wait_any(
     qts: *mut dmtr_qtoken_t,
     num_qts: c_int,
 ) -> c_int {
-    with_libos(|libos| (libos.wait_any)(qr_out, ready_offset, qts, num_qts))
+    if !qts.is_null() && num_qts > 0 {
+        let tokens = unsafe { std::slice::from_raw_parts(qts, num_qts as usize) };
+        if tokens.iter().any(|&qt| is_local_qt(qt)) {
+            return wait_any_mixed(qr_out, ready_offset, tokens);
+        }
+    }
+    let ret = with_libos(|libos| (libos.wait_any)(qr_out, ready_offset, qts, num_qts));
+    if ret == 0 && !ready_offset.is_null() {
+        let qt = unsafe { *qts.add(*ready_offset as usize) };
+        stats::record_completion(qt, completed_result(qr_out));
+    }
+    ret
+}
+
+/// Waits on tokens that include file or shared-memory queue tokens, by polling each kind in turn
+/// and backing off between fruitless polls according to the thread's wait policy.
+fn wait_any_mixed(
+    qr_out: *mut dmtr_qresult_t,
+    ready_offset: *mut c_int,
+    qts: &[dmtr_qtoken_t],
+) -> c_int {
+    let mut backoff = Backoff::new(None);
+    loop {
+        let first = match poll_mixed(qts, 1, |done| done.first().copied()) {
+            Ok(first) => first,
+            Err(e) => return e,
+        };
+        if let Some((i, qr, ret)) = first {
+            stats::record_completion(qts[i as usize], Some(&qr));
+            if !qr_out.is_null() {
+                unsafe { *qr_out = qr };
+            }
+            if !ready_offset.is_null() {
+                unsafe { *ready_offset = i };
+            }
+            return ret;
+        }
+        backoff.idle(|t| sleep_mixed(qts, t));
+    }
+}
+
+//==============================================================================
+// cq_create
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_cq_create(cqd_out: *mut c_int) -> c_int {
+    if cqd_out.is_null() {
+        return libc::EINVAL;
+    }
+    let cqd = with_cq_table(|table| table.alloc());
+    unsafe { *cqd_out = cqd };
+    0
+}
+
+//==============================================================================
+// cq_add
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_cq_add(cqd: c_int, qt: dmtr_qtoken_t) -> c_int {
+    with_cq_table(|table| match table.get_mut(cqd) {
+        Some(cq) => {
+            cq.add(qt);
+            0
+        },
+        None => libc::EBADF,
+    })
+}
+
+//==============================================================================
+// cq_wait
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_cq_wait(
+    nr_out: *mut c_int,
+    qrs_out: *mut dmtr_qresult_t,
+    max_qrs: c_int,
+    cqd: c_int,
+) -> c_int {
+    if nr_out.is_null() || qrs_out.is_null() || max_qrs <= 0 {
+        return libc::EINVAL;
+    }
+    with_cq_table(|table| {
+        let cq = match table.get_mut(cqd) {
+            Some(cq) => cq,
+            None => return libc::EBADF,
+        };
+        // Nothing could ever complete.
+        if cq.is_empty() {
+            return libc::EINVAL;
+        }
+        let mut backoff = Backoff::new(None);
+        loop {
+            let mut nr: c_int = 0;
+            let ready = cq.ready_buf(max_qrs as usize).as_mut_ptr();
+            let qts = cq.tokens();
+            let ret = if qts.iter().any(|&qt| is_local_qt(qt)) {
+                // Failed file operations come back with `DMTR_OPC_INVALID`.
+                poll_mixed(qts, max_qrs as usize, |done| {
+                    for (i, &(offset, qr, _)) in done.iter().enumerate() {
+                        unsafe {
+                            *qrs_out.add(i) = qr;
+                            *ready.add(i) = offset;
+                        }
+                    }
+                    nr = done.len() as c_int;
+                })
+            } else {
+                match with_libos(|libos| {
+                    (libos.poll_many)(
+                        &mut nr,
+                        qrs_out,
+                        ready,
+                        max_qrs,
+                        qts.as_ptr(),
+                        qts.len() as c_int,
+                    )
+                }) {
+                    0 => Ok(()),
+                    e => Err(e),
+                }
+            };
+            if let Err(e) = ret {
+                return e;
+            }
+            if nr > 0 {
+                for i in 0..nr as usize {
+                    let qt = qts[unsafe { *ready.add(i) } as usize];
+                    stats::record_completion(qt, Some(unsafe { &*qrs_out.add(i) }));
+                }
+                cq.remove_ready(nr as usize);
+                unsafe { *nr_out = nr };
+                return 0;
+            }
+            backoff.idle(|t| sleep_mixed(cq.tokens(), t));
+        }
+    })
+}
+
+//==============================================================================
+// cq_destroy
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_cq_destroy(cqd: c_int) -> c_int {
+    let cq = match with_cq_table(|table| table.free(cqd)) {
+        Some(cq) => cq,
+        None => return libc::EBADF,
+    };
+    // Operations that never completed are dropped along with the set.
+    for qt in cq.into_tokens() {
+        dmtr_drop(qt);
+    }
+    0
 }
 
 //==============================================================================
@@ -284,7 +907,39 @@ pub extern "C" fn dmtr_sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
 
 #[no_mangle]
 pub extern "C" fn dmtr_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
-    with_libos(|libos| (libos.sgafree)(sga))
+    // An event's array that was already freed has nothing left to give back.
+    if event::is_released_slot(sga) {
+        return libc::EINVAL;
+    }
+    // Buffers from a shared-memory arena go back to it, not to the libOS.
+    let ret = if !sga.is_null() && shm::free_sgarray(unsafe { &*sga }) {
+        0
+    } else {
+        with_libos(|libos| (libos.sgafree)(sga))
+    };
+    // Arrays popped through `dmtr_wait_event` live in a slot that goes back with them.
+    if ret == 0 && !sga.is_null() {
+        event::release_slot(sga);
+    }
+    ret
+}
+
+//==============================================================================
+// register_memory
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_register_memory(addr: *mut c_void, len: libc::size_t) -> c_int {
+    with_libos(|libos| (libos.register_memory)(addr, len))
+}
+
+//==============================================================================
+// unregister_memory
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_unregister_memory(addr: *mut c_void, len: libc::size_t) -> c_int {
+    with_libos(|libos| (libos.unregister_memory)(addr, len))
 }
 
 //==============================================================================
@@ -295,3 +950,40 @@ pub extern "C" fn dmtr_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
 pub extern "C" fn dmtr_getsockname(qd: c_int, saddr: *mut sockaddr, size: *mut socklen_t) -> c_int {
     with_libos(|libos| (libos.getsockname)(qd, saddr, size))
 }
+
+//==============================================================================
+// stats
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_stats(
+    buf: *mut c_char,
+    len: libc::size_t,
+    len_out: *mut libc::size_t,
+) -> c_int {
+    let rt = with_libos(|libos| (libos.runtime_stats)());
+    let text = stats::snapshot(&rt);
+    // Leave room for the terminating NUL.
+    let needed = text.len() + 1;
+    if !len_out.is_null() {
+        unsafe { *len_out = needed };
+    }
+    if buf.is_null() || len < needed {
+        return libc::ERANGE;
+    }
+    unsafe {
+        ptr::copy_nonoverlapping(text.as_ptr(), buf as *mut u8, text.len());
+        *buf.add(text.len()) = 0;
+    }
+    0
+}
+
+//==============================================================================
+// stats_reset
+//==============================================================================
+
+#[no_mangle]
+pub extern "C" fn dmtr_stats_reset() -> c_int {
+    stats::reset();
+    0
+}
@@ -0,0 +1,555 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Size-classed pool for the buffers that applications get from `dmtr_sgaalloc`.
+//!
+//! Buffers are carved out of 2 MiB regions, each dedicated to one power-of-two size class, and
+//! recycled through per-class free lists instead of going back to the global allocator. Every
+//! region lies within a single virtual address range that is reserved up front, so telling a
+//! pool buffer apart from any other pointer, and finding its size class, takes a bounds check and
+//! a shift. Regions can be backed by huge pages, bound to a NUMA node and pre-faulted.
+//!
+//! Each thread keeps a cache of free buffers per class and only takes the lock on the shared free
+//! lists to move buffers in batches. Buffers may be freed by a thread other than the one that
+//! allocated them. Requests larger than the biggest class go to the global allocator.
+
+use crate::interop::{
+    dmtr_sgarray_t,
+    dmtr_sgaseg_t,
+};
+use std::{
+    cell::RefCell,
+    cmp,
+    mem,
+    ptr,
+    slice,
+    sync::{
+        atomic::{
+            AtomicU8,
+            AtomicUsize,
+            Ordering,
+        },
+        Mutex,
+        Once,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Smallest and largest size classes, as powers of two: 64 B to 64 KiB.
+const MIN_CLASS_SHIFT: u32 = 6;
+const MAX_CLASS_SHIFT: u32 = 16;
+/// Largest buffer that comes from a size class.
+pub const MAX_SIZE: usize = 1 << MAX_CLASS_SHIFT;
+const NUM_CLASSES: usize = (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1) as usize;
+
+/// Regions are the size (and alignment) of an x86-64 huge page.
+const REGION_SHIFT: u32 = 21;
+const REGION_SIZE: usize = 1 << REGION_SHIFT;
+
+const PAGE_SIZE: usize = 4096;
+
+/// Address space reserved for the pool, by default. Only regions in use take up memory.
+pub const DEFAULT_RESERVE: usize = 4 << 30;
+
+/// Free buffers that a thread keeps per size class, by default.
+pub const DEFAULT_CACHE_SIZE: usize = 64;
+
+/// Marks regions that aren't carved yet in `Arena::region_class`.
+const NO_CLASS: u8 = u8::MAX;
+
+const MPOL_BIND: libc::c_int = 2;
+/// `MAP_HUGETLB` page size: log2(2 MiB) << `MAP_HUGE_SHIFT`.
+const MAP_HUGE_2MB: libc::c_int = 21 << 26;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct PoolConfig {
+    /// Back regions with 2 MiB huge pages, when the system has some to spare.
+    pub hugepages: bool,
+    /// Fault regions in when they are carved, instead of on first use.
+    pub populate: bool,
+    /// Node to take memory from. Otherwise, memory comes from wherever it is first touched.
+    pub numa_node: Option<u32>,
+    /// Address space to reserve, which bounds how much memory the pool can hand out.
+    pub reserve: usize,
+    /// Free buffers that a thread keeps per size class.
+    pub cache_size: usize,
+}
+
+/// Counters for the calling thread's use of the pool.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct PoolStats {
+    pub allocs: u64,
+    pub frees: u64,
+    /// Allocations served from the thread's cache.
+    pub cache_hits: u64,
+    /// Batches taken from the shared free lists.
+    pub refills: u64,
+    /// Batches returned to the shared free lists.
+    pub flushes: u64,
+    /// Allocations too large for any size class.
+    pub oversize: u64,
+    /// Allocations that found the pool exhausted and went to the global allocator.
+    pub exhausted: u64,
+    /// Regions carved so far, by all threads.
+    pub regions: u64,
+}
+
+struct Arena {
+    config: PoolConfig,
+    base: usize,
+    num_regions: usize,
+    next_region: AtomicUsize,
+    region_class: Box<[AtomicU8]>,
+    /// Shared free lists, one per size class.
+    free: Vec<Mutex<Vec<usize>>>,
+}
+
+struct Cache {
+    free: [Vec<usize>; NUM_CLASSES],
+    stats: PoolStats,
+}
+
+static ARENA_INIT: Once = Once::new();
+static mut ARENA: Option<Arena> = None;
+
+thread_local! {
+    static CACHE: RefCell<Cache> = RefCell::new(Cache::new());
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl PoolConfig {
+    /// Parses the `pool` section of the configuration.
+    pub fn parse(
+        hugepages: Option<bool>,
+        populate: Option<bool>,
+        numa_node: Option<i64>,
+        reserve_mb: Option<i64>,
+        cache_size: Option<i64>,
+    ) -> Self {
+        let numa_node = match numa_node {
+            Some(n) if n >= 0 => Some(n as u32),
+            Some(..) => panic!("Invalid pool numa_node"),
+            None => None,
+        };
+        let reserve = match reserve_mb {
+            Some(n) if n > 0 => (n as usize) << 20,
+            Some(..) => panic!("Invalid pool reserve_mb"),
+            None => DEFAULT_RESERVE,
+        };
+        let cache_size = match cache_size {
+            Some(n) if n > 0 => n as usize,
+            Some(..) => panic!("Invalid pool cache_size"),
+            None => DEFAULT_CACHE_SIZE,
+        };
+        Self {
+            hugepages: hugepages.unwrap_or(false),
+            populate: populate.unwrap_or(false),
+            numa_node,
+            reserve,
+            cache_size,
+        }
+    }
+}
+
+impl Arena {
+    /// Returns the arena, creating it with `config` if no thread has yet.
+    fn global(config: PoolConfig) -> &'static Arena {
+        unsafe {
+            ARENA_INIT.call_once(|| ARENA = Some(Arena::new(config)));
+            ARENA.as_ref().unwrap()
+        }
+    }
+
+    /// Returns the arena if some thread has already created it.
+    fn get() -> Option<&'static Arena> {
+        if ARENA_INIT.is_completed() {
+            unsafe { ARENA.as_ref() }
+        } else {
+            None
+        }
+    }
+
+    fn new(config: PoolConfig) -> Self {
+        // Reserve one extra region so that the range can be aligned to a region boundary.
+        let num_regions = config.reserve >> REGION_SHIFT;
+        let len = (num_regions + 1) << REGION_SHIFT;
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_NONE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE,
+                -1,
+                0,
+            )
+        };
+        let (base, num_regions) = if addr == libc::MAP_FAILED {
+            eprintln!("Failed to reserve {} bytes for the buffer pool", len);
+            (0, 0)
+        } else {
+            let base = (addr as usize + REGION_SIZE - 1) & !(REGION_SIZE - 1);
+            (base, num_regions)
+        };
+        Self {
+            config,
+            base,
+            num_regions,
+            next_region: AtomicUsize::new(0),
+            region_class: (0..num_regions).map(|_| AtomicU8::new(NO_CLASS)).collect(),
+            free: (0..NUM_CLASSES).map(|_| Mutex::new(Vec::new())).collect(),
+        }
+    }
+
+    fn class_of(&self, ptr: usize) -> Option<usize> {
+        if ptr < self.base || ptr >= self.base + (self.num_regions << REGION_SHIFT) {
+            return None;
+        }
+        match self.region_class[(ptr - self.base) >> REGION_SHIFT].load(Ordering::Acquire) {
+            NO_CLASS => None,
+            class => Some(class as usize),
+        }
+    }
+
+    /// Carves a new region into buffers of `class` and adds them to the shared free list.
+    /// Returns false once the reserved range is used up or the memory can't be had.
+    fn grow(&self, class: usize) -> bool {
+        let idx = self.next_region.fetch_add(1, Ordering::Relaxed);
+        if idx >= self.num_regions {
+            return false;
+        }
+        let addr = self.base + (idx << REGION_SHIFT);
+        if !self.map_region(addr) {
+            return false;
+        }
+        self.region_class[idx].store(class as u8, Ordering::Release);
+
+        let size = class_size(class);
+        let mut free = self.free[class].lock().unwrap();
+        free.extend((0..(REGION_SIZE / size)).rev().map(|i| addr + i * size));
+        true
+    }
+
+    fn map_region(&self, addr: usize) -> bool {
+        let prot = libc::PROT_READ | libc::PROT_WRITE;
+        let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_FIXED;
+        let mut mapped = false;
+        if self.config.hugepages {
+            mapped = unsafe {
+                libc::mmap(
+                    addr as *mut _,
+                    REGION_SIZE,
+                    prot,
+                    flags | libc::MAP_HUGETLB | MAP_HUGE_2MB,
+                    -1,
+                    0,
+                )
+            } != libc::MAP_FAILED;
+        }
+        if !mapped {
+            if unsafe { libc::mmap(addr as *mut _, REGION_SIZE, prot, flags, -1, 0) }
+                == libc::MAP_FAILED
+            {
+                eprintln!("Failed to map a buffer pool region");
+                return false;
+            }
+            if self.config.hugepages {
+                unsafe { libc::madvise(addr as *mut _, REGION_SIZE, libc::MADV_HUGEPAGE) };
+            }
+        }
+
+        // The policy has to be in place before the first touch, which decides where pages live.
+        if let Some(node) = self.config.numa_node {
+            let mut nodemask = [0 as libc::c_ulong; 16];
+            let bits = mem::size_of::<libc::c_ulong>() * 8;
+            let node = node as usize;
+            assert!(node < nodemask.len() * bits, "NUMA node out of range");
+            nodemask[node / bits] |= 1 << (node % bits);
+            let ret = unsafe {
+                libc::syscall(
+                    libc::SYS_mbind,
+                    addr,
+                    REGION_SIZE,
+                    MPOL_BIND,
+                    nodemask.as_ptr(),
+                    nodemask.len() * bits + 1,
+                    0,
+                )
+            };
+            if ret != 0 {
+                eprintln!("Failed to bind buffer pool region to NUMA node {}", node);
+            }
+        }
+        if self.config.populate {
+            for offset in (0..REGION_SIZE).step_by(PAGE_SIZE) {
+                unsafe { ptr::write_volatile((addr + offset) as *mut u8, 0) };
+            }
+        }
+        true
+    }
+}
+
+impl Cache {
+    fn new() -> Self {
+        Self {
+            free: Default::default(),
+            stats: PoolStats::default(),
+        }
+    }
+
+    fn alloc(&mut self, arena: &Arena, class: usize) -> Option<usize> {
+        if let Some(ptr) = self.free[class].pop() {
+            self.stats.cache_hits += 1;
+            return Some(ptr);
+        }
+        let batch = cmp::max(arena.config.cache_size / 2, 1);
+        loop {
+            {
+                let mut free = arena.free[class].lock().unwrap();
+                if !free.is_empty() {
+                    let at = free.len().saturating_sub(batch);
+                    self.free[class].extend(free.drain(at..));
+                    self.stats.refills += 1;
+                    return self.free[class].pop();
+                }
+            }
+            if !arena.grow(class) {
+                return None;
+            }
+        }
+    }
+
+    fn free(&mut self, arena: &Arena, class: usize, ptr: usize) {
+        self.free[class].push(ptr);
+        if self.free[class].len() > arena.config.cache_size {
+            // Keep half, so that a thread alternating around the limit doesn't flush every time.
+            let at = arena.config.cache_size / 2;
+            arena.free[class]
+                .lock()
+                .unwrap()
+                .extend(self.free[class].drain(at..));
+            self.stats.flushes += 1;
+        }
+    }
+}
+
+/// Sets up the pool. Only the first configuration, or the defaults if something was allocated
+/// before, takes effect: all threads share the pool.
+pub fn configure(config: PoolConfig) {
+    if Arena::global(config).config != config {
+        eprintln!("Buffer pool is already set up, ignoring new configuration");
+    }
+}
+
+/// Allocates an uninitialized buffer of at least `size` bytes.
+pub fn alloc(size: usize) -> *mut u8 {
+    let class = match size_class(size) {
+        Some(class) => class,
+        None => {
+            CACHE.with(|c| {
+                let mut c = c.borrow_mut();
+                c.stats.allocs += 1;
+                c.stats.oversize += 1;
+            });
+            return heap_alloc(size);
+        },
+    };
+    let arena = Arena::global(PoolConfig::default());
+    let ptr = CACHE.with(|c| {
+        let mut c = c.borrow_mut();
+        c.stats.allocs += 1;
+        let ptr = c.alloc(arena, class);
+        if ptr.is_none() {
+            c.stats.exhausted += 1;
+        }
+        ptr
+    });
+    match ptr {
+        Some(ptr) => ptr as *mut u8,
+        None => heap_alloc(size),
+    }
+}
+
+/// Releases a buffer from `alloc`. `ptr` may point anywhere within the buffer; `len` must be the
+/// size that was asked for if the buffer didn't come from a size class.
+///
+/// # Safety
+///
+/// `ptr` must come from `alloc` and not have been freed already.
+pub unsafe fn free(ptr: *mut u8, len: usize) {
+    let class = match Arena::get().and_then(|arena| arena.class_of(ptr as usize)) {
+        Some(class) => class,
+        None => {
+            let _ = CACHE.try_with(|c| c.borrow_mut().stats.frees += 1);
+            drop(Box::from_raw(slice::from_raw_parts_mut(ptr, len)));
+            return;
+        },
+    };
+    let arena = Arena::get().unwrap();
+    let start = ptr as usize - (ptr as usize - arena.base) % class_size(class);
+    // The cache is gone while the thread exits, in which case the buffer goes straight back.
+    let cached = CACHE.try_with(|c| {
+        let mut c = c.borrow_mut();
+        c.stats.frees += 1;
+        c.free(arena, class, start);
+    });
+    if cached.is_err() {
+        arena.free[class].lock().unwrap().push(start);
+    }
+}
+
+/// Allocates a single-segment scatter-gather array of `size` bytes.
+pub fn alloc_sgarray(size: usize) -> dmtr_sgarray_t {
+    dmtr_sgarray_t::new(&[dmtr_sgaseg_t {
+        sgaseg_buf: alloc(size) as *mut _,
+        sgaseg_len: size as u32,
+    }])
+}
+
+/// Releases every segment of an array from `alloc_sgarray`.
+pub fn free_sgarray(sga: &dmtr_sgarray_t) {
+    for seg in sga.segments() {
+        unsafe { free(seg.sgaseg_buf as *mut u8, seg.sgaseg_len as usize) };
+    }
+}
+
+/// Returns the index and address of the pool region that `ptr` lies in, and the region size, if
+/// `ptr` is a pool buffer. Regions never move, so they can be registered with a device once.
+pub fn region_of(ptr: *const u8) -> Option<(usize, *mut u8, usize)> {
+    let arena = Arena::get()?;
+    arena.class_of(ptr as usize)?;
+    let idx = (ptr as usize - arena.base) >> REGION_SHIFT;
+    let base = arena.base + (idx << REGION_SHIFT);
+    Some((idx, base as *mut u8, REGION_SIZE))
+}
+
+/// Returns the calling thread's counters.
+pub fn stats() -> PoolStats {
+    let mut stats = CACHE.with(|c| c.borrow().stats);
+    if let Some(arena) = Arena::get() {
+        let regions = arena.next_region.load(Ordering::Relaxed);
+        stats.regions = cmp::min(regions, arena.num_regions) as u64;
+    }
+    stats
+}
+
+/// Clears the calling thread's counters.
+pub fn reset_stats() {
+    CACHE.with(|c| c.borrow_mut().stats = PoolStats::default());
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for PoolConfig {
+    fn default() -> Self {
+        Self {
+            hugepages: false,
+            populate: false,
+            numa_node: None,
+            reserve: DEFAULT_RESERVE,
+            cache_size: DEFAULT_CACHE_SIZE,
+        }
+    }
+}
+
+impl Drop for Cache {
+    fn drop(&mut self) {
+        // Hand this thread's buffers back for other threads to use.
+        let arena = match Arena::get() {
+            Some(arena) => arena,
+            None => return,
+        };
+        for (class, free) in self.free.iter_mut().enumerate() {
+            if !free.is_empty() {
+                arena.free[class].lock().unwrap().append(free);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+fn size_class(size: usize) -> Option<usize> {
+    if size > (1 << MAX_CLASS_SHIFT) {
+        return None;
+    }
+    let shift = cmp::max(size.next_power_of_two().trailing_zeros(), MIN_CLASS_SHIFT);
+    Some((shift - MIN_CLASS_SHIFT) as usize)
+}
+
+fn class_size(class: usize) -> usize {
+    1 << (class as u32 + MIN_CLASS_SHIFT)
+}
+
+fn heap_alloc(size: usize) -> *mut u8 {
+    let allocation: Box<[u8]> = unsafe { Box::new_uninit_slice(size).assume_init() };
+    Box::into_raw(allocation) as *mut u8
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        alloc,
+        class_size,
+        free,
+        size_class,
+        stats,
+        MAX_CLASS_SHIFT,
+    };
+    use std::thread;
+
+    #[test]
+    fn size_classes() {
+        assert_eq!(size_class(0), Some(0));
+        assert_eq!(size_class(64), Some(0));
+        assert_eq!(size_class(65), Some(1));
+        assert_eq!(class_size(size_class(1500).unwrap()), 2048);
+        assert_eq!(size_class(1 << MAX_CLASS_SHIFT), Some(10));
+        assert_eq!(size_class((1 << MAX_CLASS_SHIFT) + 1), None);
+    }
+
+    #[test]
+    fn reuse_across_threads() {
+        let bufs: Vec<usize> = (0..1000)
+            .map(|i| {
+                let ptr = alloc(100);
+                unsafe { ptr.write_bytes(i as u8, 100) };
+                ptr as usize
+            })
+            .collect();
+        assert_eq!(stats().exhausted, 0);
+
+        // Free them elsewhere; the buffers end up back in the shared lists.
+        thread::spawn(move || {
+            for ptr in bufs {
+                unsafe { free((ptr as *mut u8).add(10), 100) };
+            }
+        })
+        .join()
+        .unwrap();
+
+        let before = stats();
+        let ptrs: Vec<*mut u8> = (0..1000).map(|_| alloc(128)).collect();
+        assert_eq!(stats().regions, before.regions);
+        for ptr in ptrs {
+            unsafe { free(ptr, 128) };
+        }
+
+        let big = alloc(1 << 20);
+        assert_eq!(stats().oversize, 1);
+        unsafe { free(big, 1 << 20) };
+    }
+}
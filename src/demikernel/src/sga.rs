@@ -0,0 +1,240 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Scatter-gather arrays backed by a reference-counted `Bytes`.
+//!
+//! Instead of copying a received buffer into memory that the application can free, the array's
+//! segment points straight into the buffer and `sga_buf` carries a handle to it. Freeing the array
+//! drops the handle, which releases the buffer once nothing else refers to it.
+//!
+//! Handles are entries of a process-wide table rather than pointers, because `sga_buf` is just as
+//! likely to hold whatever an application left in an array that it built itself. A handle has a
+//! tag in the bits that user-space addresses never use, the table index and a generation, so a
+//! stale or made-up value is turned away without ever being dereferenced.
+
+use crate::interop::{
+    dmtr_sgarray_t,
+    dmtr_sgaseg_t,
+};
+use catnip::{
+    collections::bytes::{
+        Bytes,
+        BytesMut,
+    },
+    runtime::RuntimeBuf,
+};
+use std::{
+    slice,
+    sync::{
+        Mutex,
+        Once,
+    },
+};
+
+//==============================================================================
+// Handles
+//==============================================================================
+
+/// Marks `sga_buf` values that are handles. The top 16 bits of a user-space address are always
+/// clear on the platforms that we run on.
+const HANDLE_TAG: usize = 0xd17e << 48;
+const HANDLE_TAG_MASK: usize = 0xffff << 48;
+const HANDLE_GENERATION_SHIFT: usize = 32;
+
+struct Slot {
+    /// Bumped every time the slot is freed, so that old handles to it stop matching.
+    generation: u16,
+    buf: Option<Bytes>,
+}
+
+#[derive(Default)]
+struct HandleTable {
+    slots: Vec<Slot>,
+    free: Vec<u32>,
+}
+
+// Arrays are freed by whichever thread the application likes, which already meant dropping their
+// `Bytes` there; the table only ever touches them under its lock.
+unsafe impl Send for HandleTable {}
+
+static HANDLES_INIT: Once = Once::new();
+static mut HANDLES: Option<Mutex<HandleTable>> = None;
+
+impl HandleTable {
+    fn global() -> &'static Mutex<HandleTable> {
+        unsafe {
+            HANDLES_INIT.call_once(|| HANDLES = Some(Mutex::new(HandleTable::default())));
+            HANDLES.as_ref().unwrap()
+        }
+    }
+
+    fn insert(&mut self, buf: Bytes) -> usize {
+        let index = match self.free.pop() {
+            Some(index) => index,
+            None => {
+                self.slots.push(Slot {
+                    generation: 0,
+                    buf: None,
+                });
+                (self.slots.len() - 1) as u32
+            },
+        };
+        let slot = &mut self.slots[index as usize];
+        slot.buf = Some(buf);
+        HANDLE_TAG | (slot.generation as usize) << HANDLE_GENERATION_SHIFT | index as usize
+    }
+
+    /// Returns the index of the live slot that `handle` refers to.
+    fn lookup(&self, handle: usize) -> Option<usize> {
+        if handle & HANDLE_TAG_MASK != HANDLE_TAG {
+            return None;
+        }
+        let index = handle & 0xffff_ffff;
+        let generation = (handle >> HANDLE_GENERATION_SHIFT) as u16;
+        match self.slots.get(index) {
+            Some(slot) if slot.generation == generation && slot.buf.is_some() => Some(index),
+            _ => None,
+        }
+    }
+
+    fn remove(&mut self, handle: usize) -> Option<Bytes> {
+        let index = self.lookup(handle)?;
+        let slot = &mut self.slots[index];
+        slot.generation = slot.generation.wrapping_add(1);
+        self.free.push(index as u32);
+        slot.buf.take()
+    }
+
+    fn get(&self, handle: usize) -> Option<&Bytes> {
+        let index = self.lookup(handle)?;
+        self.slots[index].buf.as_ref()
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Wraps `buf` in a single-segment scatter-gather array without copying it.
+pub fn bytes_into_sgarray(buf: Bytes) -> dmtr_sgarray_t {
+    let mut sga = dmtr_sgarray_t::new(&[dmtr_sgaseg_t {
+        sgaseg_buf: buf.as_ptr() as *mut _,
+        sgaseg_len: buf.len() as u32,
+    }]);
+    sga.sga_buf = HandleTable::global().lock().unwrap().insert(buf) as *mut _;
+    sga
+}
+
+/// Releases an array built by `bytes_into_sgarray`. Returns false, without doing anything, for
+/// arrays that don't carry a live handle, which includes arrays freed before.
+pub fn free_bytes_sgarray(sga: &dmtr_sgarray_t) -> bool {
+    if sga.sga_buf as usize & HANDLE_TAG_MASK != HANDLE_TAG {
+        return false;
+    }
+    // The buffer is dropped after the lock is released.
+    let buf = HandleTable::global()
+        .lock()
+        .unwrap()
+        .remove(sga.sga_buf as usize);
+    buf.is_some()
+}
+
+/// Turns an array built by `bytes_into_sgarray` back into a `Bytes` that shares its memory, e.g.
+/// when the application pushes a buffer that it popped. The segment may have been narrowed to a
+/// sub-range of the original buffer. Returns `None` for arrays that don't carry a live handle or
+/// whose segment no longer lies within it.
+pub fn clone_bytes_sgarray(sga: &dmtr_sgarray_t) -> Option<Bytes> {
+    if sga.sga_buf as usize & HANDLE_TAG_MASK != HANDLE_TAG || sga.sga_numsegs != 1 {
+        return None;
+    }
+    let handles = HandleTable::global().lock().unwrap();
+    let buf = handles.get(sga.sga_buf as usize)?;
+    let seg = &sga.sga_segs[0];
+    let start = (seg.sgaseg_buf as usize).checked_sub(buf.as_ptr() as usize)?;
+    let end = start.checked_add(seg.sgaseg_len as usize)?;
+    if end > buf.len() {
+        return None;
+    }
+
+    let mut clone = buf.clone();
+    clone.adjust(start);
+    clone.trim(buf.len() - end);
+    Some(clone)
+}
+
+/// Returns the contents of an array as a single `Bytes`, for runtimes whose buffers have to be
+/// contiguous. An array from `bytes_into_sgarray` shares its buffer; any other is copied, which is
+/// where the segments of a vectored push get joined.
+pub fn gather_into_bytes(sga: &dmtr_sgarray_t) -> Bytes {
+    if let Some(buf) = clone_bytes_sgarray(sga) {
+        return buf;
+    }
+    let mut buf = BytesMut::zeroed(sga.len()).unwrap();
+    let mut pos = 0;
+    for seg in sga.segments() {
+        let seg_slice =
+            unsafe { slice::from_raw_parts(seg.sgaseg_buf as *const u8, seg.sgaseg_len as usize) };
+        buf[pos..(pos + seg_slice.len())].copy_from_slice(seg_slice);
+        pos += seg_slice.len();
+    }
+    buf.freeze()
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        bytes_into_sgarray,
+        clone_bytes_sgarray,
+        free_bytes_sgarray,
+        gather_into_bytes,
+    };
+    use crate::interop::{
+        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
+    };
+    use catnip::collections::bytes::BytesMut;
+
+    /// Only live handles are honored: a second free, or whatever an application left in `sga_buf`,
+    /// is turned away.
+    #[test]
+    fn handles_reject_stale_and_foreign_values() {
+        let sga = bytes_into_sgarray(BytesMut::zeroed(64).unwrap().freeze());
+        assert!(clone_bytes_sgarray(&sga).is_some());
+        assert!(free_bytes_sgarray(&sga));
+        assert!(!free_bytes_sgarray(&sga));
+        assert!(clone_bytes_sgarray(&sga).is_none());
+
+        let mut foreign = sga;
+        foreign.sga_buf = 0x7fff_dead_beef as *mut _;
+        assert!(!free_bytes_sgarray(&foreign));
+        foreign.sga_buf = (sga.sga_buf as usize + 1) as *mut _;
+        assert!(!free_bytes_sgarray(&foreign));
+    }
+
+    /// Segments are joined in order, and a popped buffer is shared rather than copied.
+    #[test]
+    fn gather_joins_segments() {
+        let (mut head, mut body) = ([1u8, 2, 3], [4u8, 5]);
+        let sga = dmtr_sgarray_t::new(&[
+            dmtr_sgaseg_t {
+                sgaseg_buf: head.as_mut_ptr() as *mut _,
+                sgaseg_len: head.len() as u32,
+            },
+            dmtr_sgaseg_t {
+                sgaseg_buf: body.as_mut_ptr() as *mut _,
+                sgaseg_len: body.len() as u32,
+            },
+        ]);
+        let buf = gather_into_bytes(&sga);
+        assert_eq!(&buf[..], &[1, 2, 3, 4, 5]);
+
+        let popped = bytes_into_sgarray(BytesMut::zeroed(16).unwrap().freeze());
+        let shared = gather_into_bytes(&popped);
+        assert_eq!(shared.as_ptr(), popped.sga_segs[0].sgaseg_buf as *const u8);
+        assert!(free_bytes_sgarray(&popped));
+    }
+}
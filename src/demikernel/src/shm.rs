@@ -0,0 +1,1276 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Shared-memory queues: `dmtr_shmqueue` opens a queue that lives in a named file in shared
+//! memory, so that processes on the same host can hand each other data without a network stack
+//! in between.
+//!
+//! The file holds a ring of descriptors, an arena of fixed-size buffers and a ring of the free
+//! ones. Both rings are bounded MPMC rings (Vyukov's), so any number of threads in any number of
+//! processes can push and pop. A descriptor names arena buffers by index, so a pop hands out
+//! pointers straight into the arena. A push is zero-copy too when every segment lies in the
+//! arena, such as buffers from `dmtr_shmalloc`: those then change hands. Anything else is copied
+//! into arena buffers first. Messages must fit in the `DMTR_SGARRAY_MAXSIZE` buffers that a
+//! scatter-gather array can point to.
+//!
+//! Every process that has a region open holds a shared lock on its file, which the kernel releases
+//! if the process dies. The process that can take the lock exclusively is the last one, and
+//! removes the file. Buffers popped by any thread can be freed by any other: the regions that the
+//! process has mapped are kept in a table that `dmtr_sgafree` looks buffers up in.
+//!
+//! Threads that wait spin, pause or sleep according to their wait policy. Sleepers block on a
+//! futex in the shared header, which pushes, pops and buffer releases bump.
+
+use crate::{
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
+        DMTR_SGARRAY_MAXSIZE,
+    },
+    network,
+    wait::Backoff,
+};
+use libc::{
+    c_char,
+    c_int,
+};
+use std::{
+    cell::{
+        RefCell,
+        UnsafeCell,
+    },
+    cmp,
+    collections::VecDeque,
+    ffi::{
+        CStr,
+        CString,
+    },
+    io,
+    mem,
+    path::PathBuf,
+    ptr,
+    sync::{
+        atomic::{
+            AtomicU32,
+            AtomicU64,
+            AtomicUsize,
+            Ordering,
+        },
+        Arc,
+        Once,
+        RwLock,
+    },
+    thread,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Shared-memory queue descriptors start here, past those of file queues.
+pub const SHM_QD_BASE: c_int = 2 << 24;
+
+/// Set in every shared-memory queue token. The rest holds the operation's slot and generation.
+const SHM_QT_TAG: dmtr_qtoken_t = 1 << 62;
+
+pub const DEFAULT_DIR: &str = "/dev/shm";
+pub const DEFAULT_CAPACITY: usize = 1024;
+pub const DEFAULT_BUF_SIZE: usize = 2048;
+
+/// Buffers per message: no more than a scatter-gather array can hand to the application.
+const MAX_SEGS: usize = DMTR_SGARRAY_MAXSIZE;
+
+/// Marks a fully set up region, and the version of its layout.
+const MAGIC: u64 = 0x646d_7472_7368_6d33;
+
+/// Region files are sized in huge pages, so that they can live on hugetlbfs.
+const REGION_ALIGN: usize = 2 << 20;
+
+/// How long to wait for the process that creates a region to set it up.
+const ATTACH_TIMEOUT: Duration = Duration::from_secs(1);
+
+#[derive(Clone, Debug, PartialEq)]
+pub struct ShmConfig {
+    /// Where region files go: a tmpfs, or a hugetlbfs mount to back regions with huge pages.
+    pub dir: PathBuf,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct Seg {
+    buf: u32,
+    offset: u32,
+    len: u32,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct Desc {
+    numsegs: u32,
+    segs: [Seg; MAX_SEGS],
+}
+
+#[repr(C, align(64))]
+struct Padded(AtomicU64);
+
+#[repr(C)]
+struct RingHeader {
+    enqueue: Padded,
+    dequeue: Padded,
+}
+
+#[repr(C)]
+struct Slot<T> {
+    seq: AtomicU64,
+    value: UnsafeCell<T>,
+}
+
+/// A bounded MPMC ring in shared memory.
+struct Ring<T> {
+    header: *const RingHeader,
+    slots: *const Slot<T>,
+    mask: u64,
+}
+
+/// Start of a region file.
+#[repr(C, align(64))]
+struct Header {
+    magic: AtomicU64,
+    capacity: u32,
+    buf_size: u32,
+    nbufs: u32,
+    len: u64,
+    ring_offset: u64,
+    free_offset: u64,
+    arena_offset: u64,
+    /// Bumped by every push, for sleeping pops.
+    pushed: AtomicU32,
+    /// Bumped by every pop and buffer release, for sleeping pushes.
+    freed: AtomicU32,
+    /// Threads asleep on `pushed` or `freed`.
+    sleepers: AtomicU32,
+}
+
+/// A process's mapping of a region.
+struct Region {
+    path: CString,
+    /// Kept open for its shared lock on the file.
+    fd: c_int,
+    addr: *mut u8,
+    len: usize,
+    ring: Ring<Desc>,
+    free: Ring<u32>,
+    arena: *mut u8,
+    buf_size: usize,
+    nbufs: usize,
+    /// Arena buffers the process holds: allocated or popped, and not yet pushed or freed.
+    held: AtomicUsize,
+}
+
+struct ShmQueue {
+    region: Arc<Region>,
+    /// Operations not yet completed, in the order they were issued.
+    pending: VecDeque<usize>,
+}
+
+struct Op {
+    qt: dmtr_qtoken_t,
+    qd: c_int,
+    opcode: dmtr_opcode_t,
+    /// The array pushed, or the one popped.
+    sga: dmtr_sgarray_t,
+    /// For a push, the descriptor once built, and whether its buffers are copies.
+    desc: Option<Desc>,
+    copied: bool,
+    done: bool,
+}
+
+#[derive(Default)]
+struct Shm {
+    config: Option<ShmConfig>,
+    queues: Vec<Option<ShmQueue>>,
+    free_queues: Vec<usize>,
+    ops: Vec<Op>,
+    free_ops: Vec<usize>,
+}
+
+thread_local! {
+    static SHM: RefCell<Shm> = RefCell::new(Shm::default());
+}
+
+/// Regions mapped by any thread, which buffers are freed to.
+static REGIONS_INIT: Once = Once::new();
+static mut REGIONS: Option<RwLock<Vec<Arc<Region>>>> = None;
+
+/// Number of regions in `REGIONS`, so that freeing other buffers doesn't take the lock.
+static NUM_REGIONS: AtomicUsize = AtomicUsize::new(0);
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl ShmConfig {
+    /// Parses the `shm` section of the configuration.
+    pub fn parse(dir: Option<&str>) -> Self {
+        Self {
+            dir: PathBuf::from(dir.unwrap_or(DEFAULT_DIR)),
+        }
+    }
+}
+
+impl<T: Copy> Ring<T> {
+    fn size(capacity: usize) -> usize {
+        mem::size_of::<RingHeader>() + capacity * mem::size_of::<Slot<T>>()
+    }
+
+    unsafe fn at(addr: *mut u8, capacity: usize) -> Self {
+        Self {
+            header: addr as *const RingHeader,
+            slots: addr.add(mem::size_of::<RingHeader>()) as *const Slot<T>,
+            mask: capacity as u64 - 1,
+        }
+    }
+
+    unsafe fn init(&self) {
+        for i in 0..=self.mask {
+            (*self.slots.add(i as usize))
+                .seq
+                .store(i, Ordering::Relaxed);
+        }
+        (*self.header).enqueue.0.store(0, Ordering::Relaxed);
+        (*self.header).dequeue.0.store(0, Ordering::Relaxed);
+    }
+
+    /// Adds `value` unless the ring is full.
+    fn push(&self, value: T) -> bool {
+        let enqueue = unsafe { &(*self.header).enqueue.0 };
+        let mut pos = enqueue.load(Ordering::Relaxed);
+        loop {
+            let slot = unsafe { &*self.slots.add((pos & self.mask) as usize) };
+            let seq = slot.seq.load(Ordering::Acquire);
+            let diff = seq.wrapping_sub(pos) as i64;
+            if diff == 0 {
+                match enqueue.compare_exchange_weak(
+                    pos,
+                    pos + 1,
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(..) => {
+                        unsafe { *slot.value.get() = value };
+                        slot.seq.store(pos + 1, Ordering::Release);
+                        return true;
+                    },
+                    Err(current) => pos = current,
+                }
+            } else if diff < 0 {
+                return false;
+            } else {
+                pos = enqueue.load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    /// Takes the oldest value, if any.
+    fn pop(&self) -> Option<T> {
+        let dequeue = unsafe { &(*self.header).dequeue.0 };
+        let mut pos = dequeue.load(Ordering::Relaxed);
+        loop {
+            let slot = unsafe { &*self.slots.add((pos & self.mask) as usize) };
+            let seq = slot.seq.load(Ordering::Acquire);
+            let diff = seq.wrapping_sub(pos + 1) as i64;
+            if diff == 0 {
+                match dequeue.compare_exchange_weak(
+                    pos,
+                    pos + 1,
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(..) => {
+                        let value = unsafe { *slot.value.get() };
+                        slot.seq.store(pos + self.mask + 1, Ordering::Release);
+                        return Some(value);
+                    },
+                    Err(current) => pos = current,
+                }
+            } else if diff < 0 {
+                return None;
+            } else {
+                pos = dequeue.load(Ordering::Relaxed);
+            }
+        }
+    }
+}
+
+impl Region {
+    /// Opens the region at `path`, creating it with room for `capacity` descriptors and twice as
+    /// many buffers of `buf_size` bytes if it doesn't exist yet. Zero sizes accept whatever an
+    /// existing region has.
+    fn open(path: CString, capacity: usize, buf_size: usize) -> Result<Self, c_int> {
+        let start = Instant::now();
+        loop {
+            let fd = unsafe {
+                libc::open(
+                    path.as_ptr(),
+                    libc::O_RDWR | libc::O_CREAT | libc::O_EXCL | libc::O_CLOEXEC,
+                    0o600,
+                )
+            };
+            if fd >= 0 {
+                let capacity = if capacity == 0 {
+                    DEFAULT_CAPACITY
+                } else {
+                    capacity
+                };
+                let buf_size = if buf_size == 0 {
+                    DEFAULT_BUF_SIZE
+                } else {
+                    buf_size
+                };
+                // Nobody else can have the new file locked yet.
+                unsafe { libc::flock(fd, libc::LOCK_SH) };
+                let ret = Self::create(fd, &path, capacity, buf_size);
+                if ret.is_err() {
+                    unsafe {
+                        libc::unlink(path.as_ptr());
+                        libc::close(fd);
+                    }
+                }
+                return ret;
+            }
+            let e = last_errno();
+            if e != libc::EEXIST {
+                return Err(e);
+            }
+            let fd = unsafe { libc::open(path.as_ptr(), libc::O_RDWR | libc::O_CLOEXEC) };
+            if fd < 0 {
+                let e = last_errno();
+                // Removed in between: start over.
+                if e == libc::ENOENT && start.elapsed() < ATTACH_TIMEOUT {
+                    continue;
+                }
+                return Err(e);
+            }
+            // The last process to close the region removes the file while it holds the lock
+            // exclusively. Once this one holds it too, the file stays, unless it is gone already.
+            let locked = match unsafe { libc::flock(fd, libc::LOCK_SH) } {
+                0 => is_unlinked(fd).map(|unlinked| !unlinked),
+                _ => Err(last_errno()),
+            };
+            let ret = match locked {
+                Ok(true) => Self::attach(fd, &path, capacity, buf_size, start),
+                Ok(false) => {
+                    unsafe { libc::close(fd) };
+                    if start.elapsed() > ATTACH_TIMEOUT {
+                        return Err(libc::ETIMEDOUT);
+                    }
+                    continue;
+                },
+                Err(e) => Err(e),
+            };
+            if ret.is_err() {
+                unsafe { libc::close(fd) };
+            }
+            return ret;
+        }
+    }
+
+    fn create(fd: c_int, path: &CString, capacity: usize, buf_size: usize) -> Result<Self, c_int> {
+        if !capacity.is_power_of_two() || capacity > (1 << 24) || buf_size > u32::MAX as usize {
+            return Err(libc::EINVAL);
+        }
+        let buf_size = round_up(buf_size, 64);
+        let nbufs = capacity * 2;
+        let ring_offset = round_up(mem::size_of::<Header>(), 64);
+        let free_offset = round_up(ring_offset + Ring::<Desc>::size(capacity), 64);
+        let arena_offset = round_up(free_offset + Ring::<u32>::size(nbufs), 4096);
+        let len = round_up(arena_offset + nbufs * buf_size, REGION_ALIGN);
+        if unsafe { libc::ftruncate(fd, len as libc::off_t) } != 0 {
+            return Err(last_errno());
+        }
+        let addr = map(fd, len)?;
+        let header = addr as *mut Header;
+        unsafe {
+            (*header).capacity = capacity as u32;
+            (*header).buf_size = buf_size as u32;
+            (*header).nbufs = nbufs as u32;
+            (*header).len = len as u64;
+            (*header).ring_offset = ring_offset as u64;
+            (*header).free_offset = free_offset as u64;
+            (*header).arena_offset = arena_offset as u64;
+        }
+        let region = unsafe { Self::at(path.clone(), fd, addr, len) };
+        unsafe {
+            region.ring.init();
+            region.free.init();
+        }
+        for i in 0..nbufs {
+            region.free.push(i as u32);
+        }
+        // Processes attaching meanwhile wait for this.
+        unsafe { (*header).magic.store(MAGIC, Ordering::Release) };
+        Ok(region)
+    }
+
+    fn attach(
+        fd: c_int,
+        path: &CString,
+        capacity: usize,
+        buf_size: usize,
+        start: Instant,
+    ) -> Result<Self, c_int> {
+        // The file is sized before the header is written, and the magic is written last.
+        let len = loop {
+            let mut st: libc::stat = unsafe { mem::zeroed() };
+            if unsafe { libc::fstat(fd, &mut st) } != 0 {
+                return Err(last_errno());
+            }
+            if st.st_size > 0 {
+                break st.st_size as usize;
+            }
+            if start.elapsed() > ATTACH_TIMEOUT {
+                return Err(libc::ETIMEDOUT);
+            }
+            thread::sleep(Duration::from_millis(1));
+        };
+        let addr = map(fd, len)?;
+        let header = unsafe { &*(addr as *const Header) };
+        while header.magic.load(Ordering::Acquire) != MAGIC {
+            if start.elapsed() > ATTACH_TIMEOUT {
+                unsafe { libc::munmap(addr as *mut _, len) };
+                return Err(libc::ETIMEDOUT);
+            }
+            thread::sleep(Duration::from_millis(1));
+        }
+        let mismatch = (capacity != 0 && capacity != header.capacity as usize)
+            || (buf_size != 0 && round_up(buf_size, 64) != header.buf_size as usize);
+        if mismatch || header.len as usize != len {
+            unsafe { libc::munmap(addr as *mut _, len) };
+            return Err(libc::EINVAL);
+        }
+        Ok(unsafe { Self::at(path.clone(), fd, addr, len) })
+    }
+
+    unsafe fn at(path: CString, fd: c_int, addr: *mut u8, len: usize) -> Self {
+        let header = &*(addr as *const Header);
+        Self {
+            path,
+            fd,
+            addr,
+            len,
+            ring: Ring::at(
+                addr.add(header.ring_offset as usize),
+                header.capacity as usize,
+            ),
+            free: Ring::at(addr.add(header.free_offset as usize), header.nbufs as usize),
+            arena: addr.add(header.arena_offset as usize),
+            buf_size: header.buf_size as usize,
+            nbufs: header.nbufs as usize,
+            held: AtomicUsize::new(0),
+        }
+    }
+
+    fn header(&self) -> &Header {
+        unsafe { &*(self.addr as *const Header) }
+    }
+
+    /// Returns the buffer that `ptr` points into, and the offset within it.
+    fn buffer_of(&self, ptr: *const u8) -> Option<(u32, u32)> {
+        let offset = (ptr as usize).checked_sub(self.arena as usize)?;
+        if offset >= self.nbufs * self.buf_size {
+            return None;
+        }
+        Some((
+            (offset / self.buf_size) as u32,
+            (offset % self.buf_size) as u32,
+        ))
+    }
+
+    fn buffer(&self, buf: u32) -> *mut u8 {
+        unsafe { self.arena.add(buf as usize * self.buf_size) }
+    }
+
+    fn hold(&self, n: usize) {
+        self.held.fetch_add(n, Ordering::Relaxed);
+    }
+
+    fn unhold(&self, n: usize) {
+        let _ = self
+            .held
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |held| {
+                Some(held.saturating_sub(n))
+            });
+    }
+
+    fn release(&self, buf: u32) {
+        // The free ring has room for every buffer, so this can't fail.
+        let pushed = self.free.push(buf);
+        debug_assert!(pushed);
+        notify(self.header(), &self.header().freed);
+    }
+
+    /// Takes enough buffers for `len` bytes, or none at all.
+    fn alloc(&self, len: usize) -> Option<Desc> {
+        let count = cmp::max(1, (len + self.buf_size - 1) / self.buf_size);
+        if count > MAX_SEGS {
+            return None;
+        }
+        let mut desc = Desc::default();
+        for i in 0..count {
+            match self.free.pop() {
+                Some(buf) => {
+                    let seg_len = cmp::min(self.buf_size, len - i * self.buf_size);
+                    desc.segs[i] = Seg {
+                        buf,
+                        offset: 0,
+                        len: seg_len as u32,
+                    };
+                    desc.numsegs += 1;
+                },
+                None => {
+                    self.release_desc(&desc);
+                    return None;
+                },
+            }
+        }
+        Some(desc)
+    }
+
+    fn release_desc(&self, desc: &Desc) {
+        for seg in &desc.segs[..desc.numsegs as usize] {
+            self.release(seg.buf);
+        }
+    }
+
+    fn to_sgarray(&self, desc: &Desc) -> dmtr_sgarray_t {
+        let mut sga: dmtr_sgarray_t = unsafe { mem::zeroed() };
+        sga.sga_numsegs = desc.numsegs;
+        for (i, seg) in desc.segs[..desc.numsegs as usize].iter().enumerate() {
+            sga.sga_segs[i] = dmtr_sgaseg_t {
+                sgaseg_buf: unsafe { self.buffer(seg.buf).add(seg.offset as usize) } as *mut _,
+                sgaseg_len: seg.len,
+            };
+        }
+        sga
+    }
+
+    /// Describes `sga` if every segment lies within a single buffer of the arena.
+    fn describe(&self, sga: &dmtr_sgarray_t) -> Option<Desc> {
+        let mut desc = Desc {
+            numsegs: sga.sga_numsegs,
+            ..Desc::default()
+        };
+        for (i, seg) in sga.sga_segs[..sga.sga_numsegs as usize].iter().enumerate() {
+            let (buf, offset) = self.buffer_of(seg.sgaseg_buf as *const u8)?;
+            if offset as usize + seg.sgaseg_len as usize > self.buf_size {
+                return None;
+            }
+            desc.segs[i] = Seg {
+                buf,
+                offset,
+                len: seg.sgaseg_len,
+            };
+        }
+        Some(desc)
+    }
+}
+
+impl ShmQueue {
+    /// Moves pending operations along, pushes and pops each in the order they were issued.
+    fn service(&mut self, ops: &mut [Op]) {
+        let (mut push_blocked, mut pop_blocked) = (false, false);
+        let region = &self.region;
+        self.pending.retain(|&ix| {
+            let op = &mut ops[ix];
+            let done = match op.opcode {
+                dmtr_opcode_t::DMTR_OPC_PUSH if !push_blocked => {
+                    let done = try_push(region, op);
+                    push_blocked = !done;
+                    done
+                },
+                dmtr_opcode_t::DMTR_OPC_POP if !pop_blocked => match region.ring.pop() {
+                    Some(desc) => {
+                        notify(region.header(), &region.header().freed);
+                        op.sga = region.to_sgarray(&desc);
+                        region.hold(desc.numsegs as usize);
+                        true
+                    },
+                    None => {
+                        pop_blocked = true;
+                        false
+                    },
+                },
+                _ => false,
+            };
+            op.done = done;
+            !done
+        });
+    }
+}
+
+impl Shm {
+    fn config(&mut self) -> &ShmConfig {
+        self.config.get_or_insert_with(|| ShmConfig::parse(None))
+    }
+
+    fn queue(&mut self, qd: c_int) -> Option<&mut ShmQueue> {
+        if !is_shm_qd(qd) {
+            return None;
+        }
+        self.queues
+            .get_mut((qd - SHM_QD_BASE) as usize)
+            .and_then(|q| q.as_mut())
+    }
+
+    fn alloc_op(&mut self, qd: c_int, opcode: dmtr_opcode_t) -> usize {
+        let ix = match self.free_ops.pop() {
+            Some(ix) => ix,
+            None => {
+                self.ops.push(Op {
+                    qt: SHM_QT_TAG | self.ops.len() as u64,
+                    qd: 0,
+                    opcode: dmtr_opcode_t::DMTR_OPC_INVALID,
+                    sga: unsafe { mem::zeroed() },
+                    desc: None,
+                    copied: false,
+                    done: false,
+                });
+                self.ops.len() - 1
+            },
+        };
+        let op = &mut self.ops[ix];
+        op.qd = qd;
+        op.opcode = opcode;
+        op.desc = None;
+        op.copied = false;
+        op.done = false;
+        ix
+    }
+
+    fn op_index(&self, qt: dmtr_qtoken_t) -> Option<usize> {
+        let ix = (qt & 0xffff_ffff) as usize;
+        match self.ops.get(ix) {
+            Some(op) if op.qt == qt && !matches!(op.opcode, dmtr_opcode_t::DMTR_OPC_INVALID) => {
+                Some(ix)
+            },
+            _ => None,
+        }
+    }
+
+    /// Puts a slot back, with a new generation so that its old token goes stale.
+    fn free_op(&mut self, ix: usize) {
+        let op = &mut self.ops[ix];
+        op.opcode = dmtr_opcode_t::DMTR_OPC_INVALID;
+        let generation = ((op.qt >> 32) as u32 & 0x3fff_ffff).wrapping_add(1) & 0x3fff_ffff;
+        op.qt = SHM_QT_TAG | (generation as u64) << 32 | ix as u64;
+        self.free_ops.push(ix);
+    }
+
+    /// Services the queue of operation `ix` and returns whether the operation is done.
+    fn progress(&mut self, ix: usize) -> bool {
+        let qd = self.ops[ix].qd;
+        if !self.ops[ix].done {
+            let Shm { queues, ops, .. } = self;
+            if let Some(q) = queues[(qd - SHM_QD_BASE) as usize].as_mut() {
+                q.service(ops);
+            }
+        }
+        self.ops[ix].done
+    }
+
+    /// Returns the word to sleep on until operation `ix` might make progress, and its value.
+    fn wake_word(&mut self, ix: usize) -> (*const AtomicU32, u32) {
+        let opcode = self.ops[ix].opcode;
+        let qd = self.ops[ix].qd;
+        let header = self.queue(qd).unwrap().region.header();
+        let word = match opcode {
+            dmtr_opcode_t::DMTR_OPC_POP => &header.pushed,
+            _ => &header.freed,
+        };
+        (word as *const AtomicU32, word.load(Ordering::SeqCst))
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for ShmConfig {
+    fn default() -> Self {
+        Self::parse(None)
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        // Any other process with the region open still holds its shared lock. Failing to convert
+        // ours may drop it, which is fine on the way out.
+        if unsafe { libc::flock(self.fd, libc::LOCK_EX | libc::LOCK_NB) } == 0 {
+            unsafe { libc::unlink(self.path.as_ptr()) };
+        }
+        unsafe {
+            libc::munmap(self.addr as *mut _, self.len);
+            libc::close(self.fd);
+        }
+    }
+}
+
+// Regions are shared by processes that use them concurrently anyway: their rings are lock-free and
+// their header words atomic.
+unsafe impl Send for Region {}
+unsafe impl Sync for Region {}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+fn with_shm<T>(f: impl FnOnce(&mut Shm) -> T) -> T {
+    SHM.with(|s| f(&mut s.borrow_mut()))
+}
+
+fn regions() -> &'static RwLock<Vec<Arc<Region>>> {
+    unsafe {
+        REGIONS_INIT.call_once(|| REGIONS = Some(RwLock::new(Vec::new())));
+        REGIONS.as_ref().unwrap()
+    }
+}
+
+/// Lets any thread free buffers to `region`.
+fn register(region: &Arc<Region>) {
+    let mut regions = regions().write().unwrap();
+    regions.push(region.clone());
+    NUM_REGIONS.store(regions.len(), Ordering::Release);
+}
+
+fn unregister(region: &Arc<Region>) {
+    let mut regions = regions().write().unwrap();
+    regions.retain(|r| !Arc::ptr_eq(r, region));
+    NUM_REGIONS.store(regions.len(), Ordering::Release);
+}
+
+/// Whether the file open as `fd` has been removed.
+fn is_unlinked(fd: c_int) -> Result<bool, c_int> {
+    let mut st: libc::stat = unsafe { mem::zeroed() };
+    if unsafe { libc::fstat(fd, &mut st) } != 0 {
+        return Err(last_errno());
+    }
+    Ok(st.st_nlink == 0)
+}
+
+fn last_errno() -> c_int {
+    io::Error::last_os_error()
+        .raw_os_error()
+        .unwrap_or(libc::EIO)
+}
+
+fn round_up(n: usize, align: usize) -> usize {
+    (n + align - 1) / align * align
+}
+
+fn map(fd: c_int, len: usize) -> Result<*mut u8, c_int> {
+    let addr = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED,
+            fd,
+            0,
+        )
+    };
+    if addr == libc::MAP_FAILED {
+        return Err(last_errno());
+    }
+    Ok(addr as *mut u8)
+}
+
+/// Bumps `word` and wakes whoever sleeps on it.
+fn notify(header: &Header, word: &AtomicU32) {
+    word.fetch_add(1, Ordering::SeqCst);
+    if header.sleepers.load(Ordering::SeqCst) > 0 {
+        unsafe {
+            libc::syscall(
+                libc::SYS_futex,
+                word as *const AtomicU32,
+                libc::FUTEX_WAKE,
+                i32::MAX,
+            )
+        };
+    }
+}
+
+/// Sleeps until `word` no longer holds `seen`, or for at most `timeout`.
+fn sleep_on(header: *const Header, word: *const AtomicU32, seen: u32, timeout: Duration) {
+    let ts = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos() as libc::c_long,
+    };
+    unsafe {
+        (*header).sleepers.fetch_add(1, Ordering::SeqCst);
+        libc::syscall(
+            libc::SYS_futex,
+            word,
+            libc::FUTEX_WAIT,
+            seen,
+            &ts as *const libc::timespec,
+        );
+        (*header).sleepers.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+/// Tries to get a push into the ring, building its descriptor first if need be.
+fn try_push(region: &Region, op: &mut Op) -> bool {
+    if op.desc.is_none() {
+        match region.describe(&op.sga) {
+            Some(desc) => {
+                op.desc = Some(desc);
+                op.copied = false;
+            },
+            None => {
+                let len: usize = op.sga.sga_segs[..op.sga.sga_numsegs as usize]
+                    .iter()
+                    .map(|seg| seg.sgaseg_len as usize)
+                    .sum();
+                let desc = match region.alloc(len) {
+                    Some(desc) => desc,
+                    None => return false,
+                };
+                copy_in(region, &op.sga, &desc);
+                op.desc = Some(desc);
+                op.copied = true;
+            },
+        }
+    }
+    let desc = op.desc.unwrap();
+    if !region.ring.push(desc) {
+        return false;
+    }
+    notify(region.header(), &region.header().pushed);
+    if !op.copied {
+        region.unhold(desc.numsegs as usize);
+    }
+    true
+}
+
+/// Copies the contents of `sga` into the buffers of `desc`.
+fn copy_in(region: &Region, sga: &dmtr_sgarray_t, desc: &Desc) {
+    let (mut dst_seg, mut dst_off) = (0, 0);
+    for seg in &sga.sga_segs[..sga.sga_numsegs as usize] {
+        let mut src = seg.sgaseg_buf as *const u8;
+        let mut left = seg.sgaseg_len as usize;
+        while left > 0 {
+            let dst = &desc.segs[dst_seg];
+            let n = cmp::min(left, dst.len as usize - dst_off);
+            unsafe {
+                ptr::copy_nonoverlapping(src, region.buffer(dst.buf).add(dst_off), n);
+                src = src.add(n);
+            }
+            left -= n;
+            dst_off += n;
+            if dst_off == dst.len as usize {
+                dst_seg += 1;
+                dst_off = 0;
+            }
+        }
+    }
+}
+
+/// Sets up shared-memory queues for the calling thread.
+pub fn configure(config: ShmConfig) {
+    with_shm(|s| s.config = Some(config));
+}
+
+pub fn is_shm_qd(qd: c_int) -> bool {
+    (SHM_QD_BASE..SHM_QD_BASE + (1 << 24)).contains(&qd)
+}
+
+pub fn is_shm_qt(qt: dmtr_qtoken_t) -> bool {
+    qt & (SHM_QT_TAG << 1) == 0 && qt & SHM_QT_TAG != 0
+}
+
+/// Opens the shared-memory queue called `name`, creating it if no process has it open.
+pub fn open(qd_out: *mut c_int, name: *const c_char, capacity: usize, buf_size: usize) -> c_int {
+    if qd_out.is_null() || name.is_null() {
+        return libc::EINVAL;
+    }
+    let name = unsafe { CStr::from_ptr(name) }.to_string_lossy();
+    if name.is_empty() || name.contains('/') {
+        return libc::EINVAL;
+    }
+    with_shm(|s| {
+        let path = s.config().dir.join(format!("dmtr-{}", name));
+        let path = CString::new(path.to_string_lossy().into_owned()).unwrap();
+        let region = match Region::open(path, capacity, buf_size) {
+            Ok(region) => region,
+            Err(e) => return e,
+        };
+        let region = Arc::new(region);
+        register(&region);
+        let queue = ShmQueue {
+            region,
+            pending: VecDeque::new(),
+        };
+        let ix = match s.free_queues.pop() {
+            Some(ix) => {
+                s.queues[ix] = Some(queue);
+                ix
+            },
+            None => {
+                s.queues.push(Some(queue));
+                s.queues.len() - 1
+            },
+        };
+        unsafe { *qd_out = SHM_QD_BASE + ix as c_int };
+        0
+    })
+}
+
+/// Closes a shared-memory queue. Fails with `EBUSY` while operations are pending or buffers from
+/// its arena are still held.
+pub fn close(qd: c_int) -> c_int {
+    with_shm(|s| {
+        match s.queue(qd) {
+            Some(q) if !q.pending.is_empty() || q.region.held.load(Ordering::Relaxed) > 0 => {
+                return libc::EBUSY
+            },
+            Some(..) => (),
+            None => return libc::EBADF,
+        }
+        let ix = (qd - SHM_QD_BASE) as usize;
+        unregister(&s.queues[ix].take().unwrap().region);
+        s.free_queues.push(ix);
+        0
+    })
+}
+
+/// Allocates `size` bytes from the arena of queue `qd`, in as many buffers as it takes, up to
+/// `DMTR_SGARRAY_MAXSIZE`. Pushing the array to the same queue hands it over without a copy.
+pub fn alloc(sga_out: *mut dmtr_sgarray_t, qd: c_int, size: usize) -> c_int {
+    if sga_out.is_null() {
+        return libc::EINVAL;
+    }
+    with_shm(|s| {
+        let q = match s.queue(qd) {
+            Some(q) => q,
+            None => return libc::EBADF,
+        };
+        if size > q.region.buf_size * MAX_SEGS {
+            return libc::EMSGSIZE;
+        }
+        let desc = match q.region.alloc(size) {
+            Some(desc) => desc,
+            None => return libc::ENOBUFS,
+        };
+        q.region.hold(desc.numsegs as usize);
+        unsafe { *sga_out = q.region.to_sgarray(&desc) };
+        0
+    })
+}
+
+/// Returns the buffers of `sga` to their arena, whichever thread popped or allocated them. Returns
+/// false if they don't come from one.
+pub fn free_sgarray(sga: &dmtr_sgarray_t) -> bool {
+    if sga.sga_numsegs == 0 || NUM_REGIONS.load(Ordering::Acquire) == 0 {
+        return false;
+    }
+    let regions = regions().read().unwrap();
+    let ptr = sga.sga_segs[0].sgaseg_buf as *const u8;
+    let region = match regions.iter().find(|r| r.buffer_of(ptr).is_some()) {
+        Some(region) => region,
+        None => return false,
+    };
+    for seg in &sga.sga_segs[..sga.sga_numsegs as usize] {
+        if let Some((buf, _)) = region.buffer_of(seg.sgaseg_buf as *const u8) {
+            region.release(buf);
+            region.unhold(1);
+        }
+    }
+    true
+}
+
+/// Issues a push of `sga`. The array must stay valid until the push completes, unless it was
+/// handed over.
+pub fn push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
+    if qtok_out.is_null() || sga.is_null() {
+        return libc::EINVAL;
+    }
+    let sga = unsafe { *sga };
+    if sga.sga_numsegs == 0 || sga.sga_numsegs as usize > MAX_SEGS {
+        return libc::EINVAL;
+    }
+    with_shm(|s| {
+        match s.queue(qd) {
+            Some(q) => {
+                let len: usize = sga.sga_segs[..sga.sga_numsegs as usize]
+                    .iter()
+                    .map(|seg| seg.sgaseg_len as usize)
+                    .sum();
+                if len > q.region.buf_size * MAX_SEGS {
+                    return libc::EMSGSIZE;
+                }
+            },
+            None => return libc::EBADF,
+        }
+        let ix = s.alloc_op(qd, dmtr_opcode_t::DMTR_OPC_PUSH);
+        s.ops[ix].sga = sga;
+        s.queue(qd).unwrap().pending.push_back(ix);
+        // Try right away: most pushes find room and complete here.
+        s.progress(ix);
+        unsafe { *qtok_out = s.ops[ix].qt };
+        0
+    })
+}
+
+/// Issues a pop. Popped arrays point into the arena and go back with `dmtr_sgafree`.
+pub fn pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+    if qtok_out.is_null() {
+        return libc::EINVAL;
+    }
+    with_shm(|s| {
+        if s.queue(qd).is_none() {
+            return libc::EBADF;
+        }
+        let ix = s.alloc_op(qd, dmtr_opcode_t::DMTR_OPC_POP);
+        s.queue(qd).unwrap().pending.push_back(ix);
+        unsafe { *qtok_out = s.ops[ix].qt };
+        0
+    })
+}
+
+/// Returns zero and the result of a completed operation, or `EAGAIN` if it hasn't completed yet.
+pub fn poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    with_shm(|s| {
+        let ix = match s.op_index(qt) {
+            Some(ix) => ix,
+            None => return libc::EINVAL,
+        };
+        if !s.progress(ix) {
+            return libc::EAGAIN;
+        }
+        let op = &s.ops[ix];
+        let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+        qr.qr_opcode = op.opcode;
+        qr.qr_qd = op.qd;
+        qr.qr_qt = op.qt;
+        if let dmtr_opcode_t::DMTR_OPC_POP = op.opcode {
+            qr.qr_value.sga = op.sga;
+        }
+        s.free_op(ix);
+        if !qr_out.is_null() {
+            unsafe { *qr_out = qr };
+        } else if let dmtr_opcode_t::DMTR_OPC_POP = qr.qr_opcode {
+            free_sgarray(unsafe { &qr.qr_value.sga });
+        }
+        0
+    })
+}
+
+/// Like `poll`, but waits for the operation to complete, for at most `timeout`, according to the
+/// thread's wait policy. The thread's network stack keeps running meanwhile.
+pub fn wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t, timeout: Option<Duration>) -> c_int {
+    let mut backoff = Backoff::new(timeout);
+    loop {
+        // Read the word before polling, so that a wakeup in between isn't missed.
+        let wake = with_shm(|s| {
+            s.op_index(qt).map(|ix| {
+                let (word, seen) = s.wake_word(ix);
+                let header = s.queue(s.ops[ix].qd).unwrap().region.addr as *const Header;
+                (header, word, seen)
+            })
+        });
+        let ret = poll(qr_out, qt);
+        if ret != libc::EAGAIN {
+            return ret;
+        }
+        network::progress();
+        let sleep = |t| {
+            if let Some((header, word, seen)) = wake {
+                sleep_on(header, word, seen, t);
+            }
+        };
+        if !backoff.idle(sleep) {
+            return libc::ETIMEDOUT;
+        }
+    }
+}
+
+/// Forgets an operation. A push that didn't complete is withdrawn; a pop that did gives its
+/// buffers back.
+pub fn drop(qt: dmtr_qtoken_t) -> c_int {
+    with_shm(|s| {
+        let ix = match s.op_index(qt) {
+            Some(ix) => ix,
+            None => return libc::EINVAL,
+        };
+        let qd = s.ops[ix].qd;
+        let (done, opcode, desc, copied, sga) = {
+            let op = &s.ops[ix];
+            (op.done, op.opcode, op.desc, op.copied, op.sga)
+        };
+        if let Some(q) = s.queue(qd) {
+            if done {
+                if let dmtr_opcode_t::DMTR_OPC_POP = opcode {
+                    for seg in &sga.sga_segs[..sga.sga_numsegs as usize] {
+                        if let Some((buf, _)) = q.region.buffer_of(seg.sgaseg_buf as *const u8) {
+                            q.region.release(buf);
+                        }
+                    }
+                    q.region.unhold(sga.sga_numsegs as usize);
+                }
+            } else {
+                q.pending.retain(|&i| i != ix);
+                if let (Some(desc), true) = (desc, copied) {
+                    q.region.release_desc(&desc);
+                }
+            }
+        }
+        s.free_op(ix);
+        0
+    })
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        alloc,
+        close,
+        configure,
+        free_sgarray,
+        open,
+        pop,
+        push,
+        wait,
+        ShmConfig,
+        MAX_SEGS,
+    };
+    use crate::{
+        interop::{
+            dmtr_opcode_t,
+            dmtr_qresult_t,
+            dmtr_sgarray_t,
+        },
+        wait::{
+            self as wait_policy,
+            WaitPolicy,
+        },
+    };
+    use std::{
+        env,
+        ffi::CString,
+        mem,
+        slice,
+        thread,
+        time::Duration,
+    };
+
+    fn contents(sga: &dmtr_sgarray_t) -> Vec<u8> {
+        sga.sga_segs[..sga.sga_numsegs as usize]
+            .iter()
+            .flat_map(|seg| unsafe {
+                slice::from_raw_parts(seg.sgaseg_buf as *const u8, seg.sgaseg_len as usize)
+            })
+            .copied()
+            .collect()
+    }
+
+    /// A popped array, to be freed by another thread.
+    struct Popped(dmtr_sgarray_t);
+
+    unsafe impl Send for Popped {}
+
+    fn wait_pop(qd: libc::c_int) -> dmtr_sgarray_t {
+        let mut qt = 0;
+        assert_eq!(pop(&mut qt, qd), 0);
+        let mut qr: dmtr_qresult_t = unsafe { mem::zeroed() };
+        assert_eq!(wait(&mut qr, qt, None), 0);
+        assert!(matches!(qr.qr_opcode, dmtr_opcode_t::DMTR_OPC_POP));
+        unsafe { qr.qr_value.sga }
+    }
+
+    #[test]
+    fn push_pop() {
+        let config = ShmConfig {
+            dir: env::temp_dir(),
+        };
+        let name = CString::new(format!("test-{}", std::process::id())).unwrap();
+        let path = env::temp_dir().join(format!("dmtr-test-{}", std::process::id()));
+
+        // The consumer attaches from a thread of its own, and sleeps while the queue is empty.
+        let consumer = {
+            let (config, name) = (config.clone(), name.clone());
+            thread::spawn(move || {
+                configure(config);
+                wait_policy::set_policy(WaitPolicy::Sleep {
+                    spin_polls: 10,
+                    max_sleep: Duration::from_secs(1),
+                });
+                let mut qd = 0;
+                thread::sleep(Duration::from_millis(10));
+                assert_eq!(open(&mut qd, name.as_ptr(), 0, 0), 0);
+                // The second array goes back from a thread that doesn't have the queue open.
+                let popped: Vec<_> = (0..2)
+                    .map(|i| {
+                        let sga = wait_pop(qd);
+                        let data = contents(&sga);
+                        if i == 0 {
+                            assert!(free_sgarray(&sga));
+                        } else {
+                            let sga = Popped(sga);
+                            assert!(thread::spawn(move || free_sgarray(&sga.0)).join().unwrap());
+                        }
+                        data
+                    })
+                    .collect();
+                assert_eq!(close(qd), 0);
+                popped
+            })
+        };
+
+        configure(config);
+        let mut qd = 0;
+        assert_eq!(open(&mut qd, name.as_ptr(), 16, 1000), 0);
+        assert!(path.exists());
+
+        // A buffer from the arena changes hands; anything else is copied, as long as it fits in
+        // the buffers that an array can point to.
+        let mut sga: dmtr_sgarray_t = unsafe { mem::zeroed() };
+        assert_eq!(alloc(&mut sga, qd, 5), 0);
+        unsafe { (sga.sga_segs[0].sgaseg_buf as *mut u8).copy_from(b"hello".as_ptr(), 5) };
+        let mut qt = 0;
+        assert_eq!(push(&mut qt, qd, &sga), 0);
+        assert_eq!(wait(&mut qr_out(), qt, None), 0);
+
+        let mut data: Vec<u8> = (0..1024 * MAX_SEGS + 1).map(|i| i as u8).collect();
+        let mut copied: dmtr_sgarray_t = unsafe { mem::zeroed() };
+        copied.sga_numsegs = 1;
+        copied.sga_segs[0].sgaseg_buf = data.as_mut_ptr() as *mut _;
+        copied.sga_segs[0].sgaseg_len = data.len() as u32;
+        assert_eq!(push(&mut qt, qd, &copied), libc::EMSGSIZE);
+        assert_eq!(alloc(&mut sga, qd, data.len()), libc::EMSGSIZE);
+        data.truncate(1000);
+        copied.sga_segs[0].sgaseg_len = data.len() as u32;
+        thread::sleep(Duration::from_millis(50));
+        assert_eq!(push(&mut qt, qd, &copied), 0);
+        assert_eq!(wait(&mut qr_out(), qt, None), 0);
+
+        let popped = consumer.join().unwrap();
+        assert_eq!(popped, vec![b"hello".to_vec(), data]);
+        assert_eq!(close(qd), 0);
+        assert!(!path.exists());
+    }
+
+    fn qr_out() -> dmtr_qresult_t {
+        unsafe { mem::zeroed() }
+    }
+}
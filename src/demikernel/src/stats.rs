@@ -0,0 +1,364 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Per-thread counters for queue operations and the runtime's packet I/O.
+//!
+//! Each thread drives its own libOS, so counters live in thread-local storage and are updated
+//! without atomics. `dmtr_stats` renders the calling thread's counters as text.
+
+use crate::{
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qresult_t,
+        dmtr_qtoken_t,
+        dmtr_sgarray_t,
+    },
+    pool,
+};
+use libc::c_int;
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    fmt::Write,
+    time::Instant,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Values below this are counted exactly; above it, each power of two is split into
+/// `1 << SUB_BUCKET_BITS` buckets, for a relative error of at most 12.5%.
+const LINEAR_BUCKETS: usize = 16;
+const SUB_BUCKET_BITS: u32 = 3;
+const NUM_BUCKETS: usize = LINEAR_BUCKETS + (64 - 4) * (1 << SUB_BUCKET_BITS);
+
+/// Queue descriptors below this are counted in a table indexed by descriptor; the rest (such as
+/// file queues, which are numbered from a high base) in a map.
+const DENSE_QDS: usize = 1 << 16;
+
+/// Packet I/O counters kept by a runtime.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct RuntimeStats {
+    /// Packets handed to the device or kernel, counted only once it has taken them.
+    pub tx_packets: u64,
+    pub tx_bytes: u64,
+    /// Packets dropped on the transmit path (full rings, no buffers).
+    pub tx_drops: u64,
+    pub rx_packets: u64,
+    pub rx_bytes: u64,
+    /// Buffer allocations that found their pool empty.
+    pub alloc_failures: u64,
+    /// Polls that left packets on the receive ring because buffers ran low.
+    pub rx_deferred: u64,
+}
+
+/// Log-linear histogram of nanosecond latencies, with a fixed number of buckets.
+pub struct LatencyHistogram {
+    buckets: Box<[u64; NUM_BUCKETS]>,
+    count: u64,
+    max: u64,
+}
+
+#[derive(Default)]
+pub struct QueueStats {
+    pub pushes: u64,
+    pub pops: u64,
+    pub push_bytes: u64,
+    pub pop_bytes: u64,
+    /// Submissions that the libOS rejected.
+    pub failures: u64,
+    /// Operations submitted but not yet completed or dropped.
+    pub outstanding: u64,
+    /// Submission-to-completion latency. Only kept while latency tracking is on.
+    pub latency: Option<LatencyHistogram>,
+}
+
+struct Pending {
+    qd: c_int,
+    submitted: Instant,
+}
+
+#[derive(Default)]
+struct Stats {
+    /// Indexed by queue descriptor.
+    queues: Vec<QueueStats>,
+    sparse_queues: HashMap<c_int, QueueStats>,
+    track_latency: bool,
+    pending: HashMap<dmtr_qtoken_t, Pending>,
+}
+
+thread_local! {
+    static STATS: RefCell<Stats> = RefCell::new(Stats::default());
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl LatencyHistogram {
+    pub fn new() -> Self {
+        Self {
+            buckets: Box::new([0; NUM_BUCKETS]),
+            count: 0,
+            max: 0,
+        }
+    }
+
+    pub fn record(&mut self, value: u64) {
+        self.buckets[Self::bucket(value)] += 1;
+        self.count += 1;
+        self.max = self.max.max(value);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn max(&self) -> u64 {
+        self.max
+    }
+
+    /// Returns an upper bound on the `p`th percentile (0 < p <= 1) of the recorded values.
+    pub fn percentile(&self, p: f64) -> u64 {
+        let target = ((self.count as f64) * p).ceil().max(1.0) as u64;
+        let mut seen = 0;
+        for (i, &n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= target {
+                return Self::bucket_limit(i).min(self.max);
+            }
+        }
+        self.max
+    }
+
+    fn bucket(value: u64) -> usize {
+        if value < LINEAR_BUCKETS as u64 {
+            return value as usize;
+        }
+        let msb = 63 - value.leading_zeros();
+        let sub = (value >> (msb - SUB_BUCKET_BITS)) as usize & ((1 << SUB_BUCKET_BITS) - 1);
+        LINEAR_BUCKETS + ((msb - 4) as usize) * (1 << SUB_BUCKET_BITS) + sub
+    }
+
+    /// Largest value that falls into bucket `i`.
+    fn bucket_limit(i: usize) -> u64 {
+        if i < LINEAR_BUCKETS {
+            return i as u64;
+        }
+        let msb = ((i - LINEAR_BUCKETS) >> SUB_BUCKET_BITS) as u32 + 4;
+        let sub = ((i - LINEAR_BUCKETS) & ((1 << SUB_BUCKET_BITS) - 1)) as u64;
+        let shift = msb - SUB_BUCKET_BITS;
+        let limit = (((1 << SUB_BUCKET_BITS) + sub + 1) as u128) << shift;
+        (limit - 1).min(u64::MAX as u128) as u64
+    }
+}
+
+impl Stats {
+    fn queue(&mut self, qd: c_int) -> Option<&mut QueueStats> {
+        if qd < 0 {
+            return None;
+        }
+        let ix = qd as usize;
+        if ix >= DENSE_QDS {
+            return Some(self.sparse_queues.entry(qd).or_default());
+        }
+        if ix >= self.queues.len() {
+            self.queues.resize_with(ix + 1, QueueStats::default);
+        }
+        Some(&mut self.queues[ix])
+    }
+
+    fn submit(&mut self, qd: c_int, qt: dmtr_qtoken_t) {
+        if let Some(q) = self.queue(qd) {
+            q.outstanding += 1;
+        }
+        if self.track_latency {
+            let pending = Pending {
+                qd,
+                submitted: Instant::now(),
+            };
+            self.pending.insert(qt, pending);
+        }
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for LatencyHistogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+fn with_stats<T>(f: impl FnOnce(&mut Stats) -> T) -> T {
+    STATS.with(|s| f(&mut s.borrow_mut()))
+}
+
+fn sga_len(sga: &dmtr_sgarray_t) -> u64 {
+    sga.sga_segs[..sga.sga_numsegs as usize]
+        .iter()
+        .map(|seg| seg.sgaseg_len as u64)
+        .sum()
+}
+
+/// Turns tracking of per-queue completion latency on or off for the calling thread.
+pub fn set_track_latency(track_latency: bool) {
+    with_stats(|s| {
+        s.track_latency = track_latency;
+        s.pending.clear();
+    });
+}
+
+/// Records the outcome of submitting a push of `sga` to `qd`.
+pub fn record_push(qd: c_int, sga: *const dmtr_sgarray_t, qt: dmtr_qtoken_t, ret: c_int) {
+    with_stats(|s| {
+        if ret != 0 {
+            if let Some(q) = s.queue(qd) {
+                q.failures += 1;
+            }
+            return;
+        }
+        if let Some(q) = s.queue(qd) {
+            q.pushes += 1;
+            if !sga.is_null() {
+                q.push_bytes += sga_len(unsafe { &*sga });
+            }
+        }
+        s.submit(qd, qt);
+    })
+}
+
+/// Records the outcome of submitting a pop from `qd`.
+pub fn record_pop(qd: c_int, qt: dmtr_qtoken_t, ret: c_int) {
+    with_stats(|s| {
+        if ret != 0 {
+            if let Some(q) = s.queue(qd) {
+                q.failures += 1;
+            }
+            return;
+        }
+        if let Some(q) = s.queue(qd) {
+            q.pops += 1;
+        }
+        s.submit(qd, qt);
+    })
+}
+
+/// Records the completion of the operation behind `qt`, whose result is `qr` when available.
+pub fn record_completion(qt: dmtr_qtoken_t, qr: Option<&dmtr_qresult_t>) {
+    with_stats(|s| {
+        let pending = s.pending.remove(&qt);
+        let qd = match (qr, &pending) {
+            (Some(qr), _) => qr.qr_qd,
+            (None, Some(p)) => p.qd,
+            (None, None) => return,
+        };
+        let q = match s.queue(qd) {
+            Some(q) => q,
+            None => return,
+        };
+        q.outstanding = q.outstanding.saturating_sub(1);
+        if let Some(qr) = qr {
+            if let dmtr_opcode_t::DMTR_OPC_POP = qr.qr_opcode {
+                q.pop_bytes += sga_len(unsafe { &qr.qr_value.sga });
+            }
+        }
+        if let Some(p) = pending {
+            let ns = p.submitted.elapsed().as_nanos() as u64;
+            q.latency
+                .get_or_insert_with(LatencyHistogram::new)
+                .record(ns);
+        }
+    })
+}
+
+/// Forgets the operation behind a dropped token.
+pub fn record_drop(qt: dmtr_qtoken_t) {
+    with_stats(|s| {
+        if let Some(p) = s.pending.remove(&qt) {
+            if let Some(q) = s.queue(p.qd) {
+                q.outstanding = q.outstanding.saturating_sub(1);
+            }
+        }
+    })
+}
+
+/// Clears the calling thread's queue counters.
+pub fn reset() {
+    with_stats(|s| {
+        s.queues.clear();
+        s.sparse_queues.clear();
+        s.pending.clear();
+    });
+    pool::reset_stats();
+}
+
+fn write_queue(out: &mut String, qd: c_int, q: &QueueStats) {
+    if q.pushes == 0 && q.pops == 0 && q.failures == 0 {
+        return;
+    }
+    write!(
+        out,
+        "qd={} pushes={} pops={} push_bytes={} pop_bytes={} failures={} outstanding={}",
+        qd, q.pushes, q.pops, q.push_bytes, q.pop_bytes, q.failures, q.outstanding
+    )
+    .unwrap();
+    if let Some(ref h) = q.latency {
+        write!(
+            out,
+            " latency_count={} p50_ns={} p99_ns={} p999_ns={} max_ns={}",
+            h.count(),
+            h.percentile(0.5),
+            h.percentile(0.99),
+            h.percentile(0.999),
+            h.max()
+        )
+        .unwrap();
+    }
+    out.push('\n');
+}
+
+/// Renders the calling thread's counters: one line for the runtime, one for the buffer pool and
+/// one per queue in use.
+pub fn snapshot(rt: &RuntimeStats) -> String {
+    let mut out = String::new();
+    writeln!(
+        out,
+        "runtime tx_packets={} tx_bytes={} tx_drops={} rx_packets={} rx_bytes={} \
+         alloc_failures={} rx_deferred={}",
+        rt.tx_packets,
+        rt.tx_bytes,
+        rt.tx_drops,
+        rt.rx_packets,
+        rt.rx_bytes,
+        rt.alloc_failures,
+        rt.rx_deferred
+    )
+    .unwrap();
+    let p = pool::stats();
+    writeln!(
+        out,
+        "pool allocs={} frees={} cache_hits={} refills={} flushes={} oversize={} exhausted={} \
+         regions={}",
+        p.allocs, p.frees, p.cache_hits, p.refills, p.flushes, p.oversize, p.exhausted, p.regions
+    )
+    .unwrap();
+    with_stats(|s| {
+        for (qd, q) in s.queues.iter().enumerate() {
+            write_queue(&mut out, qd as c_int, q);
+        }
+        let mut sparse: Vec<_> = s.sparse_queues.iter().collect();
+        sparse.sort_by_key(|&(&qd, _)| qd);
+        for (&qd, q) in sparse {
+            write_queue(&mut out, qd, q);
+        }
+    });
+    out
+}
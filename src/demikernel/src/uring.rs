@@ -0,0 +1,474 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Minimal `io_uring` bindings, straight on top of the system calls.
+//!
+//! Only what file queues need: preparing read and write SQEs, submitting them, reaping CQEs and
+//! registering fixed buffers. SQEs are queued in the shared ring as they are prepared and handed
+//! to the kernel in one `io_uring_enter` by `submit`.
+
+use libc::{
+    c_long,
+    c_uint,
+    c_void,
+    iovec,
+};
+use std::{
+    io,
+    mem,
+    os::unix::io::RawFd,
+    ptr,
+    sync::atomic::{
+        AtomicU32,
+        Ordering,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+// System call numbers are the same on every architecture.
+const SYS_IO_URING_SETUP: c_long = 425;
+const SYS_IO_URING_ENTER: c_long = 426;
+const SYS_IO_URING_REGISTER: c_long = 427;
+
+const IORING_OFF_SQ_RING: i64 = 0;
+const IORING_OFF_CQ_RING: i64 = 0x8000000;
+const IORING_OFF_SQES: i64 = 0x10000000;
+
+const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+const IORING_ENTER_GETEVENTS: c_uint = 1 << 0;
+
+const IORING_REGISTER_BUFFERS2: c_uint = 15;
+const IORING_REGISTER_BUFFERS_UPDATE: c_uint = 16;
+const IORING_RSRC_REGISTER_SPARSE: u32 = 1 << 0;
+
+pub const IORING_OP_READV: u8 = 1;
+pub const IORING_OP_WRITEV: u8 = 2;
+pub const IORING_OP_READ_FIXED: u8 = 4;
+pub const IORING_OP_WRITE_FIXED: u8 = 5;
+const IORING_OP_ASYNC_CANCEL: u8 = 14;
+
+#[repr(C)]
+#[derive(Default)]
+struct io_sqring_offsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    resv2: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct io_cqring_offsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    resv2: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct io_uring_params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: io_sqring_offsets,
+    cq_off: io_cqring_offsets,
+}
+
+#[repr(C)]
+pub struct io_uring_sqe {
+    pub opcode: u8,
+    pub flags: u8,
+    pub ioprio: u16,
+    pub fd: i32,
+    pub off: u64,
+    pub addr: u64,
+    pub len: u32,
+    pub rw_flags: u32,
+    pub user_data: u64,
+    pub buf_index: u16,
+    pub personality: u16,
+    pub splice_fd_in: i32,
+    pub pad: [u64; 2],
+}
+
+#[repr(C)]
+struct io_uring_cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+#[repr(C)]
+struct io_uring_rsrc_register {
+    nr: u32,
+    flags: u32,
+    resv2: u64,
+    data: u64,
+    tags: u64,
+}
+
+#[repr(C)]
+struct io_uring_rsrc_update2 {
+    offset: u32,
+    resv: u32,
+    data: u64,
+    tags: u64,
+    nr: u32,
+    resv2: u32,
+}
+
+// The kernel ABI fixes these sizes.
+const _: [(); 64] = [(); mem::size_of::<io_uring_sqe>()];
+const _: [(); 16] = [(); mem::size_of::<io_uring_cqe>()];
+const _: [(); 120] = [(); mem::size_of::<io_uring_params>()];
+
+/// A memory mapping shared with the kernel.
+struct Mmap {
+    addr: *mut c_void,
+    len: usize,
+}
+
+/// Closes a file descriptor unless forgotten.
+struct FdGuard(RawFd);
+
+pub struct Ring {
+    fd: RawFd,
+    // Only kept to be unmapped along with the ring. The completion ring has no mapping of its own
+    // when the kernel maps both rings together.
+    _sq_mmap: Mmap,
+    _cq_mmap: Option<Mmap>,
+    _sqes_mmap: Mmap,
+    sq_head: *const AtomicU32,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_entries: u32,
+    sq_array: *mut u32,
+    sqes: *mut io_uring_sqe,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const io_uring_cqe,
+    /// Tail of the SQEs prepared so far. The kernel only sees it once they are submitted, so that
+    /// it never picks up an SQE that is still being filled in.
+    tail: u32,
+    /// SQEs prepared but not yet handed to the kernel.
+    pending: u32,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl Mmap {
+    fn new(fd: RawFd, len: usize, offset: i64) -> io::Result<Self> {
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                offset,
+            )
+        };
+        if addr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self { addr, len })
+    }
+
+    unsafe fn at<T>(&self, offset: u32) -> *mut T {
+        (self.addr as *mut u8).add(offset as usize) as *mut T
+    }
+}
+
+impl Ring {
+    pub fn new(entries: u32) -> io::Result<Self> {
+        let mut p = io_uring_params::default();
+        let fd = unsafe {
+            libc::syscall(
+                SYS_IO_URING_SETUP,
+                entries as c_uint,
+                &mut p as *mut io_uring_params,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = fd as RawFd;
+        // Closes the ring if mapping it fails.
+        let guard = FdGuard(fd);
+
+        let sq_len = p.sq_off.array as usize + p.sq_entries as usize * mem::size_of::<u32>();
+        let cq_len =
+            p.cq_off.cqes as usize + p.cq_entries as usize * mem::size_of::<io_uring_cqe>();
+        let single = p.features & IORING_FEAT_SINGLE_MMAP != 0;
+        let sq_mmap = Mmap::new(
+            fd,
+            if single { sq_len.max(cq_len) } else { sq_len },
+            IORING_OFF_SQ_RING,
+        )?;
+        let cq_mmap = if single {
+            None
+        } else {
+            Some(Mmap::new(fd, cq_len, IORING_OFF_CQ_RING)?)
+        };
+        let sqes_mmap = Mmap::new(
+            fd,
+            p.sq_entries as usize * mem::size_of::<io_uring_sqe>(),
+            IORING_OFF_SQES,
+        )?;
+        mem::forget(guard);
+
+        unsafe {
+            let cq = cq_mmap.as_ref().unwrap_or(&sq_mmap);
+            Ok(Self {
+                fd,
+                sq_head: sq_mmap.at(p.sq_off.head),
+                sq_tail: sq_mmap.at(p.sq_off.tail),
+                sq_mask: *sq_mmap.at::<u32>(p.sq_off.ring_mask),
+                sq_entries: p.sq_entries,
+                sq_array: sq_mmap.at(p.sq_off.array),
+                sqes: sqes_mmap.addr as *mut io_uring_sqe,
+                cq_head: cq.at(p.cq_off.head),
+                cq_tail: cq.at(p.cq_off.tail),
+                cq_mask: *cq.at::<u32>(p.cq_off.ring_mask),
+                cqes: cq.at(p.cq_off.cqes),
+                tail: (*sq_mmap.at::<AtomicU32>(p.sq_off.tail)).load(Ordering::Relaxed),
+                pending: 0,
+                _sq_mmap: sq_mmap,
+                _cq_mmap: cq_mmap,
+                _sqes_mmap: sqes_mmap,
+            })
+        }
+    }
+
+    /// Returns the ring's file descriptor, which polls readable while completions are ready.
+    pub fn fd(&self) -> RawFd {
+        self.fd
+    }
+
+    /// Returns a zeroed SQE to fill in, submitting what is queued first if the ring is full.
+    pub fn get_sqe(&mut self) -> io::Result<&mut io_uring_sqe> {
+        let head = unsafe { (*self.sq_head).load(Ordering::Acquire) };
+        let tail = self.tail;
+        if tail.wrapping_sub(head) >= self.sq_entries {
+            self.submit()?;
+            // The kernel consumes everything submitted, unless the completion ring is full.
+            let head = unsafe { (*self.sq_head).load(Ordering::Acquire) };
+            if tail.wrapping_sub(head) >= self.sq_entries {
+                return Err(io::Error::from_raw_os_error(libc::EBUSY));
+            }
+        }
+        let ix = tail & self.sq_mask;
+        unsafe {
+            *self.sq_array.add(ix as usize) = ix;
+            let sqe = &mut *self.sqes.add(ix as usize);
+            ptr::write_bytes(sqe as *mut io_uring_sqe, 0, 1);
+            self.tail = tail.wrapping_add(1);
+            self.pending += 1;
+            Ok(sqe)
+        }
+    }
+
+    /// Prepares a vectored read or write of `iovs` at `offset`.
+    pub fn prep_rw(
+        &mut self,
+        opcode: u8,
+        fd: RawFd,
+        iovs: &[iovec],
+        offset: u64,
+        user_data: u64,
+    ) -> io::Result<()> {
+        let sqe = self.get_sqe()?;
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = iovs.as_ptr() as u64;
+        sqe.len = iovs.len() as u32;
+        sqe.user_data = user_data;
+        Ok(())
+    }
+
+    /// Prepares a read or write of `len` bytes at `buf`, which lies within fixed buffer
+    /// `buf_index`.
+    pub fn prep_rw_fixed(
+        &mut self,
+        opcode: u8,
+        fd: RawFd,
+        buf: *const u8,
+        len: u32,
+        offset: u64,
+        buf_index: u16,
+        user_data: u64,
+    ) -> io::Result<()> {
+        let sqe = self.get_sqe()?;
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = buf as u64;
+        sqe.len = len;
+        sqe.buf_index = buf_index;
+        sqe.user_data = user_data;
+        Ok(())
+    }
+
+    /// Prepares the cancellation of the request submitted with `target` as its user data. The
+    /// request still completes, with `ECANCELED` if it was cancelled in time.
+    pub fn prep_cancel(&mut self, target: u64, user_data: u64) -> io::Result<()> {
+        let sqe = self.get_sqe()?;
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = target;
+        sqe.user_data = user_data;
+        Ok(())
+    }
+
+    /// Hands queued SQEs to the kernel.
+    pub fn submit(&mut self) -> io::Result<()> {
+        self.enter(0)
+    }
+
+    /// Hands queued SQEs to the kernel and blocks until at least `min_complete` CQEs are ready.
+    pub fn enter(&mut self, min_complete: u32) -> io::Result<()> {
+        if self.pending == 0 && min_complete == 0 {
+            return Ok(());
+        }
+        // Publishes the SQEs filled in since the last call.
+        unsafe { (*self.sq_tail).store(self.tail, Ordering::Release) };
+        let flags = if min_complete > 0 {
+            IORING_ENTER_GETEVENTS
+        } else {
+            0
+        };
+        let ret = unsafe {
+            libc::syscall(
+                SYS_IO_URING_ENTER,
+                self.fd,
+                self.pending as c_uint,
+                min_complete as c_uint,
+                flags,
+                ptr::null::<libc::sigset_t>(),
+                0 as libc::size_t,
+            )
+        };
+        if ret < 0 {
+            let e = io::Error::last_os_error();
+            // Interrupted waits are retried by the caller.
+            if e.raw_os_error() != Some(libc::EINTR) {
+                return Err(e);
+            }
+            return Ok(());
+        }
+        self.pending -= ret as u32;
+        Ok(())
+    }
+
+    /// Calls `f` with the user data and result of every CQE ready, and retires them.
+    pub fn reap(&mut self, mut f: impl FnMut(u64, i32)) -> usize {
+        let mut head = unsafe { (*self.cq_head).load(Ordering::Relaxed) };
+        let tail = unsafe { (*self.cq_tail).load(Ordering::Acquire) };
+        let n = tail.wrapping_sub(head) as usize;
+        while head != tail {
+            let cqe = unsafe { &*self.cqes.add((head & self.cq_mask) as usize) };
+            f(cqe.user_data, cqe.res);
+            head = head.wrapping_add(1);
+        }
+        unsafe { (*self.cq_head).store(head, Ordering::Release) };
+        n
+    }
+
+    /// Creates an empty table of `nr` fixed buffers, to be filled in with `update_buffer`.
+    pub fn register_sparse_buffers(&mut self, nr: u32) -> io::Result<()> {
+        let rr = io_uring_rsrc_register {
+            nr,
+            flags: IORING_RSRC_REGISTER_SPARSE,
+            resv2: 0,
+            data: 0,
+            tags: 0,
+        };
+        self.register(
+            IORING_REGISTER_BUFFERS2,
+            &rr as *const _ as *const c_void,
+            mem::size_of_val(&rr),
+        )
+    }
+
+    /// Makes `len` bytes at `addr` fixed buffer `index`.
+    pub fn update_buffer(&mut self, index: u32, addr: *mut u8, len: usize) -> io::Result<()> {
+        let iov = iovec {
+            iov_base: addr as *mut c_void,
+            iov_len: len,
+        };
+        let up = io_uring_rsrc_update2 {
+            offset: index,
+            resv: 0,
+            data: &iov as *const iovec as u64,
+            tags: 0,
+            nr: 1,
+            resv2: 0,
+        };
+        self.register(
+            IORING_REGISTER_BUFFERS_UPDATE,
+            &up as *const _ as *const c_void,
+            mem::size_of_val(&up),
+        )
+    }
+
+    fn register(&mut self, opcode: c_uint, arg: *const c_void, nr_args: usize) -> io::Result<()> {
+        let ret = unsafe {
+            libc::syscall(
+                SYS_IO_URING_REGISTER,
+                self.fd,
+                opcode,
+                arg,
+                nr_args as c_uint,
+            )
+        };
+        if ret < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.addr, self.len) };
+    }
+}
+
+impl Drop for FdGuard {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.0) };
+    }
+}
+
+impl Drop for Ring {
+    fn drop(&mut self) {
+        drop(FdGuard(self.fd));
+    }
+}
@@ -0,0 +1,189 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! What a thread does while it waits for a queue operation to complete.
+
+use catnip::{
+    libos::LibOS,
+    runtime::Runtime,
+};
+use std::{
+    cell::Cell,
+    hint,
+    os::unix::io::RawFd,
+    ptr,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Number of fruitless polls after which a waiting thread starts to back off, by default.
+pub const DEFAULT_SPIN_POLLS: u32 = 1000;
+
+/// Longest a waiting thread sleeps at a time, by default. Sleeps are bounded so that timers keep
+/// firing while nothing arrives.
+pub const DEFAULT_MAX_SLEEP: Duration = Duration::from_millis(1);
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum WaitPolicy {
+    /// Poll back to back. Lowest latency, but keeps a core busy even when idle.
+    Spin,
+    /// Poll back to back, but execute a `pause` between polls once `spin_polls` polls in a row
+    /// have found nothing.
+    Pause { spin_polls: u32 },
+    /// Once `spin_polls` polls in a row have found nothing, block until the runtime sees incoming
+    /// packets, for at most `max_sleep` at a time.
+    Sleep {
+        spin_polls: u32,
+        max_sleep: Duration,
+    },
+}
+
+/// Where a wait stands between fruitless polls: how many there were in a row and when it times
+/// out. It backs off according to the wait policy of the thread that created it.
+pub struct Backoff {
+    policy: WaitPolicy,
+    deadline: Option<Instant>,
+    idle_polls: u32,
+}
+
+thread_local! {
+    static WAIT_POLICY: Cell<WaitPolicy> = Cell::new(WaitPolicy::Spin);
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl WaitPolicy {
+    /// Parses the `wait` section of the configuration, defaulting to `Spin`.
+    pub fn parse(policy: Option<&str>, spin_polls: Option<i64>, max_sleep_us: Option<i64>) -> Self {
+        let spin_polls = match spin_polls {
+            Some(n) if n >= 0 => n as u32,
+            Some(..) => panic!("Invalid wait spin_polls"),
+            None => DEFAULT_SPIN_POLLS,
+        };
+        let max_sleep = match max_sleep_us {
+            Some(n) if n > 0 => Duration::from_micros(n as u64),
+            Some(..) => panic!("Invalid wait max_sleep_us"),
+            None => DEFAULT_MAX_SLEEP,
+        };
+        match policy {
+            None | Some("spin") => WaitPolicy::Spin,
+            Some("pause") => WaitPolicy::Pause { spin_polls },
+            Some("sleep") => WaitPolicy::Sleep {
+                spin_polls,
+                max_sleep,
+            },
+            Some(s) => panic!("Unknown wait policy {:?}", s),
+        }
+    }
+}
+
+impl Backoff {
+    /// Starts a wait that times out after `timeout`, if any.
+    pub fn new(timeout: Option<Duration>) -> Self {
+        Self {
+            policy: policy(),
+            deadline: timeout.map(|t| Instant::now() + t),
+            idle_polls: 0,
+        }
+    }
+
+    /// Called after a poll that found nothing. Returns false once the wait has timed out;
+    /// otherwise spins, pauses or calls `sleep` with how long it may block, as the policy says.
+    pub fn idle(&mut self, sleep: impl FnOnce(Duration)) -> bool {
+        let remaining = match self.deadline {
+            Some(deadline) => {
+                let now = Instant::now();
+                if now >= deadline {
+                    return false;
+                }
+                Some(deadline - now)
+            },
+            None => None,
+        };
+        self.idle_polls = self.idle_polls.saturating_add(1);
+        match self.policy {
+            WaitPolicy::Spin => (),
+            WaitPolicy::Pause { spin_polls } => {
+                if self.idle_polls > spin_polls {
+                    hint::spin_loop();
+                }
+            },
+            WaitPolicy::Sleep {
+                spin_polls,
+                max_sleep,
+            } => {
+                if self.idle_polls > spin_polls {
+                    sleep(remaining.map_or(max_sleep, |r| r.min(max_sleep)));
+                }
+            },
+        }
+        true
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for WaitPolicy {
+    fn default() -> Self {
+        WaitPolicy::Spin
+    }
+}
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+/// Sets the wait policy of the calling thread.
+pub fn set_policy(policy: WaitPolicy) {
+    WAIT_POLICY.with(|p| p.set(policy));
+}
+
+/// Returns the wait policy of the calling thread.
+pub fn policy() -> WaitPolicy {
+    WAIT_POLICY.with(|p| p.get())
+}
+
+/// Calls `poll` until it returns something or `timeout` expires, backing off between fruitless
+/// polls according to the calling thread's wait policy. `sleep` blocks until the runtime has
+/// incoming packets, for at most the given duration. Returns `None` on timeout.
+pub fn wait_until<RT: Runtime, T>(
+    libos: &mut LibOS<RT>,
+    timeout: Option<Duration>,
+    sleep: impl Fn(&RT, Duration),
+    mut poll: impl FnMut(&mut LibOS<RT>) -> Option<T>,
+) -> Option<T> {
+    let mut backoff = Backoff::new(timeout);
+    loop {
+        if let Some(r) = poll(libos) {
+            return Some(r);
+        }
+        if !backoff.idle(|t| sleep(libos.rt(), t)) {
+            return None;
+        }
+    }
+}
+
+/// Blocks until `fd` is readable, for at most `timeout`.
+pub fn poll_fd(fd: RawFd, timeout: Duration) {
+    let mut pfd = libc::pollfd {
+        fd,
+        events: libc::POLLIN,
+        revents: 0,
+    };
+    let ts = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos() as libc::c_long,
+    };
+    // Interruptions and errors just end the sleep early: the caller polls again either way.
+    unsafe { libc::ppoll(&mut pfd, 1, &ts, ptr::null()) };
+}